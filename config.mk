@@ -2,11 +2,17 @@
 
 CONFIG_BZIP2=1
 CONFIG_GZIP=1
+CONFIG_ZSTD=0
+CONFIG_BLAKE3=0
+CONFIG_XXHASH=0
 CONFIG_PKGFMT_V1=1
 CONFIG_PKGFMT_V2=1
 CONFIG_BDB=1
 CONFIG_MD5_DEFAULT=1
 CONFIG_MTRACE=0
+CONFIG_PTHREADS=1
+CONFIG_BTREE=0
+CONFIG_PATHTRIE=0
 
 # Try BDB_INCLUDE=-I/usr/local/include/db4 and BDB_LIBS=-L/usr/local/lib
 # for OpenBSD
@@ -23,9 +29,24 @@ BZIP2_LIBS=
 GZIP_INCLUDE=
 GZIP_LIBS=
 
+# zstd is off by default; try ZSTD_INCLUDE=-I/usr/local/include and
+# ZSTD_LIBS=-L/usr/local/lib if it lives in /usr/local
+
+ZSTD_INCLUDE=
+ZSTD_LIBS=
+
+# BLAKE3 and xxHash, for create --set-hash, are off by default too
+
+BLAKE3_INCLUDE=
+BLAKE3_LIBS=
+
+XXHASH_INCLUDE=
+XXHASH_LIBS=
+
 # Set these to the appropriate commands for your platform, or override them
 # on the command line.
 
+AR=ar
 CC=cc
 GZIP=gzip -9
 INSTALL=install
@@ -58,6 +79,21 @@ ifeq ($(CONFIG_GZIP),1)
 	CFLAGS+=$(GZIP_INCLUDE)
 endif
 
+ifeq ($(CONFIG_ZSTD),1)
+	CFLAGS+=-DCOMPRESSION_ZSTD
+	CFLAGS+=$(ZSTD_INCLUDE)
+endif
+
+ifeq ($(CONFIG_BLAKE3),1)
+	CFLAGS+=-DUSE_BLAKE3
+	CFLAGS+=$(BLAKE3_INCLUDE)
+endif
+
+ifeq ($(CONFIG_XXHASH),1)
+	CFLAGS+=-DUSE_XXHASH
+	CFLAGS+=$(XXHASH_INCLUDE)
+endif
+
 ifeq ($(CONFIG_PKGFMT_V1),1)
 	CFLAGS+=-DPKGFMT_V1
 endif
@@ -79,6 +115,23 @@ ifeq ($(CONFIG_MTRACE),1)
 	CFLAGS+=-DUSE_MTRACE
 endif
 
+ifeq ($(CONFIG_PTHREADS),1)
+	CFLAGS+=-DUSE_PTHREADS
+	CFLAGS+=-pthread
+endif
+
+# Keep the text DB and repairdb's maps in B+trees instead of rbtrees
+
+ifeq ($(CONFIG_BTREE),1)
+	CFLAGS+=-DUSE_BTREE
+endif
+
+# Keep the text DB in a trie by path component, to save memory
+
+ifeq ($(CONFIG_PATHTRIE),1)
+	CFLAGS+=-DUSE_PATHTRIE
+endif
+
 # Put any LDFLAGS you need here
 
 LDFLAGS=
@@ -97,3 +150,22 @@ ifeq ($(CONFIG_GZIP),1)
 	LDFLAGS+=$(GZIP_LIBS)
 	LDFLAGS+=-lz
 endif
+
+ifeq ($(CONFIG_ZSTD),1)
+	LDFLAGS+=$(ZSTD_LIBS)
+	LDFLAGS+=-lzstd
+endif
+
+ifeq ($(CONFIG_BLAKE3),1)
+	LDFLAGS+=$(BLAKE3_LIBS)
+	LDFLAGS+=-lblake3
+endif
+
+ifeq ($(CONFIG_XXHASH),1)
+	LDFLAGS+=$(XXHASH_LIBS)
+	LDFLAGS+=-lxxhash
+endif
+
+ifeq ($(CONFIG_PTHREADS),1)
+	LDFLAGS+=-pthread
+endif
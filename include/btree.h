@@ -0,0 +1,50 @@
+#ifndef __BTREE_H__
+#define __BTREE_H__
+
+/* The same codes as rbtree.h, so the two can stand in for each other */
+#define BTREE_SUCCESS (0)
+#define BTREE_NOT_FOUND (-1)
+#define BTREE_ERROR (-2)
+#define BTREE_NO_OVERWRITE (-3)
+
+/*
+ * An entry in a leaf; btree_enum() hands back pointers to these the
+ * way rbtree_enum() hands back nodes.
+ */
+typedef struct {
+  void *key, *value;
+} btree_entry;
+
+typedef struct {
+  /* A leaf if height is 0, else an interior node */
+  void *root;
+  int height;
+  /* The leftmost leaf, where enumeration starts */
+  void *first;
+  int (*comparator)( void *, void * );
+  void * (*copy_key)( void * );
+  void (*free_key)( void * );
+  void * (*copy_val)( void * );
+  void (*free_val)( void * );
+  unsigned long count;
+} btree;
+
+btree * btree_alloc( int (*)( void *, void * ), /* comparator */
+		     void * (*)( void * ), /* copy_key */
+		     void (*)( void * ), /* free_key */
+		     void * (*)( void * ), /* copy_val */
+		     void (*)( void * ) /* free_val */
+		     );
+int btree_build_from_sorted( btree *, void **, void **, unsigned long,
+			     unsigned long * );
+int btree_delete( btree *, void *, void ** );
+void * btree_enum( btree *, btree_entry *, void **, btree_entry ** );
+void * btree_enum_from( btree *, void *, void **, btree_entry ** );
+void btree_free( btree * );
+int btree_insert_no_overwrite( btree *, void *, void * );
+int btree_insert( btree *, void *, void * );
+int btree_query( btree *, void *, void ** );
+unsigned long btree_size( btree * );
+int btree_validate( btree * );
+
+#endif
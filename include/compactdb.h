@@ -0,0 +1,7 @@
+#ifndef __COMPACTDB_H__
+#define __COMPACTDB_H__
+
+void compactdb_help( void );
+void compactdb_main( int, char ** );
+
+#endif /* __COMPACTDB_H__ */
@@ -4,6 +4,7 @@
 #include <streams.h>
 #include <tar.h>
 
+#include <stdint.h>
 #include <sys/types.h>
 #include <time.h>
 
@@ -12,11 +13,16 @@
 #define EMIT_SUCCESS 0
 #define EMIT_ERROR -1
 
+/* Let get_threads() pick a thread count for compression */
+#define DEFAULT_THREADS 0
+
 typedef struct {
   char *output_file;
   time_t pkg_mtime;
   pkg_compression_t compression;
   pkg_version_t version;
+  /* Threads to compress with, or DEFAULT_THREADS */
+  int threads;
 } emit_opts;
 
 typedef struct {
@@ -51,10 +57,13 @@ typedef struct {
 } emit_pkg_streams;
 
 int emit_file( const char *, tar_file_info *, tar_writer * );
+int emit_file_hashed( const char *, tar_file_info *, tar_writer *,
+		      pkg_hash_t, uint8_t * );
 void finish_pkg_content( emit_opts *, emit_pkg_streams * );
 void finish_pkg_streams( emit_opts *, emit_pkg_streams * );
 void free_emit_opts( emit_opts * );
 pkg_compression_t get_compression( emit_opts * );
+int get_threads( emit_opts * );
 pkg_version_t get_version( emit_opts * );
 void guess_compression_and_version_from_filename( emit_opts * );
 int start_pkg_content( emit_opts *, emit_pkg_streams * );
@@ -0,0 +1,20 @@
+#ifndef __HASHCACHE_H__
+#define __HASHCACHE_H__
+
+#include <stdint.h>
+
+#include <sys/stat.h>
+
+#include <pkghash.h>
+#include <pkgtypes.h>
+
+/* Lives in the pkgdir, next to the package database */
+#define HASH_CACHE_FILE_NAME "pkg-hash-cache"
+
+void cache_file_hash( pkg_hash_t, const char *, struct stat *, uint8_t * );
+void close_hash_cache( void );
+void forget_cached_hash( struct stat * );
+int get_cached_hash( pkg_hash_t, const char *, struct stat *, uint8_t * );
+void open_hash_cache( void );
+
+#endif /* __HASHCACHE_H__ */
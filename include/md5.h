@@ -12,6 +12,9 @@
 #define MD5_BLOCK_LEN 64
 #define MD5_RESULT_LEN 16
 
+/* The most files get_file_md5s() hashes side by side */
+#define MD5_MAX_LANES 8
+
 typedef struct {
   enum {
     MD5_RUNNING,
@@ -29,8 +32,7 @@ typedef struct {
 } md5_state;
 
 void close_md5( md5_state * );
-int file_hash_matches( const char *, uint8_t * );
-int get_file_hash( const char *, uint8_t * );
+int get_file_md5s( const char **, uint8_t *, int *, int );
 int get_md5_result( md5_state *, uint8_t * );
 write_stream * get_md5_ws( md5_state * );
 md5_state * start_new_md5( void );
@@ -0,0 +1,7 @@
+#ifndef __OWNERS_H__
+#define __OWNERS_H__
+
+void owners_help( void );
+void owners_main( int, char ** );
+
+#endif /* __OWNERS_H__ */
@@ -0,0 +1,65 @@
+#ifndef __PATHTRIE_H__
+#define __PATHTRIE_H__
+
+/* The same codes as rbtree.h, so the two can stand in for each other */
+#define PATHTRIE_SUCCESS (0)
+#define PATHTRIE_NOT_FOUND (-1)
+#define PATHTRIE_ERROR (-2)
+#define PATHTRIE_NO_OVERWRITE (-3)
+
+/*
+ * One component of a location.  name is its number in the tree's
+ * interned component names, and pkg is one more than the number of
+ * the package that owns the location ending here, or 0 if none does.
+ */
+typedef struct pathtrie_node_struct {
+  unsigned int name, pkg;
+  /* The children, sorted by name */
+  unsigned int count, alloced;
+  struct pathtrie_node_struct *up, **children;
+} pathtrie_node;
+
+/* Interned strings, each stored once and known by its number */
+typedef struct {
+  char **strs;
+  unsigned int count, alloced;
+  /* Open hash of numbers plus one; 0 is an empty slot */
+  unsigned int *slots;
+  unsigned int nslots;
+  /* The blocks the strings live in; they never move */
+  struct pathtrie_chars_struct *chars;
+} pathtrie_strings;
+
+typedef struct {
+  pathtrie_node *root;
+  pathtrie_strings names, pkgs;
+  /* One more than the package the last insert used, or 0 */
+  unsigned int last_pkg;
+  /* Where nodes come from, and the ones deleted to use again */
+  struct pathtrie_block_struct *blocks;
+  pathtrie_node *free_nodes;
+  /*
+   * pathtrie_enum() builds the location it returns here; inserting
+   * keeps it big enough for any of them.
+   */
+  char *key;
+  unsigned long key_alloced;
+  unsigned long count;
+} pathtrie;
+
+pathtrie * pathtrie_alloc( void );
+int pathtrie_build_from_sorted( pathtrie *, void **, void **,
+				unsigned long, unsigned long * );
+int pathtrie_compare( void *, void * );
+int pathtrie_delete( pathtrie *, void *, void ** );
+void * pathtrie_enum( pathtrie *, pathtrie_node *, void **,
+		      pathtrie_node ** );
+void * pathtrie_enum_from( pathtrie *, void *, void **, pathtrie_node ** );
+void pathtrie_free( pathtrie * );
+int pathtrie_insert_no_overwrite( pathtrie *, void *, void * );
+int pathtrie_insert( pathtrie *, void *, void * );
+int pathtrie_query( pathtrie *, void *, void ** );
+unsigned long pathtrie_size( pathtrie * );
+int pathtrie_validate( pathtrie * );
+
+#endif
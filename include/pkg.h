@@ -3,17 +3,24 @@
 
 #define VERSION "0.1.1"
 
+#include <btree.h>
+#include <compactdb.h>
 #include <convert.h>
 #include <convertdb.h>
 #include <create.h>
 #include <createdb.h>
 #include <dumpdb.h>
 #include <emit.h>
+#include <hashcache.h>
 #include <install.h>
 #include <md5.h>
+#include <owners.h>
+#include <pathtrie.h>
 #include <pkgdb.h>
 #include <pkgdescr.h>
 #include <pkgglobal.h>
+#include <pkghash.h>
+#include <pkgmap.h>
 #include <pkgpath.h>
 #include <pkgtypes.h>
 #include <pkgutil.h>
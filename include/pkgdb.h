@@ -1,13 +1,17 @@
 #ifndef __PKG_DB_H__
 #define __PKG_DB_H__
 
+#include <rbtree.h>
+
 #define PKGDB_TEXT_FILE_NAME "pkg-managed-files"
+#define PKGDB_MMAP_FILE_NAME "pkg-managed-files.mmap"
 #ifdef DB_BDB
 #define PKGDB_BDB_FILE_NAME "pkg-managed-files.bdb"
 #endif /* DB_BDB */
 
 typedef enum {
   DBFMT_TEXT,
+  DBFMT_MMAP,
 #ifdef DB_BDB
   DBFMT_BDB,
 #endif /* DB_BDB */
@@ -22,25 +26,76 @@ typedef enum {
 typedef struct {
   void *private;
   char * (*query)( void *, char * );
+  /*
+   * Like query, but the result is the format's own copy; it's good
+   * until the next change, peek or close.
+   */
+  const char * (*peek)( void *, char * );
   int (*insert)( void *, char *, char * );
   int (*delete)( void *, char * );
   unsigned long (*entry_count)( void * );
   int (*enumerate)( void *, void *, char **, char **, void ** );
+  /* Like enumerate, but only the locations one package owns */
+  int (*enumerate_by_package)( void *, char *, void *, char **, void ** );
+  /* Like enumerate, but only the locations starting with a prefix */
+  int (*enumerate_prefix)( void *, char *, void *, char **, char **,
+			   void ** );
+  /*
+   * Call a function on every location and package, in order, with
+   * borrowed strings; it returns nonzero to stop early.
+   */
+  int (*foreach)( void *, int (*)( const char *, const char *, void * ),
+		  void * );
   int (*close)( void * );
+  /* NULL for formats that never need compacting */
+  int (*compact)( void * );
+  /*
+   * Group inserts and deletes: after begin, they all take effect at
+   * commit or none do after abort.  One transaction at a time.
+   */
+  int (*begin)( void * );
+  int (*commit)( void * );
+  int (*abort)( void * );
   dbfmt_t format;
   dbmode_t mode;
   char *filename;
 } pkg_db;
 
+int abort_pkg_db_txn( pkg_db * );
+int begin_pkg_db_txn( pkg_db * );
 int close_pkg_db( pkg_db * );
+int commit_pkg_db_txn( pkg_db * );
+int compact_pkg_db( pkg_db * );
 int delete_from_pkg_db( pkg_db *, char * );
 int enumerate_pkg_db( pkg_db *, void *, char **, char **, void ** );
+int enumerate_pkg_db_by_package( pkg_db *, char *, void *, char **,
+				 void ** );
+int enumerate_pkg_db_prefix( pkg_db *, char *, void *, char **, char **,
+			     void ** );
+int foreach_pkg_db( pkg_db *, int (*)( const char *, const char *, void * ),
+		    void * );
 unsigned long get_entry_count_for_pkg_db( pkg_db * );
+rbtree * get_owned_paths_for_pkg_db( pkg_db *, char * );
 int insert_into_pkg_db( pkg_db *, char *, char * );
 pkg_db * open_pkg_db( void );
 pkg_db * open_pkg_db_with_mode( dbmode_t );
+const char * peek_pkg_db( pkg_db *, char * );
 char * query_pkg_db( pkg_db *, char * );
 
+/*
+ * An in-memory index from package names to the locations they own,
+ * for formats that don't keep one on disk
+ */
+
+int add_to_owner_index( rbtree *, char *, char * );
+rbtree * build_owner_index( void *,
+			    int (*)( void *,
+				     int (*)( const char *, const char *,
+					      void * ),
+				     void * ) );
+int enumerate_owner_index( rbtree *, char *, void *, char **, void ** );
+int remove_from_owner_index( rbtree *, char *, char * );
+
 /*
  * Format-specific constructors
  */ 
@@ -48,6 +103,9 @@ char * query_pkg_db( pkg_db *, char * );
 pkg_db * create_pkg_db_text_file( char * );
 pkg_db * open_pkg_db_text_file( char *, dbmode_t );
 
+pkg_db * create_pkg_db_mmap( char * );
+pkg_db * open_pkg_db_mmap( char *, dbmode_t );
+
 #ifdef DB_BDB
 
 pkg_db * create_pkg_db_bdb( char * );
@@ -4,13 +4,14 @@
 #include <sys/types.h>
 #include <time.h>
 
-#include <md5.h>
-
-#define HASH_LEN MD5_RESULT_LEN
+#include <pkghash.h>
+#include <pkgtypes.h>
 
 typedef struct {
   char *pkg_name;
   time_t pkg_time;
+  /* What the file entries' hashes are; HASH_MD5 for old descriptions */
+  pkg_hash_t hash;
 } pkg_descr_hdr;
 
 typedef struct {
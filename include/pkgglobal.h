@@ -5,6 +5,10 @@
 #define DEFAULT_ROOT_STRING "/"
 #define DEFAULT_TEMP_STRING "/tmp"
 
+/* Size of the buffers used to move file contents around */
+#define DEFAULT_IO_BUFFER_SIZE 131072
+#define MIN_IO_BUFFER_SIZE 512
+
 void free_pkg_globals( void );
 void init_pkg_globals( void );
 int sanity_check_globals( void );
@@ -14,6 +18,10 @@ char * adjust_path_against_root( const char * );
 int get_check_md5( void );
 void set_check_md5( int );
 
+/* Keep hashes of installed files in the pkgdir between runs */
+int get_hash_cache( void );
+void set_hash_cache( int );
+
 const char * get_pkg( void );
 void set_pkg( const char * );
 
@@ -23,4 +31,15 @@ void set_root( const char * );
 const char * get_temp( void );
 void set_temp( const char * );
 
+/* Threads for (de)compression; 0 means one per online CPU */
+int get_default_threads( void );
+void set_default_threads( int );
+
+long get_io_buffer_size( void );
+void set_io_buffer_size( long );
+
+/* Try O_DIRECT when opening files for plain (uncompressed) streams */
+int get_io_direct( void );
+void set_io_direct( int );
+
 #endif /* __PKGGLOBAL_H__ */
@@ -0,0 +1,39 @@
+#ifndef __PKGHASH_H__
+#define __PKGHASH_H__
+
+#include <stdint.h>
+
+#include <md5.h>
+#include <pkgtypes.h>
+#include <streams.h>
+
+/*
+ * Room for the longest hash we know (BLAKE3); shorter ones come back
+ * zero-padded to this, so whole buffers can be compared.
+ */
+
+#define HASH_LEN 32
+
+typedef struct {
+  pkg_hash_t alg;
+  /* An md5_state for HASH_MD5, or the library's own state */
+  void *ctx;
+  /* Set once ws has been closed and the result is ready */
+  int done;
+  write_stream *ws;
+} hash_state;
+
+void close_hash( hash_state * );
+int file_hash_matches( pkg_hash_t, const char *, uint8_t * );
+int get_file_hash( pkg_hash_t, const char *, uint8_t * );
+int get_file_hashes( pkg_hash_t, const char **, uint8_t *, int *, int );
+int get_hash_len( pkg_hash_t );
+const char * get_hash_name( pkg_hash_t );
+int get_hash_result( hash_state *, uint8_t * );
+write_stream * get_hash_ws( hash_state * );
+int get_stream_hash( pkg_hash_t, read_stream *, uint8_t * );
+int hash_supported( pkg_hash_t );
+int parse_hash_name( const char *, pkg_hash_t * );
+hash_state * start_new_hash( pkg_hash_t );
+
+#endif /* __PKGHASH_H__ */
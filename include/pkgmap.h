@@ -0,0 +1,60 @@
+#ifndef __PKGMAP_H__
+#define __PKGMAP_H__
+
+#include <btree.h>
+#include <rbtree.h>
+
+/*
+ * The maps holding every location, in the text DB and in repairdb.
+ * These are rbtrees, or B+trees when built with USE_BTREE; btree.c
+ * has the same interface as rbtree.c, so this only picks the names.
+ */
+
+#ifdef USE_BTREE
+
+typedef btree pkg_map;
+typedef btree_entry pkg_map_node;
+
+#define PKG_MAP_SUCCESS BTREE_SUCCESS
+#define PKG_MAP_NOT_FOUND BTREE_NOT_FOUND
+#define PKG_MAP_ERROR BTREE_ERROR
+#define PKG_MAP_NO_OVERWRITE BTREE_NO_OVERWRITE
+
+#define pkg_map_alloc btree_alloc
+/* B+tree nodes are big to begin with, so there's no arena variant */
+#define pkg_map_alloc_transient btree_alloc
+#define pkg_map_build_from_sorted btree_build_from_sorted
+#define pkg_map_delete btree_delete
+#define pkg_map_enum btree_enum
+#define pkg_map_enum_from btree_enum_from
+#define pkg_map_free btree_free
+#define pkg_map_insert btree_insert
+#define pkg_map_insert_no_overwrite btree_insert_no_overwrite
+#define pkg_map_query btree_query
+#define pkg_map_size btree_size
+
+#else /* USE_BTREE */
+
+typedef rbtree pkg_map;
+typedef rbtree_node pkg_map_node;
+
+#define PKG_MAP_SUCCESS RBTREE_SUCCESS
+#define PKG_MAP_NOT_FOUND RBTREE_NOT_FOUND
+#define PKG_MAP_ERROR RBTREE_ERROR
+#define PKG_MAP_NO_OVERWRITE RBTREE_NO_OVERWRITE
+
+#define pkg_map_alloc rbtree_alloc
+#define pkg_map_alloc_transient rbtree_alloc_arena
+#define pkg_map_build_from_sorted rbtree_build_from_sorted
+#define pkg_map_delete rbtree_delete
+#define pkg_map_enum rbtree_enum
+#define pkg_map_enum_from rbtree_enum_from
+#define pkg_map_free rbtree_free
+#define pkg_map_insert rbtree_insert
+#define pkg_map_insert_no_overwrite rbtree_insert_no_overwrite
+#define pkg_map_query rbtree_query
+#define pkg_map_size rbtree_size
+
+#endif /* USE_BTREE */
+
+#endif /* __PKGMAP_H__ */
@@ -9,6 +9,9 @@ typedef enum {
 #ifdef COMPRESSION_BZIP2
   BZIP2,
 #endif /* COMPRESSION_BZIP2 */
+#ifdef COMPRESSION_ZSTD
+  ZSTD,
+#endif /* COMPRESSION_ZSTD */
   DEFAULT_COMPRESSION
 } pkg_compression_t;
 
@@ -22,4 +25,17 @@ typedef enum {
   DEFAULT_VERSION
 } pkg_version_t;
 
+/*
+ * Content hashes a package-description can name.  These are all here
+ * even if we weren't built with the library for one, so we can still
+ * read descriptions that use it; see hash_supported().
+ */
+
+typedef enum {
+  HASH_MD5,
+  HASH_BLAKE3,
+  HASH_XXH3,
+  DEFAULT_HASH
+} pkg_hash_t;
+
 #endif /* __PKG_TYPES_H__ */
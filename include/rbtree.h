@@ -23,6 +23,8 @@ typedef struct {
   void * (*copy_val)( void * );
   void (*free_val)( void * );
   unsigned long count;
+  /* Where nodes come from for rbtree_alloc_arena(), else NULL */
+  struct rbtree_arena_struct *arena;
 } rbtree;
 
 rbtree * rbtree_alloc( int (*)( void *, void * ), /* comparator */
@@ -31,9 +33,18 @@ rbtree * rbtree_alloc( int (*)( void *, void * ), /* comparator */
 		       void * (*)( void * ), /* copy_val */
 		       void (*)( void * ) /* free_val */
 		       );
+rbtree * rbtree_alloc_arena( int (*)( void *, void * ), /* comparator */
+			     void * (*)( void * ), /* copy_key */
+			     void (*)( void * ), /* free_key */
+			     void * (*)( void * ), /* copy_val */
+			     void (*)( void * ) /* free_val */
+			     );
+int rbtree_build_from_sorted( rbtree *, void **, void **, unsigned long,
+			      unsigned long * );
 int rbtree_delete( rbtree *, void *, void ** );
 void rbtree_dump( rbtree *, void (*)( void * ), void (*)( void * ) );
 void * rbtree_enum( rbtree *, rbtree_node *, void **, rbtree_node ** );
+void * rbtree_enum_from( rbtree *, void *, void **, rbtree_node ** );
 void rbtree_free( rbtree * );
 int rbtree_insert_no_overwrite( rbtree *, void *, void * );
 int rbtree_insert( rbtree *, void *, void * );
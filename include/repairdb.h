@@ -1,10 +1,10 @@
 #ifndef __REPAIRDB_H__
 #define __REPAIRDB_H__
 
-#include <md5.h>
 #include <pkgdb.h>
 #include <pkgdescr.h>
-#include <rbtree.h>
+#include <pkghash.h>
+#include <pkgmap.h>
 
 #include <sys/types.h>
 #include <time.h>
@@ -13,8 +13,6 @@
 #define REPAIRDB_ERROR (-1)
 #define REPAIRDB_FATAL_ERROR (-2)
 
-#define HASH_LEN MD5_RESULT_LEN
-
 typedef struct {
   /* Filesystem location claimed */
   char *location;
@@ -37,8 +35,9 @@ typedef struct {
   /* Type-specific fields */
   union {
     struct {
-      /* MD5 of files */
+      /* Hash of files, and which hash the package used */
       uint8_t hash[HASH_LEN];
+      pkg_hash_t alg;
     } f;
     struct {
       /* Target of symlinks */
@@ -61,17 +60,17 @@ typedef struct {
 
 typedef struct {
   /*
-   * The rbtree has strings as keys, and claims_list_t * as values.
+   * The map has strings as keys, and claims_list_t * as values.
    * It does *not* use the copy/free functions; this allows us to keep
    * only a single copy of each location string, and both the keys of
-   * the rbtree and the location fields of the claims_list_t
+   * the map and the location fields of the claims_list_t
    * structures pointed to by the values point to it.  Thus, when we
    * free the tree, we need to enumerate them by hand and free
    * appropriately.  Use the function free_claims_list_map().
    */
 
   int num_locations, num_packages, num_claims;
-  rbtree *t;
+  pkg_map *t;
 } claims_list_map_t;
 
 claims_list_map_t * alloc_claims_list_map( void );
@@ -83,7 +82,7 @@ claims_list_t * get_claims_list_by_location( claims_list_map_t *, char * );
 void repairdb_help( void );
 void repairdb_main( int, char ** );
 claims_list_map_t * repairdb_pass_one( void );
-rbtree * repairdb_pass_two( claims_list_map_t *, char );
-int repairdb_pass_three( pkg_db *, rbtree * );
+pkg_map * repairdb_pass_two( claims_list_map_t *, char );
+int repairdb_pass_three( pkg_db *, pkg_map * );
 
 #endif /* __REPAIRDB_H__ */
@@ -11,6 +11,15 @@ typedef struct {
 
   void (*close)( void * );
   long (*read)( void *, void *, long );
+  /*
+   * Optional, NULL if the stream can't lend out its own buffer.
+   * peek() points its second argument at up to the given number of
+   * bytes without copying and returns how many it got, STREAMS_EOF or
+   * an error; consume() then drops that many or fewer.  The pointer is
+   * only good until the next read() or peek() on the stream.
+   */
+  long (*peek)( void *, void **, long );
+  long (*consume)( void *, long );
 } read_stream;
 
 typedef struct {
@@ -20,19 +29,36 @@ typedef struct {
   long (*write)( void *, void *, long );
 } write_stream;
 
+long borrow_from_stream( read_stream *, void **, void *, long );
+int can_peek_stream( read_stream * );
 void close_read_stream( read_stream * );
 void close_write_stream( write_stream * );
+long consume_stream( read_stream *, long );
+long peek_stream( read_stream *, void **, long );
 long read_from_stream( read_stream *, void *, long );
 long write_to_stream( write_stream *, void *, long );
 
+/* Falls back to open_read_stream_none() for anything it can't map */
+read_stream * open_read_stream_mmap( const char * );
 read_stream * open_read_stream_none( const char * );
 write_stream * open_write_stream_none( const char * );
+/*
+ * Reads ahead on a worker thread; NULL if we have no threads or
+ * --threads 1, in which case just use the inner stream.
+ */
+read_stream * open_read_stream_prefetch( read_stream * );
+/* Neither of these closes the streams it's given */
+read_stream * open_tee_read_stream( read_stream *, write_stream * );
+write_stream * open_tee_write_stream( write_stream *, write_stream * );
 
 #ifdef COMPRESSION_GZIP
 read_stream * open_read_stream_gzip( const char * );
 write_stream * open_write_stream_gzip( const char * );
 read_stream * open_read_stream_from_stream_gzip( read_stream * );
 write_stream * open_write_stream_from_stream_gzip( write_stream * );
+/* Falls back to the serial version for threads <= 1 */
+write_stream * open_write_stream_from_stream_gzip_parallel( write_stream *,
+							    int );
 #endif /* COMPRESSION_GZIP */
 
 #ifdef COMPRESSION_BZIP2
@@ -40,6 +66,32 @@ read_stream * open_read_stream_bzip2( const char * );
 write_stream * open_write_stream_bzip2( const char * );
 read_stream * open_read_stream_from_stream_bzip2( read_stream * );
 write_stream * open_write_stream_from_stream_bzip2( write_stream * );
+/* These fall back to the serial versions for threads <= 1 */
+read_stream * open_read_stream_from_stream_bzip2_parallel( read_stream *,
+							   int );
+write_stream * open_write_stream_from_stream_bzip2_parallel( write_stream *,
+							     int );
 #endif /* COMPRESSION_BZIP2 */
 
+#ifdef COMPRESSION_ZSTD
+read_stream * open_read_stream_zstd( const char * );
+write_stream * open_write_stream_zstd( const char * );
+read_stream * open_read_stream_from_stream_zstd( read_stream * );
+write_stream * open_write_stream_from_stream_zstd( write_stream * );
+#endif /* COMPRESSION_ZSTD */
+
+#ifdef USE_PTHREADS
+/*
+ * Worker pool for the parallel compression streams; jobs come back
+ * from wait_stream_job() in the order they were submitted.
+ */
+typedef struct stream_pool_s stream_pool;
+
+int get_stream_pool_pending( stream_pool * );
+stream_pool * start_stream_pool( int, void (*)( void * ) );
+void stop_stream_pool( stream_pool * );
+int submit_stream_job( stream_pool *, void * );
+void * wait_stream_job( stream_pool * );
+#endif /* USE_PTHREADS */
+
 #endif
@@ -75,6 +75,11 @@ typedef struct {
       unsigned long long bytes_seen;
       unsigned long long blocks_seen;
       unsigned long long bytes_total;
+      /*
+       * The current block was only partly consumed from under us by
+       * a peek; the rest of it is still waiting there.
+       */
+      int partial;
     } in_file;
   } u;
   read_stream *rs;
@@ -92,9 +97,12 @@ typedef struct {
   union {
     struct {
       tar_file_info *f;
+      /* Spool for members of unknown size; -1 if size was given */
       char *tmp_name;
       int tmp;
       unsigned long long bytes_seen;
+      /* Declared size, if this member came from put_next_file_sized() */
+      unsigned long long bytes_total;
     } in_file;
   } u;
   write_stream *ws;
@@ -106,6 +114,8 @@ tar_file_info * get_file_info( tar_reader * );
 int get_next_file( tar_reader * );
 read_stream * get_reader_for_file( tar_reader * );
 write_stream * put_next_file( tar_writer *, tar_file_info * );
+write_stream * put_next_file_sized( tar_writer *, tar_file_info *,
+				    unsigned long long );
 tar_reader * start_tar_reader( read_stream * );
 tar_writer * start_tar_writer( write_stream * );
 
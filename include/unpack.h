@@ -1,8 +1,15 @@
 #ifndef __UNPACK_H__
 #define __UNPACK_H__
 
+#include <streams.h>
+#include <tar.h>
+
 #include <pkgtypes.h>
 
+#define PKG_STREAM_SUCCESS 0
+#define PKG_STREAM_NO_MORE_FILES -1
+#define PKG_STREAM_ERROR -2
+
 typedef struct {
   pkg_descr *descr;
   char *descr_file;
@@ -11,7 +18,46 @@ typedef struct {
   pkg_version_t version;
 } pkg_handle;
 
+typedef struct {
+  /*
+   * The package-description has already been read into this when
+   * open_pkg_stream() returns; unpacked_dir holds only the
+   * package-description.
+   */
+  pkg_handle *h;
+  /* Bare rs for the package file */
+  read_stream *file_rs;
+  /*
+   * Decompressing rs wrapped around file_rs for V1, and around
+   * content_rs for V2
+   */
+  read_stream *comp_rs;
+  /* Read-ahead around comp_rs, if we have the threads for it */
+  read_stream *prefetch_rs;
+  /* The outer tar_reader for V2, the only tar_reader for V1 */
+  tar_reader *outer_tr;
+#ifdef PKGFMT_V2
+  /* The bare rs for the package-content.tar.{|gz|bz2} member */
+  read_stream *content_rs;
+  /* The inner tar_reader for V2 */
+  tar_reader *content_tr;
+  /* The package-description came after the content in the V2 case */
+  int descr_trails;
+#endif /* PKGFMT_V2 */
+  /*
+   * The tar_reader files come from; outer_tr for V1 and content_tr
+   * for V2
+   */
+  tar_reader *tr;
+  /* Reader for the current file, if any */
+  read_stream *curr_rs;
+} pkg_stream;
+
 void close_pkg( pkg_handle * );
+void close_pkg_stream( pkg_stream * );
+int get_next_pkg_stream_file( pkg_stream *, tar_file_info **,
+			      read_stream ** );
 pkg_handle * open_pkg_file( const char * );
+pkg_stream * open_pkg_stream( const char * );
 
 #endif
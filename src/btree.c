@@ -0,0 +1,759 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <pkg.h>
+
+/*
+ * A B+tree with the same interface as rbtree.c.  All the entries live
+ * in the leaves, sorted, up to BTREE_LEAF_MAX to a leaf; the interior
+ * nodes only hold separators to steer lookups.  A lookup reads a few
+ * wide nodes instead of chasing a pointer per comparison down an
+ * rbtree, and the entries of a leaf sit together in memory.
+ *
+ * Each leaf's entry array ends with a sentinel with a NULL key and the
+ * next leaf as its value, so btree_enum() can step from one entry to
+ * the next without a separate cursor.  That also means NULL keys can't
+ * be stored, just as with rbtree_insert().
+ *
+ * Deleting doesn't merge leaves; they can run down to empty, and the
+ * separators stay where they were, which is still a correct bound.
+ * The trees here are loaded once and changed a little, so that's fine.
+ *
+ * Separators are copies made with copy_key if the tree copies keys.
+ * Otherwise they point at the keys themselves, and the caller must
+ * keep a key valid until the tree is freed, even after deleting it.
+ *
+ * Inserting or deleting invalidates any entry pointers from
+ * btree_enum() or btree_enum_from().
+ */
+
+#define BTREE_LEAF_MAX 64
+#define BTREE_INNER_MAX 64
+
+typedef struct btree_leaf_struct {
+  int count;
+  /* entries[count] is the sentinel */
+  btree_entry entries[BTREE_LEAF_MAX + 1];
+} btree_leaf;
+
+typedef struct {
+  /* The number of keys; there is one more child than that */
+  int count;
+  void *keys[BTREE_INNER_MAX];
+  void *children[BTREE_INNER_MAX + 1];
+} btree_inner;
+
+static btree_leaf * btree_alloc_leaf( void );
+static int btree_build_level( btree *, void **, void **, unsigned long,
+			      int );
+static btree_leaf * btree_build_leaf( btree *, void **, void **, int );
+static btree_leaf * btree_find_leaf( btree *, void * );
+static void btree_free_node( btree *, void *, int );
+static int btree_inner_search( btree *, btree_inner *, void * );
+static int btree_insert_leaf( btree *, btree_leaf *, void *, void *, int,
+			      void **, void ** );
+static int btree_insert_node( btree *, void *, int, void *, void *, int,
+			      void **, void ** );
+static int btree_insert_top( btree *, void *, void *, int );
+static int btree_insert_with_copies( btree *, void *, void *, int );
+static int btree_leaf_search( btree *, btree_leaf *, void *, int * );
+static btree_entry * btree_skip_sentinels( btree_entry * );
+static int btree_validate_node( btree *, void *, int, void *, void *,
+				unsigned long * );
+
+btree * btree_alloc( int (*comparator)( void *, void * ),
+		     void * (*copy_key)( void * ),
+		     void (*free_key)( void * ),
+		     void * (*copy_val)( void * ),
+		     void (*free_val)( void * ) ) {
+  btree *t;
+
+  if ( comparator ) {
+    t = malloc( sizeof( *t ) );
+    if ( t ) {
+      t->root = btree_alloc_leaf();
+      if ( t->root ) {
+	t->height = 0;
+	t->first = t->root;
+	t->comparator = comparator;
+	t->copy_key = copy_key;
+	t->free_key = free_key;
+	t->copy_val = copy_val;
+	t->free_val = free_val;
+	t->count = 0;
+      }
+      else {
+	free( t );
+	t = NULL;
+      }
+    }
+    return t;
+  }
+  else return NULL;
+}
+
+static btree_leaf * btree_alloc_leaf( void ) {
+  btree_leaf *l;
+
+  l = malloc( sizeof( *l ) );
+  if ( l ) {
+    l->count = 0;
+    l->entries[0].key = NULL;
+    l->entries[0].value = NULL;
+  }
+
+  return l;
+}
+
+/*
+ * Load n keys and values into t, as rbtree_build_from_sorted() does:
+ * if t is empty and the keys strictly increase, fill the leaves left
+ * to right and stack the interior levels on them, otherwise insert
+ * them one by one.  The leaves come out full, so the first insert into
+ * each splits it; the DBs this loads mostly don't change much.
+ */
+
+int btree_build_from_sorted( btree *t, void **keys, void **vals,
+			     unsigned long n, unsigned long *bad ) {
+  void **level, **firsts;
+  btree_leaf *l, *prev, *first;
+  unsigned long i, j, count, per, extra, pos;
+  int sorted, result, height, m;
+
+  if ( !t || ( n > 0 && !( keys && vals ) ) ) return BTREE_ERROR;
+
+  sorted = ( t->count == 0 );
+  for ( i = 0; sorted && i < n; ++i ) {
+    if ( !(keys[i]) ||
+	 ( i > 0 && t->comparator( keys[i - 1], keys[i] ) >= 0 ) )
+      sorted = 0;
+  }
+  if ( sorted && n == 0 ) return BTREE_SUCCESS;
+
+  level = firsts = NULL;
+  count = ( n + BTREE_LEAF_MAX - 1 ) / BTREE_LEAF_MAX;
+  if ( sorted ) {
+    level = malloc( sizeof( void * ) * count );
+    firsts = malloc( sizeof( void * ) * count );
+  }
+  if ( !( level && firsts ) ) {
+    if ( level ) free( level );
+    if ( firsts ) free( firsts );
+    for ( i = 0; i < n; ++i ) {
+      result = btree_insert_no_overwrite( t, keys[i], vals[i] );
+      if ( result != BTREE_SUCCESS ) {
+	if ( bad ) *bad = i;
+	return result;
+      }
+    }
+    return BTREE_SUCCESS;
+  }
+
+  /* Spread the entries evenly, so the last leaf isn't nearly empty */
+  per = n / count;
+  extra = n % count;
+  pos = 0;
+  prev = first = NULL;
+  result = BTREE_SUCCESS;
+  for ( j = 0; j < count; ++j ) {
+    m = ( int )( per + ( ( j < extra ) ? 1 : 0 ) );
+    l = btree_build_leaf( t, keys + pos, vals + pos, m );
+    if ( !l ) {
+      for ( i = 0; i < j; ++i ) btree_free_node( t, level[i], 0 );
+      result = BTREE_ERROR;
+      break;
+    }
+    if ( prev ) prev->entries[prev->count].value = l;
+    else first = l;
+    level[j] = l;
+    firsts[j] = keys[pos];
+    prev = l;
+    pos += m;
+  }
+
+  height = 0;
+  while ( result == BTREE_SUCCESS && count > 1 ) {
+    result = btree_build_level( t, level, firsts, count, height );
+    count = ( count + BTREE_INNER_MAX ) / ( BTREE_INNER_MAX + 1 );
+    ++height;
+  }
+
+  if ( result == BTREE_SUCCESS ) {
+    btree_free_node( t, t->root, t->height );
+    t->root = level[0];
+    t->height = height;
+    t->first = first;
+    t->count = n;
+  }
+  free( level );
+  free( firsts );
+
+  return result;
+}
+
+/*
+ * Replace the count nodes of the given height in level with their
+ * parents, in place; firsts holds the least key under each.  On
+ * failure, everything in level is freed.
+ */
+
+static int btree_build_level( btree *t, void **level, void **firsts,
+			      unsigned long count, int height ) {
+  btree_inner *in;
+  unsigned long i, j, parents, per, extra, pos;
+  int c, m;
+
+  parents = ( count + BTREE_INNER_MAX ) / ( BTREE_INNER_MAX + 1 );
+  per = count / parents;
+  extra = count % parents;
+  pos = 0;
+  for ( j = 0; j < parents; ++j ) {
+    m = ( int )( per + ( ( j < extra ) ? 1 : 0 ) );
+    in = malloc( sizeof( *in ) );
+    if ( in ) {
+      in->count = 0;
+      for ( c = 1; c < m; ++c ) {
+	if ( t->copy_key && t->free_key ) {
+	  in->keys[c - 1] = t->copy_key( firsts[pos + c] );
+	  if ( !(in->keys[c - 1]) ) break;
+	}
+	else in->keys[c - 1] = firsts[pos + c];
+	++(in->count);
+      }
+      if ( in->count < m - 1 ) {
+	if ( t->copy_key && t->free_key ) {
+	  for ( c = 0; c < in->count; ++c ) t->free_key( in->keys[c] );
+	}
+	free( in );
+	in = NULL;
+      }
+    }
+
+    if ( !in ) {
+      /* The new parents so far sit before the unclaimed old nodes */
+      for ( i = 0; i < j; ++i )
+	btree_free_node( t, level[i], height + 1 );
+      for ( i = pos; i < count; ++i )
+	btree_free_node( t, level[i], height );
+      return BTREE_ERROR;
+    }
+
+    memcpy( in->children, level + pos, sizeof( void * ) * m );
+    /* j <= pos, so this only overwrites nodes already taken */
+    level[j] = in;
+    firsts[j] = firsts[pos];
+    pos += m;
+  }
+
+  return BTREE_SUCCESS;
+}
+
+/* A leaf holding copies of the n keys and values, or NULL */
+
+static btree_leaf * btree_build_leaf( btree *t, void **keys, void **vals,
+				      int n ) {
+  btree_leaf *l;
+  void *k, *v;
+  int i;
+
+  l = btree_alloc_leaf();
+  if ( !l ) return NULL;
+
+  for ( i = 0; i < n; ++i ) {
+    if ( t->copy_key && t->free_key ) k = t->copy_key( keys[i] );
+    else k = keys[i];
+    if ( !k ) break;
+    if ( vals[i] && t->copy_val && t->free_val ) {
+      v = t->copy_val( vals[i] );
+      if ( !v ) {
+	if ( k != keys[i] ) t->free_key( k );
+	break;
+      }
+    }
+    else v = vals[i];
+    l->entries[i].key = k;
+    l->entries[i].value = v;
+    ++(l->count);
+  }
+  l->entries[l->count].key = NULL;
+  l->entries[l->count].value = NULL;
+
+  if ( l->count < n ) {
+    btree_free_node( t, l, 0 );
+    l = NULL;
+  }
+
+  return l;
+}
+
+int btree_delete( btree *t, void *k, void **vout ) {
+  btree_leaf *l;
+  btree_entry *e;
+  void *v;
+  int pos, found;
+
+  if ( !t ) return BTREE_ERROR;
+  l = btree_find_leaf( t, k );
+  pos = btree_leaf_search( t, l, k, &found );
+  if ( !found ) return BTREE_NOT_FOUND;
+
+  e = &(l->entries[pos]);
+  if ( vout ) {
+    if ( e->value && t->copy_val && t->free_val ) {
+      v = t->copy_val( e->value );
+      if ( v ) *vout = v;
+      else return BTREE_ERROR;
+    }
+    else *vout = e->value;
+  }
+  if ( t->copy_key && t->free_key ) t->free_key( e->key );
+  if ( e->value && t->copy_val && t->free_val ) t->free_val( e->value );
+
+  /* Close the gap, bringing the sentinel down with the rest */
+  memmove( e, e + 1, sizeof( *e ) * ( l->count - pos ) );
+  --(l->count);
+  --(t->count);
+
+  return BTREE_SUCCESS;
+}
+
+void * btree_enum( btree *t, btree_entry *in,
+		   void **vout, btree_entry **nout ) {
+  /*
+   * Like rbtree_enum(): start from the beginning if in is NULL, else
+   * go to the entry after in.  There's always a sentinel after a real
+   * entry, so in + 1 is safe.
+   */
+  btree_entry *e;
+
+  if ( in ) e = in + 1;
+  else if ( t && t->first ) e = ((btree_leaf *)(t->first))->entries;
+  else e = NULL;
+  e = btree_skip_sentinels( e );
+
+  if ( nout ) *nout = e;
+  if ( vout ) *vout = e ? e->value : NULL;
+  return e ? e->key : NULL;
+}
+
+void * btree_enum_from( btree *t, void *key,
+			void **vout, btree_entry **nout ) {
+  /* The first entry whose key is not less than key, as rbtree_enum_from() */
+  btree_leaf *l;
+  btree_entry *e;
+  int pos, found;
+
+  e = NULL;
+  if ( t ) {
+    l = btree_find_leaf( t, key );
+    pos = btree_leaf_search( t, l, key, &found );
+    e = btree_skip_sentinels( &(l->entries[pos]) );
+  }
+
+  if ( nout ) *nout = e;
+  if ( vout ) *vout = e ? e->value : NULL;
+  return e ? e->key : NULL;
+}
+
+/* Walk down to the leaf key would be in */
+
+static btree_leaf * btree_find_leaf( btree *t, void *key ) {
+  void *n;
+  int h;
+
+  n = t->root;
+  for ( h = t->height; h > 0; --h )
+    n = ((btree_inner *)n)->children[btree_inner_search( t, n, key )];
+
+  return (btree_leaf *)n;
+}
+
+void btree_free( btree *t ) {
+  if ( t ) {
+    btree_free_node( t, t->root, t->height );
+    free( t );
+  }
+}
+
+static void btree_free_node( btree *t, void *n, int height ) {
+  btree_leaf *l;
+  btree_inner *in;
+  int i;
+
+  if ( height == 0 ) {
+    l = (btree_leaf *)n;
+    for ( i = 0; i < l->count; ++i ) {
+      if ( t->free_val ) t->free_val( l->entries[i].value );
+      if ( t->free_key ) t->free_key( l->entries[i].key );
+    }
+  }
+  else {
+    in = (btree_inner *)n;
+    for ( i = 0; i <= in->count; ++i )
+      btree_free_node( t, in->children[i], height - 1 );
+    if ( t->copy_key && t->free_key ) {
+      for ( i = 0; i < in->count; ++i ) t->free_key( in->keys[i] );
+    }
+  }
+  free( n );
+}
+
+/*
+ * Which child of n key belongs under: the number of separators not
+ * greater than it, since each separator is the least key of the child
+ * to its right.
+ */
+
+static int btree_inner_search( btree *t, btree_inner *n, void *key ) {
+  int lo, hi, mid;
+
+  lo = 0;
+  hi = n->count;
+  while ( lo < hi ) {
+    mid = lo + ( hi - lo ) / 2;
+    if ( t->comparator( key, n->keys[mid] ) >= 0 ) lo = mid + 1;
+    else hi = mid;
+  }
+
+  return lo;
+}
+
+int btree_insert_no_overwrite( btree *t, void *key, void *val ) {
+  return btree_insert_with_copies( t, key, val, 0 );
+}
+
+int btree_insert( btree *t, void *key, void *val ) {
+  return btree_insert_with_copies( t, key, val, 1 );
+}
+
+/*
+ * Put k and v in leaf l.  If l is full, split it and hand back the new
+ * right half and its separator for the parent to take.
+ */
+
+static int btree_insert_leaf( btree *t, btree_leaf *l, void *k, void *v,
+			      int overwrite, void **sep_out,
+			      void **right_out ) {
+  btree_entry tmp[BTREE_LEAF_MAX + 1];
+  btree_entry *e;
+  btree_leaf *r;
+  void *sep, *next;
+  int pos, found, half;
+
+  pos = btree_leaf_search( t, l, k, &found );
+  e = &(l->entries[pos]);
+  if ( found ) {
+    if ( overwrite ) {
+      if ( t->free_key ) t->free_key( e->key );
+      e->key = k;
+      if ( t->free_val ) t->free_val( e->value );
+      e->value = v;
+      /* We don't change the count to replace an existing entry */
+      return BTREE_SUCCESS;
+    }
+    else return BTREE_NO_OVERWRITE;
+  }
+
+  if ( l->count < BTREE_LEAF_MAX ) {
+    memmove( e + 1, e, sizeof( *e ) * ( l->count + 1 - pos ) );
+    e->key = k;
+    e->value = v;
+    ++(l->count);
+    ++(t->count);
+    return BTREE_SUCCESS;
+  }
+
+  /* Full; lay the entries out with the new one, then deal them out */
+  memcpy( tmp, l->entries, sizeof( *tmp ) * pos );
+  tmp[pos].key = k;
+  tmp[pos].value = v;
+  memcpy( tmp + pos + 1, e, sizeof( *tmp ) * ( l->count - pos ) );
+  half = ( BTREE_LEAF_MAX + 1 ) / 2;
+
+  r = malloc( sizeof( *r ) );
+  if ( !r ) return BTREE_ERROR;
+  if ( t->copy_key && t->free_key ) {
+    sep = t->copy_key( tmp[half].key );
+    if ( !sep ) {
+      free( r );
+      return BTREE_ERROR;
+    }
+  }
+  else sep = tmp[half].key;
+
+  next = l->entries[l->count].value;
+  memcpy( l->entries, tmp, sizeof( *tmp ) * half );
+  l->count = half;
+  l->entries[half].key = NULL;
+  l->entries[half].value = r;
+  r->count = BTREE_LEAF_MAX + 1 - half;
+  memcpy( r->entries, tmp + half, sizeof( *tmp ) * r->count );
+  r->entries[r->count].key = NULL;
+  r->entries[r->count].value = next;
+  ++(t->count);
+
+  *sep_out = sep;
+  *right_out = r;
+  return BTREE_SUCCESS;
+}
+
+/*
+ * Insert under n, height levels above the leaves, passing a split of
+ * n up the same way btree_insert_leaf() does.  If n is full, we get
+ * the node for its right half before going down, so nothing below has
+ * changed if we can't.
+ */
+
+static int btree_insert_node( btree *t, void *n, int height,
+			      void *k, void *v, int overwrite,
+			      void **sep_out, void **right_out ) {
+  void *keys[BTREE_INNER_MAX + 1], *children[BTREE_INNER_MAX + 2];
+  btree_inner *in, *spare;
+  void *sep, *right;
+  int i, result, half;
+
+  *right_out = NULL;
+  if ( height == 0 )
+    return btree_insert_leaf( t, n, k, v, overwrite, sep_out, right_out );
+
+  in = (btree_inner *)n;
+  i = btree_inner_search( t, in, k );
+  spare = NULL;
+  if ( in->count == BTREE_INNER_MAX ) {
+    spare = malloc( sizeof( *spare ) );
+    if ( !spare ) return BTREE_ERROR;
+  }
+
+  right = NULL;
+  result = btree_insert_node( t, in->children[i], height - 1, k, v,
+			      overwrite, &sep, &right );
+  if ( result == BTREE_SUCCESS && right ) {
+    if ( in->count < BTREE_INNER_MAX ) {
+      memmove( in->keys + i + 1, in->keys + i,
+	       sizeof( void * ) * ( in->count - i ) );
+      memmove( in->children + i + 2, in->children + i + 1,
+	       sizeof( void * ) * ( in->count - i ) );
+      in->keys[i] = sep;
+      in->children[i + 1] = right;
+      ++(in->count);
+    }
+    else {
+      memcpy( keys, in->keys, sizeof( void * ) * i );
+      keys[i] = sep;
+      memcpy( keys + i + 1, in->keys + i,
+	      sizeof( void * ) * ( in->count - i ) );
+      memcpy( children, in->children, sizeof( void * ) * ( i + 1 ) );
+      children[i + 1] = right;
+      memcpy( children + i + 2, in->children + i + 1,
+	      sizeof( void * ) * ( in->count - i ) );
+
+      /* The middle separator goes up rather than to either side */
+      half = ( BTREE_INNER_MAX + 1 ) / 2;
+      in->count = half;
+      memcpy( in->keys, keys, sizeof( void * ) * half );
+      memcpy( in->children, children, sizeof( void * ) * ( half + 1 ) );
+      spare->count = BTREE_INNER_MAX - half;
+      memcpy( spare->keys, keys + half + 1,
+	      sizeof( void * ) * spare->count );
+      memcpy( spare->children, children + half + 1,
+	      sizeof( void * ) * ( spare->count + 1 ) );
+
+      *sep_out = keys[half];
+      *right_out = spare;
+      spare = NULL;
+    }
+  }
+  if ( spare ) free( spare );
+
+  return result;
+}
+
+/* Insert from the root, growing a new root if the old one splits */
+
+static int btree_insert_top( btree *t, void *k, void *v, int overwrite ) {
+  btree_inner *root;
+  void *sep, *right;
+  int result, full;
+
+  if ( t->height == 0 )
+    full = ( ((btree_leaf *)(t->root))->count == BTREE_LEAF_MAX );
+  else full = ( ((btree_inner *)(t->root))->count == BTREE_INNER_MAX );
+  root = NULL;
+  if ( full ) {
+    root = malloc( sizeof( *root ) );
+    if ( !root ) return BTREE_ERROR;
+  }
+
+  result = btree_insert_node( t, t->root, t->height, k, v, overwrite,
+			      &sep, &right );
+  if ( result == BTREE_SUCCESS && right ) {
+    root->count = 1;
+    root->keys[0] = sep;
+    root->children[0] = t->root;
+    root->children[1] = right;
+    t->root = root;
+    ++(t->height);
+    root = NULL;
+  }
+  if ( root ) free( root );
+
+  return result;
+}
+
+/* Copy the key and value as the tree wants, as rbtree_insert() does */
+
+static int btree_insert_with_copies( btree *t, void *key, void *val,
+				     int overwrite ) {
+  int result, status;
+  void *k, *v;
+
+  status = BTREE_SUCCESS;
+  if ( t && key ) {
+    if ( t->copy_key && t->free_key ) k = t->copy_key( key );
+    else k = key;
+    if ( k ) {
+      if ( t->copy_val && t->free_val ) v = t->copy_val( val );
+      else v = val;
+      if ( ( val && v ) || ( !val && !v ) ) {
+	result = btree_insert_top( t, k, v, overwrite );
+	if ( result != BTREE_SUCCESS ) {
+	  if ( k != key && t->free_key ) t->free_key( k );
+	  if ( v != val && t->free_val ) t->free_val( v );
+	  status = result;
+	}
+      }
+      else {
+	if ( k != key && t->free_key ) t->free_key( k );
+	status = BTREE_ERROR;
+      }
+    }
+    else status = BTREE_ERROR;
+  }
+  else status = BTREE_ERROR;
+  return status;
+}
+
+/*
+ * The position of the first entry in l not less than key, and whether
+ * it's equal.
+ */
+
+static int btree_leaf_search( btree *t, btree_leaf *l, void *key,
+			      int *found ) {
+  int lo, hi, mid, c;
+
+  *found = 0;
+  lo = 0;
+  hi = l->count;
+  while ( lo < hi ) {
+    mid = lo + ( hi - lo ) / 2;
+    c = t->comparator( key, l->entries[mid].key );
+    if ( c > 0 ) lo = mid + 1;
+    else {
+      if ( c == 0 ) *found = 1;
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
+int btree_query( btree *t, void *key, void **val_out ) {
+  btree_leaf *l;
+  int pos, found;
+
+  if ( t && val_out ) {
+    l = btree_find_leaf( t, key );
+    pos = btree_leaf_search( t, l, key, &found );
+    if ( found ) {
+      *val_out = l->entries[pos].value;
+      return BTREE_SUCCESS;
+    }
+    else return BTREE_NOT_FOUND;
+  }
+  else return BTREE_ERROR;
+}
+
+unsigned long btree_size( btree *t ) {
+  if ( t ) return t->count;
+  else return 0;
+}
+
+/* Step over sentinels, and so any empty leaves, to a real entry */
+
+static btree_entry * btree_skip_sentinels( btree_entry *e ) {
+  btree_leaf *next;
+
+  while ( e && !(e->key) ) {
+    next = (btree_leaf *)(e->value);
+    e = next ? next->entries : NULL;
+  }
+
+  return e;
+}
+
+/*
+ * Check that every key is in order and within the separators above
+ * it, and that the count and the chain of leaves agree with the tree.
+ * Returns 1 if so, 0 if not.
+ */
+
+int btree_validate( btree *t ) {
+  btree_entry *e;
+  void *prev;
+  unsigned long n;
+
+  if ( !t ) return 0;
+  n = 0;
+  if ( !btree_validate_node( t, t->root, t->height, NULL, NULL, &n ) )
+    return 0;
+  if ( n != t->count ) return 0;
+
+  n = 0;
+  prev = NULL;
+  e = NULL;
+  while ( btree_enum( t, e, NULL, &e ) ) {
+    if ( prev && t->comparator( prev, e->key ) >= 0 ) return 0;
+    prev = e->key;
+    ++n;
+  }
+  if ( n != t->count ) return 0;
+
+  return 1;
+}
+
+static int btree_validate_node( btree *t, void *n, int height,
+				void *lo, void *hi, unsigned long *count ) {
+  btree_leaf *l;
+  btree_inner *in;
+  int i;
+
+  if ( height == 0 ) {
+    l = (btree_leaf *)n;
+    if ( l->count < 0 || l->count > BTREE_LEAF_MAX ) return 0;
+    if ( l->entries[l->count].key ) return 0;
+    for ( i = 0; i < l->count; ++i ) {
+      if ( !(l->entries[i].key) ) return 0;
+      if ( i > 0 && t->comparator( l->entries[i - 1].key,
+				   l->entries[i].key ) >= 0 ) return 0;
+      if ( lo && t->comparator( l->entries[i].key, lo ) < 0 ) return 0;
+      if ( hi && t->comparator( l->entries[i].key, hi ) >= 0 ) return 0;
+    }
+    *count += l->count;
+  }
+  else {
+    in = (btree_inner *)n;
+    if ( in->count < 1 || in->count > BTREE_INNER_MAX ) return 0;
+    for ( i = 0; i <= in->count; ++i ) {
+      if ( i > 0 && i < in->count &&
+	   t->comparator( in->keys[i - 1], in->keys[i] ) >= 0 ) return 0;
+      if ( !btree_validate_node( t, in->children[i], height - 1,
+				 ( i > 0 ) ? in->keys[i - 1] : lo,
+				 ( i < in->count ) ? in->keys[i] : hi,
+				 count ) )
+	return 0;
+    }
+  }
+
+  return 1;
+}
@@ -0,0 +1,53 @@
+#include <pkg.h>
+
+#include <stdlib.h>
+
+#define COMPACTDB_SUCCESS (0)
+#define COMPACTDB_ERROR (-1)
+
+static void compactdb( void );
+
+static void compactdb( void ) {
+  pkg_db *db;
+  int result, status;
+
+  status = COMPACTDB_SUCCESS;
+  db = open_pkg_db();
+  if ( db ) {
+    result = compact_pkg_db( db );
+    if ( result != 0 ) {
+      fprintf( stderr, "Unable to compact package database\n" );
+      status = COMPACTDB_ERROR;
+    }
+
+    result = close_pkg_db( db );
+    if ( result != 0 && status == COMPACTDB_SUCCESS ) {
+      fprintf( stderr, "Unable to close package database\n" );
+      status = COMPACTDB_ERROR;
+    }
+  }
+  else {
+    fprintf( stderr, "Unable to open package database\n" );
+    status = COMPACTDB_ERROR;
+  }
+}
+
+void compactdb_help( void ) {
+  printf( "Compact the package DB.  Usage:\n" );
+  printf( "\n" );
+  printf( "mpkg [global options] compactdb\n" );
+  printf( "\n" );
+  printf( "For the text format, this folds the journal of changes made " );
+  printf( "since the last\ncompaction back into the database file.  " );
+  printf( "Other formats need no compacting,\nand for them this does " );
+  printf( "nothing.\n" );
+}
+
+void compactdb_main( int argc, char **argv ) {
+  if ( argc == 0 ) {
+    compactdb();
+  }
+  else {
+    fprintf( stderr, "Too many arguments for compactdb command\n" );
+  }
+}
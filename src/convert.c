@@ -22,6 +22,7 @@ static void free_convert_opts( convert_opts * );
 static int set_compression_arg( convert_opts *, const char * );
 static int set_input_file( convert_opts *, const char * );
 static int set_output_file( convert_opts *, const char * );
+static int set_threads_arg( convert_opts *, const char * );
 static int set_version_arg( convert_opts *, const char * );
 
 static convert_opts * alloc_convert_opts( void ) {
@@ -36,6 +37,7 @@ static convert_opts * alloc_convert_opts( void ) {
       opts->emit->pkg_mtime = 0;
       opts->emit->compression = DEFAULT_COMPRESSION;
       opts->emit->version = DEFAULT_VERSION;
+      opts->emit->threads = DEFAULT_THREADS;
     }
     else {
       free( opts );
@@ -149,6 +151,12 @@ void convert_help( void ) {
   printf( "    gzip\n" );
 #endif /* COMPRESSION_GZIP */
   printf( "    none\n" );
+#ifdef COMPRESSION_ZSTD
+  printf( "    zstd\n" );
+#endif /* COMPRESSION_ZSTD */
+  printf( "\n" );
+  printf( "  --set-threads <n>: compress with <n> threads where supported; " );
+  printf( "0, the default, means the global --threads setting\n" );
   printf( "\n" );
   printf( "  --set-version <version>: force output with version <version>\n" );
   printf( "  <version> can be one of:\n" );
@@ -195,6 +203,18 @@ void convert_main( int argc, char **argv ) {
 	      status = CONVERT_ERROR;
 	    }
 	  }
+	  else if ( strcmp( argv[i], "--set-threads" ) == 0 ) {
+	    if ( i + 1 < argc ) {
+	      result = set_threads_arg( opts, argv[i+1] );
+	      if ( result != CONVERT_SUCCESS ) status = result;
+	      /* Consume this and the extra arg */
+	      i += 2;
+	    }
+	    else {
+	      fprintf( stderr, "--set-threads requires an argument\n" );
+	      status = CONVERT_ERROR;
+	    }
+	  }
 	  else if ( strcmp( argv[i], "--set-compression" ) == 0 ) {
 	    if ( i + 1 < argc ) {
 	      result = set_compression_arg( opts, argv[i+1] );
@@ -377,6 +397,9 @@ static int set_compression_arg( convert_opts *opts, const char *arg ) {
 #ifdef COMPRESSION_BZIP2
       else if ( strcmp( arg, "bzip2" ) == 0 ) opts->emit->compression = BZIP2;
 #endif /* COMPRESSION_BZIP2 */
+#ifdef COMPRESSION_ZSTD
+      else if ( strcmp( arg, "zstd" ) == 0 ) opts->emit->compression = ZSTD;
+#endif /* COMPRESSION_ZSTD */
       else {
 	fprintf( stderr,
 		 "Unknown or unsupported compression type %s\n",
@@ -437,6 +460,25 @@ static int set_output_file( convert_opts *opts, const char *arg ) {
   return result;
 }
 
+static int set_threads_arg( convert_opts *opts, const char *arg ) {
+  int result, n;
+  char c;
+
+  result = CONVERT_SUCCESS;
+  if ( opts && opts->emit && arg ) {
+    if ( sscanf( arg, "%d%c", &n, &c ) == 1 && n >= 0 ) {
+      opts->emit->threads = n;
+    }
+    else {
+      fprintf( stderr, "Unable to parse thread count \"%s\"\n", arg );
+      result = CONVERT_ERROR;
+    }
+  }
+  else result = CONVERT_ERROR;
+
+  return result;
+}
+
 static int set_version_arg( convert_opts *opts, const char *arg ) {
   int result;
 
@@ -6,8 +6,15 @@
 #define CONVERTDB_SUCCESS (0)
 #define CONVERTDB_ERROR (-1)
 
+/* Where copy_db_entry() is copying to, and how many it has done */
+typedef struct {
+  pkg_db *dst;
+  int count;
+} copy_db_state;
+
 static void convertdb( dbfmt_t );
 static int copy_db_entries( pkg_db *, pkg_db * );
+static int copy_db_entry( const char *, const char *, void * );
 
 void convertdb_help( void ) {
   printf( "Convert the package database to a different format.  Usage:\n\n" );
@@ -16,6 +23,7 @@ void convertdb_help( void ) {
 #ifdef DB_BDB
   printf( "  bdb\n" );
 #endif /* DB_BDB */
+  printf( "  mmap\n" );
   printf( "  text\n" );
 }
 
@@ -30,6 +38,9 @@ void convertdb_main( int argc, char **argv ) {
       if ( strcmp( argv[0], "text" ) == 0 ) {
 	dst_fmt = DBFMT_TEXT;
       }
+      else if ( strcmp( argv[0], "mmap" ) == 0 ) {
+	dst_fmt = DBFMT_MMAP;
+      }
 #ifdef DB_BDB
       else if ( strcmp( argv[0], "bdb" ) == 0 ) {
 	dst_fmt = DBFMT_BDB;
@@ -63,7 +74,7 @@ static void convertdb( dbfmt_t dst_fmt ) {
   int status, src_backup_filename_len;
 
   status = CONVERTDB_SUCCESS;
-  if ( dst_fmt == DBFMT_TEXT
+  if ( dst_fmt == DBFMT_TEXT || dst_fmt == DBFMT_MMAP
 #ifdef DB_BDB
        || dst_fmt == DBFMT_BDB
 #endif /* DB_BDB */
@@ -82,8 +93,12 @@ static void convertdb( dbfmt_t dst_fmt ) {
 	    dst_filename =
 	      concatenate_paths( get_pkg(), PKGDB_TEXT_FILE_NAME );
 	  }
+	  else if ( dst_fmt == DBFMT_MMAP ) {
+	    dst_filename =
+	      concatenate_paths( get_pkg(), PKGDB_MMAP_FILE_NAME );
+	  }
 #ifdef DB_BDB
-	  else if ( dst_fmt = DBFMT_BDB ) {
+	  else if ( dst_fmt == DBFMT_BDB ) {
 	    dst_filename =
 	      concatenate_paths( get_pkg(), PKGDB_BDB_FILE_NAME );
 	  }
@@ -96,6 +111,9 @@ static void convertdb( dbfmt_t dst_fmt ) {
 	      if ( dst_fmt == DBFMT_TEXT ) {
 		dst = create_pkg_db_text_file( dst_filename );
 	      }
+	      else if ( dst_fmt == DBFMT_MMAP ) {
+		dst = create_pkg_db_mmap( dst_filename );
+	      }
 #ifdef DB_BDB
 	      else if ( dst_fmt == DBFMT_BDB ) {
 		dst = create_pkg_db_bdb( dst_filename );
@@ -124,25 +142,35 @@ static void convertdb( dbfmt_t dst_fmt ) {
 	  if ( dst && status == CONVERTDB_SUCCESS ) {
 	    /*
 	     * We have source and destination databases open; next we
-	     * make a backup copy of the source.
+	     * make a backup copy of the source, after folding any
+	     * journal into it so the copy is the whole DB.
 	     */
-	    src_backup_filename_len = strlen( src_filename ) + 5;
-	    src_backup_filename = malloc( ( src_backup_filename_len + 1 ) *
-					  sizeof( *src_backup_filename ) );
-	    if ( src_backup_filename ) {
-	      snprintf( src_backup_filename, src_backup_filename_len,
-			"%s.bak", src_filename );
-	      result = copy_file( src_backup_filename, src_filename );
-	      if ( result != LINK_OR_COPY_SUCCESS ) {
-		fprintf( stderr, "Unable to back up source database\n" );
+	    result = compact_pkg_db( src );
+	    if ( result != 0 ) {
+	      fprintf( stderr, "Unable to compact source database\n" );
+	      status = CONVERTDB_ERROR;
+	    }
+
+	    if ( status == CONVERTDB_SUCCESS ) {
+	      src_backup_filename_len = strlen( src_filename ) + 5;
+	      src_backup_filename =
+		malloc( ( src_backup_filename_len + 1 ) *
+			sizeof( *src_backup_filename ) );
+	      if ( src_backup_filename ) {
+		snprintf( src_backup_filename, src_backup_filename_len,
+			  "%s.bak", src_filename );
+		result = copy_file( src_backup_filename, src_filename );
+		if ( result != LINK_OR_COPY_SUCCESS ) {
+		  fprintf( stderr, "Unable to back up source database\n" );
+		  status = CONVERTDB_ERROR;
+		}
+		free( src_backup_filename );
+		src_backup_filename = NULL;
+	      }
+	      else {
+		fprintf( stderr, "Unable to allocate memory\n" );
 		status = CONVERTDB_ERROR;
 	      }
-	      free( src_backup_filename );
-	      src_backup_filename = NULL;
-	    }
-	    else {
-	      fprintf( stderr, "Unable to allocate memory\n" );
-	      status = CONVERTDB_ERROR;
 	    }
 
 	    if ( status == CONVERTDB_SUCCESS ) {
@@ -207,55 +235,63 @@ static void convertdb( dbfmt_t dst_fmt ) {
 }
 
 static int copy_db_entries( pkg_db *src, pkg_db *dst ) {
-  int status, result, count;
-  void *n, *temp;
-  char *key, *value;
+  int status, result;
+  copy_db_state st;
 
   status = CONVERTDB_SUCCESS;
   if ( src && dst ) {
-    count = 0;
-    n = NULL;
-    do {
-      /* Grab an entry from the source */
-      result = enumerate_pkg_db( src, n, &key, &value, &temp );
-      if ( result != 0 ) {
+    /* One transaction for the lot, rather than one per entry */
+    result = begin_pkg_db_txn( dst );
+    if ( result != 0 ) {
+      fprintf( stderr, "Unable to begin destination database transaction\n" );
+      status = CONVERTDB_ERROR;
+    }
+
+    if ( status == CONVERTDB_SUCCESS ) {
+      st.dst = dst;
+      st.count = 0;
+      result = foreach_pkg_db( src, copy_db_entry, &st );
+      if ( result < 0 ) {
 	fprintf( stderr, "Error enumerating from source database\n" );
 	status = CONVERTDB_ERROR;
       }
+      else if ( result > 0 ) status = CONVERTDB_ERROR;
 
-      /* Did we get one? */
-      if ( status == CONVERTDB_SUCCESS && key && value ) {
-	/* Insert it into the destination */
-	result = insert_into_pkg_db( dst, key, value );
-	if ( result == 0 ) ++count;
-	else {
-	  fprintf( stderr,
-		   "Error inserting %s/%s into destination database\n",
-		   key, value );
+      if ( status == CONVERTDB_SUCCESS ) {
+	result = commit_pkg_db_txn( dst );
+	if ( result != 0 ) {
+	  fprintf( stderr, "Unable to commit destination database\n" );
 	  status = CONVERTDB_ERROR;
 	}
       }
-
-      /* Free the key/value */
-      if ( key ) {
-	free( key );
-	key = NULL;
-      }
-
-      if ( value ) {
-	free( value );
-	value = NULL;
-      }
-
-      /* Prep for the next entry */
-      n = temp;
-    } while ( n && status == CONVERTDB_SUCCESS );
+      else abort_pkg_db_txn( dst );
+    }
 
     if ( status == CONVERTDB_SUCCESS ) {
-      printf( "Copied %d key/value pairs into destination database\n", count );
+      printf( "Copied %d key/value pairs into destination database\n",
+	      st.count );
     }
   }
   else status = CONVERTDB_ERROR;
 
   return status;  
 }
+
+static int copy_db_entry( const char *key, const char *value, void *st_v ) {
+  copy_db_state *st;
+  int result;
+
+  st = (copy_db_state *)st_v;
+  result = insert_into_pkg_db( st->dst, (char *)key, (char *)value );
+  if ( result == 0 ) {
+    ++(st->count);
+    return 0;
+  }
+  else {
+    fprintf( stderr,
+	     "Error inserting %s/%s into destination database\n",
+	     key, value );
+    /* Stop here */
+    return 1;
+  }
+}
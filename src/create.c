@@ -16,6 +16,9 @@
 #define CREATE_SUCCESS 0
 #define CREATE_ERROR -1
 
+/* How many files the scan may get ahead of the hashing threads */
+#define MAX_PENDING_HASHES 256
+
 typedef enum {
   ENABLED,
   DISABLED,
@@ -26,6 +29,8 @@ typedef struct {
   char *input_directory, *pkg_name;
   emit_opts *emit;
   create_boolean_opt dirs, files, symlinks;
+  /* Content hash for the package-description, or DEFAULT_HASH */
+  pkg_hash_t hash;
 } create_opts;
 
 typedef struct {
@@ -48,8 +53,25 @@ typedef struct {
 typedef struct {
   rbtree *dirs, *files, *symlinks;
   int dirs_count, files_count, symlinks_count;
+#ifdef USE_PTHREADS
+  /* Hashes files for the scan, if we're hashing there and have threads */
+  stream_pool *hash_pool;
+#endif /* USE_PTHREADS */
 } create_pkg_info;
 
+#ifdef USE_PTHREADS
+
+typedef struct {
+  char *src_path;
+  /* The file's key in create_pkg_info.files */
+  char *path;
+  pkg_hash_t alg;
+  uint8_t hash[HASH_LEN];
+  int result;
+} create_hash_job;
+
+#endif /* USE_PTHREADS */
+
 static create_opts * alloc_create_opts( void );
 static create_pkg_info * alloc_pkginfo( create_opts * );
 static int build_pkg_descr_dirs( create_opts *, create_pkg_info *,
@@ -58,11 +80,16 @@ static int build_pkg_descr_files( create_opts *, create_pkg_info *,
 				  pkg_descr * );
 static int build_pkg_descr_symlinks( create_opts *, create_pkg_info *,
 				     pkg_descr * );
+static int build_and_emit_descr( create_opts *, create_pkg_info *,
+				 tar_writer * );
 static int build_pkg_descr( create_opts *, create_pkg_info *, pkg_descr ** );
 static void build_pkg( create_opts * );
 #ifdef PKGFMT_V1
 static int check_path_for_descr( const char * );
 #endif /* PKGFMT_V1 */
+#ifdef USE_PTHREADS
+static int collect_hash_job( create_pkg_info * );
+#endif /* USE_PTHREADS */
 static int create_parse_options( create_opts *, int, char ** );
 static void * dir_info_copier( void * );
 static void dir_info_free( void * );
@@ -72,20 +99,33 @@ static void * file_info_copier( void * );
 static void file_info_free( void * );
 static void free_create_opts( create_opts * );
 static void free_pkginfo( create_pkg_info * );
+static int get_descr_trails( create_opts * );
 static int get_dirs_enabled( create_opts * );
 static int get_files_enabled( create_opts * );
+static pkg_hash_t get_hash( create_opts * );
 static time_t get_pkg_mtime( create_opts * );
 static char * get_pkg_name( create_opts * );
 static int get_symlinks_enabled( create_opts * );
 static char * guess_pkg_name_from_input_directory( const char * );
 static char * guess_pkg_name_from_output_file( const char * );
+#ifdef USE_PTHREADS
+static void hash_job_work( void * );
+#endif /* USE_PTHREADS */
 static int scan_directory_tree_internal( create_opts *, create_pkg_info *,
 					 const char *, const char * );
 static int scan_directory_tree( create_opts *, create_pkg_info * );
 static int set_compression_arg( create_opts *, char * );
+static int set_hash_arg( create_opts *, char * );
 static void set_default_opts( create_opts * );
 static int set_pkg_time_arg( create_opts *, char * );
+static int set_threads_arg( create_opts *, char * );
 static int set_version_arg( create_opts *, char * );
+#ifdef USE_PTHREADS
+static int start_hash_pool( create_opts *, create_pkg_info * );
+static int stop_hash_pool( create_pkg_info * );
+static int submit_hash_job( create_pkg_info *, const char *, const char *,
+			    pkg_hash_t );
+#endif /* USE_PTHREADS */
 static void * symlink_info_copier( void * );
 static void symlink_info_free( void * );
 
@@ -99,12 +139,14 @@ static create_opts * alloc_create_opts( void ) {
     opts->dirs = DEFAULT;
     opts->files = DEFAULT;
     opts->symlinks = DEFAULT;
+    opts->hash = DEFAULT_HASH;
     opts->emit = malloc( sizeof( *(opts->emit) ) );
     if ( opts->emit ) {
       opts->emit->output_file = NULL;
       opts->emit->pkg_mtime = 0;
       opts->emit->compression = DEFAULT_COMPRESSION;
       opts->emit->version = DEFAULT_VERSION;
+      opts->emit->threads = DEFAULT_THREADS;
     }
     else {
       free( opts );
@@ -129,6 +171,9 @@ static create_pkg_info * alloc_pkginfo( create_opts *opts ) {
       temp->dirs_count = 0;
       temp->files_count = 0;
       temp->symlinks_count = 0;
+#ifdef USE_PTHREADS
+      temp->hash_pool = NULL;
+#endif /* USE_PTHREADS */
    
       /*
        * Use pre_path_comparator() for all of these so things appear
@@ -136,29 +181,29 @@ static create_pkg_info * alloc_pkginfo( create_opts *opts ) {
        */
 
       if ( get_dirs_enabled( opts ) && !error ) {
-	temp->dirs = rbtree_alloc( post_path_comparator,
-				   rbtree_string_copier,
-				   rbtree_string_free,
-				   dir_info_copier,
-				   dir_info_free );
+	temp->dirs = rbtree_alloc_arena( post_path_comparator,
+					 rbtree_string_copier,
+					 rbtree_string_free,
+					 dir_info_copier,
+					 dir_info_free );
 	if ( !(temp->dirs) ) error = 1;
       }
 
       if ( get_files_enabled( opts ) && !error ) {
-	temp->files = rbtree_alloc( post_path_comparator,
-				    rbtree_string_copier,
-				    rbtree_string_free,
-				    file_info_copier,
-				    file_info_free );
+	temp->files = rbtree_alloc_arena( post_path_comparator,
+					  rbtree_string_copier,
+					  rbtree_string_free,
+					  file_info_copier,
+					  file_info_free );
 	if ( !(temp->files) ) error = 1;
       }
 
       if ( get_symlinks_enabled( opts ) && !error ) {
-	temp->symlinks = rbtree_alloc( post_path_comparator,
-				       rbtree_string_copier,
-				       rbtree_string_free,
-				       symlink_info_copier,
-				       symlink_info_free );
+	temp->symlinks = rbtree_alloc_arena( post_path_comparator,
+					     rbtree_string_copier,
+					     rbtree_string_free,
+					     symlink_info_copier,
+					     symlink_info_free );
 	if ( !(temp->symlinks) ) error = 1;
       }
       
@@ -540,6 +585,7 @@ static int build_pkg_descr( create_opts *opts, create_pkg_info *pkginfo,
 	status = CREATE_ERROR;
       }
       descr->hdr.pkg_time = get_pkg_mtime( opts );
+      descr->hdr.hash = get_hash( opts );
       descr->num_entries = 0;
       descr->num_entries_alloced = 0;
 
@@ -613,18 +659,56 @@ static int build_pkg_descr( create_opts *opts, create_pkg_info *pkginfo,
   return status;
 }
 
+/*
+ * Build the package-description from pkginfo and emit it to tw; the
+ * directory and symlink rbtrees aren't needed after this.
+ */
+
+static int build_and_emit_descr( create_opts *opts, create_pkg_info *pkginfo,
+				 tar_writer *tw ) {
+  int status;
+  pkg_descr *descr;
+
+  status = CREATE_SUCCESS;
+  if ( opts && pkginfo && tw ) {
+    descr = NULL;
+    status = build_pkg_descr( opts, pkginfo, &descr );
+
+    /* Now we can free the directory and symlink rbtrees */
+    if ( pkginfo->dirs ) {
+      rbtree_free( pkginfo->dirs );
+      pkginfo->dirs = NULL;
+    }
+    if ( pkginfo->symlinks ) {
+      rbtree_free( pkginfo->symlinks );
+      pkginfo->symlinks = NULL;
+    }
+
+    if ( status == CREATE_SUCCESS ) {
+      status = emit_descr( opts, descr, tw );
+      if ( status != CREATE_SUCCESS )
+	fprintf( stderr, "Unable to emit package-description\n" );
+    }
+    else fprintf( stderr, "Unable to build package-description\n" );
+
+    if ( descr ) free_pkg_descr( descr );
+  }
+  else status = CREATE_ERROR;
+
+  return status;
+}
+
 static void build_pkg( create_opts *opts ) {
-  int status, result;
+  int status, result, trails;
   create_pkg_info *pkginfo;
   emit_pkg_streams *streams;
-  pkg_descr *descr;
 
   status = CREATE_SUCCESS;
   if ( opts ) {
     pkginfo = alloc_pkginfo( opts );
     if ( pkginfo ) {
       streams = NULL;
-      descr = NULL;
+      trails = get_descr_trails( opts );
 
       /*
        * scan_directory_tree() recursively walks the directory tree
@@ -639,69 +723,50 @@ static void build_pkg( create_opts *opts ) {
 
       result = scan_directory_tree( opts, pkginfo );
       if ( result == CREATE_SUCCESS ) {
-	/* Construct the pkg_descr */
-	result = build_pkg_descr( opts, pkginfo, &descr );
-	if ( result != CREATE_SUCCESS ) status = result;
-
-	/* Now we can free the directory and symlink rbtrees */
-	if ( pkginfo->dirs ) {
-	  rbtree_free( pkginfo->dirs );
-	  pkginfo->dirs = NULL;
-	}
-	if ( pkginfo->symlinks ) {
-	  rbtree_free( pkginfo->symlinks );
-	  pkginfo->symlinks = NULL;
-	}
-
-	if ( status == CREATE_SUCCESS ) {
-	  streams = start_pkg_streams( opts->emit );
-	  if ( streams ) {
-	    result = emit_descr( opts, descr, streams->pkg_tw );
-	    if ( result != CREATE_SUCCESS ) {
-	      fprintf( stderr, "Unable to emit package-description\n" );
-	      status = result;
-	    }
+	streams = start_pkg_streams( opts->emit );
+	if ( streams ) {
+	  /*
+	   * If the package-description goes first, the file hashes
+	   * came from the scan; otherwise emit_files() fills them in
+	   * and it goes after the content.
+	   */
+	  if ( !trails ) {
+	    result = build_and_emit_descr( opts, pkginfo, streams->pkg_tw );
+	    if ( result != CREATE_SUCCESS ) status = result;
+	  }
 
-	    if ( status == CREATE_SUCCESS ) {
-	      /* We can free descr here */
-	      free_pkg_descr( descr );
-	      descr = NULL;
-	      /* Get ready to emit content */
-	      result = start_pkg_content( opts->emit, streams );
-	      if ( result == EMIT_SUCCESS ) {
-		/* Now emit the files */
-		result = emit_files( opts, pkginfo, streams->emit_tw );
-		if ( result != CREATE_SUCCESS ) {
-		  fprintf( stderr, "Unable to emit package contents\n" );
-		  status = result;
-		}
-		finish_pkg_content( opts->emit, streams );
-	      }
-	      else {
+	  if ( status == CREATE_SUCCESS ) {
+	    /* Get ready to emit content */
+	    result = start_pkg_content( opts->emit, streams );
+	    if ( result == EMIT_SUCCESS ) {
+	      /* Now emit the files */
+	      result = emit_files( opts, pkginfo, streams->emit_tw );
+	      if ( result != CREATE_SUCCESS ) {
 		fprintf( stderr, "Unable to emit package contents\n" );
-		status = CREATE_ERROR;
+		status = result;
 	      }
+	      finish_pkg_content( opts->emit, streams );
+	    }
+	    else {
+	      fprintf( stderr, "Unable to emit package contents\n" );
+	      status = CREATE_ERROR;
 	    }
-
-	    finish_pkg_streams( opts->emit, streams );
-	    /* Remove the output if we had an error with it */
-	    if ( status != CREATE_SUCCESS ) unlink( opts->emit->output_file );
 	  }
-	  else {
-	    fprintf( stderr,
-		     "Unable to open output streams for %s\n",
-		     opts->emit->output_file );
-	    status = CREATE_ERROR;
+
+	  if ( trails && status == CREATE_SUCCESS ) {
+	    result = build_and_emit_descr( opts, pkginfo, streams->pkg_tw );
+	    if ( result != CREATE_SUCCESS ) status = result;
 	  }
 
-	  /*
-	   * Make sure we free descr if we didn't get far enough to
-	   * use and free it above.
-	   */
-	  if ( descr ) free_pkg_descr( descr );
+	  finish_pkg_streams( opts->emit, streams );
+	  /* Remove the output if we had an error with it */
+	  if ( status != CREATE_SUCCESS ) unlink( opts->emit->output_file );
 	}
 	else {
-	  fprintf( stderr, "Unable to build package-description\n" );
+	  fprintf( stderr,
+		   "Unable to open output streams for %s\n",
+		   opts->emit->output_file );
+	  status = CREATE_ERROR;
 	}
 
 	/* Now we can free the files rbtree */
@@ -753,6 +818,48 @@ static int check_path_for_descr( const char *path ) {
 
 #endif /* PKGFMT_V1 */
 
+#ifdef USE_PTHREADS
+
+/*
+ * Wait for the oldest outstanding hash job and store its result in
+ * pkginfo->files.
+ */
+
+static int collect_hash_job( create_pkg_info *pkginfo ) {
+  int status, result;
+  create_hash_job *job;
+  create_file_info *fi;
+
+  status = CREATE_SUCCESS;
+  job = wait_stream_job( pkginfo->hash_pool );
+  if ( job ) {
+    if ( job->result == 0 ) {
+      result = rbtree_query( pkginfo->files, job->path, (void **)(&fi) );
+      /* fi is the copy in the rbtree, so this sticks */
+      if ( result == RBTREE_SUCCESS && fi )
+	memcpy( fi->hash, job->hash, sizeof( fi->hash ) );
+      else {
+	fprintf( stderr,
+		 "Internal error storing hash for file %s\n", job->src_path );
+	status = CREATE_ERROR;
+      }
+    }
+    else {
+      fprintf( stderr, "Unable to get %s hash for file %s\n",
+	       get_hash_name( job->alg ), job->src_path );
+      status = CREATE_ERROR;
+    }
+    free( job->src_path );
+    free( job->path );
+    free( job );
+  }
+  else status = CREATE_ERROR;
+
+  return status;
+}
+
+#endif /* USE_PTHREADS */
+
 void create_help( void ) {
   printf( "Create new packages from a directory of files.  Usage:\n\n" );
   printf( "mpkg [global options] create [options] <input> [<name>] " );
@@ -783,6 +890,24 @@ void create_help( void ) {
   printf( "    gzip\n" );
 #endif /* COMPRESSION_GZIP */
   printf( "    none\n" );
+#ifdef COMPRESSION_ZSTD
+  printf( "    zstd\n" );
+#endif /* COMPRESSION_ZSTD */
+  printf( "\n" );
+  printf( "  --set-hash <hash>: hash files with <hash> in the " );
+  printf( "package-description.\n" );
+  printf( "  <hash> can be one of:\n" );
+#ifdef USE_BLAKE3
+  printf( "    blake3\n" );
+#endif /* USE_BLAKE3 */
+  printf( "    md5 (the default, and all older versions can read)\n" );
+#ifdef USE_XXHASH
+  printf( "    xxh3\n" );
+#endif /* USE_XXHASH */
+  printf( "\n" );
+  printf( "  --set-threads <n>: use <n> threads for compression where " );
+  printf( "supported, and for hashing files for v1 output; 0, the " );
+  printf( "default, means the global --threads setting.\n" );
   printf( "\n" );
   printf( "  --set-version <version>: use <version> in the output.\n" );
   printf( "  <version> can be one of:\n" );
@@ -894,6 +1019,18 @@ int create_parse_options( create_opts *opts, int argc, char **argv ) {
 	    status = CREATE_ERROR;
 	  }	  
 	}
+	else if ( strcmp( argv[i], "--set-hash" ) == 0 ) {
+	  if ( i + 1 < argc ) {
+	    status = set_hash_arg( opts, argv[i + 1] );
+	    /* Consume the extra arg */
+	    ++i;
+	  }
+	  else {
+	    fprintf( stderr,
+		     "The --set-hash option requires a parameter; try \'mpkg help create\'\n" );
+	    status = CREATE_ERROR;
+	  }
+	}
 	else if ( strcmp( argv[i], "--set-pkg-time" ) == 0 ) {
 	  if ( i + 1 < argc ) {
 	    status = set_pkg_time_arg( opts, argv[i + 1] );
@@ -906,6 +1043,18 @@ int create_parse_options( create_opts *opts, int argc, char **argv ) {
 	    status = CREATE_ERROR;
 	  }
 	}
+	else if ( strcmp( argv[i], "--set-threads" ) == 0 ) {
+	  if ( i + 1 < argc ) {
+	    status = set_threads_arg( opts, argv[i + 1] );
+	    /* Consume the extra arg */
+	    ++i;
+	  }
+	  else {
+	    fprintf( stderr,
+		     "The --set-threads option requires a parameter; try \'mpkg help create\'\n" );
+	    status = CREATE_ERROR;
+	  }
+	}
 	else if ( strcmp( argv[i], "--set-version" ) == 0 ) {
 	  if ( i + 1 < argc ) {
 	    status = set_version_arg( opts, argv[i + 1] );
@@ -1177,7 +1326,11 @@ static int emit_files( create_opts *opts, create_pkg_info *pkginfo,
 	    ti.group = 0;
 	    ti.mode = 0644;
 	    ti.mtime = get_pkg_mtime( opts );
-	    result = emit_file( fi->src_path, &ti, tw );
+	    /* fi points into the rbtree, so this fills in its hash */
+	    result = emit_file_hashed( fi->src_path, &ti, tw,
+				       get_hash( opts ),
+				       get_descr_trails( opts ) ?
+				       fi->hash : NULL );
 	    if ( result != EMIT_SUCCESS ) {
 	      fprintf( stderr, "Error emitting file %s\n", fi->src_path );
 	      status = CREATE_ERROR;
@@ -1263,6 +1416,9 @@ static void free_create_opts( create_opts *opts ) {
 
 static void free_pkginfo( create_pkg_info *pkginfo ) {
   if ( pkginfo ) {
+#ifdef USE_PTHREADS
+    stop_hash_pool( pkginfo );
+#endif /* USE_PTHREADS */
     if ( pkginfo->dirs ) rbtree_free( pkginfo->dirs );
     if ( pkginfo->files ) rbtree_free( pkginfo->files );
     if ( pkginfo->symlinks ) rbtree_free( pkginfo->symlinks );
@@ -1270,6 +1426,23 @@ static void free_pkginfo( create_pkg_info *pkginfo ) {
   }
 }
 
+/*
+ * V2 packages get their package-description after the content, so we
+ * can hash files as we emit them rather than reading them twice.  V1
+ * keeps it first, since its streaming reader has only the one pass.
+ */
+
+static int get_descr_trails( create_opts *opts ) {
+  int result;
+
+  result = 0;
+#ifdef PKGFMT_V2
+  if ( opts && get_version( opts->emit ) == V2 ) result = 1;
+#endif /* PKGFMT_V2 */
+
+  return result;
+}
+
 static int get_dirs_enabled( create_opts *opts ) {
   int result;
 
@@ -1290,6 +1463,16 @@ static int get_files_enabled( create_opts *opts ) {
   return result;
 }
 
+static pkg_hash_t get_hash( create_opts *opts ) {
+  pkg_hash_t result;
+
+  if ( opts && opts->hash != DEFAULT_HASH ) result = opts->hash;
+  /* MD5 by default, so older versions can still read what we make */
+  else result = HASH_MD5;
+
+  return result;
+}
+
 static time_t get_pkg_mtime( create_opts *opts ) {
   time_t result;
 
@@ -1359,6 +1542,17 @@ static char * guess_pkg_name_from_output_file( const char *outfile ) {
   return result;
 }
 
+#ifdef USE_PTHREADS
+
+static void hash_job_work( void *vp ) {
+  create_hash_job *job;
+
+  job = (create_hash_job *)vp;
+  job->result = get_file_hash( job->alg, job->src_path, job->hash );
+}
+
+#endif /* USE_PTHREADS */
+
 static int scan_directory_tree_internal( create_opts *opts,
 					 create_pkg_info *pkginfo,
 					 const char *path_prefix,
@@ -1373,10 +1567,14 @@ static int scan_directory_tree_internal( create_opts *opts,
   DIR *cwd;
   struct dirent *dentry;
   char *next_path, *next_prefix;
-  int next_prefix_len, prefix_len;
+  int next_prefix_len, prefix_len, pooled;
 
   status = CREATE_SUCCESS;
   if ( opts && pkginfo && path_prefix && prefix ) {
+    pooled = 0;
+#ifdef USE_PTHREADS
+    if ( pkginfo->hash_pool ) pooled = 1;
+#endif /* USE_PTHREADS */
     cwd = opendir( path_prefix );
     if ( cwd ) {
       do {
@@ -1414,12 +1612,21 @@ static int scan_directory_tree_internal( create_opts *opts,
 		      if ( grp ) fi.group = grp->gr_name;
 		      else fi.group = "root";
 
-		      /* Get the file's MD5 */
-		      result = get_file_hash( next_path, fi.hash );
-		      if ( result != 0 ) {
-			fprintf( stderr, "Unable to get MD5 for file %s\n",
-				 next_path );
-			status = CREATE_ERROR;
+		      /*
+		       * Get the file's hash, unless emit_files() or the
+		       * hash pool will get it for us
+		       */
+		      if ( get_descr_trails( opts ) || pooled )
+			memset( fi.hash, 0, sizeof( fi.hash ) );
+		      else {
+			result = get_file_hash( get_hash( opts ), next_path,
+						fi.hash );
+			if ( result != 0 ) {
+			  fprintf( stderr, "Unable to get %s hash for file %s\n",
+				   get_hash_name( get_hash( opts ) ),
+				   next_path );
+			  status = CREATE_ERROR;
+			}
 		      }
 
 		      if ( status == CREATE_SUCCESS ) {
@@ -1427,6 +1634,14 @@ static int scan_directory_tree_internal( create_opts *opts,
 			  rbtree_insert( pkginfo->files, next_prefix, &fi );
 			if ( result == RBTREE_SUCCESS ) {
 			  ++(pkginfo->files_count);
+#ifdef USE_PTHREADS
+			  if ( pooled ) {
+			    result = submit_hash_job( pkginfo, next_path,
+						      next_prefix,
+						      get_hash( opts ) );
+			    if ( result != CREATE_SUCCESS ) status = result;
+			  }
+#endif /* USE_PTHREADS */
 			}
 			else {
 			  fprintf( stderr,
@@ -1676,9 +1891,18 @@ static int scan_directory_tree( create_opts *opts,
       }
 
       if ( status != CREATE_ERROR ) {
+#ifdef USE_PTHREADS
+	/* Spread hashing over threads while we walk the tree */
+	start_hash_pool( opts, pkginfo );
+#endif /* USE_PTHREADS */
 	result = scan_directory_tree_internal( opts, pkginfo,
 					       opts->input_directory, "/" );
 	if ( result != CREATE_SUCCESS ) status = result;
+#ifdef USE_PTHREADS
+	/* Collect the stragglers before anyone looks at the hashes */
+	result = stop_hash_pool( pkginfo );
+	if ( result != CREATE_SUCCESS ) status = result;
+#endif /* USE_PTHREADS */
       }
     }
     else status = CREATE_ERROR;
@@ -1700,6 +1924,9 @@ static int set_compression_arg( create_opts *opts, char *arg ) {
 #endif
 #ifdef COMPRESSION_BZIP2
       else if ( strcmp( arg, "bzip2" ) == 0 ) opts->emit->compression = BZIP2;
+#endif
+#ifdef COMPRESSION_ZSTD
+      else if ( strcmp( arg, "zstd" ) == 0 ) opts->emit->compression = ZSTD;
 #endif
       else {
 	fprintf( stderr,
@@ -1719,6 +1946,33 @@ static int set_compression_arg( create_opts *opts, char *arg ) {
   return result;
 }
 
+static int set_hash_arg( create_opts *opts, char *arg ) {
+  int result;
+  pkg_hash_t alg;
+
+  result = CREATE_SUCCESS;
+  if ( opts && arg ) {
+    if ( opts->hash == DEFAULT_HASH ) {
+      if ( parse_hash_name( arg, &alg ) == 0 && hash_supported( alg ) )
+	opts->hash = alg;
+      else {
+	fprintf( stderr,
+		 "Unknown or unsupported hash %s\n",
+		 arg );
+	result = CREATE_ERROR;
+      }
+    }
+    else {
+      fprintf( stderr,
+	       "Only one --set-hash option is permitted.\n" );
+      result = CREATE_ERROR;
+    }
+  }
+  else result = CREATE_ERROR;
+
+  return result;
+}
+
 static void set_default_opts( create_opts *opts ) {
   opts->input_directory = NULL;
   opts->pkg_name = NULL;
@@ -1726,9 +1980,11 @@ static void set_default_opts( create_opts *opts ) {
   opts->emit->pkg_mtime = time( NULL );
   opts->emit->compression = DEFAULT_COMPRESSION;
   opts->emit->version = DEFAULT_VERSION;
+  opts->emit->threads = DEFAULT_THREADS;
   opts->files = DEFAULT;
   opts->dirs = DEFAULT;
   opts->symlinks = DEFAULT;
+  opts->hash = DEFAULT_HASH;
 }
 
 static int set_pkg_time_arg( create_opts *opts, char *arg ) {
@@ -1750,6 +2006,25 @@ static int set_pkg_time_arg( create_opts *opts, char *arg ) {
   return result;
 }
 
+static int set_threads_arg( create_opts *opts, char *arg ) {
+  int result, n;
+  char c;
+
+  result = CREATE_SUCCESS;
+  if ( opts && arg ) {
+    if ( sscanf( arg, "%d%c", &n, &c ) == 1 && n >= 0 ) {
+      opts->emit->threads = n;
+    }
+    else {
+      fprintf( stderr, "Unable to parse thread count \"%s\".\n", arg );
+      result = CREATE_ERROR;
+    }
+  }
+  else result = CREATE_ERROR;
+
+  return result;
+}
+
 static int set_version_arg( create_opts *opts, char *arg ) {
   int result;
 
@@ -1786,6 +2061,99 @@ static int set_version_arg( create_opts *opts, char *arg ) {
   return result;
 }
 
+#ifdef USE_PTHREADS
+
+/*
+ * Start a pool to hash files for the scan, if the scan is hashing them
+ * at all and we have more than one thread to do it with; 0 if we did.
+ */
+
+static int start_hash_pool( create_opts *opts, create_pkg_info *pkginfo ) {
+  int threads;
+
+  if ( !(pkginfo->hash_pool) && get_files_enabled( opts ) &&
+       pkginfo->files && !get_descr_trails( opts ) ) {
+    threads = get_threads( opts->emit );
+    if ( threads > 1 )
+      pkginfo->hash_pool = start_stream_pool( threads, hash_job_work );
+  }
+
+  return ( pkginfo->hash_pool ) ? 0 : -1;
+}
+
+/*
+ * Collect any hash jobs still outstanding and shut down the pool; once
+ * anything fails, just free the rest.
+ */
+
+static int stop_hash_pool( create_pkg_info *pkginfo ) {
+  int status;
+  create_hash_job *job;
+
+  status = CREATE_SUCCESS;
+  if ( pkginfo->hash_pool ) {
+    while ( get_stream_pool_pending( pkginfo->hash_pool ) > 0 ) {
+      if ( status == CREATE_SUCCESS ) status = collect_hash_job( pkginfo );
+      else {
+	job = wait_stream_job( pkginfo->hash_pool );
+	if ( job ) {
+	  free( job->src_path );
+	  free( job->path );
+	  free( job );
+	}
+      }
+    }
+    stop_stream_pool( pkginfo->hash_pool );
+    pkginfo->hash_pool = NULL;
+  }
+
+  return status;
+}
+
+/*
+ * Queue src_path to be hashed into the entry for path in
+ * pkginfo->files, first collecting results if we're too far ahead.
+ */
+
+static int submit_hash_job( create_pkg_info *pkginfo, const char *src_path,
+			    const char *path, pkg_hash_t alg ) {
+  int status;
+  create_hash_job *job;
+
+  status = CREATE_SUCCESS;
+  while ( status == CREATE_SUCCESS &&
+	  get_stream_pool_pending( pkginfo->hash_pool ) >=
+	  MAX_PENDING_HASHES )
+    status = collect_hash_job( pkginfo );
+
+  if ( status == CREATE_SUCCESS ) {
+    job = malloc( sizeof( *job ) );
+    if ( job ) {
+      job->src_path = copy_string( src_path );
+      job->path = copy_string( path );
+      job->alg = alg;
+      job->result = -1;
+      if ( !( job->src_path && job->path &&
+	      submit_stream_job( pkginfo->hash_pool, job ) == 0 ) ) {
+	fprintf( stderr, "Unable to allocate memory for file %s\n",
+		 src_path );
+	if ( job->src_path ) free( job->src_path );
+	if ( job->path ) free( job->path );
+	free( job );
+	status = CREATE_ERROR;
+      }
+    }
+    else {
+      fprintf( stderr, "Unable to allocate memory for file %s\n", src_path );
+      status = CREATE_ERROR;
+    }
+  }
+
+  return status;
+}
+
+#endif /* USE_PTHREADS */
+
 static void * symlink_info_copier( void *v ) {
   create_symlink_info *si, *rsi;
 
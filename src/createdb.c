@@ -13,6 +13,7 @@ static int check_or_create_pkg_dir( void );
 #ifdef DB_BDB
 static void createdb_bdb( void );
 #endif
+static void createdb_mmap( void );
 static void createdb_text( void );
 
 static int check_or_create_pkg_dir( void ) {
@@ -159,6 +160,7 @@ void createdb_help( void ) {
 #ifdef DB_BDB
   printf( "  bdb\n" );
 #endif /* DB_BDB */
+  printf( "  mmap\n" );
   printf( "  text\n" );
 }
 
@@ -175,6 +177,7 @@ void createdb_main( int argc, char **argv ) {
     }
     else if ( argc == 1 ) {
       if ( strcmp( argv[0], "text" ) == 0 ) createdb_text();
+      else if ( strcmp( argv[0], "mmap" ) == 0 ) createdb_mmap();
 #ifdef DB_BDB
       else if ( strcmp( argv[0], "bdb" ) == 0 ) createdb_bdb();
 #endif
@@ -193,6 +196,32 @@ void createdb_main( int argc, char **argv ) {
   /* else sanity_check_globals() will emit a warning */
 }
 
+static void createdb_mmap( void ) {
+  int status;
+  pkg_db *db;
+  char *filename;
+
+  status = check_or_create_pkg_dir();
+  if ( status == 0 ) {
+    filename = concatenate_paths( get_pkg(), PKGDB_MMAP_FILE_NAME );
+    if ( filename ) {
+      db = create_pkg_db_mmap( filename );
+      if ( db ) {
+	close_pkg_db( db );
+      }
+      else {
+	fprintf( stderr,
+		 "Couldn't create mmap db\n" );
+      }
+      free( filename );
+    }
+    else {
+      fprintf( stderr,
+	       "Couldn't allocate memory to create mmap db\n" );
+    }
+  }
+}
+
 static void createdb_text( void ) {
   int status;
   pkg_db *db;
@@ -2,10 +2,8 @@
 
 #include <stdlib.h>
 
-#define DUMPDB_SUCCESS (0)
-#define DUMPDB_ERROR (-1)
-
 static void dumpdb( void );
+static int dump_entry( const char *, const char *, void * );
 
 void dumpdb_help( void ) {
   printf( "Dump the contents of the package DB.  Usage:\n" );
@@ -32,45 +30,18 @@ void dumpdb_main( int argc, char **argv ) {
 
 static void dumpdb( void ) {
   pkg_db *db;
-  void *n, *temp;
-  char *key, *value;
-  int result, status;
+  int result;
 
-  status = DUMPDB_SUCCESS;
   db = open_pkg_db_with_mode( DBMODE_RO );
   if ( db ) {
-    n = NULL;
-    key = value = NULL;
-    do {
-      /* Retrieve an entry */
-      result = enumerate_pkg_db( db, n, &key, &value, &temp );
-      if ( result != 0 ) {
-	fprintf( stderr, "Unable to enumerate database\n" );
-	status = DUMPDB_ERROR;
-      }
-
-      if ( status == DUMPDB_SUCCESS && key && value ) {
-	printf( "%s %s\n", key, value );
-      }
-
-      /* Free the key and value */
-      if ( key ) {
-	free( key );
-	key = NULL;
-      }
-
-      if ( value ) {
-	free( value );
-	value = NULL;
-      }
-
-      /* Prep for next entry */
-      n = temp;
-    } while ( n && status == DUMPDB_SUCCESS );
+    result = foreach_pkg_db( db, dump_entry, NULL );
+    if ( result != 0 ) fprintf( stderr, "Unable to enumerate database\n" );
     close_pkg_db( db );
   }
-  else {
-    fprintf( stderr, "Unable to open package database\n" );
-    status = DUMPDB_ERROR;
-  }
+  else fprintf( stderr, "Unable to open package database\n" );
+}
+
+static int dump_entry( const char *key, const char *value, void *unused ) {
+  printf( "%s %s\n", key, value );
+  return 0;
 }
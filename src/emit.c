@@ -6,38 +6,111 @@
 
 #include <pkg.h>
 
-#define EMIT_BUF_LEN 1024
-
 int emit_file( const char *src, tar_file_info *ti, tar_writer *tw ) {
-  int status;
-  read_stream *rs;
-  write_stream *ws;
-  char buf[EMIT_BUF_LEN];
-  long len;
+  return emit_file_hashed( src, ti, tw, HASH_MD5, NULL );
+}
+
+/*
+ * Like emit_file(), but if hash isn't NULL, also compute the alg hash
+ * of what we wrote into it, so callers needn't read the file again.
+ */
+
+int emit_file_hashed( const char *src, tar_file_info *ti, tar_writer *tw,
+		      pkg_hash_t alg, uint8_t *hash ) {
+  int status, sized;
+  read_stream *rs, *file_rs;
+  write_stream *ws, *hash_ws;
+  hash_state *h;
+  char *buf;
+  void *data;
+  long len, buf_len;
+  struct stat st;
+  unsigned long long total;
 
   status = EMIT_SUCCESS;
   if ( src && ti && tw ) {
-    rs = open_read_stream_none( src );
+    h = NULL;
+    hash_ws = NULL;
+    rs = file_rs = open_read_stream_mmap( src );
+    if ( rs && hash ) {
+      /* Hash through a tee, so the data only goes by once */
+      h = start_new_hash( alg );
+      if ( h ) hash_ws = get_hash_ws( h );
+      if ( hash_ws ) rs = open_tee_read_stream( file_rs, hash_ws );
+      else rs = NULL;
+      if ( !rs ) {
+	fprintf( stderr, "Unable to start %s hash for %s\n",
+		 get_hash_name( alg ), src );
+	if ( hash_ws ) close_write_stream( hash_ws );
+	if ( h ) close_hash( h );
+	close_read_stream( file_rs );
+	file_rs = NULL;
+	status = EMIT_ERROR;
+      }
+    }
     if ( rs ) {
-      ws = put_next_file( tw, ti );
-      if ( ws ) {
-        while ( ( len = read_from_stream( rs, buf, EMIT_BUF_LEN ) ) > 0 ) {
-          if ( write_to_stream( ws, buf, len ) != len ) {
+      /*
+       * If we know the size, the tar_writer can write the header up
+       * front and skip spooling the content to a temp file.
+       */
+      if ( stat( src, &st ) == 0 && S_ISREG( st.st_mode ) ) {
+	ws = put_next_file_sized( tw, ti, st.st_size );
+	sized = 1;
+      }
+      else {
+	ws = put_next_file( tw, ti );
+	sized = 0;
+      }
+      buf_len = get_io_buffer_size();
+      buf = malloc( buf_len );
+      if ( ws && buf ) {
+	total = 0;
+        while ( ( len = borrow_from_stream( rs, &data, buf, buf_len ) )
+		> 0 ) {
+	  if ( sized && total + len > st.st_size ) {
+	    fprintf( stderr, "File %s grew while writing it to tarball\n",
+		     src );
+	    status = EMIT_ERROR;
+	    break;
+	  }
+          if ( write_to_stream( ws, data, len ) != len ) {
             fprintf( stderr, "Unable to write to tarball for %s\n", src );
             status = EMIT_ERROR;
             break;
           }
+	  total += len;
         }
+	if ( status == EMIT_SUCCESS && sized && total != st.st_size ) {
+	  fprintf( stderr, "File %s shrank while writing it to tarball\n",
+		   src );
+	  status = EMIT_ERROR;
+	}
         close_write_stream( ws );
       }
+      else if ( ws ) {
+	fprintf( stderr, "Unable to allocate memory for %s\n", src );
+	close_write_stream( ws );
+	status = EMIT_ERROR;
+      }
       else {
         fprintf( stderr,
                  "Unable to open write stream to tarball for %s\n", src );
         status = EMIT_ERROR;
       }
-      close_read_stream( rs );
+      if ( buf ) free( buf );
+      if ( rs != file_rs ) close_read_stream( rs );
+      close_read_stream( file_rs );
+      if ( h ) {
+	close_write_stream( hash_ws );
+	if ( status == EMIT_SUCCESS && get_hash_result( h, hash ) != 0 ) {
+	  fprintf( stderr, "Unable to get %s hash for %s\n",
+		   get_hash_name( alg ), src );
+	  status = EMIT_ERROR;
+	}
+	close_hash( h );
+      }
     }
-    else {
+    else if ( status == EMIT_SUCCESS ) {
       fprintf( stderr, "Unable to read from file %s\n", src );
       status = EMIT_ERROR;
     }
@@ -190,6 +263,16 @@ pkg_compression_t get_compression( emit_opts *opts ) {
   return result;
 }
 
+int get_threads( emit_opts *opts ) {
+  int result;
+
+  if ( opts && opts->threads != DEFAULT_THREADS ) result = opts->threads;
+  /* Fall back to the global --threads setting */
+  else result = get_default_threads();
+
+  return result;
+}
+
 pkg_version_t get_version( emit_opts *opts ) {
   pkg_version_t result;
 
@@ -225,6 +308,9 @@ void guess_compression_and_version_from_filename( emit_opts *opts ) {
 # ifdef COMPRESSION_GZIP
   const char *v1gz_postfix = ".tar.gz";
 # endif /* COMPRESSION_GZIP */
+# ifdef COMPRESSION_ZSTD
+  const char *v1zst_postfix = ".tar.zst";
+# endif /* COMPRESSION_ZSTD */
   const char *v1none_postfix = ".tar";
 #endif /* PKGFMT_V1 */
 #ifdef PKGFMT_V2
@@ -272,6 +358,25 @@ void guess_compression_and_version_from_filename( emit_opts *opts ) {
       }
     }
 # endif /* COMPRESSION_GZIP */
+# ifdef COMPRESSION_ZSTD
+    len = strlen( v1zst_postfix );
+    if ( n > len ) {
+      temp = opts->output_file + ( n - len );
+      if ( strcmp( temp, v1zst_postfix ) == 0 ) {
+	/*
+	 * Don't guess from filename if we've already seen settings
+	 * inconsistent with it
+	 */
+	if ( ( opts->compression == DEFAULT_COMPRESSION ||
+	       opts->compression == ZSTD ) &&
+	     ( opts->version == DEFAULT_VERSION ||
+	       opts->version == V1 ) ) {
+	  opts->compression = ZSTD;
+	  opts->version = V1;
+	}
+      }
+    }
+# endif /* COMPRESSION_ZSTD */
     len = strlen( v1none_postfix );
     if ( n > len ) {
       temp = opts->output_file + ( n - len );
@@ -346,6 +451,12 @@ int start_pkg_content( emit_opts *opts,
 		   TAR_FILENAME_LEN + TAR_PREFIX_LEN + 1 );
 	  break;
 #endif /* COMPRESSION_BZIP2 */
+#ifdef COMPRESSION_ZSTD
+	case ZSTD:
+	  strncpy( streams->ti_outer.filename, "package-content.tar.zst",
+		   TAR_FILENAME_LEN + TAR_PREFIX_LEN + 1 );
+	  break;
+#endif /* COMPRESSION_ZSTD */
 	default:
 	  fprintf( stderr, "Internal error with get_compression()\n" );
 	  status = EMIT_ERROR;
@@ -368,7 +479,8 @@ int start_pkg_content( emit_opts *opts,
 	    case GZIP:
 	      /* We reuse comp_ws, since V2 didn't use it in prepare_streams() */
 	      streams->comp_ws =
-		open_write_stream_from_stream_gzip( streams->content_out_ws );
+		open_write_stream_from_stream_gzip_parallel( streams->content_out_ws,
+							     get_threads( opts ) );
 	      if ( streams->comp_ws )
 		streams->content_ws = streams->comp_ws;
 	      else {
@@ -383,7 +495,8 @@ int start_pkg_content( emit_opts *opts,
 	    case BZIP2:
 	      /* We reuse comp_ws, since V2 didn't use it in prepare_streams() */
 	      streams->comp_ws =
-		open_write_stream_from_stream_bzip2( streams->content_out_ws );
+		open_write_stream_from_stream_bzip2_parallel( streams->content_out_ws,
+							      get_threads( opts ) );
 	      if ( streams->comp_ws )
 		streams->content_ws = streams->comp_ws;
 	      else {
@@ -394,6 +507,21 @@ int start_pkg_content( emit_opts *opts,
 	      }
 	      break;
 #endif /* COMPRESSION_BZIP2 */
+#ifdef COMPRESSION_ZSTD
+	    case ZSTD:
+	      /* We reuse comp_ws, since V2 didn't use it in prepare_streams() */
+	      streams->comp_ws =
+		open_write_stream_from_stream_zstd( streams->content_out_ws );
+	      if ( streams->comp_ws )
+		streams->content_ws = streams->comp_ws;
+	      else {
+		fprintf( stderr,
+			 "Error setting up zstd compressed stream for inner content tarball in output file %s\n",
+			 opts->output_file );
+		status = EMIT_ERROR;
+	      }
+	      break;
+#endif /* COMPRESSION_ZSTD */
 	    default:
 	      fprintf( stderr, "Internal error with get_compression()\n" );
 	      status = EMIT_ERROR;
@@ -543,7 +671,8 @@ emit_pkg_streams * start_pkg_streams( emit_opts *opts ) {
 #ifdef COMPRESSION_GZIP
 	    case GZIP:
 	      streams->comp_ws =
-		open_write_stream_from_stream_gzip( streams->out_ws );
+		open_write_stream_from_stream_gzip_parallel( streams->out_ws,
+							     get_threads( opts ) );
 	      if ( streams->comp_ws ) {
 		streams->ws = streams->comp_ws;
 	      }
@@ -558,7 +687,8 @@ emit_pkg_streams * start_pkg_streams( emit_opts *opts ) {
 #ifdef COMPRESSION_BZIP2
 	    case BZIP2:
 	      streams->comp_ws = 
-		open_write_stream_from_stream_bzip2( streams->out_ws );
+		open_write_stream_from_stream_bzip2_parallel( streams->out_ws,
+							      get_threads( opts ) );
 	      if ( streams->comp_ws ) {
 		streams->ws = streams->comp_ws;
 	      }
@@ -570,6 +700,21 @@ emit_pkg_streams * start_pkg_streams( emit_opts *opts ) {
 	      }
 	      break;
 #endif /* COMPRESSION_BZIP2 */
+#ifdef COMPRESSION_ZSTD
+	    case ZSTD:
+	      streams->comp_ws =
+		open_write_stream_from_stream_zstd( streams->out_ws );
+	      if ( streams->comp_ws ) {
+		streams->ws = streams->comp_ws;
+	      }
+	      else {
+		fprintf( stderr,
+			 "Unable to open zstd output stream for file %s\n",
+			 opts->output_file );
+		status = EMIT_ERROR;
+	      }
+	      break;
+#endif /* COMPRESSION_ZSTD */
 	    default:
 	      fprintf( stderr, "Internal error with get_compression()\n" );
 	      status = EMIT_ERROR;
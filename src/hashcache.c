@@ -0,0 +1,483 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <unistd.h>
+
+#ifdef USE_PTHREADS
+#include <pthread.h>
+#endif /* USE_PTHREADS */
+
+#include <pkg.h>
+
+/*
+ * A cache of the content hashes of installed files, kept in the pkgdir
+ * so status, repairdb content checking and the checks before removing
+ * or replacing a file don't have to read every file on every run.
+ * Entries are keyed on device, inode and hash, and only used while the
+ * file's size, mtime and ctime are what they were when it was hashed;
+ * nothing can set a ctime back, so anything that writes to the file
+ * makes it miss.  Each entry also remembers the path it was hashed
+ * under, so saving can drop the ones for files that were removed or
+ * changed behind our back instead of carrying them forever.  The
+ * commands that check installed files open it and close it around their
+ * work; when it isn't open, nothing is cached.
+ */
+
+typedef struct {
+  dev_t dev;
+  ino_t ino;
+  pkg_hash_t alg;
+} hash_cache_key;
+
+typedef struct {
+  off_t size;
+  time_t mtime, ctime;
+  long mtime_ns, ctime_ns;
+  uint8_t hash[HASH_LEN];
+  /* Where we last saw it, or NULL when only used to compare */
+  char *path;
+} hash_cache_val;
+
+static rbtree *cache = NULL;
+/* Whether cache has changed since we loaded it */
+static int dirty = 0;
+#ifdef USE_PTHREADS
+/* get_file_hash() can be called from several threads at once */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif /* USE_PTHREADS */
+
+static int compare_hash_cache_keys( void *, void * );
+static void * copy_hash_cache_key( void * );
+static void * copy_hash_cache_val( void * );
+static void fill_hash_cache_val( hash_cache_val *, struct stat * );
+static void free_hash_cache_val( void * );
+static char * get_hash_cache_path( void );
+static void load_hash_cache( const char * );
+static void lock_hash_cache( void );
+static int parse_hash_cache_line( char *, struct stat * );
+static int parse_hex( const char *, uint8_t *, int );
+static int same_hash_cache_val( hash_cache_val *, hash_cache_val * );
+static int save_hash_cache( const char * );
+static int still_hash_cache_val( hash_cache_key *, hash_cache_val * );
+static void unlock_hash_cache( void );
+
+/*
+ * Remember that filename hashes to hash under alg.  If before isn't
+ * NULL, it's what get_cached_hash() got from stat() before we started
+ * hashing, and we only remember it if nothing changed in the meantime.
+ */
+
+void cache_file_hash( pkg_hash_t alg, const char *filename,
+		      struct stat *before, uint8_t *hash ) {
+  struct stat st;
+  hash_cache_key k;
+  hash_cache_val v, b;
+
+  if ( cache && filename && hash &&
+       stat( filename, &st ) == 0 && S_ISREG( st.st_mode ) ) {
+    fill_hash_cache_val( &v, &st );
+    if ( before ) {
+      fill_hash_cache_val( &b, before );
+      if ( before->st_dev != st.st_dev || before->st_ino != st.st_ino ||
+	   !same_hash_cache_val( &b, &v ) )
+	return;
+    }
+    memset( &k, 0, sizeof( k ) );
+    k.dev = st.st_dev;
+    k.ino = st.st_ino;
+    k.alg = alg;
+    memcpy( v.hash, hash, HASH_LEN );
+    v.path = (char *)filename;
+    lock_hash_cache();
+    if ( cache && rbtree_insert( cache, &k, &v ) == RBTREE_SUCCESS )
+      dirty = 1;
+    unlock_hash_cache();
+  }
+}
+
+/* Write the cache back out if it changed, and forget it */
+
+void close_hash_cache( void ) {
+  char *path;
+
+  lock_hash_cache();
+  if ( cache ) {
+    if ( dirty ) {
+      path = get_hash_cache_path();
+      if ( path ) {
+	save_hash_cache( path );
+	free( path );
+      }
+    }
+    rbtree_free( cache );
+    cache = NULL;
+    dirty = 0;
+  }
+  unlock_hash_cache();
+}
+
+static int compare_hash_cache_keys( void *x, void *y ) {
+  hash_cache_key *a, *b;
+
+  a = (hash_cache_key *)x;
+  b = (hash_cache_key *)y;
+  if ( a->dev != b->dev ) return ( a->dev < b->dev ) ? -1 : 1;
+  else if ( a->ino != b->ino ) return ( a->ino < b->ino ) ? -1 : 1;
+  else if ( a->alg != b->alg ) return ( a->alg < b->alg ) ? -1 : 1;
+  else return 0;
+}
+
+static void * copy_hash_cache_key( void *v ) {
+  hash_cache_key *k;
+
+  k = malloc( sizeof( *k ) );
+  if ( k ) memcpy( k, v, sizeof( *k ) );
+  return k;
+}
+
+static void * copy_hash_cache_val( void *v ) {
+  hash_cache_val *c;
+
+  c = malloc( sizeof( *c ) );
+  if ( c ) {
+    memcpy( c, v, sizeof( *c ) );
+    if ( c->path ) {
+      c->path = copy_string( c->path );
+      if ( !( c->path ) ) {
+	free( c );
+	c = NULL;
+      }
+    }
+  }
+  return c;
+}
+
+static void fill_hash_cache_val( hash_cache_val *v, struct stat *st ) {
+  memset( v, 0, sizeof( *v ) );
+  v->size = st->st_size;
+  v->mtime = st->st_mtim.tv_sec;
+  v->mtime_ns = st->st_mtim.tv_nsec;
+  v->ctime = st->st_ctim.tv_sec;
+  v->ctime_ns = st->st_ctim.tv_nsec;
+}
+
+static void free_hash_cache_val( void *v ) {
+  hash_cache_val *c;
+
+  c = (hash_cache_val *)v;
+  if ( c ) {
+    if ( c->path ) free( c->path );
+    free( c );
+  }
+}
+
+/* Drop whatever we had for a file that's about to go away */
+
+void forget_cached_hash( struct stat *st ) {
+  hash_cache_key k;
+  pkg_hash_t alg;
+
+  if ( cache && st ) {
+    memset( &k, 0, sizeof( k ) );
+    k.dev = st->st_dev;
+    k.ino = st->st_ino;
+    lock_hash_cache();
+    for ( alg = HASH_MD5; alg < DEFAULT_HASH && cache; ++alg ) {
+      k.alg = alg;
+      if ( rbtree_delete( cache, &k, NULL ) == RBTREE_SUCCESS ) dirty = 1;
+    }
+    unlock_hash_cache();
+  }
+}
+
+/*
+ * Look filename up, filling in st from stat() as we go.  Returns 1 and
+ * fills in hash on a hit, 0 on a miss, when st is good to hand back to
+ * cache_file_hash() once it's been hashed, or -1 if there's no cache or
+ * we couldn't stat() it, so there's no point caching it.
+ */
+
+int get_cached_hash( pkg_hash_t alg, const char *filename,
+		     struct stat *st, uint8_t *hash ) {
+  int result;
+  hash_cache_key k;
+  hash_cache_val v;
+  void *found;
+
+  if ( !( cache && filename && st && hash ) ) return -1;
+  if ( stat( filename, st ) != 0 || !S_ISREG( st->st_mode ) ) return -1;
+
+  memset( &k, 0, sizeof( k ) );
+  k.dev = st->st_dev;
+  k.ino = st->st_ino;
+  k.alg = alg;
+  fill_hash_cache_val( &v, st );
+  result = 0;
+  lock_hash_cache();
+  if ( cache && rbtree_query( cache, &k, &found ) == RBTREE_SUCCESS ) {
+    if ( same_hash_cache_val( (hash_cache_val *)found, &v ) ) {
+      memcpy( hash, ((hash_cache_val *)found)->hash, HASH_LEN );
+      result = 1;
+    }
+  }
+  unlock_hash_cache();
+
+  return result;
+}
+
+static char * get_hash_cache_path( void ) {
+  return concatenate_paths( get_pkg(), HASH_CACHE_FILE_NAME );
+}
+
+static void load_hash_cache( const char *path ) {
+  FILE *fp;
+  char *line;
+  struct stat st;
+  int lnum;
+
+  fp = fopen( path, "r" );
+  if ( fp ) {
+    if ( fstat( fileno( fp ), &st ) == 0 ) {
+      lnum = 0;
+      while ( ( line = read_line_from_file( fp ) ) != NULL ) {
+	++lnum;
+	if ( !is_whitespace( line ) &&
+	     parse_hash_cache_line( line, &st ) != 0 ) {
+	  fprintf( stderr, "Warning: ignoring bad line %d in %s\n",
+		   lnum, path );
+	  /* We'll write it back out without that line */
+	  dirty = 1;
+	}
+	free( line );
+      }
+    }
+    fclose( fp );
+  }
+  /* Not having one yet is fine */
+}
+
+static void lock_hash_cache( void ) {
+#ifdef USE_PTHREADS
+  pthread_mutex_lock( &cache_lock );
+#endif /* USE_PTHREADS */
+}
+
+/*
+ * Start caching, loading what's already in the pkgdir.  A no-op with
+ * --disable-hash-cache.
+ */
+
+void open_hash_cache( void ) {
+  char *path;
+
+  if ( !get_hash_cache() ) return;
+
+  lock_hash_cache();
+  if ( !cache ) {
+    cache = rbtree_alloc( compare_hash_cache_keys,
+			  copy_hash_cache_key, free,
+			  copy_hash_cache_val, free_hash_cache_val );
+    dirty = 0;
+    if ( cache ) {
+      path = get_hash_cache_path();
+      if ( path ) {
+	load_hash_cache( path );
+	free( path );
+      }
+    }
+  }
+  unlock_hash_cache();
+}
+
+/*
+ * Lines are <dev> <inode> <hash name> <size> <mtime> <mtime ns>
+ * <ctime> <ctime ns> <hash in hex> <path>.  cst is the stat of the
+ * cache file itself: like git's index, we don't trust an entry for a
+ * file that changed in the same tick the cache was written in, since it
+ * could have changed again after it was hashed without its ctime moving.
+ */
+
+static int parse_hash_cache_line( char *line, struct stat *cst ) {
+  char **fields;
+  int status;
+  unsigned long long dev, ino;
+  long long size, mtime, ctime;
+  long mtime_ns, ctime_ns;
+  hash_cache_key k;
+  hash_cache_val v;
+  char c;
+
+  status = parse_strings_from_line( line, &fields );
+  if ( status == 0 ) {
+    memset( &k, 0, sizeof( k ) );
+    memset( &v, 0, sizeof( v ) );
+    if ( strlistlen( fields ) == 9 ) {
+      /* From before we kept paths; we can't check it, so let it go */
+      dirty = 1;
+    }
+    else if ( strlistlen( fields ) == 10 &&
+	      sscanf( fields[0], "%llu%c", &dev, &c ) == 1 &&
+	      sscanf( fields[1], "%llu%c", &ino, &c ) == 1 &&
+	      parse_hash_name( fields[2], &(k.alg) ) == 0 &&
+	      sscanf( fields[3], "%lld%c", &size, &c ) == 1 &&
+	      sscanf( fields[4], "%lld%c", &mtime, &c ) == 1 &&
+	      sscanf( fields[5], "%ld%c", &mtime_ns, &c ) == 1 &&
+	      sscanf( fields[6], "%lld%c", &ctime, &c ) == 1 &&
+	      sscanf( fields[7], "%ld%c", &ctime_ns, &c ) == 1 &&
+	      parse_hex( fields[8], v.hash, get_hash_len( k.alg ) ) == 0 ) {
+      k.dev = (dev_t)dev;
+      k.ino = (ino_t)ino;
+      v.size = (off_t)size;
+      v.mtime = (time_t)mtime;
+      v.mtime_ns = mtime_ns;
+      v.ctime = (time_t)ctime;
+      v.ctime_ns = ctime_ns;
+      v.path = fields[9];
+      if ( v.ctime < cst->st_mtim.tv_sec ||
+	   ( v.ctime == cst->st_mtim.tv_sec &&
+	     v.ctime_ns < cst->st_mtim.tv_nsec ) ) {
+	if ( rbtree_insert( cache, &k, &v ) != RBTREE_SUCCESS ) status = -1;
+      }
+      /* else racy; let it get hashed again */
+    }
+    else status = -1;
+
+    /* The fields point into line */
+    free( fields );
+  }
+
+  return status;
+}
+
+/* Parse len bytes of hex from s into out, which is HASH_LEN long */
+
+static int parse_hex( const char *s, uint8_t *out, int len ) {
+  int i;
+  unsigned int byte;
+  char digits[3];
+
+  if ( len <= 0 || len > HASH_LEN || strlen( s ) != 2 * len ) return -1;
+  memset( out, 0, HASH_LEN );
+  digits[2] = '\0';
+  for ( i = 0; i < len; ++i ) {
+    digits[0] = s[2*i];
+    digits[1] = s[2*i+1];
+    if ( strspn( digits, "0123456789abcdefABCDEF" ) != 2 ||
+	 sscanf( digits, "%x", &byte ) != 1 )
+      return -1;
+    out[i] = (uint8_t)byte;
+  }
+
+  return 0;
+}
+
+static int same_hash_cache_val( hash_cache_val *a, hash_cache_val *b ) {
+  return ( a->size == b->size &&
+	   a->mtime == b->mtime && a->mtime_ns == b->mtime_ns &&
+	   a->ctime == b->ctime && a->ctime_ns == b->ctime_ns );
+}
+
+/*
+ * Write the cache to a temp in the pkgdir and rename it into place, so
+ * a crash or another mpkg never sees half of one, leaving out entries
+ * for files that aren't there as we hashed them any more.  Failing
+ * because we can't write to the pkgdir (status as a normal user) isn't
+ * worth a warning; the cache is only ever a shortcut.
+ */
+
+static int save_hash_cache( const char *path ) {
+  char *tmpl, *hex;
+  int fd, status, len;
+  FILE *fp;
+  rbtree_node *n;
+  hash_cache_key *k;
+  void *vv;
+  hash_cache_val *v;
+
+  status = 0;
+  len = strlen( path ) + 8;
+  tmpl = malloc( len );
+  if ( tmpl ) {
+    snprintf( tmpl, len, "%s.XXXXXX", path );
+    fd = mkstemp( tmpl );
+    if ( fd >= 0 ) {
+      fchmod( fd, 0644 );
+      fp = fdopen( fd, "w" );
+      if ( fp ) {
+	n = NULL;
+	while ( status == 0 &&
+		( k = rbtree_enum( cache, n, &vv, &n ) ) ) {
+	  v = (hash_cache_val *)vv;
+	  if ( v && still_hash_cache_val( k, v ) ) {
+	    hex = hash_to_string( v->hash, get_hash_len( k->alg ) );
+	    if ( hex ) {
+	      fprintf( fp, "%llu %llu %s %lld %lld %ld %lld %ld %s %s\n",
+		       (unsigned long long)(k->dev),
+		       (unsigned long long)(k->ino),
+		       get_hash_name( k->alg ), (long long)(v->size),
+		       (long long)(v->mtime), v->mtime_ns,
+		       (long long)(v->ctime), v->ctime_ns, hex, v->path );
+	      free( hex );
+	    }
+	    else status = -1;
+	  }
+	}
+	if ( ferror( fp ) ) status = -1;
+	if ( fclose( fp ) != 0 ) status = -1;
+      }
+      else {
+	close( fd );
+	status = -1;
+      }
+
+      if ( status == 0 ) {
+	if ( rename( tmpl, path ) != 0 ) status = -1;
+      }
+      if ( status != 0 ) {
+	fprintf( stderr, "Warning: couldn't write hash cache %s: %s\n",
+		 path, strerror( errno ) );
+	unlink( tmpl );
+      }
+    }
+    else if ( errno != EACCES && errno != EPERM && errno != EROFS ) {
+      fprintf( stderr, "Warning: couldn't write hash cache %s: %s\n",
+	       path, strerror( errno ) );
+      status = -1;
+    }
+    else status = -1;
+
+    free( tmpl );
+  }
+  else status = -1;
+
+  return status;
+}
+
+/*
+ * Whether v's path is still the file k names, unchanged since it was
+ * hashed; paths with whitespace in can't go in the file, so they never
+ * are.
+ */
+
+static int still_hash_cache_val( hash_cache_key *k, hash_cache_val *v ) {
+  struct stat st;
+  hash_cache_val now;
+
+  if ( !( v->path ) ||
+       v->path[strcspn( v->path, " \t\r\n\v\f" )] != '\0' ||
+       stat( v->path, &st ) != 0 || !S_ISREG( st.st_mode ) ||
+       st.st_dev != k->dev || st.st_ino != k->ino )
+    return 0;
+  fill_hash_cache_val( &now, &st );
+  return same_hash_cache_val( v, &now );
+}
+
+static void unlock_hash_cache( void ) {
+#ifdef USE_PTHREADS
+  pthread_mutex_unlock( &cache_lock );
+#endif /* USE_PTHREADS */
+}
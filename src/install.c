@@ -39,6 +39,8 @@ typedef struct {
   gid_t group;
   mode_t mode;
   time_t mtime;
+  /* Its hash, for the hash cache once it's in place */
+  uint8_t hash[HASH_LEN];
 } file_descr;
 
 typedef struct {
@@ -121,10 +123,12 @@ static int do_install_one_symlink( pkg_db *, pkg_handle *, install_state *,
 static int do_install_symlinks( pkg_db *, pkg_handle *, install_state * );
 static int do_preinst_dirs( pkg_handle *, install_state * );
 static int do_preinst_files( pkg_handle *, install_state * );
+static int do_preinst_files_from_stream( pkg_handle *, pkg_stream *,
+					 install_state * );
 static int do_preinst_one_dir( install_state *, pkg_handle *,
 			       pkg_descr_entry * );
 static int do_preinst_one_file( install_state *, pkg_handle *,
-				pkg_descr_entry * );
+				pkg_descr_entry *, read_stream * );
 static int do_preinst_one_symlink( install_state *, pkg_handle *,
 				   pkg_descr_entry * );
 static int do_preinst_symlinks( pkg_handle *, install_state * );
@@ -136,7 +140,9 @@ static int handle_dir_replace( pkg_db *, pkg_descr_entry * );
 static int handle_file_replace( pkg_db *, pkg_descr *, pkg_descr_entry * );
 static int handle_replace( pkg_db *, pkg_handle *, install_state * );
 static int handle_symlink_replace( pkg_db *, pkg_descr_entry * );
-static int install_pkg( pkg_db *, pkg_handle * );
+static int install_pkg( pkg_db *, pkg_handle *, pkg_stream * );
+static int write_stream_to_fd( read_stream *, int, pkg_hash_t,
+			       pkg_descr_entry * );
 static int rollback_dir_set( rbtree ** );
 static int rollback_file_set( rbtree ** );
 static int rollback_install_descr( pkg_handle *, install_state * );
@@ -250,6 +256,7 @@ static void * copy_file_descr( void *fv ) {
       fcpy->group = f->group;
       fcpy->mode = f->mode;
       fcpy->mtime = f->mtime;
+      memcpy( fcpy->hash, f->hash, sizeof( fcpy->hash ) );
       if ( f->temp_file ) {
 	fcpy->temp_file = copy_string( f->temp_file );
 	if ( !(fcpy->temp_file) ) {
@@ -423,11 +430,11 @@ static int create_dirs_as_needed( pkg_handle *pkg, const char *path,
 		if ( record_dir ) {
 		  if ( !(*dirs) ) {
 		    *dirs =
-		      rbtree_alloc( rbtree_string_comparator,
-				    rbtree_string_copier,
-				    rbtree_string_free,
-				    copy_dir_descr,
-				    free_dir_descr );
+		      rbtree_alloc_arena( rbtree_string_comparator,
+					  rbtree_string_copier,
+					  rbtree_string_free,
+					  copy_dir_descr,
+					  free_dir_descr );
 		  }
 		
 		  if ( *dirs ) {
@@ -694,11 +701,11 @@ static int do_install_one_dir( pkg_db *db, pkg_handle *p, install_state *is,
 
       if ( !(is->pass_nine_dirs_to_process) ) {
 	is->pass_nine_dirs_to_process =
-	  rbtree_alloc( rbtree_string_comparator,
-			rbtree_string_copier,
-			rbtree_string_free,
-			copy_dir_descr,
-			free_dir_descr );
+	  rbtree_alloc_arena( rbtree_string_comparator,
+			      rbtree_string_copier,
+			      rbtree_string_free,
+			      copy_dir_descr,
+			      free_dir_descr );
       }
 		
       if ( is->pass_nine_dirs_to_process ) {
@@ -728,10 +735,10 @@ static int do_install_one_dir( pkg_db *db, pkg_handle *p, install_state *is,
 
 	  if ( !(is->pass_eight_names_installed) ) {
 	    is->pass_eight_names_installed =
-	      rbtree_alloc( rbtree_string_comparator,
-			    rbtree_string_copier,
-			    rbtree_string_free,
-			    NULL, NULL );
+	      rbtree_alloc_arena( rbtree_string_comparator,
+				  rbtree_string_copier,
+				  rbtree_string_free,
+				  NULL, NULL );
 	  }
 	  
 	  if ( is->pass_eight_names_installed ) {
@@ -801,6 +808,7 @@ static int do_install_one_file( pkg_db *db, pkg_handle *p, install_state *is,
 	   * file if we succeed
 	   */
 
+	  if ( S_ISREG( st.st_mode ) ) forget_cached_hash( &st );
 	  result = unlink( full_path );
 	  if ( result != 0 ) {
 	    fprintf( stderr, "Couldn't remove existing %s at %s: %s\n",
@@ -867,10 +875,10 @@ static int do_install_one_file( pkg_db *db, pkg_handle *p, install_state *is,
 	    if ( is->old_descr ) {
 	      if ( !(is->pass_eight_names_installed) ) {
 		is->pass_eight_names_installed =
-		  rbtree_alloc( rbtree_string_comparator,
-				rbtree_string_copier,
-				rbtree_string_free,
-				NULL, NULL );
+		  rbtree_alloc_arena( rbtree_string_comparator,
+				      rbtree_string_copier,
+				      rbtree_string_free,
+				      NULL, NULL );
 	      }
 	  
 	      if ( is->pass_eight_names_installed ) {
@@ -938,6 +946,14 @@ static int do_install_one_file( pkg_db *db, pkg_handle *p, install_state *is,
 	  /* Get rid of the temp */
 	  unlink( temp_path );
 
+	  /*
+	   * With checking on, its content was checked against the hash
+	   * on the way in, and we're done changing its ctime.
+	   */
+	  if ( status == INSTALL_SUCCESS && get_check_md5() )
+	    cache_file_hash( p->descr->hdr.hash, full_path, NULL,
+			     descr->hash );
+
 	  free( temp_path );
 	}
 	else {
@@ -991,6 +1007,7 @@ static int do_install_one_symlink( pkg_db *db, pkg_handle *p,
 	   * file if we succeed
 	   */
 
+	  if ( S_ISREG( st.st_mode ) ) forget_cached_hash( &st );
 	  result = unlink( full_path );
 	  if ( result != 0 ) {
 	    fprintf( stderr, "Couldn't remove existing %s at %s: %s\n",
@@ -1072,10 +1089,10 @@ static int do_install_one_symlink( pkg_db *db, pkg_handle *p,
 	      if ( is->old_descr ) {
 		if ( !(is->pass_eight_names_installed) ) {
 		  is->pass_eight_names_installed =
-		    rbtree_alloc( rbtree_string_comparator,
-				  rbtree_string_copier,
-				  rbtree_string_free,
-				  NULL, NULL );
+		    rbtree_alloc_arena( rbtree_string_comparator,
+					rbtree_string_copier,
+					rbtree_string_free,
+					NULL, NULL );
 		}
 	  
 		if ( is->pass_eight_names_installed ) {
@@ -1266,7 +1283,7 @@ static int do_preinst_files( pkg_handle *p, install_state *is ) {
     for ( i = 0; i < desc->num_entries; ++i ) {
       e = desc->entries + i;
       if ( e->type == ENTRY_FILE ) {
-	result = do_preinst_one_file( is, p, e );
+	result = do_preinst_one_file( is, p, e, NULL );
 	if ( result != INSTALL_SUCCESS ) {
 	  temp = concatenate_paths( get_root(), e->filename );
 	  if ( temp ) {
@@ -1284,6 +1301,117 @@ static int do_preinst_files( pkg_handle *p, install_state *is ) {
   return status;
 }
 
+static int do_preinst_files_from_stream( pkg_handle *p, pkg_stream *ps,
+					 install_state *is ) {
+  int status, result, i;
+  pkg_descr *desc;
+  pkg_descr_entry *e;
+  rbtree *files;
+  tar_file_info *tinf;
+  read_stream *rs;
+  rbtree_node *n;
+  char *temp, *filename;
+  void *ev;
+
+  status = INSTALL_SUCCESS;
+  if ( p && ps && is ) {
+    desc = p->descr;
+    /*
+     * Map the filenames of file entries in the package-description to
+     * the entries, so we can install them in whatever order they come
+     * out of the package.  The value is set to NULL once a file has
+     * been seen.
+     */
+    files = rbtree_alloc_arena( rbtree_string_comparator,
+				rbtree_string_copier,
+				rbtree_string_free,
+				NULL, NULL );
+    if ( files ) {
+      for ( i = 0; i < desc->num_entries; ++i ) {
+	e = desc->entries + i;
+	if ( e->type == ENTRY_FILE ) {
+	  result = rbtree_insert( files, e->filename, e );
+	  if ( result != RBTREE_SUCCESS ) {
+	    fprintf( stderr, "Couldn't insert into rbtree.\n" );
+	    status = INSTALL_ERROR;
+	    break;
+	  }
+	}
+      }
+
+      while ( status == INSTALL_SUCCESS &&
+	      ( result = get_next_pkg_stream_file( ps, &tinf, &rs ) ) ==
+	      PKG_STREAM_SUCCESS ) {
+	temp = concatenate_paths( "/", tinf->filename );
+	if ( temp ) {
+	  ev = NULL;
+	  result = rbtree_query( files, temp, &ev );
+	  if ( result == RBTREE_SUCCESS ) {
+	    if ( ev ) {
+	      e = (pkg_descr_entry *)ev;
+	      /* Mark it seen first, or a duplicate would go in twice */
+	      result = rbtree_insert( files, temp, NULL );
+	      if ( result == RBTREE_SUCCESS ) {
+		result = do_preinst_one_file( is, p, e, rs );
+		if ( result != INSTALL_SUCCESS ) {
+		  filename = concatenate_paths( get_root(), e->filename );
+		  if ( filename ) {
+		    fprintf( stderr, "Couldn't preinstall file %s\n",
+			     filename );
+		    free( filename );
+		  }
+		  status = result;
+		}
+	      }
+	      else {
+		fprintf( stderr, "Couldn't insert into rbtree.\n" );
+		status = INSTALL_ERROR;
+	      }
+	    }
+	    else {
+	      fprintf( stderr, "Duplicate file %s in package\n", temp );
+	      status = INSTALL_ERROR;
+	    }
+	  }
+	  /* Else it isn't in the package-description; skip it */
+	  free( temp );
+	}
+	else status = INSTALL_ERROR;
+      }
+
+      if ( status == INSTALL_SUCCESS ) {
+	if ( result == PKG_STREAM_NO_MORE_FILES ) {
+	  /* Anything still non-NULL never showed up in the package */
+	  n = NULL;
+	  do {
+	    ev = NULL;
+	    temp = rbtree_enum( files, n, &ev, &n );
+	    if ( temp && ev ) {
+	      fprintf( stderr, "File %s from package-description not found\n",
+		       temp );
+	      status = INSTALL_ERROR;
+	    }
+	  } while ( n );
+	}
+	else {
+	  fprintf( stderr, "Error reading content of package %s\n",
+		   desc->hdr.pkg_name );
+	  status = INSTALL_ERROR;
+	}
+      }
+
+      rbtree_free( files );
+    }
+    else {
+      fprintf( stderr, "Couldn't allocate rbtree.\n" );
+      status = INSTALL_ERROR;
+    }
+  }
+  else status = INSTALL_ERROR;
+
+  return status;
+}
+
 static int do_preinst_one_dir( install_state *is,
 			       pkg_handle *pkg,
 			       pkg_descr_entry *e ) {
@@ -1411,11 +1539,11 @@ static int do_preinst_one_dir( install_state *is,
 	    if ( record_dir ) {
 	      if ( !(is->pass_two_dirs) ) {
 		is->pass_two_dirs =
-		  rbtree_alloc( rbtree_string_comparator,
-				rbtree_string_copier,
-				rbtree_string_free,
-				copy_dir_descr,
-				free_dir_descr );
+		  rbtree_alloc_arena( rbtree_string_comparator,
+				      rbtree_string_copier,
+				      rbtree_string_free,
+				      copy_dir_descr,
+				      free_dir_descr );
 	      }
 		
 	      if ( is->pass_two_dirs ) {
@@ -1450,7 +1578,8 @@ static int do_preinst_one_dir( install_state *is,
 
 static int do_preinst_one_file( install_state *is,
 				pkg_handle *pkg,
-				pkg_descr_entry *e ) {
+				pkg_descr_entry *e,
+				read_stream *rs ) {
   int status, result, tmpfd;
   uid_t owner;
   gid_t group;
@@ -1499,13 +1628,15 @@ static int do_preinst_one_file( install_state *is,
 	   */
 
 	  src = NULL;
-	  temp = concatenate_paths( pkg->unpacked_dir, "package-content" );
-	  if ( temp ) {
-	    src = concatenate_paths( temp, e->filename );
-	    free( temp );
+	  if ( !rs ) {
+	    temp = concatenate_paths( pkg->unpacked_dir, "package-content" );
+	    if ( temp ) {
+	      src = concatenate_paths( temp, e->filename );
+	      free( temp );
+	    }
 	  }
 
-	  if ( src ) {
+	  if ( src || rs ) {
 	    base = get_base_path( p );
 	    lastcomp = get_last_component( p );
 	    if ( base && lastcomp ) {
@@ -1518,30 +1649,51 @@ static int do_preinst_one_file( install_state *is,
 		tmpfd = mkstemp( format );
 
 		if ( tmpfd != -1 ) {
-		  /*
-		   * Okay, we've got a temp, and its name is now in
-		   * format.  Clear out the temp, and try to hard-link
-		   * from the appropriate place.
-		   */
-		  close( tmpfd );
-		  unlink( format );
-		  /* Try to link src to format, copy if not possible. */
-		  result = link_or_copy( format, src );
+		  if ( rs ) {
+		    /*
+		     * We're streaming the package, so the content goes
+		     * straight into the temp and is never unpacked
+		     * anywhere else.
+		     */
+		    result = write_stream_to_fd( rs, tmpfd,
+						 pkg->descr->hdr.hash, e );
+		    if ( close( tmpfd ) != 0 && result == INSTALL_SUCCESS ) {
+		      if ( errno == ENOSPC ) result = INSTALL_OUT_OF_DISK;
+		      else result = INSTALL_ERROR;
+		    }
+		  }
+		  else {
+		    /*
+		     * Okay, we've got a temp, and its name is now in
+		     * format.  Clear out the temp, and try to hard-link
+		     * from the appropriate place.
+		     */
+		    close( tmpfd );
+		    unlink( format );
+		    /* Try to link src to format, copy if not possible. */
+		    result = link_or_copy( format, src );
+		    if ( result == LINK_OR_COPY_SUCCESS )
+		      result = INSTALL_SUCCESS;
+		    else if ( result == LINK_OR_COPY_OUT_OF_DISK )
+		      result = INSTALL_OUT_OF_DISK;
+		    else result = INSTALL_ERROR;
+		  }
 
-		  if ( result == LINK_OR_COPY_SUCCESS ) {
+		  if ( result == INSTALL_SUCCESS ) {
 		    fd.owner = owner;
 		    fd.group = group;
 		    fd.mode = e->u.f.mode;
 		    fd.mtime = pkg->descr->hdr.pkg_time;
+		    memcpy( fd.hash, e->u.f.hash, sizeof( fd.hash ) );
 		    fd.temp_file = concatenate_paths( base, format );
 		    if ( fd.temp_file ) {
 		      if ( !(is->pass_three_files) ) {
 			is->pass_three_files =
-			  rbtree_alloc( rbtree_string_comparator,
-					rbtree_string_copier,
-					rbtree_string_free,
-					copy_file_descr,
-					free_file_descr );
+			  rbtree_alloc_arena( rbtree_string_comparator,
+					      rbtree_string_copier,
+					      rbtree_string_free,
+					      copy_file_descr,
+					      free_file_descr );
 		      }
 		
 		      if ( is->pass_three_files ) {
@@ -1573,9 +1725,10 @@ static int do_preinst_one_file( install_state *is,
 
 		    if ( status != INSTALL_SUCCESS ) unlink( format );
 		  }
-		  else if ( result == LINK_OR_COPY_OUT_OF_DISK )
-		    status = INSTALL_OUT_OF_DISK;
-		  else status = INSTALL_ERROR;
+		  else {
+		    unlink( format );
+		    status = result;
+		  }
 		}
 		else status = INSTALL_ERROR;
 
@@ -1592,7 +1745,7 @@ static int do_preinst_one_file( install_state *is,
 	      status = INSTALL_ERROR;
 	    }
 
-	    free( src );
+	    if ( src ) free( src );
 	  }
 	  else status = INSTALL_ERROR;
 	}
@@ -1692,11 +1845,11 @@ static int do_preinst_one_symlink( install_state *is,
 		    if ( sd.temp_symlink ) {
 		      if ( !(is->pass_four_symlinks) ) {
 			is->pass_four_symlinks =
-			  rbtree_alloc( rbtree_string_comparator,
-					rbtree_string_copier,
-					rbtree_string_free,
-					copy_symlink_descr,
-					free_symlink_descr );
+			  rbtree_alloc_arena( rbtree_string_comparator,
+					      rbtree_string_copier,
+					      rbtree_string_free,
+					      copy_symlink_descr,
+					      free_symlink_descr );
 		      }
 		
 		      if ( is->pass_four_symlinks ) {
@@ -1964,23 +2117,26 @@ static int handle_file_replace( pkg_db *db, pkg_descr *old_p,
 	  /* Check if the file has been modified */
 	  if ( buf.st_mtime == old_p->hdr.pkg_time ) {
 	    if ( get_check_md5() ) {
-	      result = file_hash_matches( full_path, e->u.f.hash );
+	      result = file_hash_matches( old_p->hdr.hash, full_path,
+					  e->u.f.hash );
 	      if ( result == 1 ) {
 		/* Hash match; remove it */
 		printf( "RF %s\n", full_path );
+		forget_cached_hash( &buf );
 		unlink( full_path );
 	      }
 	      /* if result == 0, no match, so leave it */
 	      else if ( result != 0 ) {
 		/* Error checking */
 		fprintf( stderr,
-			 "Warning: couldn't check MD5 of old file %s\n",
-			 full_path );
+			 "Warning: couldn't check %s hash of old file %s\n",
+			 get_hash_name( old_p->hdr.hash ), full_path );
 	      }
 	    }
 	    else {
 	      /* No MD5 check; go ahead and unlink it */
 	      printf( "RF %s\n", full_path );
+	      forget_cached_hash( &buf );
 	      unlink( full_path );
 	    }
 	  }
@@ -2040,10 +2196,10 @@ static int handle_replace( pkg_db *db, pkg_handle *p, install_state *is ) {
   int status, result, i, need_to_remove, has_pkg_db;
   pkg_descr *old;
   pkg_descr_entry *e;
-  rbtree *dirs_to_handle, *others_to_handle;
+  rbtree *dirs_to_handle, *others_to_handle, *old_owned;
   rbtree_node *n;
-  char *temp, *path, *canonical_path;
-  void *e_v;
+  char *path, *canonical_path;
+  void *e_v, *owned_v;
 
   status = INSTALL_SUCCESS;
   if ( db && p && is ) {
@@ -2052,16 +2208,18 @@ static int handle_replace( pkg_db *db, pkg_handle *p, install_state *is ) {
       /* Load it */
       old = read_pkg_descr_from_file( is->old_descr );
       if ( old ) {
-	others_to_handle = rbtree_alloc( rbtree_string_comparator,
-					 NULL, NULL, NULL, NULL );
+	others_to_handle = rbtree_alloc_arena( rbtree_string_comparator,
+					       NULL, NULL, NULL, NULL );
 	/*
 	 * Use post_path_comparator for directories, so subdirectories
 	 * will be processed ahead of their parents
 	 */
-	dirs_to_handle = rbtree_alloc( post_path_comparator,
-				       NULL, NULL, NULL, NULL );
+	dirs_to_handle = rbtree_alloc_arena( post_path_comparator,
+					     NULL, NULL, NULL, NULL );
+	/* What the old install still owns in the pkgdb */
+	old_owned = get_owned_paths_for_pkg_db( db, old->hdr.pkg_name );
 
-	if ( dirs_to_handle && others_to_handle ) {
+	if ( dirs_to_handle && others_to_handle && old_owned ) {
 	  for ( i = 0; i < old->num_entries; ++i ) {
 	    e = &(old->entries[i]);
 	    canonical_path = canonicalize_and_copy( e->filename );
@@ -2071,12 +2229,8 @@ static int handle_replace( pkg_db *db, pkg_handle *p, install_state *is ) {
 	       * earlier, and if it still has a pkgdb entry owned by the
 	       * old install.
 	       */
-	      temp = query_pkg_db( db, canonical_path );
-	      if ( temp ) {
-		if ( strcmp( temp, old->hdr.pkg_name ) == 0 ) has_pkg_db = 1;
-		else has_pkg_db = 0;
-		free( temp );
-	      }
+	      result = rbtree_query( old_owned, canonical_path, &owned_v );
+	      if ( result == RBTREE_SUCCESS ) has_pkg_db = 1;
 	      else has_pkg_db = 0;
 
 	      if ( has_pkg_db ) {
@@ -2223,6 +2377,7 @@ static int handle_replace( pkg_db *db, pkg_handle *p, install_state *is ) {
 	  /* Free the rbtrees */
 	  rbtree_free( dirs_to_handle );
 	  rbtree_free( others_to_handle );
+	  rbtree_free( old_owned );
 	}
 	else {
 	  fprintf( stderr,
@@ -2230,6 +2385,7 @@ static int handle_replace( pkg_db *db, pkg_handle *p, install_state *is ) {
 		   p->descr->hdr.pkg_name );
 	  if ( dirs_to_handle ) rbtree_free( dirs_to_handle );
 	  if ( others_to_handle ) rbtree_free( others_to_handle );
+	  if ( old_owned ) rbtree_free( old_owned );
 	  /* Skip it */
 	}
 
@@ -2348,26 +2504,69 @@ static int handle_symlink_replace( pkg_db *db, pkg_descr_entry *e ) {
 void install_help( void ) {
   printf( "Install packages.  Usage:\n" );
   printf( "\n" );
-  printf( "mpkg [global options] install <package 1> <package 2> ...\n" );
+  printf( "mpkg [global options] install [options] <package 1> <package 2> ...\n" );
   printf( "\n" );
   printf( "<package 1>, etc., are filenames of packages to install.\n" );
+  printf( "\n" );
+  printf( "Options:\n" );
+  printf( "  --enable-streaming | --disable-streaming\n" );
+  printf( "    Write files straight from the package into place, rather than\n" );
+  printf( "    unpacking the whole package to the temp directory first.  This\n" );
+  printf( "    is the default.  Version 1 packages which don't have their\n" );
+  printf( "    package-description first are always unpacked; version 2\n" );
+  printf( "    packages with it last have their content skipped once to\n" );
+  printf( "    find it.\n" );
 }
 
 void install_main( int argc, char **argv ) {
   pkg_db *db;
-  int i, status;
+  int i, status, streaming;
   pkg_handle *p;
+  pkg_stream *ps;
+
+  streaming = 1;
+  i = 0;
+  while ( i < argc ) {
+    if ( strcmp( argv[i], "--enable-streaming" ) == 0 ) streaming = 1;
+    else if ( strcmp( argv[i], "--disable-streaming" ) == 0 ) streaming = 0;
+    else if ( strcmp( argv[i], "--" ) == 0 ) {
+      ++i;
+      break;
+    }
+    else if ( strncmp( argv[i], "--", 2 ) == 0 ) {
+      fprintf( stderr, "Unknown option for install %s\n", argv[i] );
+      return;
+    }
+    else break;
+    ++i;
+  }
+  argc -= i;
+  argv += i;
 
   if ( argc > 0 ) {
     status = sanity_check_globals();
     if ( status == 0 ) {
       db = open_pkg_db();
       if ( db ) {
+	open_hash_cache();
 	for ( i = 0; i < argc; ++i ) {
-	  p = open_pkg_file( argv[i] );
-	  if ( p ) {
-	    status = install_pkg( db, p );
-	    close_pkg( p );
+	  ps = NULL;
+	  p = NULL;
+	  if ( streaming ) ps = open_pkg_stream( argv[i] );
+	  /*
+	   * Fall back to unpacking if we couldn't stream it; the
+	   * package-description might have come after the content.
+	   */
+	  if ( !ps ) p = open_pkg_file( argv[i] );
+	  if ( ps || p ) {
+	    if ( ps ) {
+	      status = install_pkg( db, ps->h, ps );
+	      close_pkg_stream( ps );
+	    }
+	    else {
+	      status = install_pkg( db, p, NULL );
+	      close_pkg( p );
+	    }
 	    if ( status != INSTALL_SUCCESS ) {
 	      fprintf( stderr, "Failed to install %s\n", argv[i] );
 	      if ( status == INSTALL_OUT_OF_DISK ) {
@@ -2383,6 +2582,7 @@ void install_main( int argc, char **argv ) {
 		     argv[i] );
 	  }
 	}
+	close_hash_cache();
 	close_pkg_db( db );
       }
       else {
@@ -2397,7 +2597,7 @@ void install_main( int argc, char **argv ) {
   }
 }
 
-static int install_pkg( pkg_db *db, pkg_handle *p ) {
+static int install_pkg( pkg_db *db, pkg_handle *p, pkg_stream *ps ) {
   /*
    *
    * Theory of the package installer:
@@ -2421,7 +2621,10 @@ static int install_pkg( pkg_db *db, pkg_handle *p ) {
    * 3.) Iterate through the file list in the package.  For each file,
    * copy it to a temporary file in the directory it will be installed
    * in, and keep a list of temporary files and names to eventually
-   * install to.
+   * install to.  If we were given a pkg_stream, the files are read
+   * from the package in the order they appear there and written
+   * straight to the temporaries, checking MD5s as we go, so nothing
+   * was unpacked ahead of time.
    *
    * 4.) Iterate through the list of symlinks in the package.  If
    * nothing with that name already exists, create the symlink.  If
@@ -2433,7 +2636,9 @@ static int install_pkg( pkg_db *db, pkg_handle *p ) {
    * At this point, we have created everything we need to in the
    * location it needs to be installed in, so we are at a maximum of
    * disk space consumption.  If we get here, we can now begin making
-   * the installation permanent in the next phases.
+   * the installation permanent in the next phases.  All of their
+   * package db changes are made in one transaction, committed after
+   * pass nine.
    *
    * 5.) Iterate over the directory list in the package installer
    * again; every directory in it already exists due to pass two.
@@ -2504,32 +2709,55 @@ static int install_pkg( pkg_db *db, pkg_handle *p ) {
       if ( status != INSTALL_SUCCESS ) goto err_preinst_dirs;
 
       /* Pass three */
-      status = do_preinst_files( p, is );
+      if ( ps ) status = do_preinst_files_from_stream( p, ps, is );
+      else status = do_preinst_files( p, is );
       if ( status != INSTALL_SUCCESS ) goto err_preinst_files;
 
       /* Pass four */
       status = do_preinst_symlinks( p, is );
       if ( status != INSTALL_SUCCESS ) goto err_preinst_symlinks;
+
+      result = begin_pkg_db_txn( db );
+      if ( result != 0 ) {
+	fprintf( stderr,
+		 "Unable to begin package db transaction installing %s\n",
+		 p->descr->hdr.pkg_name );
+	status = INSTALL_ERROR;
+	goto err_preinst_symlinks;
+      }
       
       /* Pass five */
       status = do_install_dirs( db, p, is );
-      if ( status != INSTALL_SUCCESS ) goto install_done;
+      if ( status != INSTALL_SUCCESS ) goto install_commit;
 
       /* Pass six */
       status = do_install_files( db, p, is );
-      if ( status != INSTALL_SUCCESS ) goto install_done;
+      if ( status != INSTALL_SUCCESS ) goto install_commit;
 
       /* Pass seven */
       status = do_install_symlinks( db, p, is );
-      if ( status != INSTALL_SUCCESS ) goto install_done;
+      if ( status != INSTALL_SUCCESS ) goto install_commit;
 
       /* Pass eight */
       status = handle_replace( db, p, is );
-      if ( status != INSTALL_SUCCESS ) goto install_done;
+      if ( status != INSTALL_SUCCESS ) goto install_commit;
 
       /* Pass nine */
       status = adjust_dir_mtimes( db, p, is );
 
+    install_commit:
+      /*
+       * Commit even if a pass failed; the files it got to are in
+       * place by now, and the db has to say who owns them.
+       */
+      result = commit_pkg_db_txn( db );
+      if ( result != 0 ) {
+	fprintf( stderr,
+		 "Unable to commit package db changes installing %s\n",
+		 p->descr->hdr.pkg_name );
+	if ( status == INSTALL_SUCCESS ) status = INSTALL_ERROR;
+      }
+
       goto install_done;
 
     err_preinst_symlinks:
@@ -2807,3 +3035,86 @@ static int rollback_symlink_set( rbtree **symlinks ) {
 
   return status;  
 }
+
+static int write_stream_to_fd( read_stream *rs, int fd, pkg_hash_t alg,
+			       pkg_descr_entry *e ) {
+  int status, result;
+  unsigned char *buf;
+  void *data;
+  long len, written, wlen, buf_len;
+  hash_state *h;
+  write_stream *hash_ws;
+  read_stream *hash_rs;
+  uint8_t cksum[HASH_LEN];
+
+  status = INSTALL_SUCCESS;
+  if ( rs && fd >= 0 && e ) {
+    h = NULL;
+    hash_ws = NULL;
+    hash_rs = NULL;
+    buf_len = get_io_buffer_size();
+    buf = malloc( buf_len );
+    if ( !buf ) {
+      fprintf( stderr, "Couldn't allocate buffer for %s\n", e->filename );
+      status = INSTALL_ERROR;
+    }
+    if ( status == INSTALL_SUCCESS && get_check_md5() ) {
+      h = start_new_hash( alg );
+      if ( h ) hash_ws = get_hash_ws( h );
+      /* Hash it on the way through rather than as a separate write */
+      if ( hash_ws ) hash_rs = open_tee_read_stream( rs, hash_ws );
+      if ( hash_rs ) rs = hash_rs;
+      else {
+	fprintf( stderr, "Couldn't start %s hash for %s\n",
+		 get_hash_name( alg ), e->filename );
+	status = INSTALL_ERROR;
+      }
+    }
+
+    if ( status == INSTALL_SUCCESS ) {
+      while ( ( len = borrow_from_stream( rs, &data,
+					  buf, buf_len ) ) > 0 ) {
+	written = 0;
+	while ( written < len &&
+		( wlen = write( fd, (unsigned char *)data + written,
+				len - written ) ) >= 0 ) {
+	  written += wlen;
+	}
+
+	if ( written < len ) {
+	  fprintf( stderr, "Error writing %s: %s\n",
+		   e->filename, strerror( errno ) );
+	  if ( errno == ENOSPC ) status = INSTALL_OUT_OF_DISK;
+	  else status = INSTALL_ERROR;
+	  break;
+	}
+      }
+
+      if ( status == INSTALL_SUCCESS && len < 0 ) {
+	fprintf( stderr, "Error reading %s from package\n", e->filename );
+	status = INSTALL_ERROR;
+      }
+    }
+
+    if ( hash_rs ) close_read_stream( hash_rs );
+    if ( hash_ws ) close_write_stream( hash_ws );
+    if ( h ) {
+      if ( status == INSTALL_SUCCESS ) {
+	result = get_hash_result( h, cksum );
+	if ( result == 0 ) {
+	  if ( memcmp( cksum, e->u.f.hash, HASH_LEN ) != 0 ) {
+	    fprintf( stderr, "Checksums do not match for %s\n",
+		     e->filename );
+	    status = INSTALL_ERROR;
+	  }
+	}
+	else status = INSTALL_ERROR;
+      }
+      close_hash( h );
+    }
+    if ( buf ) free( buf );
+  }
+  else status = INSTALL_ERROR;
+
+  return status;
+}
@@ -1,8 +1,14 @@
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <pkg.h>
 
+#if defined( __GNUC__ ) && ( defined( __x86_64__ ) || defined( __i386__ ) )
+/* We can pick SSE2 or AVX2 lanes at runtime */
+# define MD5_X86_LANES
+#endif
+
 #define INIT_H0 0x67452301
 #define INIT_H1 0xEFCDAB89
 #define INIT_H2 0x98BADCFE
@@ -21,6 +27,87 @@
   (a) += (b); \
   }
 
+/* Load a little-endian 32-bit word from p */
+#define MD5_LE32( p ) \
+  ( (uint32_t)((p)[0]) | ( (uint32_t)((p)[1]) << 8 ) | \
+    ( (uint32_t)((p)[2]) << 16 ) | ( (uint32_t)((p)[3]) << 24 ) )
+
+/*
+ * All 64 steps of one block, fully unrolled, on a, b, c, d and the
+ * sixteen words of x; the caller adds the results into the state.
+ * Nothing here cares whether these are scalars or vectors of lanes.
+ */
+
+#define MD5_ROUNDS( a, b, c, d, x ) { \
+  MD5_STEP( MD5_F, (a), (b), (c), (d), (x)[0],  s[0],  t[0]  ); \
+  MD5_STEP( MD5_F, (d), (a), (b), (c), (x)[1],  s[1],  t[1]  ); \
+  MD5_STEP( MD5_F, (c), (d), (a), (b), (x)[2],  s[2],  t[2]  ); \
+  MD5_STEP( MD5_F, (b), (c), (d), (a), (x)[3],  s[3],  t[3]  ); \
+  MD5_STEP( MD5_F, (a), (b), (c), (d), (x)[4],  s[4],  t[4]  ); \
+  MD5_STEP( MD5_F, (d), (a), (b), (c), (x)[5],  s[5],  t[5]  ); \
+  MD5_STEP( MD5_F, (c), (d), (a), (b), (x)[6],  s[6],  t[6]  ); \
+  MD5_STEP( MD5_F, (b), (c), (d), (a), (x)[7],  s[7],  t[7]  ); \
+  MD5_STEP( MD5_F, (a), (b), (c), (d), (x)[8],  s[8],  t[8]  ); \
+  MD5_STEP( MD5_F, (d), (a), (b), (c), (x)[9],  s[9],  t[9]  ); \
+  MD5_STEP( MD5_F, (c), (d), (a), (b), (x)[10], s[10], t[10] ); \
+  MD5_STEP( MD5_F, (b), (c), (d), (a), (x)[11], s[11], t[11] ); \
+  MD5_STEP( MD5_F, (a), (b), (c), (d), (x)[12], s[12], t[12] ); \
+  MD5_STEP( MD5_F, (d), (a), (b), (c), (x)[13], s[13], t[13] ); \
+  MD5_STEP( MD5_F, (c), (d), (a), (b), (x)[14], s[14], t[14] ); \
+  MD5_STEP( MD5_F, (b), (c), (d), (a), (x)[15], s[15], t[15] ); \
+  \
+  MD5_STEP( MD5_G, (a), (b), (c), (d), (x)[1],  s[16], t[16] ); \
+  MD5_STEP( MD5_G, (d), (a), (b), (c), (x)[6],  s[17], t[17] ); \
+  MD5_STEP( MD5_G, (c), (d), (a), (b), (x)[11], s[18], t[18] ); \
+  MD5_STEP( MD5_G, (b), (c), (d), (a), (x)[0],  s[19], t[19] ); \
+  MD5_STEP( MD5_G, (a), (b), (c), (d), (x)[5],  s[20], t[20] ); \
+  MD5_STEP( MD5_G, (d), (a), (b), (c), (x)[10], s[21], t[21] ); \
+  MD5_STEP( MD5_G, (c), (d), (a), (b), (x)[15], s[22], t[22] ); \
+  MD5_STEP( MD5_G, (b), (c), (d), (a), (x)[4],  s[23], t[23] ); \
+  MD5_STEP( MD5_G, (a), (b), (c), (d), (x)[9],  s[24], t[24] ); \
+  MD5_STEP( MD5_G, (d), (a), (b), (c), (x)[14], s[25], t[25] ); \
+  MD5_STEP( MD5_G, (c), (d), (a), (b), (x)[3],  s[26], t[26] ); \
+  MD5_STEP( MD5_G, (b), (c), (d), (a), (x)[8],  s[27], t[27] ); \
+  MD5_STEP( MD5_G, (a), (b), (c), (d), (x)[13], s[28], t[28] ); \
+  MD5_STEP( MD5_G, (d), (a), (b), (c), (x)[2],  s[29], t[29] ); \
+  MD5_STEP( MD5_G, (c), (d), (a), (b), (x)[7],  s[30], t[30] ); \
+  MD5_STEP( MD5_G, (b), (c), (d), (a), (x)[12], s[31], t[31] ); \
+  \
+  MD5_STEP( MD5_H, (a), (b), (c), (d), (x)[5],  s[32], t[32] ); \
+  MD5_STEP( MD5_H, (d), (a), (b), (c), (x)[8],  s[33], t[33] ); \
+  MD5_STEP( MD5_H, (c), (d), (a), (b), (x)[11], s[34], t[34] ); \
+  MD5_STEP( MD5_H, (b), (c), (d), (a), (x)[14], s[35], t[35] ); \
+  MD5_STEP( MD5_H, (a), (b), (c), (d), (x)[1],  s[36], t[36] ); \
+  MD5_STEP( MD5_H, (d), (a), (b), (c), (x)[4],  s[37], t[37] ); \
+  MD5_STEP( MD5_H, (c), (d), (a), (b), (x)[7],  s[38], t[38] ); \
+  MD5_STEP( MD5_H, (b), (c), (d), (a), (x)[10], s[39], t[39] ); \
+  MD5_STEP( MD5_H, (a), (b), (c), (d), (x)[13], s[40], t[40] ); \
+  MD5_STEP( MD5_H, (d), (a), (b), (c), (x)[0],  s[41], t[41] ); \
+  MD5_STEP( MD5_H, (c), (d), (a), (b), (x)[3],  s[42], t[42] ); \
+  MD5_STEP( MD5_H, (b), (c), (d), (a), (x)[6],  s[43], t[43] ); \
+  MD5_STEP( MD5_H, (a), (b), (c), (d), (x)[9],  s[44], t[44] ); \
+  MD5_STEP( MD5_H, (d), (a), (b), (c), (x)[12], s[45], t[45] ); \
+  MD5_STEP( MD5_H, (c), (d), (a), (b), (x)[15], s[46], t[46] ); \
+  MD5_STEP( MD5_H, (b), (c), (d), (a), (x)[2],  s[47], t[47] ); \
+  \
+  MD5_STEP( MD5_I, (a), (b), (c), (d), (x)[0],  s[48], t[48] ); \
+  MD5_STEP( MD5_I, (d), (a), (b), (c), (x)[7],  s[49], t[49] ); \
+  MD5_STEP( MD5_I, (c), (d), (a), (b), (x)[14], s[50], t[50] ); \
+  MD5_STEP( MD5_I, (b), (c), (d), (a), (x)[5],  s[51], t[51] ); \
+  MD5_STEP( MD5_I, (a), (b), (c), (d), (x)[12], s[52], t[52] ); \
+  MD5_STEP( MD5_I, (d), (a), (b), (c), (x)[3],  s[53], t[53] ); \
+  MD5_STEP( MD5_I, (c), (d), (a), (b), (x)[10], s[54], t[54] ); \
+  MD5_STEP( MD5_I, (b), (c), (d), (a), (x)[1],  s[55], t[55] ); \
+  MD5_STEP( MD5_I, (a), (b), (c), (d), (x)[8],  s[56], t[56] ); \
+  MD5_STEP( MD5_I, (d), (a), (b), (c), (x)[15], s[57], t[57] ); \
+  MD5_STEP( MD5_I, (c), (d), (a), (b), (x)[6],  s[58], t[58] ); \
+  MD5_STEP( MD5_I, (b), (c), (d), (a), (x)[13], s[59], t[59] ); \
+  MD5_STEP( MD5_I, (a), (b), (c), (d), (x)[4],  s[60], t[60] ); \
+  MD5_STEP( MD5_I, (d), (a), (b), (c), (x)[11], s[61], t[61] ); \
+  MD5_STEP( MD5_I, (c), (d), (a), (b), (x)[2],  s[62], t[62] ); \
+  MD5_STEP( MD5_I, (b), (c), (d), (a), (x)[9],  s[63], t[63] ); \
+  }
+
 static const uint8_t s[64] = {
   7, 12, 17, 22, 7, 12, 17, 22,
   7, 12, 17, 22, 7, 12, 17, 22,
@@ -56,8 +143,39 @@ static const uint32_t t[64] = {
   0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
 };
 
+#ifdef MD5_X86_LANES
+
+typedef uint32_t md5_v4 __attribute__(( vector_size( 16 ) ));
+typedef uint32_t md5_v8 __attribute__(( vector_size( 32 ) ));
+
+/* One file being hashed in a lane of get_file_md5s() */
+typedef struct {
+  /* Index into the caller's arrays, or -1 if the lane is idle */
+  int index;
+  read_stream *rs;
+  md5_state *md5;
+  /* Only for streams that can't lend us their buffer */
+  void *buf;
+  uint8_t *data;
+  long avail;
+} md5_lane;
+
+#endif /* MD5_X86_LANES */
+
+#ifdef MD5_X86_LANES
+static void hash_files_in_lanes( const char **, uint8_t *, int *, int, int );
+#endif /* MD5_X86_LANES */
 static void md5_close( void * );
-static void md5_process_block( md5_state *, uint8_t * );
+#ifdef MD5_X86_LANES
+static int md5_fill_lane( md5_lane *, const char **, uint8_t *, int *, int,
+			  int * );
+#endif /* MD5_X86_LANES */
+static int md5_lanes( void );
+static void md5_process_blocks( md5_state *, uint8_t *, long );
+#ifdef MD5_X86_LANES
+static void md5_process_blocks_x4( md5_state **, uint8_t **, long );
+static void md5_process_blocks_x8( md5_state **, uint8_t **, long );
+#endif /* MD5_X86_LANES */
 static long md5_write( void *, void *, long );
 
 void close_md5( md5_state *md5 ) {
@@ -67,100 +185,41 @@ void close_md5( md5_state *md5 ) {
   }
 }
 
-#define MATCH_BUF_LEN 1024
-
-int file_hash_matches( const char *filename, uint8_t *hash ) {
-  int result;
-  md5_state *md5_ctxt;
-  read_stream *file_rs;
-  write_stream *md5_ws;
-  void *buf;
-  long len;
-  uint8_t h[HASH_LEN];
-
-  result = 0;
-  md5_ctxt = start_new_md5();
-  if ( md5_ctxt ) {
-    md5_ws = get_md5_ws( md5_ctxt );
-    if ( md5_ws ) {
-      file_rs = open_read_stream_none( filename );
-      if ( file_rs ) {
-	buf = malloc( MATCH_BUF_LEN );
-	if ( buf ) {
-	  while ( ( len = read_from_stream( file_rs, buf,
-					    MATCH_BUF_LEN ) ) > 0 ) {
-	    write_to_stream( md5_ws, buf, len );
-	  }
-	  free( buf );
-	}
-	else result = -4;
+/*
+ * MD5 n files, into hashes + i * HASH_LEN, with what get_file_hash()
+ * would have returned for each in results[i].  Where the CPU has SIMD
+ * lanes, up to MD5_MAX_LANES files go side by side.
+ */
 
-	close_read_stream( file_rs );
-      }
-      else result = -3;
-
-      close_write_stream( md5_ws );
-      if ( result == 0 ) {
-	if ( get_md5_result( md5_ctxt, h ) == 0 ) {
-	  if ( memcmp( h, hash, sizeof( uint8_t ) * HASH_LEN ) == 0 )
-	    result = 1;
-	  else result = 0;
-	}
-	else result = -5;
-      }
+int get_file_md5s( const char **filenames, uint8_t *hashes, int *results,
+		   int n ) {
+  int i, lanes;
+  read_stream *rs;
+
+  if ( filenames && hashes && results && n >= 0 ) {
+    /* MD5 only fills the first MD5_RESULT_LEN of each */
+    memset( hashes, 0, sizeof( *hashes ) * HASH_LEN * n );
+    lanes = md5_lanes();
+    if ( lanes > 1 && n > 1 ) {
+#ifdef MD5_X86_LANES
+      hash_files_in_lanes( filenames, hashes, results, n, lanes );
+#endif /* MD5_X86_LANES */
     }
-    else result = -2;
-    
-    close_md5( md5_ctxt );
-  }
-  else result = -1;
-
-  return result;
-}
-
-#define GET_BUF_LEN 1024
-
-int get_file_hash( const char *filename, uint8_t *hash ) {
-  int result;
-  md5_state *md5_ctxt;
-  read_stream *file_rs;
-  write_stream *md5_ws;
-  void *buf;
-  long len;
-
-  result = 0;
-  md5_ctxt = start_new_md5();
-  if ( md5_ctxt ) {
-    md5_ws = get_md5_ws( md5_ctxt );
-    if ( md5_ws ) {
-      file_rs = open_read_stream_none( filename );
-      if ( file_rs ) {
-	buf = malloc( MATCH_BUF_LEN );
-	if ( buf ) {
-	  while ( ( len = read_from_stream( file_rs, buf,
-					    MATCH_BUF_LEN ) ) > 0 ) {
-	    write_to_stream( md5_ws, buf, len );
-	  }
-	  free( buf );
+    else {
+      /* Not get_file_hash(); get_file_hashes() did the cache already */
+      for ( i = 0; i < n; ++i ) {
+	rs = open_read_stream_mmap( filenames[i] );
+	if ( rs ) {
+	  results[i] = get_stream_hash( HASH_MD5, rs,
+					hashes + i * HASH_LEN );
+	  close_read_stream( rs );
 	}
-	else result = -4;
-
-	close_read_stream( file_rs );
-      }
-      else result = -3;
-
-      close_write_stream( md5_ws );
-      if ( result == 0 ) {
-	if ( get_md5_result( md5_ctxt, hash ) != 0 ) result = -5;
+	else results[i] = -3;
       }
     }
-    else result = -2;
-    
-    close_md5( md5_ctxt );
+    return 0;
   }
-  else result = -1;
-
-  return result;
+  else return -1;
 }
 
 int get_md5_result( md5_state *md5, uint8_t *out ) {
@@ -193,6 +252,81 @@ write_stream * get_md5_ws( md5_state *md5 ) {
   return md5->ws;
 }
 
+#ifdef MD5_X86_LANES
+
+static void hash_files_in_lanes( const char **filenames, uint8_t *hashes,
+				 int *results, int n, int lanes ) {
+  md5_lane lane[MD5_MAX_LANES];
+  md5_state *states[MD5_MAX_LANES];
+  uint8_t *data[MD5_MAX_LANES];
+  md5_state idle;
+  long blocks;
+  int i, active, first, next;
+
+  for ( i = 0; i < lanes; ++i ) {
+    lane[i].index = -1;
+    lane[i].rs = NULL;
+    lane[i].md5 = NULL;
+    lane[i].buf = NULL;
+    lane[i].data = NULL;
+    lane[i].avail = 0;
+  }
+  /* Idle lanes hash whatever into this, and nobody looks */
+  memset( &idle, 0, sizeof( idle ) );
+  next = 0;
+
+  do {
+    active = 0;
+    first = -1;
+    blocks = 0;
+    for ( i = 0; i < lanes; ++i ) {
+      if ( md5_fill_lane( &(lane[i]), filenames, hashes, results, n,
+			  &next ) ) {
+	if ( active == 0 || lane[i].avail / MD5_BLOCK_LEN < blocks )
+	  blocks = lane[i].avail / MD5_BLOCK_LEN;
+	if ( first < 0 ) first = i;
+	++active;
+      }
+    }
+
+    if ( active > 1 ) {
+      for ( i = 0; i < lanes; ++i ) {
+	if ( lane[i].index >= 0 ) {
+	  states[i] = lane[i].md5;
+	  data[i] = lane[i].data;
+	}
+	else {
+	  states[i] = &idle;
+	  data[i] = lane[first].data;
+	}
+      }
+
+      if ( lanes == 8 ) md5_process_blocks_x8( states, data, blocks );
+      else md5_process_blocks_x4( states, data, blocks );
+
+      for ( i = 0; i < lanes; ++i ) {
+	if ( lane[i].index >= 0 ) {
+	  lane[i].data += blocks * MD5_BLOCK_LEN;
+	  lane[i].avail -= blocks * MD5_BLOCK_LEN;
+	  lane[i].md5->byte_count += blocks * MD5_BLOCK_LEN;
+	}
+      }
+    }
+    else if ( active == 1 ) {
+      /* The last file left; lanes won't help */
+      write_to_stream( get_md5_ws( lane[first].md5 ), lane[first].data,
+		       lane[first].avail );
+      lane[first].avail = 0;
+    }
+  } while ( active > 0 );
+
+  for ( i = 0; i < lanes; ++i ) {
+    if ( lane[i].buf ) free( lane[i].buf );
+  }
+}
+
+#endif /* MD5_X86_LANES */
+
 static void md5_close( void *v ) {
   md5_state *md5;
   uint64_t bits;
@@ -210,7 +344,7 @@ static void md5_close( void *v ) {
      */
 
     if ( md5->curr_block == MD5_BLOCK_LEN ) {
-      md5_process_block( md5, md5->block );
+      md5_process_blocks( md5, md5->block, 1 );
       md5->curr_block = 0;      
     }
     md5->block[md5->curr_block] = 0x80;
@@ -223,7 +357,7 @@ static void md5_close( void *v ) {
 
     while ( md5->curr_block != 56 ) {
       if ( md5->curr_block == MD5_BLOCK_LEN ) {
-	md5_process_block( md5, md5->block );
+	md5_process_blocks( md5, md5->block, 1 );
 	md5->curr_block = 0;      
       }
       md5->block[md5->curr_block] = 0;
@@ -245,106 +379,239 @@ static void md5_close( void *v ) {
     md5->block[62] = ( bits >> 48 ) & 0xff;
     md5->block[63] = ( bits >> 56 ) & 0xff;
 
-    md5_process_block( md5, md5->block );
+    md5_process_blocks( md5, md5->block, 1 );
     md5->state = MD5_DONE;
     md5->ws = NULL;
   }
 }
 
-static void md5_process_block( md5_state *md5, uint8_t *block ) {
-  uint32_t a, b, c, d;
-  uint8_t i;
-  uint32_t le_block[16];
-
-  for ( i = 0; i < 16; ++i ) {
-    le_block[i] = (uint32_t)(block[4 * i]);
-    le_block[i] |= (uint32_t)(block[4 * i + 1] << 8);
-    le_block[i] |= (uint32_t)(block[4 * i + 2] << 16);
-    le_block[i] |= (uint32_t)(block[4 * i + 3] << 24);
+#ifdef MD5_X86_LANES
+
+/*
+ * Get the lane ready for the next round: on a block boundary with at
+ * least one whole block to hash, starting on the next file or
+ * finishing the current one as needed.  Return 0 if we've run out of
+ * files for it.
+ */
+
+static int md5_fill_lane( md5_lane *lane, const char **filenames,
+			  uint8_t *hashes, int *results, int n, int *next ) {
+  void *data;
+  long len, buf_len;
+  int i;
+
+  while ( 1 ) {
+    if ( lane->index < 0 ) {
+      /* Start on the next file, if any */
+      if ( *next >= n ) return 0;
+      i = (*next)++;
+      lane->rs = open_read_stream_mmap( filenames[i] );
+      if ( lane->rs ) {
+	lane->md5 = start_new_md5();
+	if ( lane->md5 ) {
+	  lane->index = i;
+	  lane->avail = 0;
+	}
+	else {
+	  results[i] = -1;
+	  close_read_stream( lane->rs );
+	  lane->rs = NULL;
+	}
+      }
+      else results[i] = -3;
+    }
+    else if ( lane->avail == 0 ) {
+      buf_len = get_io_buffer_size();
+      if ( !can_peek_stream( lane->rs ) && !(lane->buf) )
+	lane->buf = malloc( buf_len );
+      if ( can_peek_stream( lane->rs ) || lane->buf )
+	len = borrow_from_stream( lane->rs, &data, lane->buf, buf_len );
+      else len = -4;
+
+      if ( len > 0 ) {
+	lane->data = (uint8_t *)data;
+	lane->avail = len;
+      }
+      else {
+	/* That's the end of this file, one way or another */
+	i = lane->index;
+	close_write_stream( get_md5_ws( lane->md5 ) );
+	if ( len == -4 ) results[i] = -4;
+	else if ( len < 0 ) results[i] = -6;
+	else if ( get_md5_result( lane->md5,
+				  hashes + i * HASH_LEN ) != 0 )
+	  results[i] = -5;
+	else results[i] = 0;
+	close_md5( lane->md5 );
+	lane->md5 = NULL;
+	close_read_stream( lane->rs );
+	lane->rs = NULL;
+	lane->index = -1;
+      }
+    }
+    else if ( lane->md5->curr_block != 0 || lane->avail < MD5_BLOCK_LEN ) {
+      /* Feed the odd bytes in the usual way until we line up again */
+      len = MD5_BLOCK_LEN - lane->md5->curr_block;
+      if ( len > lane->avail ) len = lane->avail;
+      write_to_stream( get_md5_ws( lane->md5 ), lane->data, len );
+      lane->data += len;
+      lane->avail -= len;
+    }
+    else return 1;
   }
+}
+
+#endif /* MD5_X86_LANES */
+
+/* How many files get_file_md5s() can hash side by side on this CPU */
+
+static int md5_lanes( void ) {
+  int result;
+
+  result = 1;
+#ifdef MD5_X86_LANES
+  if ( __builtin_cpu_supports( "avx2" ) ) result = 8;
+  else if ( __builtin_cpu_supports( "sse2" ) ) result = 4;
+#endif /* MD5_X86_LANES */
+
+  return result;
+}
+
+/*
+ * Run count whole blocks straight from data through md5, keeping the
+ * state in locals in between.
+ */
+
+static void md5_process_blocks( md5_state *md5, uint8_t *data, long count ) {
+  uint32_t a, b, c, d;
+  uint32_t x[16];
+  int i;
 
   a = md5->h[0];
   b = md5->h[1];
   c = md5->h[2];
   d = md5->h[3];
 
-  MD5_STEP( MD5_F, a, b, c, d, le_block[0],  s[0],  t[0]  );
-  MD5_STEP( MD5_F, d, a, b, c, le_block[1],  s[1],  t[1]  );
-  MD5_STEP( MD5_F, c, d, a, b, le_block[2],  s[2],  t[2]  );
-  MD5_STEP( MD5_F, b, c, d, a, le_block[3],  s[3],  t[3]  );
-  MD5_STEP( MD5_F, a, b, c, d, le_block[4],  s[4],  t[4]  );
-  MD5_STEP( MD5_F, d, a, b, c, le_block[5],  s[5],  t[5]  );
-  MD5_STEP( MD5_F, c, d, a, b, le_block[6],  s[6],  t[6]  );
-  MD5_STEP( MD5_F, b, c, d, a, le_block[7],  s[7],  t[7]  );
-  MD5_STEP( MD5_F, a, b, c, d, le_block[8],  s[8],  t[8]  );
-  MD5_STEP( MD5_F, d, a, b, c, le_block[9],  s[9],  t[9]  );
-  MD5_STEP( MD5_F, c, d, a, b, le_block[10], s[10], t[10] );
-  MD5_STEP( MD5_F, b, c, d, a, le_block[11], s[11], t[11] );
-  MD5_STEP( MD5_F, a, b, c, d, le_block[12], s[12], t[12] );
-  MD5_STEP( MD5_F, d, a, b, c, le_block[13], s[13], t[13] );
-  MD5_STEP( MD5_F, c, d, a, b, le_block[14], s[14], t[14] );
-  MD5_STEP( MD5_F, b, c, d, a, le_block[15], s[15], t[15] );
-
-  MD5_STEP( MD5_G, a, b, c, d, le_block[1],  s[16], t[16] );
-  MD5_STEP( MD5_G, d, a, b, c, le_block[6],  s[17], t[17] );
-  MD5_STEP( MD5_G, c, d, a, b, le_block[11], s[18], t[18] );
-  MD5_STEP( MD5_G, b, c, d, a, le_block[0],  s[19], t[19] );
-  MD5_STEP( MD5_G, a, b, c, d, le_block[5],  s[20], t[20] );
-  MD5_STEP( MD5_G, d, a, b, c, le_block[10], s[21], t[21] );
-  MD5_STEP( MD5_G, c, d, a, b, le_block[15], s[22], t[22] );
-  MD5_STEP( MD5_G, b, c, d, a, le_block[4],  s[23], t[23] );
-  MD5_STEP( MD5_G, a, b, c, d, le_block[9],  s[24], t[24] );
-  MD5_STEP( MD5_G, d, a, b, c, le_block[14], s[25], t[25] );
-  MD5_STEP( MD5_G, c, d, a, b, le_block[3],  s[26], t[26] );
-  MD5_STEP( MD5_G, b, c, d, a, le_block[8],  s[27], t[27] );
-  MD5_STEP( MD5_G, a, b, c, d, le_block[13], s[28], t[28] );
-  MD5_STEP( MD5_G, d, a, b, c, le_block[2],  s[29], t[29] );
-  MD5_STEP( MD5_G, c, d, a, b, le_block[7],  s[30], t[30] );
-  MD5_STEP( MD5_G, b, c, d, a, le_block[12], s[31], t[31] );
-
-  MD5_STEP( MD5_H, a, b, c, d, le_block[5],  s[32], t[32] );
-  MD5_STEP( MD5_H, d, a, b, c, le_block[8],  s[33], t[33] );
-  MD5_STEP( MD5_H, c, d, a, b, le_block[11], s[34], t[34] );
-  MD5_STEP( MD5_H, b, c, d, a, le_block[14], s[35], t[35] );
-  MD5_STEP( MD5_H, a, b, c, d, le_block[1],  s[36], t[36] );
-  MD5_STEP( MD5_H, d, a, b, c, le_block[4],  s[37], t[37] );
-  MD5_STEP( MD5_H, c, d, a, b, le_block[7],  s[38], t[38] );
-  MD5_STEP( MD5_H, b, c, d, a, le_block[10], s[39], t[39] );
-  MD5_STEP( MD5_H, a, b, c, d, le_block[13], s[40], t[40] );
-  MD5_STEP( MD5_H, d, a, b, c, le_block[0],  s[41], t[41] );
-  MD5_STEP( MD5_H, c, d, a, b, le_block[3],  s[42], t[42] );
-  MD5_STEP( MD5_H, b, c, d, a, le_block[6],  s[43], t[43] );
-  MD5_STEP( MD5_H, a, b, c, d, le_block[9],  s[44], t[44] );
-  MD5_STEP( MD5_H, d, a, b, c, le_block[12], s[45], t[45] );
-  MD5_STEP( MD5_H, c, d, a, b, le_block[15], s[46], t[46] );
-  MD5_STEP( MD5_H, b, c, d, a, le_block[2],  s[47], t[47] );
-
-  MD5_STEP( MD5_I, a, b, c, d, le_block[0],  s[48], t[48] );
-  MD5_STEP( MD5_I, d, a, b, c, le_block[7],  s[49], t[49] );
-  MD5_STEP( MD5_I, c, d, a, b, le_block[14], s[50], t[50] );
-  MD5_STEP( MD5_I, b, c, d, a, le_block[5],  s[51], t[51] );
-  MD5_STEP( MD5_I, a, b, c, d, le_block[12], s[52], t[52] );
-  MD5_STEP( MD5_I, d, a, b, c, le_block[3],  s[53], t[53] );
-  MD5_STEP( MD5_I, c, d, a, b, le_block[10], s[54], t[54] );
-  MD5_STEP( MD5_I, b, c, d, a, le_block[1],  s[55], t[55] );
-  MD5_STEP( MD5_I, a, b, c, d, le_block[8],  s[56], t[56] );
-  MD5_STEP( MD5_I, d, a, b, c, le_block[15], s[57], t[57] );
-  MD5_STEP( MD5_I, c, d, a, b, le_block[6],  s[58], t[58] );
-  MD5_STEP( MD5_I, b, c, d, a, le_block[13], s[59], t[59] );
-  MD5_STEP( MD5_I, a, b, c, d, le_block[4],  s[60], t[60] );
-  MD5_STEP( MD5_I, d, a, b, c, le_block[11], s[61], t[61] );
-  MD5_STEP( MD5_I, c, d, a, b, le_block[2],  s[62], t[62] );
-  MD5_STEP( MD5_I, b, c, d, a, le_block[9],  s[63], t[63] );
-
-  md5->h[0] += a;
-  md5->h[1] += b;
-  md5->h[2] += c;
-  md5->h[3] += d;
+  while ( count > 0 ) {
+    for ( i = 0; i < 16; ++i ) x[i] = MD5_LE32( data + 4 * i );
+
+    MD5_ROUNDS( a, b, c, d, x );
+
+    a += md5->h[0];
+    b += md5->h[1];
+    c += md5->h[2];
+    d += md5->h[3];
+    md5->h[0] = a;
+    md5->h[1] = b;
+    md5->h[2] = c;
+    md5->h[3] = d;
+
+    data += MD5_BLOCK_LEN;
+    --count;
+  }
+}
+
+#ifdef MD5_X86_LANES
+
+/*
+ * md5_process_blocks() for four or eight independent states at once,
+ * one per vector lane; each data[i] must have count blocks in it.
+ */
+
+__attribute__(( target( "sse2" ) ))
+static void md5_process_blocks_x4( md5_state **md5, uint8_t **data,
+				   long count ) {
+  md5_v4 a, b, c, d, a0, b0, c0, d0;
+  md5_v4 x[16];
+  long off;
+  int i, j;
+
+  for ( i = 0; i < 4; ++i ) {
+    a[i] = md5[i]->h[0];
+    b[i] = md5[i]->h[1];
+    c[i] = md5[i]->h[2];
+    d[i] = md5[i]->h[3];
+  }
+
+  for ( off = 0; off < count * MD5_BLOCK_LEN; off += MD5_BLOCK_LEN ) {
+    /* Build whole vectors, rather than storing into them lane by lane */
+    for ( j = 0; j < 16; ++j ) {
+      x[j] = (md5_v4){ MD5_LE32( data[0] + off + 4 * j ),
+		       MD5_LE32( data[1] + off + 4 * j ),
+		       MD5_LE32( data[2] + off + 4 * j ),
+		       MD5_LE32( data[3] + off + 4 * j ) };
+    }
+
+    a0 = a;
+    b0 = b;
+    c0 = c;
+    d0 = d;
+    MD5_ROUNDS( a, b, c, d, x );
+    a += a0;
+    b += b0;
+    c += c0;
+    d += d0;
+  }
+
+  for ( i = 0; i < 4; ++i ) {
+    md5[i]->h[0] = a[i];
+    md5[i]->h[1] = b[i];
+    md5[i]->h[2] = c[i];
+    md5[i]->h[3] = d[i];
+  }
 }
 
+__attribute__(( target( "avx2" ) ))
+static void md5_process_blocks_x8( md5_state **md5, uint8_t **data,
+				   long count ) {
+  md5_v8 a, b, c, d, a0, b0, c0, d0;
+  md5_v8 x[16];
+  long off;
+  int i, j;
+
+  for ( i = 0; i < 8; ++i ) {
+    a[i] = md5[i]->h[0];
+    b[i] = md5[i]->h[1];
+    c[i] = md5[i]->h[2];
+    d[i] = md5[i]->h[3];
+  }
+
+  for ( off = 0; off < count * MD5_BLOCK_LEN; off += MD5_BLOCK_LEN ) {
+    for ( j = 0; j < 16; ++j ) {
+      x[j] = (md5_v8){ MD5_LE32( data[0] + off + 4 * j ),
+		       MD5_LE32( data[1] + off + 4 * j ),
+		       MD5_LE32( data[2] + off + 4 * j ),
+		       MD5_LE32( data[3] + off + 4 * j ),
+		       MD5_LE32( data[4] + off + 4 * j ),
+		       MD5_LE32( data[5] + off + 4 * j ),
+		       MD5_LE32( data[6] + off + 4 * j ),
+		       MD5_LE32( data[7] + off + 4 * j ) };
+    }
+
+    a0 = a;
+    b0 = b;
+    c0 = c;
+    d0 = d;
+    MD5_ROUNDS( a, b, c, d, x );
+    a += a0;
+    b += b0;
+    c += c0;
+    d += d0;
+  }
+
+  for ( i = 0; i < 8; ++i ) {
+    md5[i]->h[0] = a[i];
+    md5[i]->h[1] = b[i];
+    md5[i]->h[2] = c[i];
+    md5[i]->h[3] = d[i];
+  }
+}
+
+#endif /* MD5_X86_LANES */
+
 static long md5_write( void *v, void *buf, long len ) {
   md5_state *md5;
-  long count;
+  long count, n;
   uint8_t *b;
 
   if ( v && buf ) {
@@ -352,14 +619,25 @@ static long md5_write( void *v, void *buf, long len ) {
     b = (uint8_t *)buf;
     count = 0;
     while ( count < len ) {
-      if ( md5->curr_block == MD5_BLOCK_LEN ) {
-	md5_process_block( md5, md5->block );
-	md5->curr_block = 0;
-	md5->byte_count += MD5_BLOCK_LEN;
+      if ( md5->curr_block == 0 && len - count >= MD5_BLOCK_LEN ) {
+	/* Whole blocks go straight from the caller's buffer */
+	n = ( len - count ) / MD5_BLOCK_LEN;
+	md5_process_blocks( md5, b + count, n );
+	md5->byte_count += n * MD5_BLOCK_LEN;
+	count += n * MD5_BLOCK_LEN;
+      }
+      else {
+	n = MD5_BLOCK_LEN - md5->curr_block;
+	if ( n > len - count ) n = len - count;
+	memcpy( md5->block + md5->curr_block, b + count, n );
+	md5->curr_block += n;
+	count += n;
+	if ( md5->curr_block == MD5_BLOCK_LEN ) {
+	  md5_process_blocks( md5, md5->block, 1 );
+	  md5->curr_block = 0;
+	  md5->byte_count += MD5_BLOCK_LEN;
+	}
       }
-      md5->block[md5->curr_block] = b[count];
-      ++count;
-      ++(md5->curr_block);
     }
     return len;
   }
@@ -0,0 +1,96 @@
+#include <pkg.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#define OWNERS_SUCCESS (0)
+#define OWNERS_ERROR (-1)
+
+static int owners( pkg_db *, const char * );
+
+void owners_help( void ) {
+  printf( "List what the package DB holds under directories.  Usage:\n" );
+  printf( "\n" );
+  printf( "mpkg [global options] owners <dir 1> <dir 2> ...\n" );
+  printf( "\n" );
+  printf( "For each directory, the owners command emits the directory " );
+  printf( "itself and every\nlocation beneath it which some package " );
+  printf( "owns, one to a line, in the same\nformat as dumpdb:\n" );
+  printf( "\n" );
+  printf( "<location> <package name>\n" );
+}
+
+void owners_main( int argc, char **argv ) {
+  pkg_db *db;
+  int i;
+
+  if ( argc > 0 ) {
+    db = open_pkg_db_with_mode( DBMODE_RO );
+    if ( db ) {
+      for ( i = 0; i < argc; ++i ) owners( db, argv[i] );
+      close_pkg_db( db );
+    }
+    else fprintf( stderr, "Unable to open package database\n" );
+  }
+  else {
+    fprintf( stderr, "At least one directory is required for the " );
+    fprintf( stderr, "owners command\n" );
+  }
+}
+
+/*
+ * The locations are in order, so everything under dir is one run of
+ * them starting with dir and a slash; the prefix enumeration finds the
+ * start of it and stops at the end.
+ */
+
+static int owners( pkg_db *db, const char *dir ) {
+  char *adjusted, *prefix, *key, *value;
+  const char *pkg;
+  void *n;
+  int status, result, len;
+
+  status = OWNERS_SUCCESS;
+  adjusted = adjust_path_against_root( dir );
+  if ( adjusted ) {
+    len = strlen( adjusted );
+    prefix = malloc( len + 2 );
+    if ( prefix ) {
+      strcpy( prefix, adjusted );
+      /* The root already ends in a slash */
+      if ( len == 0 || adjusted[len - 1] != '/' ) {
+	pkg = peek_pkg_db( db, adjusted );
+	if ( pkg ) printf( "%s %s\n", adjusted, pkg );
+	strcat( prefix, "/" );
+      }
+
+      n = NULL;
+      do {
+	result = enumerate_pkg_db_prefix( db, prefix, n, &key, &value, &n );
+	if ( result == 0 && n ) {
+	  printf( "%s %s\n", key, value );
+	  free( key );
+	  free( value );
+	}
+      } while ( result == 0 && n );
+      if ( result != 0 ) {
+	fprintf( stderr, "Unable to enumerate database under %s\n",
+		 adjusted );
+	status = OWNERS_ERROR;
+      }
+
+      free( prefix );
+    }
+    else {
+      fprintf( stderr, "Unable to allocate memory\n" );
+      status = OWNERS_ERROR;
+    }
+    free( adjusted );
+  }
+  else {
+    fprintf( stderr, "%s is not under the install root\n", dir );
+    status = OWNERS_ERROR;
+  }
+
+  return status;
+}
@@ -0,0 +1,664 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pkg.h>
+
+/*
+ * A trie of locations by path component, with the same interface as
+ * rbtree.c for string keys and values.  Locations share long runs of
+ * leading directories, and those are stored once here as interior
+ * nodes; each component name is interned, so the many copies of names
+ * like "man1" or "LC_MESSAGES" are stored once as well.  Values are
+ * package names, and the same few hundred of those own everything, so
+ * a node only holds a number for one.
+ *
+ * A key is split at every '/', so "/usr/bin" is "", "usr" and "bin".
+ * Children are sorted by name, so enumeration goes in the order of
+ * pathtrie_compare(), which is strcmp() with '/' sorting before every
+ * other character.  The two only differ where a name is a prefix of
+ * its sibling's and the next character is below '/', as "foo" and
+ * "foo-2" are: here everything under "foo/" comes before "foo-2".
+ * Everything with a given prefix still comes out in one run.
+ *
+ * Interned names and package names are only freed with the whole
+ * tree; deletes are rare next to how many entries there are.  Values
+ * handed back are the interned copies, good until the tree is freed.
+ * The key pathtrie_enum() hands back is only good until the next call
+ * to it.
+ */
+
+#define PATHTRIE_BLOCK_NODES 1024
+#define PATHTRIE_CHARS_BLOCK 65536
+#define PATHTRIE_INITIAL_SLOTS 256
+
+struct pathtrie_block_struct {
+  struct pathtrie_block_struct *next;
+  unsigned int used;
+  pathtrie_node nodes[PATHTRIE_BLOCK_NODES];
+};
+
+struct pathtrie_chars_struct {
+  struct pathtrie_chars_struct *next;
+  size_t used, size;
+  char data[1];
+};
+
+#define PATHTRIE_NAME( t, n ) ( (t)->names.strs[(n)->name] )
+#define PATHTRIE_PKG( t, n ) ( (t)->pkgs.strs[(n)->pkg - 1] )
+
+static pathtrie_node * pathtrie_add_child( pathtrie *, pathtrie_node *,
+					   unsigned int, const char *,
+					   size_t );
+static unsigned int pathtrie_child_search( pathtrie *, pathtrie_node *,
+					   const char *, size_t, int * );
+static pathtrie_node * pathtrie_find( pathtrie *, char * );
+static pathtrie_node * pathtrie_first( pathtrie *, pathtrie_node * );
+static void pathtrie_free_node( pathtrie *, pathtrie_node * );
+static unsigned int pathtrie_hash( const char *, size_t );
+static int pathtrie_insert_key( pathtrie *, char *, char *, int );
+static int pathtrie_intern( pathtrie_strings *, const char *, size_t,
+			    unsigned int * );
+static char * pathtrie_make_key( pathtrie *, pathtrie_node * );
+static int pathtrie_name_cmp( const char *, const char *, size_t );
+static pathtrie_node * pathtrie_new_node( pathtrie * );
+static pathtrie_node * pathtrie_next_after( pathtrie *, pathtrie_node * );
+static unsigned int pathtrie_position( pathtrie *, pathtrie_node * );
+static void pathtrie_prune( pathtrie *, pathtrie_node * );
+static void pathtrie_strings_free( pathtrie_strings * );
+static int pathtrie_validate_node( pathtrie *, pathtrie_node *,
+				   unsigned long * );
+
+/*
+ * Add a child named by the len chars at c to n, at position pos in its
+ * children.
+ */
+
+static pathtrie_node * pathtrie_add_child( pathtrie *t, pathtrie_node *n,
+					   unsigned int pos, const char *c,
+					   size_t len ) {
+  pathtrie_node *child, **temp;
+  unsigned int name, new_alloced;
+
+  if ( pathtrie_intern( &(t->names), c, len, &name ) != 0 ) return NULL;
+
+  if ( n->count == n->alloced ) {
+    new_alloced = ( n->alloced > 0 ) ? 2 * n->alloced : 1;
+    temp = realloc( n->children, sizeof( *temp ) * new_alloced );
+    if ( !temp ) return NULL;
+    n->children = temp;
+    n->alloced = new_alloced;
+  }
+
+  child = pathtrie_new_node( t );
+  if ( child ) {
+    child->name = name;
+    child->up = n;
+    memmove( n->children + pos + 1, n->children + pos,
+	     sizeof( *(n->children) ) * ( n->count - pos ) );
+    n->children[pos] = child;
+    ++(n->count);
+  }
+
+  return child;
+}
+
+pathtrie * pathtrie_alloc( void ) {
+  pathtrie *t;
+
+  t = malloc( sizeof( *t ) );
+  if ( t ) {
+    memset( t, 0, sizeof( *t ) );
+    t->root = pathtrie_new_node( t );
+    if ( !(t->root) ) {
+      free( t );
+      t = NULL;
+    }
+  }
+
+  return t;
+}
+
+/*
+ * Load n keys and values into t, for the same callers as
+ * rbtree_build_from_sorted().  A trie doesn't care about the order, but
+ * sorted keys always add children at the end, which is the first place
+ * pathtrie_child_search() looks.
+ */
+
+int pathtrie_build_from_sorted( pathtrie *t, void **keys, void **vals,
+				unsigned long n, unsigned long *bad ) {
+  unsigned long i;
+  int result;
+
+  if ( !t || ( n > 0 && !( keys && vals ) ) ) return PATHTRIE_ERROR;
+
+  for ( i = 0; i < n; ++i ) {
+    result = pathtrie_insert_key( t, keys[i], vals[i], 0 );
+    if ( result != PATHTRIE_SUCCESS ) {
+      if ( bad ) *bad = i;
+      return result;
+    }
+  }
+
+  return PATHTRIE_SUCCESS;
+}
+
+/*
+ * The position of the first child of n not less than the len chars at
+ * c, and whether it's equal.  The last child is tried first.
+ */
+
+static unsigned int pathtrie_child_search( pathtrie *t, pathtrie_node *n,
+					   const char *c, size_t len,
+					   int *found ) {
+  unsigned int lo, hi, mid;
+  int cmp;
+
+  *found = 0;
+  if ( n->count == 0 ) return 0;
+
+  cmp = pathtrie_name_cmp( PATHTRIE_NAME( t, n->children[n->count - 1] ),
+			   c, len );
+  if ( cmp < 0 ) return n->count;
+  else if ( cmp == 0 ) {
+    *found = 1;
+    return n->count - 1;
+  }
+
+  lo = 0;
+  hi = n->count - 1;
+  while ( lo < hi ) {
+    mid = lo + ( hi - lo ) / 2;
+    cmp = pathtrie_name_cmp( PATHTRIE_NAME( t, n->children[mid] ), c, len );
+    if ( cmp < 0 ) lo = mid + 1;
+    else if ( cmp > 0 ) hi = mid;
+    else {
+      *found = 1;
+      return mid;
+    }
+  }
+
+  return lo;
+}
+
+/* Like strcmp(), but '/' sorts before every other character */
+
+int pathtrie_compare( void *a_v, void *b_v ) {
+  const unsigned char *a, *b;
+  int ra, rb;
+
+  a = (const unsigned char *)a_v;
+  b = (const unsigned char *)b_v;
+  while ( *a == *b ) {
+    if ( *a == '\0' ) return 0;
+    ++a;
+    ++b;
+  }
+  ra = ( *a == '/' ) ? 1 : ( ( *a == '\0' ) ? 0 : *a + 1 );
+  rb = ( *b == '/' ) ? 1 : ( ( *b == '\0' ) ? 0 : *b + 1 );
+
+  return ( ra < rb ) ? -1 : 1;
+}
+
+int pathtrie_delete( pathtrie *t, void *key, void **vout ) {
+  pathtrie_node *n;
+  char *v;
+
+  if ( !( t && key ) ) return PATHTRIE_ERROR;
+  n = pathtrie_find( t, key );
+  if ( !( n && n->pkg ) ) return PATHTRIE_NOT_FOUND;
+
+  if ( vout ) {
+    /* Hand back a copy, as rbtree_delete() does with copiers */
+    v = copy_string( PATHTRIE_PKG( t, n ) );
+    if ( v ) *vout = v;
+    else return PATHTRIE_ERROR;
+  }
+  n->pkg = 0;
+  --(t->count);
+  pathtrie_prune( t, n );
+
+  return PATHTRIE_SUCCESS;
+}
+
+void * pathtrie_enum( pathtrie *t, pathtrie_node *in,
+		      void **val_out, pathtrie_node **out ) {
+  pathtrie_node *n;
+
+  n = NULL;
+  if ( t ) {
+    if ( !in ) n = t->root;
+    else if ( in->count > 0 ) n = in->children[0];
+    else n = pathtrie_next_after( t, in );
+    n = pathtrie_first( t, n );
+  }
+
+  if ( out ) *out = n;
+  if ( n ) {
+    if ( val_out ) *val_out = PATHTRIE_PKG( t, n );
+    return pathtrie_make_key( t, n );
+  }
+  else {
+    if ( val_out ) *val_out = NULL;
+    return NULL;
+  }
+}
+
+/* Start enumerating at the first key not less than key */
+
+void * pathtrie_enum_from( pathtrie *t, void *key_v,
+			   void **val_out, pathtrie_node **out ) {
+  pathtrie_node *n, *start;
+  char *c, *end;
+  unsigned int pos;
+  int found;
+
+  start = NULL;
+  if ( t && key_v ) {
+    n = t->root;
+    c = (char *)key_v;
+    do {
+      end = strchr( c, '/' );
+      if ( !end ) end = c + strlen( c );
+      pos = pathtrie_child_search( t, n, c, end - c, &found );
+      if ( found && *end == '/' ) {
+	n = n->children[pos];
+	c = end + 1;
+      }
+      else {
+	/*
+	 * An equal child is where key itself would be; anything past
+	 * pos comes after all of key's subtree, and past the end of n
+	 * means past all of n's.
+	 */
+	if ( pos < n->count ) start = n->children[pos];
+	else if ( n != t->root ) start = pathtrie_next_after( t, n );
+	break;
+      }
+    } while ( 1 );
+    start = pathtrie_first( t, start );
+  }
+
+  if ( out ) *out = start;
+  if ( start ) {
+    if ( val_out ) *val_out = PATHTRIE_PKG( t, start );
+    return pathtrie_make_key( t, start );
+  }
+  else {
+    if ( val_out ) *val_out = NULL;
+    return NULL;
+  }
+}
+
+static pathtrie_node * pathtrie_find( pathtrie *t, char *key ) {
+  pathtrie_node *n;
+  char *end;
+  unsigned int pos;
+  int found;
+
+  n = t->root;
+  do {
+    end = strchr( key, '/' );
+    if ( !end ) end = key + strlen( key );
+    pos = pathtrie_child_search( t, n, key, end - key, &found );
+    if ( !found ) return NULL;
+    n = n->children[pos];
+    key = end + 1;
+  } while ( *end == '/' );
+
+  return n;
+}
+
+/* The first node holding a location at or after n, in order */
+
+static pathtrie_node * pathtrie_first( pathtrie *t, pathtrie_node *n ) {
+  while ( n && !(n->pkg) ) {
+    if ( n->count > 0 ) n = n->children[0];
+    else n = pathtrie_next_after( t, n );
+  }
+
+  return n;
+}
+
+void pathtrie_free( pathtrie *t ) {
+  struct pathtrie_block_struct *b, *next;
+  unsigned int i;
+
+  if ( t ) {
+    for ( b = t->blocks; b; b = next ) {
+      next = b->next;
+      for ( i = 0; i < b->used; ++i ) {
+	if ( b->nodes[i].children ) free( b->nodes[i].children );
+      }
+      free( b );
+    }
+    pathtrie_strings_free( &(t->names) );
+    pathtrie_strings_free( &(t->pkgs) );
+    if ( t->key ) free( t->key );
+    free( t );
+  }
+}
+
+static void pathtrie_free_node( pathtrie *t, pathtrie_node *n ) {
+  if ( n->children ) free( n->children );
+  n->children = NULL;
+  n->up = t->free_nodes;
+  t->free_nodes = n;
+}
+
+/* FNV-1a */
+
+static unsigned int pathtrie_hash( const char *c, size_t len ) {
+  unsigned int h;
+  size_t i;
+
+  h = 2166136261U;
+  for ( i = 0; i < len; ++i ) {
+    h ^= (unsigned char)(c[i]);
+    h *= 16777619U;
+  }
+
+  return h;
+}
+
+int pathtrie_insert_no_overwrite( pathtrie *t, void *key, void *val ) {
+  return pathtrie_insert_key( t, key, val, 0 );
+}
+
+int pathtrie_insert( pathtrie *t, void *key, void *val ) {
+  return pathtrie_insert_key( t, key, val, 1 );
+}
+
+static int pathtrie_insert_key( pathtrie *t, char *key, char *val,
+				int overwrite ) {
+  pathtrie_node *n, *child;
+  char *end, *temp;
+  unsigned long len;
+  unsigned int pkg, pos;
+  int found;
+
+  if ( !( t && key && val ) ) return PATHTRIE_ERROR;
+
+  /* Make sure pathtrie_enum() will have room for this one */
+  len = strlen( key ) + 1;
+  if ( len > t->key_alloced ) {
+    temp = realloc( t->key, len );
+    if ( !temp ) return PATHTRIE_ERROR;
+    t->key = temp;
+    t->key_alloced = len;
+  }
+
+  if ( t->last_pkg > 0 && strcmp( t->pkgs.strs[t->last_pkg - 1], val ) == 0 )
+    pkg = t->last_pkg - 1;
+  else {
+    if ( pathtrie_intern( &(t->pkgs), val, strlen( val ), &pkg ) != 0 )
+      return PATHTRIE_ERROR;
+    t->last_pkg = pkg + 1;
+  }
+
+  n = t->root;
+  do {
+    end = strchr( key, '/' );
+    if ( !end ) end = key + strlen( key );
+    pos = pathtrie_child_search( t, n, key, end - key, &found );
+    if ( found ) n = n->children[pos];
+    else {
+      child = pathtrie_add_child( t, n, pos, key, end - key );
+      if ( !child ) {
+	/* Don't leave any part of the path we made behind */
+	pathtrie_prune( t, n );
+	return PATHTRIE_ERROR;
+      }
+      n = child;
+    }
+    key = end + 1;
+  } while ( *end == '/' );
+
+  if ( n->pkg ) {
+    if ( !overwrite ) return PATHTRIE_NO_OVERWRITE;
+  }
+  else ++(t->count);
+  n->pkg = pkg + 1;
+
+  return PATHTRIE_SUCCESS;
+}
+
+/* Find or add the len chars at c in s, and give its number */
+
+static int pathtrie_intern( pathtrie_strings *s, const char *c, size_t len,
+			    unsigned int *num_out ) {
+  struct pathtrie_chars_struct *b;
+  unsigned int h, i, j, mask, nslots, *slots;
+  char **temp, *str;
+  size_t size;
+
+  if ( 3 * ( s->count + 1 ) > 2 * s->nslots ) {
+    nslots = ( s->nslots > 0 ) ? 2 * s->nslots : PATHTRIE_INITIAL_SLOTS;
+    slots = malloc( sizeof( *slots ) * nslots );
+    if ( !slots ) return -1;
+    memset( slots, 0, sizeof( *slots ) * nslots );
+    mask = nslots - 1;
+    for ( j = 0; j < s->count; ++j ) {
+      str = s->strs[j];
+      for ( i = pathtrie_hash( str, strlen( str ) ) & mask; slots[i];
+	    i = ( i + 1 ) & mask );
+      slots[i] = j + 1;
+    }
+    if ( s->slots ) free( s->slots );
+    s->slots = slots;
+    s->nslots = nslots;
+  }
+
+  mask = s->nslots - 1;
+  h = pathtrie_hash( c, len );
+  for ( i = h & mask; s->slots[i]; i = ( i + 1 ) & mask ) {
+    if ( pathtrie_name_cmp( s->strs[s->slots[i] - 1], c, len ) == 0 ) {
+      *num_out = s->slots[i] - 1;
+      return 0;
+    }
+  }
+
+  if ( s->count == s->alloced ) {
+    j = ( s->alloced > 0 ) ? 2 * s->alloced : PATHTRIE_INITIAL_SLOTS;
+    temp = realloc( s->strs, sizeof( *temp ) * j );
+    if ( !temp ) return -1;
+    s->strs = temp;
+    s->alloced = j;
+  }
+
+  b = s->chars;
+  if ( !b || b->used + len + 1 > b->size ) {
+    size = ( len + 1 > PATHTRIE_CHARS_BLOCK ) ?
+      len + 1 : PATHTRIE_CHARS_BLOCK;
+    b = malloc( offsetof( struct pathtrie_chars_struct, data ) + size );
+    if ( !b ) return -1;
+    b->used = 0;
+    b->size = size;
+    b->next = s->chars;
+    s->chars = b;
+  }
+  str = b->data + b->used;
+  memcpy( str, c, len );
+  str[len] = '\0';
+  b->used += len + 1;
+
+  s->strs[s->count] = str;
+  s->slots[i] = s->count + 1;
+  *num_out = s->count;
+  ++(s->count);
+
+  return 0;
+}
+
+/* Put n's location together in t->key */
+
+static char * pathtrie_make_key( pathtrie *t, pathtrie_node *n ) {
+  pathtrie_node *m;
+  unsigned long len, l;
+
+  len = 0;
+  for ( m = n; m != t->root; m = m->up )
+    len += strlen( PATHTRIE_NAME( t, m ) ) + 1;
+
+  /* That counted a '/' after each, and the last one is the NUL */
+  t->key[--len] = '\0';
+  for ( m = n; m != t->root; m = m->up ) {
+    l = strlen( PATHTRIE_NAME( t, m ) );
+    len -= l;
+    memcpy( t->key + len, PATHTRIE_NAME( t, m ), l );
+    if ( m->up != t->root ) t->key[--len] = '/';
+  }
+
+  return t->key;
+}
+
+/* Compare name with the len chars at c, as strcmp() would */
+
+static int pathtrie_name_cmp( const char *name, const char *c,
+			      size_t len ) {
+  int result;
+
+  result = strncmp( name, c, len );
+  if ( result == 0 && name[len] != '\0' ) result = 1;
+
+  return result;
+}
+
+static pathtrie_node * pathtrie_new_node( pathtrie *t ) {
+  struct pathtrie_block_struct *b;
+  pathtrie_node *n;
+
+  if ( t->free_nodes ) {
+    n = t->free_nodes;
+    t->free_nodes = n->up;
+  }
+  else {
+    b = t->blocks;
+    if ( !b || b->used == PATHTRIE_BLOCK_NODES ) {
+      b = malloc( sizeof( *b ) );
+      if ( !b ) return NULL;
+      b->used = 0;
+      b->next = t->blocks;
+      t->blocks = b;
+    }
+    n = &(b->nodes[(b->used)++]);
+  }
+  memset( n, 0, sizeof( *n ) );
+
+  return n;
+}
+
+/* The node after everything under n, in order */
+
+static pathtrie_node * pathtrie_next_after( pathtrie *t, pathtrie_node *n ) {
+  unsigned int pos;
+
+  while ( n->up ) {
+    pos = pathtrie_position( t, n );
+    if ( pos + 1 < n->up->count ) return n->up->children[pos + 1];
+    n = n->up;
+  }
+
+  return NULL;
+}
+
+/* Where n is among its parent's children */
+
+static unsigned int pathtrie_position( pathtrie *t, pathtrie_node *n ) {
+  const char *name;
+  int found;
+
+  name = PATHTRIE_NAME( t, n );
+  return pathtrie_child_search( t, n->up, name, strlen( name ), &found );
+}
+
+/* Take n and any parents left with nothing under them out of the tree */
+
+static void pathtrie_prune( pathtrie *t, pathtrie_node *n ) {
+  pathtrie_node *up;
+  unsigned int pos;
+
+  while ( n != t->root && !(n->pkg) && n->count == 0 ) {
+    up = n->up;
+    pos = pathtrie_position( t, n );
+    memmove( up->children + pos, up->children + pos + 1,
+	     sizeof( *(up->children) ) * ( up->count - pos - 1 ) );
+    --(up->count);
+    pathtrie_free_node( t, n );
+    if ( up->count == 0 ) {
+      free( up->children );
+      up->children = NULL;
+      up->alloced = 0;
+    }
+    n = up;
+  }
+}
+
+int pathtrie_query( pathtrie *t, void *key, void **val_out ) {
+  pathtrie_node *n;
+
+  if ( !( t && key && val_out ) ) return PATHTRIE_ERROR;
+  n = pathtrie_find( t, key );
+  if ( n && n->pkg ) {
+    *val_out = PATHTRIE_PKG( t, n );
+    return PATHTRIE_SUCCESS;
+  }
+  else return PATHTRIE_NOT_FOUND;
+}
+
+unsigned long pathtrie_size( pathtrie *t ) {
+  if ( t ) return t->count;
+  else return 0;
+}
+
+static void pathtrie_strings_free( pathtrie_strings *s ) {
+  struct pathtrie_chars_struct *b, *next;
+
+  for ( b = s->chars; b; b = next ) {
+    next = b->next;
+    free( b );
+  }
+  if ( s->strs ) free( s->strs );
+  if ( s->slots ) free( s->slots );
+}
+
+/*
+ * Check the children are in order and point back up, nothing is left
+ * empty, and the count is right.  Returns 1 if all is well.
+ */
+
+int pathtrie_validate( pathtrie *t ) {
+  unsigned long n;
+
+  if ( !t ) return 0;
+  if ( t->root->pkg || t->root->up ) return 0;
+  n = 0;
+  if ( !pathtrie_validate_node( t, t->root, &n ) ) return 0;
+  if ( n != t->count ) return 0;
+
+  return 1;
+}
+
+static int pathtrie_validate_node( pathtrie *t, pathtrie_node *n,
+				   unsigned long *count ) {
+  pathtrie_node *c;
+  unsigned int i;
+
+  if ( n->pkg ) {
+    if ( n->pkg > t->pkgs.count ) return 0;
+    ++(*count);
+  }
+  else if ( n != t->root && n->count == 0 ) return 0;
+  if ( n->count > n->alloced ) return 0;
+
+  for ( i = 0; i < n->count; ++i ) {
+    c = n->children[i];
+    if ( c->up != n || c->name >= t->names.count ) return 0;
+    if ( i > 0 && strcmp( PATHTRIE_NAME( t, n->children[i - 1] ),
+			  PATHTRIE_NAME( t, c ) ) >= 0 ) return 0;
+    if ( !pathtrie_validate_node( t, c, count ) ) return 0;
+  }
+
+  return 1;
+}
@@ -1,5 +1,6 @@
 #include <pkg.h>
 
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,6 +12,7 @@
 static void help_callback( int, char ** );
 static void help_help( void );
 int main( int, char **, char ** );
+static int parse_io_buffer_size( const char *, long * );
 static void version_callback( int, char ** );
 static void version_help( void );
 
@@ -19,6 +21,7 @@ struct cmd_s {
   void (*callback)( int, char ** );
   void (*help)( void );
 } cmd_table[] = {
+  { "compactdb", compactdb_main, compactdb_help },
   { "convert", convert_main, convert_help },
   { "convertdb", convertdb_main, convertdb_help },
   { "create", create_main, create_help },
@@ -26,6 +29,7 @@ struct cmd_s {
   { "dumpdb", dumpdb_main, dumpdb_help },
   { "help", help_callback, help_help },
   { "install", install_main, install_help },
+  { "owners", owners_main, owners_help },
   { "remove", remove_main, remove_help },
   { "repairdb", repairdb_main, repairdb_help },
   { "status", status_main, status_help },
@@ -43,11 +47,21 @@ static void help_callback( int argc, char **argv ) {
     printf( "\t--enable-md5:\tEnable MD5 checking\n" );
     printf( "\t--disable-md5:" );
     printf( "\tDisable MD5 checking (use mtimes instead)\n" );
+    printf( "\t--enable-hash-cache:\tRemember hashes of installed files " );
+    printf( "between runs\n" );
+    printf( "\t--disable-hash-cache:\tHash installed files every time\n" );
+    printf( "\t--enable-direct-io:\tTry to bypass the page cache " );
+    printf( "(O_DIRECT) for uncompressed files\n" );
+    printf( "\t--disable-direct-io:\tUse the page cache as usual\n" );
     printf( "\n" );
     printf( "\t--instroot <path>:\tUse <path> as root for packages\n" );
     printf( "\t--pkgdir <path>:\tUse package database and descriptions " );
     printf( "in <path>\n" );
     printf( "\t--tempdir <path>:\tKeep temp files in <path>\n" );
+    printf( "\t--threads <n>:\tUse <n> threads for compression and " );
+    printf( "decompression\n" );
+    printf( "\t--io-buffer-size <n>:\tMove file contents in buffers of " );
+    printf( "<n> bytes; k and m\n\t\t\t\tsuffixes are allowed\n" );
     printf( "\n" );
     printf( "The commands are:\n\n" );
 
@@ -89,9 +103,39 @@ static void help_help( void ) {
   printf( "mpkg [global options] help [<command>]\n" );
 }
 
+/*
+ * Parse a byte count with an optional k or m suffix for
+ * --io-buffer-size; 0 on success.
+ */
+
+static int parse_io_buffer_size( const char *str, long *size_out ) {
+  long n, mult;
+  char suffix, c;
+  int result, status;
+
+  status = 0;
+  result = sscanf( str, "%ld%c%c", &n, &suffix, &c );
+  if ( result == 1 ) mult = 1;
+  else if ( result == 2 ) {
+    if ( suffix == 'k' || suffix == 'K' ) mult = 1024;
+    else if ( suffix == 'm' || suffix == 'M' ) mult = 1024 * 1024;
+    else status = -1;
+  }
+  else status = -1;
+
+  if ( status == 0 ) {
+    if ( n > 0 && n <= LONG_MAX / mult && n * mult >= MIN_IO_BUFFER_SIZE )
+      *size_out = n * mult;
+    else status = -1;
+  }
+
+  return status;
+}
+
 int main( int argc, char **argv, char **envp ) {
-  int i, error;
-  char *cmd, *curr;
+  int i, error, n;
+  long size;
+  char *cmd, *curr, c;
   int cmd_argc;
   char **cmd_argv;
 
@@ -133,12 +177,50 @@ int main( int argc, char **argv, char **envp ) {
 	  break;
 	}
       }
+      else if ( strcmp( curr, "--threads" ) == 0 ) {
+	if ( i + 1 < argc &&
+	     sscanf( argv[i + 1], "%d%c", &n, &c ) == 1 && n >= 0 ) {
+	  set_default_threads( n );
+	  ++i;
+	}
+	else {
+	  fprintf( stderr, "--threads requires a number of threads\n" );
+	  error = 6;
+	  break;
+	}
+      }
+      else if ( strcmp( curr, "--io-buffer-size" ) == 0 ) {
+	if ( i + 1 < argc &&
+	     parse_io_buffer_size( argv[i + 1], &size ) == 0 ) {
+	  set_io_buffer_size( size );
+	  ++i;
+	}
+	else {
+	  fprintf( stderr,
+		   "--io-buffer-size requires a size of at least %d bytes\n",
+		   MIN_IO_BUFFER_SIZE );
+	  error = 7;
+	  break;
+	}
+      }
+      else if ( strcmp( curr, "--enable-direct-io" ) == 0 ) {
+	set_io_direct( 1 );
+      }
+      else if ( strcmp( curr, "--disable-direct-io" ) == 0 ) {
+	set_io_direct( 0 );
+      }
       else if ( strcmp( curr, "--enable-md5" ) == 0 ) {
 	set_check_md5( 1 );
       }
       else if ( strcmp( curr, "--disable-md5" ) == 0 ) {
 	set_check_md5( 0 );
       }
+      else if ( strcmp( curr, "--enable-hash-cache" ) == 0 ) {
+	set_hash_cache( 1 );
+      }
+      else if ( strcmp( curr, "--disable-hash-cache" ) == 0 ) {
+	set_hash_cache( 0 );
+      }
       else {
 	fprintf( stderr, "Unknown option %s\n", curr );
 	error = 4;
@@ -3,6 +3,105 @@
 #include <stdlib.h>
 #include <string.h>
 
+static int add_entry_to_owner_index( const char *, const char *, void * );
+static void free_owned_set( void * );
+
+int abort_pkg_db_txn( pkg_db *db ) {
+  int status, result;
+
+  status = 0;
+  if ( db ) {
+    if ( db->mode == DBMODE_RW ) {
+      result = db->abort( db->private );
+      if ( result != 0 ) status = result;
+    }
+    else status = -2;
+  }
+  else status = -1;
+  return status;
+}
+
+static int add_entry_to_owner_index( const char *loc, const char *pkg,
+				     void *idx ) {
+  return add_to_owner_index( (rbtree *)idx, (char *)loc, (char *)pkg );
+}
+
+/*
+ * Note that pkg owns loc.  The index maps each package name to an
+ * rbtree of its locations, with no values.
+ */
+
+int add_to_owner_index( rbtree *idx, char *loc, char *pkg ) {
+  rbtree *owned;
+  void *owned_v;
+  int status, result;
+
+  status = 0;
+  if ( idx && loc && pkg ) {
+    result = rbtree_query( idx, pkg, &owned_v );
+    if ( result == RBTREE_SUCCESS ) owned = (rbtree *)owned_v;
+    else if ( result == RBTREE_NOT_FOUND ) {
+      owned = rbtree_alloc( rbtree_string_comparator,
+			    rbtree_string_copier,
+			    rbtree_string_free,
+			    NULL, NULL );
+      if ( owned && rbtree_insert( idx, pkg, owned ) != RBTREE_SUCCESS ) {
+	rbtree_free( owned );
+	owned = NULL;
+      }
+    }
+    else owned = NULL;
+
+    if ( owned ) {
+      if ( rbtree_insert( owned, loc, NULL ) != RBTREE_SUCCESS ) status = -1;
+    }
+    else status = -1;
+  }
+  else status = -1;
+  return status;
+}
+
+int begin_pkg_db_txn( pkg_db *db ) {
+  int status, result;
+
+  status = 0;
+  if ( db ) {
+    if ( db->mode == DBMODE_RW ) {
+      result = db->begin( db->private );
+      if ( result != 0 ) status = result;
+    }
+    else status = -2;
+  }
+  else status = -1;
+  return status;
+}
+
+/*
+ * Build an owner index from everything a format's foreach function
+ * visits in private.
+ */
+
+rbtree * build_owner_index( void *private,
+			    int (*foreach)( void *,
+					    int (*)( const char *,
+						     const char *, void * ),
+					    void * ) ) {
+  rbtree *idx;
+
+  idx = rbtree_alloc( rbtree_string_comparator,
+		      rbtree_string_copier,
+		      rbtree_string_free,
+		      NULL,
+		      free_owned_set );
+  if ( idx ) {
+    if ( foreach( private, add_entry_to_owner_index, idx ) != 0 ) {
+      rbtree_free( idx );
+      idx = NULL;
+    }
+  }
+  return idx;
+}
+
 int close_pkg_db( pkg_db *db ) {
   int status, result;
 
@@ -20,6 +119,38 @@ int close_pkg_db( pkg_db *db ) {
   return status;
 }
 
+int commit_pkg_db_txn( pkg_db *db ) {
+  int status, result;
+
+  status = 0;
+  if ( db ) {
+    if ( db->mode == DBMODE_RW ) {
+      result = db->commit( db->private );
+      if ( result != 0 ) status = result;
+    }
+    else status = -2;
+  }
+  else status = -1;
+  return status;
+}
+
+int compact_pkg_db( pkg_db *db ) {
+  int status, result;
+
+  status = 0;
+  if ( db ) {
+    if ( db->mode == DBMODE_RW ) {
+      if ( db->compact ) {
+	result = db->compact( db->private );
+	if ( result != 0 ) status = result;
+      }
+    }
+    else status = -2;
+  }
+  else status = -1;
+  return status;
+}
+
 int delete_from_pkg_db( pkg_db *db, char *key ) {
   int status, result;
 
@@ -35,6 +166,41 @@ int delete_from_pkg_db( pkg_db *db, char *key ) {
   return status;
 }
 
+/*
+ * Enumerate the locations pkg owns in idx, the same way as
+ * enumerate_pkg_db_by_package().  Nothing may be added to or removed
+ * from idx until the end.
+ */
+
+int enumerate_owner_index( rbtree *idx, char *pkg, void *n_in,
+			   char **k_out, void **n_out ) {
+  rbtree *owned;
+  rbtree_node *n;
+  void *owned_v, *val;
+  char *key;
+  int status, result;
+
+  status = 0;
+  if ( idx && pkg && k_out && n_out ) {
+    *k_out = NULL;
+    *n_out = NULL;
+    result = rbtree_query( idx, pkg, &owned_v );
+    if ( result == RBTREE_SUCCESS ) {
+      owned = (rbtree *)owned_v;
+      n = (rbtree_node *)n_in;
+      key = (char *)rbtree_enum( owned, n, &val, &n );
+      if ( key ) {
+	*k_out = copy_string( key );
+	if ( *k_out ) *n_out = (void *)n;
+	else status = -1;
+      }
+    }
+    else if ( result != RBTREE_NOT_FOUND ) status = -1;
+  }
+  else status = -1;
+  return status;
+}
+
 int enumerate_pkg_db( pkg_db *db, void *n_in,
 		      char **k_out, char **v_out,
 		      void **n_out ) {
@@ -44,11 +210,95 @@ int enumerate_pkg_db( pkg_db *db, void *n_in,
   else return -1;
 }
 
+/*
+ * Enumerate the locations owned by pkg: start with n_in NULL, and pass
+ * each *n_out back in until it comes out NULL.  Each location comes
+ * back in *k_out for the caller to free.
+ */
+
+int enumerate_pkg_db_by_package( pkg_db *db, char *pkg, void *n_in,
+				 char **k_out, void **n_out ) {
+  if ( db && pkg && k_out && n_out )
+    return db->enumerate_by_package( db->private, pkg, n_in,
+				     k_out, n_out );
+  else return -1;
+}
+
+/*
+ * Enumerate the locations starting with prefix, in order, the same way
+ * as enumerate_pkg_db(); the formats all keep locations sorted, so this
+ * only visits the matching ones.  To get everything under a directory,
+ * pass it with a trailing slash.
+ */
+
+int enumerate_pkg_db_prefix( pkg_db *db, char *prefix, void *n_in,
+			     char **k_out, char **v_out, void **n_out ) {
+  if ( db && prefix && k_out && v_out && n_out )
+    return db->enumerate_prefix( db->private, prefix, n_in,
+				 k_out, v_out, n_out );
+  else return -1;
+}
+
+int foreach_pkg_db( pkg_db *db,
+		    int (*fn)( const char *, const char *, void * ),
+		    void *arg ) {
+  if ( db && fn ) return db->foreach( db->private, fn, arg );
+  else return -1;
+}
+
+static void free_owned_set( void *owned ) {
+  if ( owned ) rbtree_free( (rbtree *)owned );
+}
+
 unsigned long get_entry_count_for_pkg_db( pkg_db *db ) {
   if ( db ) return db->entry_count( db->private );
   else return 0;
 }
 
+/*
+ * Get the set of locations pkg owns, as an rbtree with no values that
+ * the caller frees; it's empty if pkg owns nothing, and NULL on error.
+ */
+
+rbtree * get_owned_paths_for_pkg_db( pkg_db *db, char *pkg ) {
+  rbtree *owned;
+  void *n;
+  char *loc;
+  int result;
+
+  owned = NULL;
+  if ( db && pkg ) {
+    owned = rbtree_alloc_arena( rbtree_string_comparator,
+				rbtree_string_copier,
+				rbtree_string_free,
+				NULL, NULL );
+    if ( owned ) {
+      n = NULL;
+      do {
+	loc = NULL;
+	result = enumerate_pkg_db_by_package( db, pkg, n, &loc, &n );
+	if ( result == 0 && loc ) {
+	  if ( rbtree_insert( owned, loc, NULL ) != RBTREE_SUCCESS )
+	    result = -1;
+	}
+	if ( loc ) free( loc );
+      } while ( result == 0 && n );
+
+      if ( result != 0 ) {
+	while ( n ) {
+	  loc = NULL;
+	  if ( enumerate_pkg_db_by_package( db, pkg, n, &loc, &n ) != 0 )
+	    n = NULL;
+	  if ( loc ) free( loc );
+	}
+	rbtree_free( owned );
+	owned = NULL;
+      }
+    }
+  }
+  return owned;
+}
+
 int insert_into_pkg_db( pkg_db *db, char *key, char *value ) {
   int status, result;
 
@@ -89,6 +339,16 @@ pkg_db * open_pkg_db_with_mode( dbmode_t mode ) {
   }
 #endif
 
+  if ( !db ) {
+    temp_len = strlen( pkg_dir ) + strlen( PKGDB_MMAP_FILE_NAME ) + 2;
+    temp = malloc( sizeof( *temp ) * temp_len );
+    if ( temp ) {
+      snprintf( temp, temp_len, "%s/%s", pkg_dir, PKGDB_MMAP_FILE_NAME );
+      db = open_pkg_db_mmap( temp, mode );
+      free( temp );
+    }
+  }
+
   if ( !db ) {
     temp_len = strlen( pkg_dir ) + strlen( PKGDB_TEXT_FILE_NAME ) + 2;
     temp = malloc( sizeof( *temp ) * temp_len );
@@ -102,6 +362,11 @@ pkg_db * open_pkg_db_with_mode( dbmode_t mode ) {
   return db;
 }
 
+const char * peek_pkg_db( pkg_db *db, char *key ) {
+  if ( db && key ) return db->peek( db->private, key );
+  else return NULL;
+}
+
 char * query_pkg_db( pkg_db *db, char *key ) {
   char *result;
 
@@ -111,3 +376,34 @@ char * query_pkg_db( pkg_db *db, char *key ) {
   }
   else return NULL;
 }
+
+/*
+ * Note that pkg no longer owns loc, dropping pkg from the index when
+ * that was its last one.
+ */
+
+int remove_from_owner_index( rbtree *idx, char *loc, char *pkg ) {
+  rbtree *owned;
+  void *owned_v, *val;
+  int status, result;
+
+  status = 0;
+  if ( idx && loc && pkg ) {
+    result = rbtree_query( idx, pkg, &owned_v );
+    if ( result == RBTREE_SUCCESS ) {
+      owned = (rbtree *)owned_v;
+      result = rbtree_delete( owned, loc, &val );
+      if ( result == RBTREE_SUCCESS || result == RBTREE_NOT_FOUND ) {
+	if ( rbtree_size( owned ) == 0 ) {
+	  result = rbtree_delete( idx, pkg, &owned_v );
+	  if ( result == RBTREE_SUCCESS ) rbtree_free( owned );
+	  else status = -1;
+	}
+      }
+      else status = -1;
+    }
+    else if ( result != RBTREE_NOT_FOUND ) status = -1;
+  }
+  else status = -1;
+  return status;
+}
@@ -2,61 +2,156 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
 #include <db.h>
 
 #include <pkg.h>
 
 #define SIZEOF_STR( str ) ( strlen( str) + 1 ) * sizeof( char );
 
+/*
+ * Opened read-write, the database lives in a transactional environment
+ * whose home (and logs) are in <filename>.env, so begin/commit/abort
+ * map onto real BDB transactions and recovery runs on every open.
+ * Read-only opens skip the environment, as before.  The filename is
+ * always absolute (pkgdir is), so BDB finds it from any home.
+ */
+
+#define BDB_ENV_SUFFIX ".env"
+
+/*
+ * The environment is private to the process that has it open, so a
+ * read-write open first takes an exclusive flock() on <filename>.lock
+ * and keeps it until close; a second writer waits rather than running
+ * recovery over logs the first is still writing.
+ */
+
+#define BDB_LOCK_SUFFIX ".lock"
+
+/*
+ * Alongside the database is a secondary one in <filename>.bypkg,
+ * keyed on package name with the locations as sorted duplicates, that
+ * BDB keeps in step with every change.  A database from before there
+ * was one gets it built on its first read-write open; read-only, we
+ * scan the whole database instead.
+ */
+
+#define BDB_BYPKG_SUFFIX ".bypkg"
+
+/* Starting size of the buffer foreach_bdb() reads records in bulk into */
+#define BDB_BULK_SIZE ( 256 * 1024 )
+
+/* Before 4.3, a buffer too small for a record got ENOMEM */
+#ifndef DB_BUFFER_SMALL
+#define DB_BUFFER_SMALL ENOMEM
+#endif /* DB_BUFFER_SMALL */
+
+typedef struct {
+  /* The lock file, held while env is open, or -1 */
+  int lock_fd;
+  DB_ENV *env;
+  DB *db, *bypkg;
+  DB_TXN *txn;
+  /* peek_bdb() reads into this, and reuses it each time */
+  DBT peek;
+} bdb_data;
+
+static int abort_bdb( void * );
+static int begin_bdb( void * );
+static int bypkg_key_bdb( DB *, const DBT *, const DBT *, DBT * );
 static int close_bdb( void * );
+static int commit_bdb( void * );
 static int delete_from_bdb( void *, char * );
 static unsigned long entry_count_bdb( void * );
 static int enumerate_bdb( void *, void *, char **, char **, void ** );
+static int enumerate_by_package_bdb( void *, char *, void *, char **,
+				     void ** );
+static int enumerate_prefix_bdb( void *, char *, void *, char **, char **,
+				 void ** );
+static int foreach_bdb( void *, int (*)( const char *, const char *, void * ),
+			void * );
 static char * query_bdb( void *, char * );
 static int insert_into_bdb( void *, char *, char * );
+static DB_ENV * open_bdb_env( char * );
+static int lock_bdb( char * );
+static int open_bypkg_bdb( bdb_data *, char *, dbmode_t, int );
+static const char * peek_bdb( void *, char * );
+static pkg_db * setup_bdb_pkg_db( char *, dbmode_t );
+
+static int abort_bdb( void *db ) {
+  bdb_data *d = (bdb_data *)db;
+  int result;
+
+  if ( !(d->txn) ) return -1;
+  result = d->txn->abort( d->txn );
+  d->txn = NULL;
+  return result;
+}
+
+static int begin_bdb( void *db ) {
+  bdb_data *d = (bdb_data *)db;
+  int result;
+
+  if ( !(d->env) || d->txn ) return -1;
+  result = d->env->txn_begin( d->env, NULL, &(d->txn), 0 );
+  if ( result != 0 ) {
+    fprintf( stderr, "DB_ENV->txn_begin() failed (%d)\n", result );
+    d->txn = NULL;
+  }
+  return result;
+}
+
+/* The secondary key for an entry is just its package name */
+
+static int bypkg_key_bdb( DB *sdb, const DBT *pkey, const DBT *pdata,
+			  DBT *skey ) {
+  memset( skey, 0, sizeof( *skey ) );
+  skey->data = pdata->data;
+  skey->size = pdata->size;
+  return 0;
+}
+
+static int commit_bdb( void *db ) {
+  bdb_data *d = (bdb_data *)db;
+  int result;
+
+  if ( !(d->txn) ) return -1;
+  /* One synchronous log flush for everything since begin_bdb() */
+  result = d->txn->commit( d->txn, 0 );
+  if ( result != 0 )
+    fprintf( stderr, "DB_TXN->commit() failed (%d)\n", result );
+  d->txn = NULL;
+  return result;
+}
 
 pkg_db * create_pkg_db_bdb( char *filename ) {
-  pkg_db *ret = malloc( sizeof ( pkg_db ) );
-  DB *bdb;
+  pkg_db *ret;
+  bdb_data *d;
   int result;
 
+  ret = setup_bdb_pkg_db( filename, DBMODE_RW );
   if ( ret == NULL ) return NULL;
+  d = (bdb_data *)(ret->private);
 
-  ret->query = query_bdb;
-  ret->insert = insert_into_bdb;
-  ret->delete = delete_from_bdb;
-  ret->close = close_bdb;
-  ret->enumerate = enumerate_bdb;
-  ret->entry_count = entry_count_bdb;
-  ret->format = DBFMT_BDB;
-  ret->filename = copy_string( filename );
-  ret->mode = DBMODE_RW;
-  if ( !(ret->filename) ) {
-    free( ret );
-    return NULL;
-  }
-
-  if( ( result = db_create( &bdb, NULL, 0 ) ) != 0 )
+  if( ( result = d->db->open( d->db, NULL, filename, NULL, DB_BTREE,
+			      DB_CREATE | DB_EXCL | DB_AUTO_COMMIT,
+			      0644 ) ) != 0 )
   {
-    /* Might want to use DB->err, but it's simpler to fprintf. */
-    fprintf( stderr, "bdb db_create failed (%d)\n", result );
+    fprintf( stderr, "bdb database create failed (%d)\n", result );
+    close_bdb( d );
     free( ret->filename );
     free( ret );
     return NULL;
   }
-  ret->private = (void *)bdb;
 
-  /* DB->set_flags() must come before DB->open() */
-  result = bdb->set_flags( bdb, DB_RECNUM );
-  if ( result != 0 ) {
-    fprintf( stderr, "DB->set_flags() failed, returned %d\n", result );
-  }
-
-  if( ( result = bdb->open( bdb, NULL, filename, 
-    NULL, DB_BTREE, DB_CREATE | DB_EXCL, 0644 ) ) != 0 )
-  {
-    fprintf( stderr, "bdb database create failed (%d)\n", result );
-    bdb->close( bdb, 0 );
+  if ( open_bypkg_bdb( d, filename, DBMODE_RW, 1 ) != 0 ) {
+    close_bdb( d );
     free( ret->filename );
     free( ret );
     return NULL;
@@ -66,50 +161,33 @@ pkg_db * create_pkg_db_bdb( char *filename ) {
 }
 
 pkg_db * open_pkg_db_bdb( char *filename, dbmode_t mode ) {
-  pkg_db *ret = malloc( sizeof ( pkg_db ) );
-  DB *bdb;
+  pkg_db *ret;
+  bdb_data *d;
+  struct stat st;
   int result;
 
-  if ( ret == NULL ) return NULL;
+  /* Don't leave an environment behind for a database that isn't there */
+  if ( stat( filename, &st ) != 0 ) return NULL;
 
-  ret->query = query_bdb;
-  ret->insert = insert_into_bdb;
-  ret->delete = delete_from_bdb;
-  ret->close = close_bdb;
-  ret->enumerate = enumerate_bdb;
-  ret->entry_count = entry_count_bdb;
-  ret->format = DBFMT_BDB;
-  ret->filename = copy_string( filename );
-  ret->mode = mode;
-  if ( !(ret->filename) ) {
-    free( ret );
-    return NULL;
-  }
+  ret = setup_bdb_pkg_db( filename, mode );
+  if ( ret == NULL ) return NULL;
+  d = (bdb_data *)(ret->private);
 
-  if( ( result = db_create( &bdb, NULL, 0 ) ) != 0 )
+  if( ( result =
+          d->db->open( d->db, NULL, filename,
+                       NULL, DB_BTREE,
+                       (mode == DBMODE_RW) ? DB_AUTO_COMMIT : DB_RDONLY,
+                       0 ) ) != 0)
   {
-    /* Might want to use DB->err, but it's simpler to fprintf.*/
-    /* fprintf( stderr, "bdb db_create failed (%d)\n", result ); */
+    /* fprintf( stderr, "bdb database open failed\n" ); */
+    close_bdb( d );
     free( ret->filename );
     free( ret );
     return NULL;
   }
-  ret->private = (void *)bdb;
-
-  /* DB->set_flags() must come before DB->open() */
-  result = bdb->set_flags( bdb, DB_RECNUM );
-  if ( result != 0 ) {
-    fprintf( stderr, "DB->set_flags() failed, returned %d\n", result );
-  }
 
-  if( ( result =
-          bdb->open( bdb, NULL, filename, 
-                     NULL, DB_BTREE,
-                     (mode == DBMODE_RW) ? 0 : DB_RDONLY,
-                     0 ) ) != 0)
-  {
-    /* fprintf( stderr, "bdb database open failed\n" ); */
-    bdb->close( bdb, 0 );
+  if ( open_bypkg_bdb( d, filename, mode, 0 ) != 0 ) {
+    close_bdb( d );
     free( ret->filename );
     free( ret );
     return NULL;
@@ -119,14 +197,33 @@ pkg_db * open_pkg_db_bdb( char *filename, dbmode_t mode ) {
 }
 
 static int close_bdb( void *db ) {
-  int ret;
-  DB *bdb = (DB *)db;
-  ret = bdb->close( bdb, 0 ); /* frees db->private too */
+  int ret, result;
+  bdb_data *d = (bdb_data *)db;
+
+  ret = 0;
+  /* Anything not committed by now never will be */
+  if ( d->txn ) abort_bdb( d );
+  /* Secondaries have to close before their primary */
+  if ( d->bypkg ) ret = d->bypkg->close( d->bypkg, 0 );
+  if ( d->db ) {
+    result = d->db->close( d->db, 0 );
+    if ( ret == 0 ) ret = result;
+  }
+  if ( d->env ) {
+    /* Checkpoint so the next recovery has nothing to do */
+    d->env->txn_checkpoint( d->env, 0, 0, 0 );
+    result = d->env->close( d->env, 0 );
+    if ( ret == 0 ) ret = result;
+  }
+  /* Closing it drops the lock */
+  if ( d->lock_fd >= 0 ) close( d->lock_fd );
+  if ( d->peek.data ) free( d->peek.data );
+  free( d );
   return ret;
 }
 
 static int delete_from_bdb( void *db, char *key ) {
-  DB *bdb = (DB *)db;
+  bdb_data *d = (bdb_data *)db;
   DBT bdb_key;
   int result;
 
@@ -134,13 +231,13 @@ static int delete_from_bdb( void *db, char *key ) {
   bdb_key.data = key;
   bdb_key.size = SIZEOF_STR( key );
 
-  result = bdb->del( bdb, NULL, &bdb_key, 0 );
+  result = d->db->del( d->db, d->txn, &bdb_key, 0 );
   
   return result;
 }
 
 static char * query_bdb( void *db, char *key ) {
-  DB *bdb = (DB *)db;
+  bdb_data *d = (bdb_data *)db;
   DBT bdb_key, bdb_value;
   int result;
 
@@ -151,7 +248,7 @@ static char * query_bdb( void *db, char *key ) {
   memset( &bdb_value, 0, sizeof( bdb_value ) );
   bdb_value.flags = DB_DBT_MALLOC;
 
-  result = bdb->get( bdb, NULL, &bdb_key, &bdb_value, 0 );
+  result = d->db->get( d->db, d->txn, &bdb_key, &bdb_value, 0 );
 
   if ( result == 0 && bdb_value.data ) return bdb_value.data;
   else {
@@ -161,7 +258,7 @@ static char * query_bdb( void *db, char *key ) {
 } 
 
 static int insert_into_bdb( void *db, char *key, char *value ) {
-  DB *bdb = (DB *)db;
+  bdb_data *d = (bdb_data *)db;
   DBT bdb_key, bdb_value;
   int result;
 
@@ -174,23 +271,23 @@ static int insert_into_bdb( void *db, char *key, char *value ) {
   bdb_value.data = value;
   bdb_value.size = SIZEOF_STR( value );
 
-  result = bdb->put( bdb, NULL, &bdb_key, &bdb_value, 0 );
+  result = d->db->put( d->db, d->txn, &bdb_key, &bdb_value, 0 );
 
   return result;
 }
 
 static unsigned long entry_count_bdb( void *db ) {
-  DB *bdb;
+  bdb_data *d;
   DB_BTREE_STAT *stats;
   int result;
   unsigned long count;
 
-  bdb = (DB *)db;
+  d = (bdb_data *)db;
   count = 0;
   stats = NULL;
 
-  if ( bdb ) {
-    result = bdb->stat( bdb, NULL, &stats, 0 );
+  if ( d ) {
+    result = d->db->stat( d->db, d->txn, &stats, 0 );
     if ( result == 0 && stats) count = stats->bt_nkeys;
   }
 
@@ -200,7 +297,7 @@ static unsigned long entry_count_bdb( void *db ) {
 
 static int enumerate_bdb( void *db, void *n_in, char **k_out,
 			  char **v_out, void **n_out ) {
-  DB *bdb;
+  bdb_data *d;
   DBC *cursor;
   DBT bdb_key, bdb_value;
   int status, result;
@@ -208,11 +305,12 @@ static int enumerate_bdb( void *db, void *n_in, char **k_out,
 
   status = 0;
   if ( db && k_out && v_out && n_out ) {
-    bdb = (DB *)db;
+    d = (bdb_data *)db;
     cursor = (DBC *)n_in;
 
+    /* Enumerate inside a transaction only if it ends before commit */
     if ( !cursor ) {
-      result = bdb->cursor( bdb, NULL, &cursor, 0 );
+      result = d->db->cursor( d->db, d->txn, &cursor, 0 );
       if ( result != 0 || cursor == NULL ) status = -1;
     }
     if ( status == 0 ) {
@@ -241,3 +339,437 @@ static int enumerate_bdb( void *db, void *n_in, char **k_out,
   else status = -1;
   return status;
 }
+
+static int enumerate_by_package_bdb( void *db, char *pkg, void *n_in,
+				     char **k_out, void **n_out ) {
+  bdb_data *d;
+  DBC *cursor;
+  DBT bdb_skey, bdb_key, bdb_value;
+  int status, result, done;
+
+  status = 0;
+  if ( db && pkg && k_out && n_out ) {
+    d = (bdb_data *)db;
+    cursor = (DBC *)n_in;
+    *k_out = NULL;
+    *n_out = NULL;
+
+    if ( !cursor ) {
+      if ( d->bypkg )
+	result = d->bypkg->cursor( d->bypkg, d->txn, &cursor, 0 );
+      else result = d->db->cursor( d->db, d->txn, &cursor, 0 );
+      if ( result != 0 || cursor == NULL ) status = -1;
+    }
+
+    done = 0;
+    while ( status == 0 && !done ) {
+      memset( &bdb_skey, 0, sizeof( bdb_skey ) );
+      memset( &bdb_key, 0, sizeof( bdb_key ) );
+      bdb_key.flags = DB_DBT_MALLOC;
+      memset( &bdb_value, 0, sizeof( bdb_value ) );
+      bdb_value.flags = DB_DBT_MALLOC;
+
+      if ( d->bypkg ) {
+	bdb_skey.data = pkg;
+	bdb_skey.size = SIZEOF_STR( pkg );
+	result = cursor->c_pget( cursor, &bdb_skey, &bdb_key, &bdb_value,
+				 n_in ? DB_NEXT_DUP : DB_SET );
+      }
+      else {
+	/* No index; pick out pkg's entries from the lot */
+	result = cursor->c_get( cursor, &bdb_key, &bdb_value, DB_NEXT );
+      }
+      n_in = cursor;
+
+      if ( result == 0 && bdb_key.data && bdb_value.data ) {
+	if ( d->bypkg || strcmp( bdb_value.data, pkg ) == 0 ) {
+	  *k_out = bdb_key.data;
+	  *n_out = cursor;
+	  done = 1;
+	}
+	else free( bdb_key.data );
+	free( bdb_value.data );
+      }
+      else {
+	cursor->c_close( cursor );
+	if ( bdb_key.data ) free( bdb_key.data );
+	if ( bdb_value.data ) free( bdb_value.data );
+	if ( result != DB_NOTFOUND ) status = -1;
+	done = 1;
+      }
+    }
+  }
+  else status = -1;
+  return status;
+}
+
+/*
+ * The btree keeps locations in order, so DB_SET_RANGE on the bare
+ * prefix lands on the first one with it.
+ */
+
+static int enumerate_prefix_bdb( void *db, char *prefix, void *n_in,
+				 char **k_out, char **v_out, void **n_out ) {
+  bdb_data *d;
+  DBC *cursor;
+  DBT bdb_key, bdb_value;
+  int status, result;
+
+  status = 0;
+  if ( db && prefix && k_out && v_out && n_out ) {
+    d = (bdb_data *)db;
+    cursor = (DBC *)n_in;
+    *k_out = NULL;
+    *v_out = NULL;
+    *n_out = NULL;
+
+    if ( !cursor ) {
+      result = d->db->cursor( d->db, d->txn, &cursor, 0 );
+      if ( result != 0 || cursor == NULL ) status = -1;
+    }
+    if ( status == 0 ) {
+      memset( &bdb_key, 0, sizeof( bdb_key ) );
+      bdb_key.flags = DB_DBT_MALLOC;
+      memset( &bdb_value, 0, sizeof( bdb_value ) );
+      bdb_value.flags = DB_DBT_MALLOC;
+
+      if ( !n_in ) {
+	/* Without the terminating NUL, so it sorts before its matches */
+	bdb_key.data = prefix;
+	bdb_key.size = strlen( prefix );
+	result = cursor->c_get( cursor, &bdb_key, &bdb_value, DB_SET_RANGE );
+      }
+      else result = cursor->c_get( cursor, &bdb_key, &bdb_value, DB_NEXT );
+
+      if ( result == 0 && bdb_key.data && bdb_value.data &&
+	   strncmp( bdb_key.data, prefix, strlen( prefix ) ) == 0 ) {
+	*n_out = cursor;
+	*k_out = bdb_key.data;
+	*v_out = bdb_value.data;
+      }
+      else {
+	cursor->c_close( cursor );
+	if ( bdb_key.data && bdb_key.data != prefix ) free( bdb_key.data );
+	if ( bdb_value.data ) free( bdb_value.data );
+	if ( result != 0 && result != DB_NOTFOUND ) status = -1;
+      }
+    }
+  }
+  else status = -1;
+  return status;
+}
+
+/*
+ * Walk the database with bulk reads, many records to a call, handing
+ * fn pointers into the buffer.
+ */
+
+static int foreach_bdb( void *db,
+			int (*fn)( const char *, const char *, void * ),
+			void *arg ) {
+  bdb_data *d;
+  DBC *cursor;
+  DBT bdb_key, bdb_bulk;
+  void *buf, *p, *kp, *vp, *temp;
+  u_int32_t buf_len, klen, vlen;
+  int status, result;
+
+  status = 0;
+  if ( db && fn ) {
+    d = (bdb_data *)db;
+    buf_len = BDB_BULK_SIZE;
+    buf = malloc( buf_len );
+    cursor = NULL;
+    if ( buf ) {
+      result = d->db->cursor( d->db, d->txn, &cursor, 0 );
+      if ( result != 0 || cursor == NULL ) {
+	cursor = NULL;
+	status = -1;
+      }
+    }
+    else status = -1;
+
+    while ( status == 0 ) {
+      memset( &bdb_key, 0, sizeof( bdb_key ) );
+      memset( &bdb_bulk, 0, sizeof( bdb_bulk ) );
+      bdb_bulk.data = buf;
+      bdb_bulk.ulen = buf_len;
+      bdb_bulk.flags = DB_DBT_USERMEM;
+
+      result = cursor->c_get( cursor, &bdb_key, &bdb_bulk,
+			      DB_MULTIPLE_KEY | DB_NEXT );
+      if ( result == 0 ) {
+	DB_MULTIPLE_INIT( p, &bdb_bulk );
+	while ( status == 0 ) {
+	  DB_MULTIPLE_KEY_NEXT( p, &bdb_bulk, kp, klen, vp, vlen );
+	  if ( p == NULL ) break;
+	  /* We always store the NUL; anything else isn't ours to pass on */
+	  if ( klen > 0 && vlen > 0 && ((char *)kp)[klen - 1] == '\0' &&
+	       ((char *)vp)[vlen - 1] == '\0' )
+	    status = fn( (const char *)kp, (const char *)vp, arg );
+	  else fprintf( stderr, "Skipping malformed bdb record\n" );
+	}
+      }
+      else if ( result == DB_BUFFER_SMALL ) {
+	/* One record too big for the buffer; make room and go again */
+	while ( buf_len < bdb_bulk.size ) buf_len *= 2;
+	temp = realloc( buf, buf_len );
+	if ( temp ) buf = temp;
+	else status = -1;
+      }
+      else if ( result == DB_NOTFOUND ) break;
+      else {
+	fprintf( stderr, "bdb bulk read failed (%d)\n", result );
+	status = -1;
+      }
+    }
+
+    if ( cursor ) cursor->c_close( cursor );
+    if ( buf ) free( buf );
+  }
+  else status = -1;
+  return status;
+}
+
+/*
+ * Take the writer's lock for filename, waiting for whoever has it;
+ * returns the descriptor to close to let it go, or -1.
+ */
+
+static int lock_bdb( char *filename ) {
+  char *lock_filename;
+  int lock_filename_len, fd, result;
+
+  lock_filename_len = strlen( filename ) + strlen( BDB_LOCK_SUFFIX ) + 1;
+  lock_filename = malloc( sizeof( *lock_filename ) * lock_filename_len );
+  if ( lock_filename == NULL ) return -1;
+  snprintf( lock_filename, lock_filename_len, "%s%s",
+	    filename, BDB_LOCK_SUFFIX );
+
+  fd = open( lock_filename, O_RDWR | O_CREAT, 0644 );
+  if ( fd >= 0 ) {
+    result = flock( fd, LOCK_EX | LOCK_NB );
+    if ( result != 0 && errno == EWOULDBLOCK ) {
+      fprintf( stderr, "Waiting for another mpkg to finish with %s\n",
+	       filename );
+      do {
+	result = flock( fd, LOCK_EX );
+      } while ( result != 0 && errno == EINTR );
+    }
+    if ( result != 0 ) {
+      fprintf( stderr, "Couldn't lock %s: %s\n",
+	       lock_filename, strerror( errno ) );
+      close( fd );
+      fd = -1;
+    }
+  }
+  else {
+    fprintf( stderr, "Couldn't open %s: %s\n",
+	     lock_filename, strerror( errno ) );
+  }
+
+  free( lock_filename );
+  return fd;
+}
+
+/* Open (creating and recovering as needed) the environment for filename */
+
+static DB_ENV * open_bdb_env( char *filename ) {
+  DB_ENV *env;
+  char *home;
+  int home_len, result;
+
+  home_len = strlen( filename ) + strlen( BDB_ENV_SUFFIX ) + 1;
+  home = malloc( sizeof( *home ) * home_len );
+  if ( home == NULL ) return NULL;
+  snprintf( home, home_len, "%s%s", filename, BDB_ENV_SUFFIX );
+
+  if ( mkdir( home, 0755 ) != 0 && errno != EEXIST ) {
+    fprintf( stderr, "Couldn't create bdb environment %s\n", home );
+    free( home );
+    return NULL;
+  }
+
+  if( ( result = db_env_create( &env, 0 ) ) != 0 )
+  {
+    fprintf( stderr, "bdb db_env_create failed (%d)\n", result );
+    free( home );
+    return NULL;
+  }
+
+  /* Logs are only needed back to the last checkpoint */
+#ifdef DB_LOG_AUTO_REMOVE
+  env->log_set_config( env, DB_LOG_AUTO_REMOVE, 1 );
+#else
+  env->set_flags( env, DB_LOG_AUTOREMOVE, 1 );
+#endif
+
+  /*
+   * lock_bdb() keeps any other mpkg out of the environment while we
+   * have it, so there's no locking subsystem and the regions can live
+   * in our own memory.
+   */
+  if( ( result = env->open( env, home,
+			    DB_CREATE | DB_INIT_LOG | DB_INIT_MPOOL |
+			    DB_INIT_TXN | DB_PRIVATE | DB_RECOVER,
+			    0644 ) ) != 0 )
+  {
+    fprintf( stderr, "bdb environment open of %s failed (%d)\n",
+	     home, result );
+    env->close( env, 0 );
+    env = NULL;
+  }
+
+  free( home );
+  return env;
+}
+
+/*
+ * Open the by-package index for the already-open d->db and associate
+ * it, first throwing out any old one if the database is new.
+ * Read-only, a missing index just leaves d->bypkg NULL.
+ */
+
+static int open_bypkg_bdb( bdb_data *d, char *filename, dbmode_t mode,
+			   int fresh ) {
+  char *bypkg_filename;
+  int bypkg_filename_len, result;
+
+  bypkg_filename_len = strlen( filename ) + strlen( BDB_BYPKG_SUFFIX ) + 1;
+  bypkg_filename = malloc( sizeof( *bypkg_filename ) * bypkg_filename_len );
+  if ( bypkg_filename == NULL ) return -1;
+  snprintf( bypkg_filename, bypkg_filename_len, "%s%s",
+	    filename, BDB_BYPKG_SUFFIX );
+  if ( fresh ) unlink( bypkg_filename );
+
+  result = db_create( &(d->bypkg), d->env, 0 );
+  if ( result == 0 ) {
+    result = d->bypkg->set_flags( d->bypkg, DB_DUP | DB_DUPSORT );
+    if ( result == 0 ) {
+      result = d->bypkg->open( d->bypkg, NULL, bypkg_filename, NULL,
+			       DB_BTREE,
+			       ( mode == DBMODE_RW ) ?
+			       DB_CREATE | DB_AUTO_COMMIT : DB_RDONLY,
+			       0644 );
+    }
+    if ( result != 0 ) {
+      d->bypkg->close( d->bypkg, 0 );
+      d->bypkg = NULL;
+    }
+  }
+  else d->bypkg = NULL;
+
+  if ( d->bypkg ) {
+    /* DB_CREATE fills in a new, empty index from the database */
+    result = d->db->associate( d->db, NULL, d->bypkg, bypkg_key_bdb,
+			       ( mode == DBMODE_RW ) ? DB_CREATE : 0 );
+    if ( result != 0 ) {
+      fprintf( stderr, "DB->associate() of %s failed (%d)\n",
+	       bypkg_filename, result );
+      d->bypkg->close( d->bypkg, 0 );
+      d->bypkg = NULL;
+    }
+  }
+  else if ( mode == DBMODE_RW ) {
+    fprintf( stderr, "bdb open of %s failed (%d)\n",
+	     bypkg_filename, result );
+  }
+
+  free( bypkg_filename );
+  return ( d->bypkg || mode != DBMODE_RW ) ? 0 : -1;
+}
+
+static const char * peek_bdb( void *db, char *key ) {
+  bdb_data *d = (bdb_data *)db;
+  DBT bdb_key;
+  int result;
+
+  memset( &bdb_key, 0, sizeof( bdb_key ) );
+  bdb_key.data = key;
+  bdb_key.size = SIZEOF_STR( key );
+
+  /* d->peek keeps its buffer from last time, and DB grows it as needed */
+  d->peek.flags = DB_DBT_REALLOC;
+
+  result = d->db->get( d->db, d->txn, &bdb_key, &(d->peek), 0 );
+
+  if ( result == 0 && d->peek.data ) return (const char *)(d->peek.data);
+  else return NULL;
+}
+
+/* Fill in a pkg_db and its (environment and) DB handle, unopened */
+
+static pkg_db * setup_bdb_pkg_db( char *filename, dbmode_t mode ) {
+  pkg_db *ret = malloc( sizeof ( pkg_db ) );
+  bdb_data *d;
+  int result;
+
+  if ( ret == NULL ) return NULL;
+
+  ret->query = query_bdb;
+  ret->peek = peek_bdb;
+  ret->insert = insert_into_bdb;
+  ret->delete = delete_from_bdb;
+  ret->close = close_bdb;
+  ret->compact = NULL;
+  ret->begin = begin_bdb;
+  ret->commit = commit_bdb;
+  ret->abort = abort_bdb;
+  ret->enumerate = enumerate_bdb;
+  ret->enumerate_by_package = enumerate_by_package_bdb;
+  ret->enumerate_prefix = enumerate_prefix_bdb;
+  ret->foreach = foreach_bdb;
+  ret->entry_count = entry_count_bdb;
+  ret->format = DBFMT_BDB;
+  ret->filename = copy_string( filename );
+  ret->mode = mode;
+  if ( !(ret->filename) ) {
+    free( ret );
+    return NULL;
+  }
+
+  d = malloc( sizeof( *d ) );
+  if ( d == NULL ) {
+    free( ret->filename );
+    free( ret );
+    return NULL;
+  }
+  d->lock_fd = -1;
+  d->env = NULL;
+  d->db = NULL;
+  d->bypkg = NULL;
+  d->txn = NULL;
+  memset( &(d->peek), 0, sizeof( d->peek ) );
+  ret->private = (void *)d;
+
+  if ( mode == DBMODE_RW ) {
+    d->lock_fd = lock_bdb( filename );
+    if ( d->lock_fd >= 0 ) d->env = open_bdb_env( filename );
+    if ( d->env == NULL ) {
+      if ( d->lock_fd >= 0 ) close( d->lock_fd );
+      free( d );
+      free( ret->filename );
+      free( ret );
+      return NULL;
+    }
+  }
+
+  if( ( result = db_create( &(d->db), d->env, 0 ) ) != 0 )
+  {
+    /* Might want to use DB->err, but it's simpler to fprintf. */
+    fprintf( stderr, "bdb db_create failed (%d)\n", result );
+    d->db = NULL;
+    close_bdb( d );
+    free( ret->filename );
+    free( ret );
+    return NULL;
+  }
+
+  /* DB->set_flags() must come before DB->open() */
+  result = d->db->set_flags( d->db, DB_RECNUM );
+  if ( result != 0 ) {
+    fprintf( stderr, "DB->set_flags() failed, returned %d\n", result );
+  }
+
+  return ret;
+}
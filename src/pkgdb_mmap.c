@@ -0,0 +1,1204 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <pkg.h>
+
+/*
+ * The mmap database format: a file written once, sorted by location,
+ * that we map and search in place instead of parsing, so opening it
+ * costs the same however many files are managed.  After a header page
+ * come the entries, in blocks that start on page boundaries; within a
+ * block each location is front-coded against the one before it, and
+ * package names are numbers into a table at the end of the file.  An
+ * index after the blocks has each block's first location in full, so
+ * finding a location is a binary search over the index and a scan of
+ * one block.
+ *
+ * Since the file can't be changed in place, opening it read-write
+ * keeps inserts and deletes in an rbtree over the top of it, and
+ * closing a changed database writes a new file alongside and renames
+ * it into place.  Anyone who already had the old one mapped keeps a
+ * consistent copy.
+ *
+ * Each entry is <shared prefix length> <suffix length> <suffix>
+ * <package number>, with the numbers as LEB128 varints.  The file is
+ * in native byte order, and the header says which that was.
+ */
+
+#define MMAP_DB_MAGIC "mpkgdb\n"
+#define MMAP_DB_VERSION 1
+#define MMAP_DB_BYTE_ORDER 0x01020304
+#define MMAP_DB_PAGE_SIZE 4096
+
+typedef struct {
+  char magic[8];
+  uint32_t byte_order;
+  uint32_t version;
+  uint32_t page_size;
+  uint32_t num_pkgs;
+  uint64_t num_entries;
+  uint64_t num_blocks;
+  uint64_t index_off;
+  uint64_t pkgs_off;
+  uint64_t file_size;
+  /* Longest location, so readers know how big a buffer to decode into */
+  uint32_t max_key_len;
+  uint32_t unused;
+} mmap_db_header;
+
+typedef struct {
+  /* Where the block starts, and how many bytes of entries it has */
+  uint64_t off;
+  uint64_t len;
+  /* Where its first location is, in full and NUL-terminated */
+  uint64_t key_off;
+} mmap_db_block;
+
+typedef struct {
+  char *filename;
+  unsigned char *map;
+  size_t map_len;
+  mmap_db_header *hdr;
+  mmap_db_block *index;
+  /* num_pkgs offsets of NUL-terminated package names */
+  uint64_t *pkgs;
+  /*
+   * Opened read-write, changes since we opened it: locations to
+   * package names, or to NULL for ones deleted from the file.
+   */
+  rbtree *changes;
+  unsigned long count;
+  int dirty;
+  /*
+   * In a transaction, what each location touched held before it (NULL
+   * if nothing), and whether we were dirty at the start.
+   */
+  rbtree *undo;
+  int undo_dirty;
+  /* See build_owner_index(); NULL until someone enumerates by package */
+  rbtree *owners;
+} mmap_db_data;
+
+/* Where we are in the file's entries */
+typedef struct {
+  uint64_t block, pos;
+  char *key;
+  uint64_t key_len;
+  uint64_t pkg;
+  int valid;
+} mmap_db_pos;
+
+/* For enumerate_mmap(): the file's entries merged with the changes */
+typedef struct {
+  mmap_db_pos pos;
+  rbtree_node *n;
+  int advance_pos, advance_n;
+} mmap_db_cursor;
+
+typedef struct {
+  FILE *fp;
+  /* Where the next block goes */
+  uint64_t off;
+  /* The block being built */
+  unsigned char *blk;
+  uint64_t blk_len, blk_alloc;
+  /* The last location put in it */
+  char *prev;
+  uint64_t prev_len, prev_alloc;
+  mmap_db_block *index;
+  uint64_t num_blocks, index_alloc;
+  /* First locations of the blocks, offsets in index[] relative to this */
+  char *keys;
+  uint64_t keys_len, keys_alloc;
+  /* Package names to their number plus one, and the names in order */
+  rbtree *pkg_nums;
+  char **pkgs;
+  uint64_t num_pkgs, pkgs_alloc;
+  uint64_t num_entries;
+  uint32_t max_key_len;
+  int error;
+} mmap_db_writer;
+
+static int abort_mmap( void * );
+static int add_to_mmap_writer( mmap_db_writer *, const char *,
+			       const char * );
+static int begin_mmap( void * );
+static int close_mmap( void * );
+static int commit_mmap( void * );
+static int delete_from_mmap( void *, char * );
+static void drop_owners_mmap( mmap_db_data * );
+static unsigned long entry_count_mmap( void * );
+static int enumerate_mmap( void *, void *, char **, char **, void ** );
+static int enumerate_by_package_mmap( void *, char *, void *, char **,
+				      void ** );
+static int enumerate_prefix_mmap( void *, char *, void *, char **, char **,
+				  void ** );
+static int foreach_mmap( void *,
+			 int (*)( const char *, const char *, void * ),
+			 void * );
+static void free_mmap_db_data( mmap_db_data * );
+static void free_mmap_writer( mmap_db_writer * );
+static int get_varint( const unsigned char *, uint64_t, uint64_t *,
+		       uint64_t * );
+static int grow_buffer( void **, uint64_t *, uint64_t, size_t );
+static int insert_into_mmap( void *, char *, char * );
+static int in_mmap_file( mmap_db_data *, const char * );
+static mmap_db_data * map_mmap_db( char * );
+static int next_merged( mmap_db_data *, mmap_db_cursor *, const char **,
+			const char ** );
+static int next_mmap_pos( mmap_db_data *, mmap_db_pos * );
+static const char * peek_mmap( void *, char * );
+static int put_varint( mmap_db_writer *, uint64_t );
+static const char * query_mmap_file( mmap_db_data *, const char * );
+static char * query_mmap( void *, char * );
+static int save_undo_mmap( mmap_db_data *, char * );
+static int seek_mmap_pos( mmap_db_data *, mmap_db_pos *, const char * );
+static pkg_db * setup_mmap_pkg_db( char *, dbmode_t );
+static int start_mmap_pos( mmap_db_data *, mmap_db_pos *, uint64_t );
+static void update_owners_mmap( mmap_db_data *, char *, char * );
+static int write_mmap_block( mmap_db_writer * );
+static int write_mmap_db( mmap_db_data *, const char * );
+static int write_zeros( FILE *, uint64_t );
+
+/* Put back everything changed since begin_mmap() */
+
+static int abort_mmap( void *vp ) {
+  mmap_db_data *d;
+  rbtree *undo;
+  rbtree_node *n;
+  void *key_v, *val_v;
+  int status, result;
+
+  status = 0;
+  if ( vp && ((mmap_db_data *)vp)->undo ) {
+    d = (mmap_db_data *)vp;
+    undo = d->undo;
+    d->undo = NULL;
+    n = NULL;
+    while ( key_v = rbtree_enum( undo, n, &val_v, &n ) ) {
+      if ( val_v ) result = insert_into_mmap( d, key_v, val_v );
+      else result = delete_from_mmap( d, key_v );
+      if ( result != 0 ) status = -1;
+    }
+    rbtree_free( undo );
+    d->dirty = d->undo_dirty;
+  }
+  else status = -1;
+
+  return status;
+}
+
+/*
+ * Append a location to the file being written; they must come in
+ * strictly increasing order.
+ */
+
+static int add_to_mmap_writer( mmap_db_writer *w, const char *key,
+			       const char *pkg ) {
+  uint64_t key_len, shared, need;
+  uint32_t num;
+  void *v;
+  int result;
+
+  if ( w->error ) return -1;
+
+  key_len = strlen( key );
+  if ( w->num_entries > 0 && strcmp( w->prev, key ) >= 0 ) {
+    fprintf( stderr, "pkgdb_mmap: %s out of order while writing\n", key );
+    w->error = 1;
+    return -1;
+  }
+
+  /* Number the package, if this is the first we've seen of it */
+  result = rbtree_query( w->pkg_nums, (void *)pkg, &v );
+  if ( result == RBTREE_SUCCESS ) num = (uint32_t)((uintptr_t)v - 1);
+  else {
+    if ( w->num_pkgs >= UINT32_MAX ||
+	 grow_buffer( (void **)&(w->pkgs), &(w->pkgs_alloc),
+		      w->num_pkgs + 1, sizeof( *(w->pkgs) ) ) != 0 ) {
+      w->error = 1;
+      return -1;
+    }
+    w->pkgs[w->num_pkgs] = copy_string( pkg );
+    if ( !(w->pkgs[w->num_pkgs]) ||
+	 rbtree_insert( w->pkg_nums, (void *)pkg,
+			(void *)((uintptr_t)(w->num_pkgs) + 1) ) !=
+	 RBTREE_SUCCESS ) {
+      if ( w->pkgs[w->num_pkgs] ) free( w->pkgs[w->num_pkgs] );
+      w->error = 1;
+      return -1;
+    }
+    num = (uint32_t)((w->num_pkgs)++);
+  }
+
+  /*
+   * Start a new block if this one would spill onto another page; an
+   * entry too big for a page gets a block to itself.  Leave room for
+   * the suffix and three varints of up to ten bytes.
+   */
+  need = key_len + 3 * 10;
+  if ( w->blk_len > 0 && w->blk_len + need > MMAP_DB_PAGE_SIZE ) {
+    if ( write_mmap_block( w ) != 0 ) return -1;
+  }
+
+  if ( w->blk_len == 0 ) {
+    /* Index the first location of the block in full */
+    if ( grow_buffer( (void **)&(w->index), &(w->index_alloc),
+		      w->num_blocks + 1, sizeof( *(w->index) ) ) != 0 ||
+	 grow_buffer( (void **)&(w->keys), &(w->keys_alloc),
+		      w->keys_len + key_len + 1, 1 ) != 0 ) {
+      w->error = 1;
+      return -1;
+    }
+    w->index[w->num_blocks].off = w->off;
+    w->index[w->num_blocks].len = 0;
+    w->index[w->num_blocks].key_off = w->keys_len;
+    memcpy( w->keys + w->keys_len, key, key_len + 1 );
+    w->keys_len += key_len + 1;
+    ++(w->num_blocks);
+    shared = 0;
+  }
+  else {
+    for ( shared = 0;
+	  shared < key_len && shared < w->prev_len &&
+	    key[shared] == w->prev[shared];
+	  ++shared );
+  }
+
+  if ( grow_buffer( (void **)&(w->blk), &(w->blk_alloc),
+		    w->blk_len + key_len + 3 * 10, 1 ) != 0 ||
+       grow_buffer( (void **)&(w->prev), &(w->prev_alloc),
+		    key_len + 1, 1 ) != 0 ) {
+    w->error = 1;
+    return -1;
+  }
+  put_varint( w, shared );
+  put_varint( w, key_len - shared );
+  memcpy( w->blk + w->blk_len, key + shared, key_len - shared );
+  w->blk_len += key_len - shared;
+  put_varint( w, num );
+
+  memcpy( w->prev, key, key_len + 1 );
+  w->prev_len = key_len;
+  if ( key_len > w->max_key_len ) w->max_key_len = (uint32_t)key_len;
+  ++(w->num_entries);
+
+  return 0;
+}
+
+static int begin_mmap( void *vp ) {
+  mmap_db_data *d;
+  int status;
+
+  status = 0;
+  if ( vp && !(((mmap_db_data *)vp)->undo) ) {
+    d = (mmap_db_data *)vp;
+    d->undo = rbtree_alloc( rbtree_string_comparator,
+			    rbtree_string_copier,
+			    rbtree_string_free,
+			    rbtree_string_copier,
+			    rbtree_string_free );
+    if ( d->undo ) d->undo_dirty = d->dirty;
+    else status = -1;
+  }
+  else status = -1;
+
+  return status;
+}
+
+static int close_mmap( void *vp ) {
+  mmap_db_data *d;
+  int status;
+
+  status = 0;
+  if ( vp ) {
+    d = (mmap_db_data *)vp;
+    /* Anything not committed by now never will be */
+    if ( d->undo ) abort_mmap( d );
+    if ( d->dirty ) status = write_mmap_db( d, d->filename );
+    free_mmap_db_data( d );
+  }
+  else status = -1;
+
+  return status;
+}
+
+/*
+ * Changes only reach the disk when the file is rewritten at close, so
+ * a commit just makes them permanent for this session.
+ */
+
+static int commit_mmap( void *vp ) {
+  mmap_db_data *d;
+  int status;
+
+  status = 0;
+  if ( vp && ((mmap_db_data *)vp)->undo ) {
+    d = (mmap_db_data *)vp;
+    rbtree_free( d->undo );
+    d->undo = NULL;
+  }
+  else status = -1;
+
+  return status;
+}
+
+pkg_db * create_pkg_db_mmap( char *filename ) {
+  if ( filename ) {
+    /* An empty database is just a header; write one and open it */
+    if ( write_mmap_db( NULL, filename ) == 0 )
+      return setup_mmap_pkg_db( filename, DBMODE_RW );
+    else return NULL;
+  }
+  else return NULL;
+}
+
+static int delete_from_mmap( void *vp, char *key ) {
+  mmap_db_data *d;
+  void *v;
+  int status, result;
+
+  status = 0;
+  if ( vp && key && save_undo_mmap( (mmap_db_data *)vp, key ) == 0 ) {
+    d = (mmap_db_data *)vp;
+    update_owners_mmap( d, key, NULL );
+    result = rbtree_query( d->changes, key, &v );
+    if ( result == RBTREE_SUCCESS ) {
+      if ( v ) {
+	/* We have it; if the file has it too, it has to stay deleted */
+	if ( in_mmap_file( d, key ) )
+	  result = rbtree_insert( d->changes, key, NULL );
+	else result = rbtree_delete( d->changes, key, NULL );
+	if ( result == RBTREE_SUCCESS ) {
+	  --(d->count);
+	  d->dirty = 1;
+	}
+	else {
+	  drop_owners_mmap( d );
+	  status = -1;
+	}
+      }
+      /* else already deleted */
+    }
+    else if ( in_mmap_file( d, key ) ) {
+      if ( rbtree_insert( d->changes, key, NULL ) == RBTREE_SUCCESS ) {
+	--(d->count);
+	d->dirty = 1;
+      }
+      else {
+	drop_owners_mmap( d );
+	status = -1;
+      }
+    }
+  }
+  else status = -1;
+
+  return status;
+}
+
+static void drop_owners_mmap( mmap_db_data *d ) {
+  if ( d->owners ) {
+    rbtree_free( d->owners );
+    d->owners = NULL;
+  }
+}
+
+static unsigned long entry_count_mmap( void *vp ) {
+  if ( vp ) return ((mmap_db_data *)vp)->count;
+  else return 0;
+}
+
+static int enumerate_mmap( void *vp, void *n_in, char **k_out,
+			   char **v_out, void **n_out ) {
+  mmap_db_data *d;
+  mmap_db_cursor *c;
+  const char *k, *v;
+  void *val;
+  int status, result;
+
+  status = 0;
+  if ( vp && k_out && v_out && n_out ) {
+    d = (mmap_db_data *)vp;
+    *k_out = NULL;
+    *v_out = NULL;
+    c = (mmap_db_cursor *)n_in;
+    if ( !c ) {
+      c = malloc( sizeof( *c ) );
+      if ( c ) {
+	c->advance_pos = 0;
+	c->advance_n = 0;
+	c->n = NULL;
+	if ( start_mmap_pos( d, &(c->pos), 0 ) == 0 )
+	  rbtree_enum( d->changes, NULL, &val, &(c->n) );
+	else {
+	  free( c );
+	  c = NULL;
+	}
+      }
+      if ( !c ) status = -1;
+    }
+
+    if ( status == 0 ) {
+      result = next_merged( d, c, &k, &v );
+      if ( result > 0 ) {
+	*k_out = copy_string( k );
+	*v_out = copy_string( v );
+	if ( *k_out && *v_out ) *n_out = c;
+	else result = -1;
+      }
+      if ( result <= 0 ) {
+	if ( result < 0 ) {
+	  fprintf( stderr, "pkgdb_mmap: error while enumerating %s\n",
+		   d->filename );
+	  if ( *k_out ) free( *k_out );
+	  if ( *v_out ) free( *v_out );
+	  status = -1;
+	}
+	free( c->pos.key );
+	free( c );
+	*k_out = NULL;
+	*v_out = NULL;
+	*n_out = NULL;
+      }
+    }
+  }
+  else status = -1;
+
+  return status;
+}
+
+static int enumerate_by_package_mmap( void *vp, char *pkg, void *n_in,
+				      char **k_out, void **n_out ) {
+  mmap_db_data *d;
+
+  if ( vp && pkg && k_out && n_out ) {
+    d = (mmap_db_data *)vp;
+    if ( !(d->owners) ) d->owners = build_owner_index( d, foreach_mmap );
+    if ( d->owners )
+      return enumerate_owner_index( d->owners, pkg, n_in, k_out, n_out );
+    else return -1;
+  }
+  else return -1;
+}
+
+/*
+ * Like enumerate_mmap(), but the cursor starts with a search for prefix
+ * in the file and the changes, and we stop at the first location
+ * without it.
+ */
+
+static int enumerate_prefix_mmap( void *vp, char *prefix, void *n_in,
+				  char **k_out, char **v_out, void **n_out ) {
+  mmap_db_data *d;
+  mmap_db_cursor *c;
+  const char *k, *v;
+  void *val;
+  int status, result;
+
+  status = 0;
+  if ( vp && prefix && k_out && v_out && n_out ) {
+    d = (mmap_db_data *)vp;
+    *k_out = NULL;
+    *v_out = NULL;
+    c = (mmap_db_cursor *)n_in;
+    if ( !c ) {
+      c = malloc( sizeof( *c ) );
+      if ( c ) {
+	c->advance_pos = 0;
+	c->advance_n = 0;
+	c->n = NULL;
+	if ( seek_mmap_pos( d, &(c->pos), prefix ) == 0 )
+	  rbtree_enum_from( d->changes, prefix, &val, &(c->n) );
+	else {
+	  free( c );
+	  c = NULL;
+	}
+      }
+      if ( !c ) status = -1;
+    }
+
+    if ( status == 0 ) {
+      result = next_merged( d, c, &k, &v );
+      if ( result > 0 && strncmp( k, prefix, strlen( prefix ) ) != 0 )
+	result = 0;
+      if ( result > 0 ) {
+	*k_out = copy_string( k );
+	*v_out = copy_string( v );
+	if ( *k_out && *v_out ) *n_out = c;
+	else result = -1;
+      }
+      if ( result <= 0 ) {
+	if ( result < 0 ) {
+	  fprintf( stderr, "pkgdb_mmap: error while enumerating %s\n",
+		   d->filename );
+	  if ( *k_out ) free( *k_out );
+	  if ( *v_out ) free( *v_out );
+	  status = -1;
+	}
+	free( c->pos.key );
+	free( c );
+	*k_out = NULL;
+	*v_out = NULL;
+	*n_out = NULL;
+      }
+    }
+  }
+  else status = -1;
+
+  return status;
+}
+
+/*
+ * The same merge as enumerate_mmap(), handing fn the strings in the map
+ * and the changes directly.
+ */
+
+static int foreach_mmap( void *vp,
+			 int (*fn)( const char *, const char *, void * ),
+			 void *arg ) {
+  mmap_db_data *d;
+  mmap_db_cursor c;
+  const char *k, *v;
+  void *val;
+  int status, result;
+
+  status = 0;
+  if ( vp && fn ) {
+    d = (mmap_db_data *)vp;
+    c.advance_pos = 0;
+    c.advance_n = 0;
+    c.n = NULL;
+    if ( start_mmap_pos( d, &(c.pos), 0 ) == 0 ) {
+      rbtree_enum( d->changes, NULL, &val, &(c.n) );
+      while ( status == 0 && ( result = next_merged( d, &c, &k, &v ) ) ) {
+	if ( result > 0 ) status = fn( k, v, arg );
+	else {
+	  fprintf( stderr, "pkgdb_mmap: error while enumerating %s\n",
+		   d->filename );
+	  status = -1;
+	}
+      }
+      free( c.pos.key );
+    }
+    else status = -1;
+  }
+  else status = -1;
+
+  return status;
+}
+
+static void free_mmap_db_data( mmap_db_data *d ) {
+  if ( d ) {
+    if ( d->map ) munmap( d->map, d->map_len );
+    if ( d->changes ) rbtree_free( d->changes );
+    if ( d->undo ) rbtree_free( d->undo );
+    if ( d->owners ) rbtree_free( d->owners );
+    if ( d->filename ) free( d->filename );
+    free( d );
+  }
+}
+
+static void free_mmap_writer( mmap_db_writer *w ) {
+  uint64_t i;
+
+  if ( w->blk ) free( w->blk );
+  if ( w->prev ) free( w->prev );
+  if ( w->index ) free( w->index );
+  if ( w->keys ) free( w->keys );
+  if ( w->pkg_nums ) rbtree_free( w->pkg_nums );
+  if ( w->pkgs ) {
+    for ( i = 0; i < w->num_pkgs; ++i ) free( w->pkgs[i] );
+    free( w->pkgs );
+  }
+}
+
+/* Read a varint from p at *pos, which must stay short of len */
+
+static int get_varint( const unsigned char *p, uint64_t len, uint64_t *pos,
+		       uint64_t *out ) {
+  uint64_t v;
+  int shift;
+
+  v = 0;
+  for ( shift = 0; shift < 64 && *pos < len; shift += 7 ) {
+    v |= (uint64_t)(p[*pos] & 0x7f) << shift;
+    if ( !(p[(*pos)++] & 0x80) ) {
+      *out = v;
+      return 0;
+    }
+  }
+
+  return -1;
+}
+
+/* Make sure *buf, with room for *alloc items of size sz, has room for n */
+
+static int grow_buffer( void **buf, uint64_t *alloc, uint64_t n, size_t sz ) {
+  uint64_t new_alloc;
+  void *tmp;
+
+  if ( *alloc >= n ) return 0;
+  new_alloc = ( *alloc > 0 ) ? 2 * *alloc : 16;
+  while ( new_alloc < n ) new_alloc *= 2;
+  tmp = realloc( *buf, new_alloc * sz );
+  if ( tmp ) {
+    *buf = tmp;
+    *alloc = new_alloc;
+    return 0;
+  }
+  else return -1;
+}
+
+static int insert_into_mmap( void *vp, char *key, char *value ) {
+  mmap_db_data *d;
+  void *v;
+  int status, result, existed;
+
+  status = 0;
+  if ( vp && key && value &&
+       save_undo_mmap( (mmap_db_data *)vp, key ) == 0 ) {
+    d = (mmap_db_data *)vp;
+    update_owners_mmap( d, key, value );
+    result = rbtree_query( d->changes, key, &v );
+    if ( result == RBTREE_SUCCESS ) existed = ( v != NULL );
+    else existed = in_mmap_file( d, key );
+    if ( rbtree_insert( d->changes, key, value ) == RBTREE_SUCCESS ) {
+      if ( !existed ) ++(d->count);
+      d->dirty = 1;
+    }
+    else {
+      drop_owners_mmap( d );
+      status = -1;
+    }
+  }
+  else status = -1;
+
+  return status;
+}
+
+static int in_mmap_file( mmap_db_data *d, const char *key ) {
+  return ( query_mmap_file( d, key ) != NULL );
+}
+
+/* Map filename and check it over; NULL if it isn't one of ours */
+
+static mmap_db_data * map_mmap_db( char *filename ) {
+  mmap_db_data *d;
+  mmap_db_header *h;
+  struct stat st;
+  int fd, ok;
+
+  d = NULL;
+  fd = open( filename, O_RDONLY );
+  if ( fd >= 0 ) {
+    if ( fstat( fd, &st ) == 0 && S_ISREG( st.st_mode ) &&
+	 st.st_size >= sizeof( mmap_db_header ) ) {
+      d = malloc( sizeof( *d ) );
+      if ( d ) {
+	d->filename = copy_string( filename );
+	d->map_len = (size_t)(st.st_size);
+	d->map = mmap( NULL, d->map_len, PROT_READ, MAP_SHARED, fd, 0 );
+	d->changes = NULL;
+	d->dirty = 0;
+	d->undo = NULL;
+	d->owners = NULL;
+	if ( d->map == MAP_FAILED ) d->map = NULL;
+	ok = ( d->filename && d->map );
+	if ( ok ) {
+	  h = (mmap_db_header *)(d->map);
+	  d->hdr = h;
+	  ok = ( memcmp( h->magic, MMAP_DB_MAGIC, sizeof( h->magic ) ) == 0 &&
+		 h->byte_order == MMAP_DB_BYTE_ORDER &&
+		 h->version == MMAP_DB_VERSION &&
+		 h->file_size == d->map_len &&
+		 h->index_off <= h->file_size &&
+		 h->num_blocks <= ( h->file_size - h->index_off ) /
+		 sizeof( mmap_db_block ) &&
+		 h->index_off % sizeof( uint64_t ) == 0 &&
+		 h->pkgs_off <= h->file_size &&
+		 h->num_pkgs <= ( h->file_size - h->pkgs_off ) /
+		 sizeof( uint64_t ) &&
+		 h->pkgs_off % sizeof( uint64_t ) == 0 );
+	}
+	if ( ok ) {
+	  d->index = (mmap_db_block *)(d->map + d->hdr->index_off);
+	  d->pkgs = (uint64_t *)(d->map + d->hdr->pkgs_off);
+	  d->count = (unsigned long)(d->hdr->num_entries);
+	  /*
+	   * The file ends with the NUL after the last package name, so
+	   * any string that starts in it ends in it.  The offsets in the
+	   * index get checked as we use them; looking them all over now
+	   * would cost as much as reading the whole index.
+	   */
+	  ok = ( d->map[d->map_len - 1] == '\0' );
+	}
+	if ( !ok ) fprintf( stderr, "pkgdb_mmap: %s is damaged\n", filename );
+	if ( !ok ) {
+	  free_mmap_db_data( d );
+	  d = NULL;
+	}
+      }
+    }
+    close( fd );
+  }
+
+  return d;
+}
+
+/*
+ * The next location in order from the file or the changes, skipping
+ * deleted ones.  The pointers are good until the next call.  Returns 1
+ * if we got one, 0 at the end, or -1 if the file was damaged.
+ */
+
+static int next_merged( mmap_db_data *d, mmap_db_cursor *c,
+			const char **k, const char **v ) {
+  void *val;
+  int cmp;
+
+  while ( 1 ) {
+    if ( c->advance_pos ) {
+      if ( next_mmap_pos( d, &(c->pos) ) != 0 ) return -1;
+      c->advance_pos = 0;
+    }
+    if ( c->advance_n ) {
+      rbtree_enum( d->changes, c->n, &val, &(c->n) );
+      c->advance_n = 0;
+    }
+
+    if ( !(c->pos.valid) && !(c->n) ) return 0;
+    else if ( !(c->n) ) cmp = -1;
+    else if ( !(c->pos.valid) ) cmp = 1;
+    else cmp = strcmp( c->pos.key, (char *)(c->n->key) );
+
+    if ( cmp < 0 ) {
+      *k = c->pos.key;
+      *v = (char *)(d->map + d->pkgs[c->pos.pkg]);
+      c->advance_pos = 1;
+      return 1;
+    }
+    else {
+      /* The change wins; a NULL value means it's gone */
+      if ( cmp == 0 ) c->advance_pos = 1;
+      c->advance_n = 1;
+      if ( c->n->value ) {
+	*k = (char *)(c->n->key);
+	*v = (char *)(c->n->value);
+	return 1;
+      }
+    }
+  }
+}
+
+/*
+ * Step p to the next entry in the file, clearing p->valid past the
+ * last one.  Returns -1 if the file is damaged.
+ */
+
+static int next_mmap_pos( mmap_db_data *d, mmap_db_pos *p ) {
+  mmap_db_block *b;
+  const unsigned char *blk;
+  uint64_t shared, suffix, pkg;
+  int first;
+
+  while ( p->block < d->hdr->num_blocks &&
+	  p->pos >= d->index[p->block].len ) {
+    ++(p->block);
+    p->pos = 0;
+  }
+  if ( p->block >= d->hdr->num_blocks ) {
+    p->valid = 0;
+    return 0;
+  }
+
+  b = &(d->index[p->block]);
+  if ( b->off > d->map_len || b->len > d->map_len - b->off ) {
+    p->valid = 0;
+    return -1;
+  }
+  blk = d->map + b->off;
+  /* The first entry of a block has nothing to share */
+  first = ( p->pos == 0 );
+  if ( get_varint( blk, b->len, &(p->pos), &shared ) != 0 ||
+       get_varint( blk, b->len, &(p->pos), &suffix ) != 0 ||
+       shared > ( first ? 0 : p->key_len ) ||
+       suffix > d->hdr->max_key_len - shared ||
+       suffix > b->len - p->pos ) {
+    p->valid = 0;
+    return -1;
+  }
+  memcpy( p->key + shared, blk + p->pos, suffix );
+  p->pos += suffix;
+  p->key_len = shared + suffix;
+  p->key[p->key_len] = '\0';
+  if ( get_varint( blk, b->len, &(p->pos), &pkg ) != 0 ||
+       pkg >= d->hdr->num_pkgs || d->pkgs[pkg] >= d->map_len ) {
+    p->valid = 0;
+    return -1;
+  }
+  p->pkg = pkg;
+  p->valid = 1;
+
+  return 0;
+}
+
+pkg_db * open_pkg_db_mmap( char *filename, dbmode_t mode ) {
+  if ( filename ) return setup_mmap_pkg_db( filename, mode );
+  else return NULL;
+}
+
+static const char * peek_mmap( void *vp, char *key ) {
+  mmap_db_data *d;
+  void *v;
+
+  if ( vp && key ) {
+    d = (mmap_db_data *)vp;
+    if ( d->changes && rbtree_query( d->changes, key, &v ) ==
+	 RBTREE_SUCCESS ) {
+      /* NULL if it was deleted */
+      return (const char *)v;
+    }
+    else return query_mmap_file( d, key );
+  }
+  else return NULL;
+}
+
+static int put_varint( mmap_db_writer *w, uint64_t v ) {
+  do {
+    w->blk[(w->blk_len)++] = ( v & 0x7f ) | ( ( v > 0x7f ) ? 0x80 : 0 );
+    v >>= 7;
+  } while ( v > 0 );
+
+  return 0;
+}
+
+/*
+ * Find key in the file itself, ignoring any changes; returns the
+ * package name in the map, or NULL.
+ */
+
+static const char * query_mmap_file( mmap_db_data *d, const char *key ) {
+  mmap_db_pos p;
+  const char *result;
+
+  result = NULL;
+  if ( seek_mmap_pos( d, &p, key ) == 0 ) {
+    if ( p.valid && strcmp( p.key, key ) == 0 )
+      result = (char *)(d->map + d->pkgs[p.pkg]);
+    free( p.key );
+  }
+
+  return result;
+}
+
+static char * query_mmap( void *vp, char *key ) {
+  const char *pkg;
+
+  pkg = peek_mmap( vp, key );
+  if ( pkg ) return copy_string( pkg );
+  else return NULL;
+}
+
+/* In a transaction, remember what key held before its first change */
+
+static int save_undo_mmap( mmap_db_data *d, char *key ) {
+  void *v;
+  const char *old;
+  int status;
+
+  status = 0;
+  if ( d->undo && rbtree_query( d->undo, key, &v ) == RBTREE_NOT_FOUND ) {
+    old = peek_mmap( d, key );
+    if ( rbtree_insert( d->undo, key, (char *)old ) != RBTREE_SUCCESS )
+      status = -1;
+  }
+
+  return status;
+}
+
+/*
+ * Point p at the first entry in the file at or after key, or past the
+ * end; a binary search of the index finds the block to start in.
+ */
+
+static int seek_mmap_pos( mmap_db_data *d, mmap_db_pos *p,
+			  const char *key ) {
+  uint64_t lo, hi, mid;
+
+  /* Find the last block starting at or before key */
+  lo = 0;
+  hi = d->hdr->num_blocks;
+  while ( hi - lo > 1 ) {
+    mid = lo + ( hi - lo ) / 2;
+    if ( d->index[mid].key_off >= d->map_len ) {
+      fprintf( stderr, "pkgdb_mmap: %s is damaged\n", d->filename );
+      return -1;
+    }
+    if ( strcmp( (char *)(d->map + d->index[mid].key_off), key ) <= 0 )
+      lo = mid;
+    else hi = mid;
+  }
+
+  if ( start_mmap_pos( d, p, lo ) != 0 ) return -1;
+  while ( p->valid && strcmp( p->key, key ) < 0 ) {
+    if ( next_mmap_pos( d, p ) != 0 ) {
+      fprintf( stderr, "pkgdb_mmap: %s is damaged\n", d->filename );
+      break;
+    }
+  }
+
+  return 0;
+}
+
+static pkg_db * setup_mmap_pkg_db( char *filename, dbmode_t mode ) {
+  pkg_db *db;
+  mmap_db_data *d;
+
+  db = malloc( sizeof( *db ) );
+  if ( db ) {
+    db->query = query_mmap;
+    db->peek = peek_mmap;
+    db->insert = insert_into_mmap;
+    db->delete = delete_from_mmap;
+    db->close = close_mmap;
+    db->compact = NULL;
+    db->begin = begin_mmap;
+    db->commit = commit_mmap;
+    db->abort = abort_mmap;
+    db->entry_count = entry_count_mmap;
+    db->enumerate = enumerate_mmap;
+    db->enumerate_by_package = enumerate_by_package_mmap;
+    db->enumerate_prefix = enumerate_prefix_mmap;
+    db->foreach = foreach_mmap;
+    db->format = DBFMT_MMAP;
+    db->filename = copy_string( filename );
+    db->mode = mode;
+
+    d = NULL;
+    if ( db->filename ) {
+      d = map_mmap_db( filename );
+      if ( d ) {
+	/* Only changes need the rbtree */
+	d->changes = rbtree_alloc( rbtree_string_comparator,
+				   rbtree_string_copier,
+				   rbtree_string_free,
+				   rbtree_string_copier,
+				   rbtree_string_free );
+	if ( !(d->changes) ) {
+	  free_mmap_db_data( d );
+	  d = NULL;
+	}
+      }
+    }
+
+    if ( d ) db->private = d;
+    else {
+      if ( db->filename ) free( db->filename );
+      free( db );
+      db = NULL;
+    }
+  }
+
+  return db;
+}
+
+/* Point p at the first entry of block b, or past the end */
+
+static int start_mmap_pos( mmap_db_data *d, mmap_db_pos *p, uint64_t b ) {
+  p->key = malloc( d->hdr->max_key_len + 1 );
+  if ( !(p->key) ) return -1;
+  p->key[0] = '\0';
+  p->key_len = 0;
+  p->block = b;
+  p->pos = 0;
+  p->valid = 0;
+  if ( next_mmap_pos( d, p ) != 0 ) {
+    fprintf( stderr, "pkgdb_mmap: %s is damaged\n", d->filename );
+    /* Leave it invalid, so it reads as running out */
+  }
+
+  return 0;
+}
+
+/* Move key to pkg, or out if pkg is NULL, in any owner index */
+
+static void update_owners_mmap( mmap_db_data *d, char *key, char *pkg ) {
+  const char *old;
+  int result;
+
+  if ( d->owners ) {
+    result = 0;
+    old = peek_mmap( d, key );
+    if ( old ) result = remove_from_owner_index( d->owners, key, (char *)old );
+    if ( result == 0 && pkg )
+      result = add_to_owner_index( d->owners, key, pkg );
+    if ( result != 0 ) drop_owners_mmap( d );
+  }
+}
+
+static int write_mmap_block( mmap_db_writer *w ) {
+  uint64_t padded;
+
+  if ( w->blk_len > 0 ) {
+    padded = ( w->blk_len + MMAP_DB_PAGE_SIZE - 1 ) &
+      ~((uint64_t)MMAP_DB_PAGE_SIZE - 1);
+    if ( fwrite( w->blk, 1, w->blk_len, w->fp ) != w->blk_len ||
+	 write_zeros( w->fp, padded - w->blk_len ) != 0 ) {
+      w->error = 1;
+      return -1;
+    }
+    w->index[w->num_blocks - 1].len = w->blk_len;
+    w->off += padded;
+    w->blk_len = 0;
+    w->prev_len = 0;
+  }
+
+  return 0;
+}
+
+/*
+ * Write out everything in d (the file merged with its changes), or an
+ * empty database if d is NULL, to a temp next to filename and rename
+ * it over filename.
+ */
+
+static int write_mmap_db( mmap_db_data *d, const char *filename ) {
+  mmap_db_writer w;
+  mmap_db_header h;
+  mmap_db_cursor c;
+  const char *k, *v;
+  char *tmpl;
+  void *val;
+  uint64_t pkg_off, i;
+  int fd, status, result, tmpl_len;
+
+  status = 0;
+  memset( &w, 0, sizeof( w ) );
+  tmpl_len = strlen( filename ) + 8;
+  tmpl = malloc( tmpl_len );
+  w.pkg_nums = rbtree_alloc( rbtree_string_comparator,
+			     rbtree_string_copier, rbtree_string_free,
+			     NULL, NULL );
+  if ( !tmpl || !(w.pkg_nums) ) {
+    fprintf( stderr, "pkgdb_mmap: out of memory writing %s\n", filename );
+    if ( tmpl ) free( tmpl );
+    free_mmap_writer( &w );
+    return -1;
+  }
+
+  snprintf( tmpl, tmpl_len, "%s.XXXXXX", filename );
+  fd = mkstemp( tmpl );
+  if ( fd >= 0 ) {
+    fchmod( fd, 0644 );
+    w.fp = fdopen( fd, "w" );
+    if ( !(w.fp) ) close( fd );
+  }
+  if ( w.fp ) {
+    /* The header goes in last, once we know what to put in it */
+    w.off = MMAP_DB_PAGE_SIZE;
+    if ( write_zeros( w.fp, MMAP_DB_PAGE_SIZE ) != 0 ) status = -1;
+
+    if ( status == 0 && d ) {
+      c.advance_pos = 0;
+      c.advance_n = 0;
+      c.n = NULL;
+      if ( start_mmap_pos( d, &(c.pos), 0 ) == 0 ) {
+	rbtree_enum( d->changes, NULL, &val, &(c.n) );
+	while ( ( result = next_merged( d, &c, &k, &v ) ) > 0 ) {
+	  if ( add_to_mmap_writer( &w, k, v ) != 0 ) break;
+	}
+	if ( result < 0 || w.error ) status = -1;
+	free( c.pos.key );
+      }
+      else status = -1;
+    }
+    if ( status == 0 && write_mmap_block( &w ) != 0 ) status = -1;
+
+    if ( status == 0 ) {
+      memset( &h, 0, sizeof( h ) );
+      memcpy( h.magic, MMAP_DB_MAGIC, sizeof( h.magic ) );
+      h.byte_order = MMAP_DB_BYTE_ORDER;
+      h.version = MMAP_DB_VERSION;
+      h.page_size = MMAP_DB_PAGE_SIZE;
+      h.num_pkgs = w.num_pkgs;
+      h.num_entries = w.num_entries;
+      h.num_blocks = w.num_blocks;
+      h.max_key_len = w.max_key_len;
+      /* Blocks end on a page boundary, so this is aligned */
+      h.index_off = w.off;
+      for ( i = 0; i < w.num_blocks; ++i )
+	w.index[i].key_off += h.index_off +
+	  w.num_blocks * sizeof( mmap_db_block );
+      h.pkgs_off = h.index_off + w.num_blocks * sizeof( mmap_db_block ) +
+	w.keys_len;
+      h.pkgs_off = ( h.pkgs_off + sizeof( uint64_t ) - 1 ) &
+	~((uint64_t)sizeof( uint64_t ) - 1);
+      pkg_off = h.pkgs_off + w.num_pkgs * sizeof( uint64_t );
+
+      if ( ( w.num_blocks > 0 &&
+	     fwrite( w.index, sizeof( mmap_db_block ), w.num_blocks, w.fp ) !=
+	     w.num_blocks ) ||
+	   ( w.keys_len > 0 &&
+	     fwrite( w.keys, 1, w.keys_len, w.fp ) != w.keys_len ) ||
+	   write_zeros( w.fp, h.pkgs_off - h.index_off -
+			w.num_blocks * sizeof( mmap_db_block ) -
+			w.keys_len ) != 0 )
+	status = -1;
+      for ( i = 0; status == 0 && i < w.num_pkgs; ++i ) {
+	if ( fwrite( &pkg_off, sizeof( pkg_off ), 1, w.fp ) != 1 )
+	  status = -1;
+	pkg_off += strlen( w.pkgs[i] ) + 1;
+      }
+      for ( i = 0; status == 0 && i < w.num_pkgs; ++i ) {
+	if ( fwrite( w.pkgs[i], 1, strlen( w.pkgs[i] ) + 1, w.fp ) !=
+	     strlen( w.pkgs[i] ) + 1 )
+	  status = -1;
+      }
+      h.file_size = pkg_off;
+
+      if ( status == 0 &&
+	   ( fseek( w.fp, 0, SEEK_SET ) != 0 ||
+	     fwrite( &h, sizeof( h ), 1, w.fp ) != 1 ) )
+	status = -1;
+    }
+
+    if ( fclose( w.fp ) != 0 ) status = -1;
+    if ( status == 0 && rename( tmpl, filename ) != 0 ) status = -1;
+    if ( status != 0 ) {
+      fprintf( stderr, "pkgdb_mmap: couldn't write %s\n", filename );
+      unlink( tmpl );
+    }
+  }
+  else {
+    fprintf( stderr, "pkgdb_mmap: couldn't create a temp for %s: %s\n",
+	     filename, strerror( errno ) );
+    status = -1;
+  }
+
+  free( tmpl );
+  free_mmap_writer( &w );
+
+  return status;
+}
+
+static int write_zeros( FILE *fp, uint64_t n ) {
+  static const char zeros[512];
+  uint64_t len;
+
+  while ( n > 0 ) {
+    len = ( n > sizeof( zeros ) ) ? sizeof( zeros ) : n;
+    if ( fwrite( zeros, 1, len, fp ) != len ) return -1;
+    n -= len;
+  }
+
+  return 0;
+}
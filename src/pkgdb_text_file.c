@@ -10,89 +10,377 @@
 
 #include <pkg.h>
 
+/*
+ * Changes to an existing text DB are not written back by rewriting the
+ * whole file; each close appends the inserts and deletes it made to a
+ * journal next to it, as lines of the form
+ *
+ * + <location> <package>
+ * - <location>
+ *
+ * followed by a line holding a single '.' to commit the batch.  Opening
+ * the DB replays every committed batch over the base file, and a batch
+ * with no commit line (a close that died part way through) is ignored.
+ * Once the journal grows large compared to the DB, or on request, it is
+ * folded back into the base file.
+ */
+
+#define JOURNAL_SUFFIX ".journal"
+#define JOURNAL_INSERT '+'
+#define JOURNAL_DELETE '-'
+#define JOURNAL_COMMIT "."
+/* Fold the journal in once it has more records than this... */
+#define JOURNAL_COMPACT_MIN 1024
+/* ...and more than one for every JOURNAL_COMPACT_RATIO entries */
+#define JOURNAL_COMPACT_RATIO 2
+
+/*
+ * What holds the locations in memory: a pkg_map, or with USE_PATHTRIE
+ * a trie by path component, which is much smaller for a big DB.
+ */
+
+#ifdef USE_PATHTRIE
+
+typedef pathtrie text_map;
+typedef pathtrie_node text_map_node;
+
+#define TEXT_MAP_SUCCESS PATHTRIE_SUCCESS
+#define TEXT_MAP_NOT_FOUND PATHTRIE_NOT_FOUND
+#define TEXT_MAP_ERROR PATHTRIE_ERROR
+#define TEXT_MAP_NO_OVERWRITE PATHTRIE_NO_OVERWRITE
+
+/* A trie gains nothing from one long run, so load a bit at a time */
+#define TEXT_MAP_BATCH 4096
+
+#define text_map_alloc() pathtrie_alloc()
+#define text_map_build_from_sorted pathtrie_build_from_sorted
+#define text_map_delete pathtrie_delete
+#define text_map_enum pathtrie_enum
+#define text_map_enum_from pathtrie_enum_from
+#define text_map_free pathtrie_free
+#define text_map_insert pathtrie_insert
+#define text_map_query pathtrie_query
+#define text_map_size pathtrie_size
+
+#else /* USE_PATHTRIE */
+
+typedef pkg_map text_map;
+typedef pkg_map_node text_map_node;
+
+#define TEXT_MAP_SUCCESS PKG_MAP_SUCCESS
+#define TEXT_MAP_NOT_FOUND PKG_MAP_NOT_FOUND
+#define TEXT_MAP_ERROR PKG_MAP_ERROR
+#define TEXT_MAP_NO_OVERWRITE PKG_MAP_NO_OVERWRITE
+
+/* Build from the whole file at once; see parse_text_file() */
+#define TEXT_MAP_BATCH 0
+
+#define text_map_alloc() \
+  pkg_map_alloc( rbtree_string_comparator, \
+		 rbtree_string_copier, rbtree_string_free, \
+		 rbtree_string_copier, rbtree_string_free )
+#define text_map_build_from_sorted pkg_map_build_from_sorted
+#define text_map_delete pkg_map_delete
+#define text_map_enum pkg_map_enum
+#define text_map_enum_from pkg_map_enum_from
+#define text_map_free pkg_map_free
+#define text_map_insert pkg_map_insert
+#define text_map_query pkg_map_query
+#define text_map_size pkg_map_size
+
+#endif /* USE_PATHTRIE */
+
 typedef struct {
-  char *filename;
-  rbtree *data;
+  char *filename, *journal_filename;
+  text_map *data;
   int dirty, created;
+  /* Records in the committed part of the journal, and its length */
+  unsigned long journal_records;
+  off_t journal_len;
+  /* Records made since open, not yet in the journal */
+  char *pending;
+  size_t pending_len, pending_alloc;
+  unsigned long pending_records;
+  /*
+   * In a transaction, what each location touched held before it (NULL
+   * if nothing), and how much of pending and dirty to go back to.
+   */
+  rbtree *undo;
+  size_t undo_pending_len;
+  unsigned long undo_pending_records;
+  int undo_dirty;
+  /* Package names to what they own; built the first time it's asked */
+  rbtree *owners;
 } text_file_data;
 
+/*
+ * The lines of the base file while reading it, with the fields parsed
+ * out of them in place, so the map can be built in one go.
+ */
+typedef struct {
+  char **lines;
+  void **keys, **vals;
+  int *lnums;
+  unsigned long count, alloced;
+} text_file_lines;
+
+static int abort_text_file( void * );
+static int add_journal_record( text_file_data *, char, char *, char * );
+static text_file_data * alloc_text_file_data( char * );
+static int begin_text_file( void * );
 static int close_text_file( void * );
+static int commit_text_file( void * );
+static int compact_text_file( void * );
 static int delete_from_text_file( void *, char * );
+static void drop_owners( text_file_data * );
 static unsigned long entry_count_text_file( void * );
 static int enumerate_text_file( void *, void *, char **, char **, void ** );
+static int enumerate_by_package_text_file( void *, char *, void *, char **,
+					   void ** );
+static int enumerate_prefix_text_file( void *, char *, void *, char **,
+				       char **, void ** );
+static int foreach_text_file( void *,
+			      int (*)( const char *, const char *, void * ),
+			      void * );
+static void free_text_file_data( text_file_data * );
 static int insert_into_text_file( void *, char *, char * );
+static int load_text_file_lines( text_file_lines *, text_map * );
 static int make_backup( text_file_data * );
-static int parse_line( char *, rbtree *, int );
-static int parse_text_file( FILE *, rbtree * );
+static int parse_journal_line( char *, text_map *, int );
+static int parse_line( char *, text_file_lines *, int );
+static int parse_text_file( FILE *, text_map * );
+static const char * peek_text_file( void *, char * );
 static char * query_text_file( void *, char * );
+static int read_journal( text_file_data * );
 static text_file_data * read_text_file( char * );
+static int save_undo( text_file_data *, char * );
+static void setup_text_file_db( pkg_db * );
+static void update_owners( text_file_data *, char *, char * );
+static int write_journal( text_file_data * );
+static int write_text_file( text_file_data * );
 
-static int close_text_file( void *tfd_v ) {
+/*
+ * Put back everything changed since begin_text_file(), and drop the
+ * journal records for it.
+ */
+
+static int abort_text_file( void *tfd_v ) {
   text_file_data *tfd;
-  int status, result, lnum;
-  FILE *fp;
+  rbtree *undo;
   rbtree_node *n;
   void *key_v, *val_v;
-  char *key, *val;
+  int status, result;
+
+  status = 0;
+  if ( tfd_v && ((text_file_data *)tfd_v)->undo ) {
+    tfd = (text_file_data *)tfd_v;
+    undo = tfd->undo;
+    tfd->undo = NULL;
+    n = NULL;
+    while ( key_v = rbtree_enum( undo, n, &val_v, &n ) ) {
+      if ( val_v ) result = text_map_insert( tfd->data, key_v, val_v );
+      else {
+	result = text_map_delete( tfd->data, key_v, NULL );
+	if ( result == TEXT_MAP_NOT_FOUND ) result = TEXT_MAP_SUCCESS;
+      }
+      if ( result != TEXT_MAP_SUCCESS ) {
+	fprintf( stderr, "pkgdb_text_file: " );
+	fprintf( stderr, "couldn't restore %s while aborting.\n",
+		 (char *)key_v );
+	status = -1;
+      }
+    }
+    rbtree_free( undo );
+    /* Cheaper to build the owner index again if anyone asks */
+    drop_owners( tfd );
+    tfd->pending_len = tfd->undo_pending_len;
+    tfd->pending_records = tfd->undo_pending_records;
+    tfd->dirty = tfd->undo_dirty;
+  }
+  else status = -1;
+  return status;
+}
+
+/*
+ * Queue a journal record in tfd->pending; nothing reaches the disk
+ * until commit or close.
+ */
+
+static int add_journal_record( text_file_data *tfd, char op,
+			       char *key, char *val ) {
+  size_t len, reserve, new_alloc;
+  char *temp;
+  int status;
+
+  status = 0;
+  if ( tfd && key ) {
+    /* Op, space, key, and optionally space and value, then newline */
+    len = 2 + strlen( key ) + 1;
+    if ( val ) len += 1 + strlen( val );
+
+    /* Always leave room for the commit line write_journal() adds */
+    reserve = len + strlen( JOURNAL_COMMIT "\n" ) + 1;
+    if ( tfd->pending_len + reserve > tfd->pending_alloc ) {
+      new_alloc = ( tfd->pending_alloc > 0 ) ? tfd->pending_alloc : 1024;
+      while ( tfd->pending_len + reserve > new_alloc ) new_alloc *= 2;
+      temp = realloc( tfd->pending, new_alloc );
+      if ( temp ) {
+	tfd->pending = temp;
+	tfd->pending_alloc = new_alloc;
+      }
+      else status = -1;
+    }
+
+    if ( status == 0 ) {
+      if ( val ) {
+	snprintf( tfd->pending + tfd->pending_len, len + 1,
+		  "%c %s %s\n", op, key, val );
+      }
+      else {
+	snprintf( tfd->pending + tfd->pending_len, len + 1,
+		  "%c %s\n", op, key );
+      }
+      tfd->pending_len += len;
+      ++(tfd->pending_records);
+    }
+  }
+  else status = -1;
+  return status;
+}
+
+static text_file_data * alloc_text_file_data( char *filename ) {
+  text_file_data *tfd;
+  int len;
+
+  tfd = malloc( sizeof( *tfd ) );
+  if ( tfd ) {
+    tfd->dirty = 0;
+    tfd->created = 0;
+    tfd->journal_records = 0;
+    tfd->journal_len = 0;
+    tfd->pending = NULL;
+    tfd->pending_len = 0;
+    tfd->pending_alloc = 0;
+    tfd->pending_records = 0;
+    tfd->undo = NULL;
+    tfd->owners = NULL;
+    tfd->filename = copy_string( filename );
+    len = strlen( filename ) + strlen( JOURNAL_SUFFIX ) + 1;
+    tfd->journal_filename = malloc( sizeof( char ) * len );
+    if ( tfd->journal_filename ) {
+      snprintf( tfd->journal_filename, len, "%s%s",
+		filename, JOURNAL_SUFFIX );
+    }
+    tfd->data = text_map_alloc();
+    if ( !( tfd->filename && tfd->journal_filename && tfd->data ) ) {
+      free_text_file_data( tfd );
+      tfd = NULL;
+    }
+  }
+  return tfd;
+}
+
+static int begin_text_file( void *tfd_v ) {
+  text_file_data *tfd;
+  int status;
+
+  status = 0;
+  if ( tfd_v && !(((text_file_data *)tfd_v)->undo) ) {
+    tfd = (text_file_data *)tfd_v;
+    tfd->undo = rbtree_alloc( rbtree_string_comparator,
+			      rbtree_string_copier,
+			      rbtree_string_free,
+			      rbtree_string_copier,
+			      rbtree_string_free );
+    if ( tfd->undo ) {
+      tfd->undo_pending_len = tfd->pending_len;
+      tfd->undo_pending_records = tfd->pending_records;
+      tfd->undo_dirty = tfd->dirty;
+    }
+    else status = -1;
+  }
+  else status = -1;
+  return status;
+}
+
+static int close_text_file( void *tfd_v ) {
+  text_file_data *tfd;
+  unsigned long records;
+  int status;
 
   status = 0;
   if ( tfd_v ) {
     tfd = (text_file_data *)tfd_v;
+    /* Anything not committed by now never will be */
+    if ( tfd->undo ) abort_text_file( tfd );
     if ( tfd->dirty ) {
-      if ( !(tfd->created) ) result = make_backup( tfd );
-      else result = 0;
+      records = tfd->journal_records + tfd->pending_records;
+      if ( tfd->created ||
+	   ( records > JOURNAL_COMPACT_MIN &&
+	     records * JOURNAL_COMPACT_RATIO > text_map_size( tfd->data ) ) ) {
+	status = compact_text_file( tfd );
+      }
+      else status = write_journal( tfd );
+    }
+    free_text_file_data( tfd );
+  }
+  else status = -1;
+  return status;
+}
 
-      if ( result == 0 ) {
-	fp = fopen( tfd->filename, "w" );
-	if ( fp ) {
-	  n = NULL;
-	  lnum = 0;
-	  while ( key_v = rbtree_enum( tfd->data, n, &val_v, &n ) ) {
-	    ++lnum;
-	    if ( key_v && val_v ) {
-	      key = (char *)key_v;
-	      val = (char *)val_v;
-	      if ( strlen( key ) > 0 && strlen( val ) > 0 ) {
-		result = fprintf( fp, "%s %s\n", key, val );
-		if ( result < 0 ) {
-		  fprintf( stderr, "pkgdb_text_file line %d: ", lnum );
-		  fprintf( stderr, "error %d while writing\n", result );
-		  status = -1;
-		}
-	      }
-	      else {
-		fprintf( stderr, "pkgdb_text_file line %d: ", lnum );
-		fprintf( stderr,
-			 "empty line from the rbtree while writing.\n" );
-		status = -1;
-	      }
-	    }
-	    else {
-	      fprintf( stderr, "pkgdb_text_file line %d: ", lnum );
-	      fprintf( stderr,
-		       "got a NULL out of the rbtree while writing.\n" );
-	      status = -1;
-	    }
-	  }
-	  fclose( fp );
-	}
-	else {
-	  fprintf( stderr, "pkgdb_text_file: " );
-	  fprintf( stderr, "couldn't open output file %s to flush.\n",
-		   tfd->filename );
-	  status = -1;
-	}
+/*
+ * The transaction's records go to the journal as one batch, with a
+ * single fsync; a freshly created DB is written out whole at close.
+ */
+
+static int commit_text_file( void *tfd_v ) {
+  text_file_data *tfd;
+  int status;
+
+  status = 0;
+  if ( tfd_v && ((text_file_data *)tfd_v)->undo ) {
+    tfd = (text_file_data *)tfd_v;
+    rbtree_free( tfd->undo );
+    tfd->undo = NULL;
+    if ( !(tfd->created) ) status = write_journal( tfd );
+  }
+  else status = -1;
+  return status;
+}
+
+/*
+ * Fold the journal and any pending changes into the base file now.
+ */
+
+static int compact_text_file( void *tfd_v ) {
+  text_file_data *tfd;
+  int status, result;
+
+  status = 0;
+  if ( tfd_v ) {
+    tfd = (text_file_data *)tfd_v;
+    status = write_text_file( tfd );
+    if ( status == 0 ) {
+      /*
+       * Replaying a journal is idempotent, so if we die before this
+       * the next open just applies it again to the new base file.
+       */
+      result = unlink( tfd->journal_filename );
+      if ( result == 0 || errno == ENOENT ) {
+	tfd->journal_records = 0;
+	tfd->journal_len = 0;
+	tfd->pending_len = 0;
+	tfd->pending_records = 0;
+	tfd->dirty = 0;
+	tfd->created = 0;
       }
       else {
 	fprintf( stderr, "pkgdb_text_file: " );
-	fprintf( stderr, "couldn't make backup of file %s.\n",
-		 tfd->filename );
+	fprintf( stderr, "couldn't remove journal %s after compacting.\n",
+		 tfd->journal_filename );
 	status = -1;
       }
     }
-    free( tfd->filename );
-    rbtree_free( tfd->data );
-    free( tfd );
   }
   else status = -1;
   return status;
@@ -106,47 +394,27 @@ pkg_db * create_pkg_db_text_file( char *filename ) {
   if ( filename ) {
     temp = malloc( sizeof( *temp ) );
     if ( temp ) {
-      temp->query = query_text_file;
-      temp->insert = insert_into_text_file;
-      temp->delete = delete_from_text_file;
-      temp->close = close_text_file;
-      temp->entry_count = entry_count_text_file;
-      temp->enumerate = enumerate_text_file;
-      temp->format = DBFMT_TEXT;
+      setup_text_file_db( temp );
       temp->filename = copy_string( filename );
       temp->mode = DBMODE_RW;
 
       if ( temp->filename ) {
-	tfd = malloc( sizeof( *tfd ) );
+	tfd = alloc_text_file_data( filename );
 	if ( tfd ) {
 	  temp->private = (void *)tfd;
-	  tfd->filename = copy_string( filename );
-	  tfd->data = rbtree_alloc( rbtree_string_comparator,
-				    rbtree_string_copier,
-				    rbtree_string_free,
-				    rbtree_string_copier,
-				    rbtree_string_free );
-	  tfd->dirty = 0;
 	  tfd->created = 1;
-	  if ( tfd->filename && tfd->data ) {
+	  /* A stale journal must not be replayed over the new DB */
+	  if ( unlink( tfd->journal_filename ) == 0 || errno == ENOENT ) {
 	    fp = fopen( tfd->filename, "w" );
-	    if ( fp ) {
-	      fclose( fp );
-	      return temp;
-	    }
-	    else {
-	      free( tfd->filename );
-	      rbtree_free( tfd->data );
-	      free( tfd );
-	      free( temp->filename );
-	      free( temp );
-	      return NULL;
-	    }
+	  }
+	  else fp = NULL;
+
+	  if ( fp ) {
+	    fclose( fp );
+	    return temp;
 	  }
 	  else {
-	    if ( tfd->filename ) free( tfd->filename );
-	    if ( tfd->data ) rbtree_free( tfd->data );
-	    free( tfd );
+	    free_text_file_data( tfd );
 	    free( temp->filename );
 	    free( temp );
 	    return NULL;
@@ -175,20 +443,39 @@ static int delete_from_text_file( void *tfd_v, char *key ) {
   status = 0;
   if ( tfd_v && key ) {
     tfd = (text_file_data *)tfd_v;
-    result = rbtree_delete( tfd->data, key, NULL );
-    if ( result == RBTREE_SUCCESS ) tfd->dirty = 1;
-    else if ( result != RBTREE_NOT_FOUND ) status = -1;
+    result = save_undo( tfd, key );
+    if ( result == 0 ) {
+      update_owners( tfd, key, NULL );
+      result = text_map_delete( tfd->data, key, NULL );
+    }
+    else result = TEXT_MAP_ERROR;
+    if ( result == TEXT_MAP_SUCCESS ) {
+      if ( !(tfd->created) )
+	status = add_journal_record( tfd, JOURNAL_DELETE, key, NULL );
+      tfd->dirty = 1;
+    }
+    else if ( result != TEXT_MAP_NOT_FOUND ) {
+      drop_owners( tfd );
+      status = -1;
+    }
   }
   else status = -1;
   return status;
 }
 
+static void drop_owners( text_file_data *tfd ) {
+  if ( tfd->owners ) {
+    rbtree_free( tfd->owners );
+    tfd->owners = NULL;
+  }
+}
+
 static unsigned long entry_count_text_file( void *tfd_v ) {
   text_file_data *tfd;
 
   if ( tfd_v ) {
     tfd = (text_file_data *)tfd_v;
-    return rbtree_size( tfd->data );
+    return text_map_size( tfd->data );
   }
   else return 0;
 }
@@ -198,15 +485,15 @@ static int enumerate_text_file( void *tfd_v, void *n_in,
 				void **n_out ) {
   int status;
   text_file_data *tfd;
-  rbtree_node *n;
+  text_map_node *n;
   void *ktmp_v, *vtmp_v;
   char *ktmp, *vtmp, *kcpy, *vcpy;
 
   status = 0;
   if ( tfd_v && k_out && v_out && n_out ) {
     tfd = (text_file_data *)tfd_v;
-    n = (rbtree_node *)n_in;
-    ktmp_v = rbtree_enum( tfd->data, n, &vtmp_v, &n );
+    n = (text_map_node *)n_in;
+    ktmp_v = text_map_enum( tfd->data, n, &vtmp_v, &n );
     ktmp = (char *)ktmp_v;
     vtmp = (char *)vtmp_v;
     if ( ktmp ) {
@@ -243,6 +530,94 @@ static int enumerate_text_file( void *tfd_v, void *n_in,
   return status;
 }
 
+static int enumerate_by_package_text_file( void *tfd_v, char *pkg,
+					   void *n_in, char **k_out,
+					   void **n_out ) {
+  text_file_data *tfd;
+
+  if ( tfd_v && pkg && k_out && n_out ) {
+    tfd = (text_file_data *)tfd_v;
+    if ( !(tfd->owners) )
+      tfd->owners = build_owner_index( tfd, foreach_text_file );
+    if ( tfd->owners )
+      return enumerate_owner_index( tfd->owners, pkg, n_in, k_out, n_out );
+    else return -1;
+  }
+  else return -1;
+}
+
+static int enumerate_prefix_text_file( void *tfd_v, char *prefix,
+				       void *n_in, char **k_out,
+				       char **v_out, void **n_out ) {
+  text_file_data *tfd;
+  text_map_node *n;
+  void *key_v, *val_v;
+  int status;
+
+  status = 0;
+  if ( tfd_v && prefix && k_out && v_out && n_out ) {
+    tfd = (text_file_data *)tfd_v;
+    *k_out = NULL;
+    *v_out = NULL;
+    *n_out = NULL;
+    n = (text_map_node *)n_in;
+    if ( n ) key_v = text_map_enum( tfd->data, n, &val_v, &n );
+    else key_v = text_map_enum_from( tfd->data, prefix, &val_v, &n );
+
+    /* The first one without the prefix is past the end */
+    if ( key_v && val_v &&
+	 strncmp( (char *)key_v, prefix, strlen( prefix ) ) == 0 ) {
+      *k_out = copy_string( (char *)key_v );
+      *v_out = copy_string( (char *)val_v );
+      if ( *k_out && *v_out ) *n_out = (void *)n;
+      else {
+	fprintf( stderr, "pkgdb_text_file: " );
+	fprintf( stderr, "couldn't copy a string while enumerating.\n" );
+	if ( *k_out ) free( *k_out );
+	if ( *v_out ) free( *v_out );
+	*k_out = NULL;
+	*v_out = NULL;
+	status = -1;
+      }
+    }
+  }
+  else status = -1;
+  return status;
+}
+
+static int foreach_text_file( void *tfd_v,
+			      int (*fn)( const char *, const char *, void * ),
+			      void *arg ) {
+  text_file_data *tfd;
+  text_map_node *n;
+  void *key_v, *val_v;
+  int result;
+
+  if ( tfd_v && fn ) {
+    tfd = (text_file_data *)tfd_v;
+    result = 0;
+    n = NULL;
+    while ( result == 0 &&
+	    ( key_v = text_map_enum( tfd->data, n, &val_v, &n ) ) ) {
+      result = fn( (const char *)key_v, (const char *)val_v, arg );
+    }
+    return result;
+  }
+  else return -1;
+}
+
+static void free_text_file_data( text_file_data *tfd ) {
+  if ( tfd ) {
+    if ( tfd->filename ) free( tfd->filename );
+    if ( tfd->journal_filename ) free( tfd->journal_filename );
+    if ( tfd->data ) text_map_free( tfd->data );
+    if ( tfd->pending ) free( tfd->pending );
+    if ( tfd->undo ) rbtree_free( tfd->undo );
+    if ( tfd->owners ) rbtree_free( tfd->owners );
+    free( tfd );
+  }
+}
+
 static int insert_into_text_file( void *tfd_v, char *key, char *data ) {
   int status, result;
   text_file_data *tfd;
@@ -250,23 +625,64 @@ static int insert_into_text_file( void *tfd_v, char *key, char *data ) {
   status = 0;
   if ( tfd_v && key && data ) {
     tfd = (text_file_data *)tfd_v;
-    result = rbtree_insert( tfd->data, key, data );
-    if ( result == RBTREE_SUCCESS ) tfd->dirty = 1;
-    else status = -1;
+    result = save_undo( tfd, key );
+    if ( result == 0 ) {
+      update_owners( tfd, key, data );
+      result = text_map_insert( tfd->data, key, data );
+    }
+    else result = TEXT_MAP_ERROR;
+    if ( result == TEXT_MAP_SUCCESS ) {
+      if ( !(tfd->created) )
+	status = add_journal_record( tfd, JOURNAL_INSERT, key, data );
+      tfd->dirty = 1;
+    }
+    else {
+      /* It no longer matches what we have */
+      drop_owners( tfd );
+      status = -1;
+    }
   }
   else status = -1;
   return status;
 }
 
-#define BK_BUFSIZ 1024
+/*
+ * Put the lines gathered in tl into t, and free them.
+ */
+
+static int load_text_file_lines( text_file_lines *tl, text_map *t ) {
+  int status, result;
+  unsigned long i, bad;
+
+  status = 0;
+  result = text_map_build_from_sorted( t, tl->keys, tl->vals, tl->count,
+				      &bad );
+  if ( result != TEXT_MAP_SUCCESS ) {
+    if ( result == TEXT_MAP_NO_OVERWRITE ) {
+      fprintf( stderr, "pkgdb_text_file line %d: ", tl->lnums[bad] );
+      fprintf( stderr, "duplicate entry for %s\n",
+	       (char *)(tl->keys[bad]) );
+    }
+    else fprintf( stderr, "pkgdb_text_file: error inserting (%d)\n",
+		  result );
+    status = -1;
+  }
+
+  for ( i = 0; i < tl->count; ++i ) free( tl->lines[i] );
+  tl->count = 0;
+
+  return status;
+}
+
+/*
+ * Keep the base file we're about to replace as <filename>.bak; it's
+ * about to be renamed over, so a hard link is as good as a copy.
+ */
 
 static int make_backup( text_file_data *tfd ) {
   int status, result, bk_file_len;
   char *bk_file;
-  int srcfd, dstfd;
   struct stat st;
-  char buf[BK_BUFSIZ];
-  int count, written, wcount;
 
   status = 0;
   if ( tfd && tfd->filename ) {
@@ -275,26 +691,15 @@ static int make_backup( text_file_data *tfd ) {
     if ( bk_file ) {
       snprintf( bk_file, bk_file_len, "%s.bak", tfd->filename );
 
-      /* Try to stat the backup file, and remove any old backup */
+      /* Don't clobber anything but an old backup */
       result = lstat( bk_file, &st );
       if ( result == 0 ) {
-	/* It exists */
-	if ( S_ISREG(st.st_mode) || S_ISLNK(st.st_mode) ) {
-	  /* Try to remove it */
-	  result = unlink( bk_file );
-	  if ( result != 0 ) status = -1;
-	}
-	/* else error */
-	else status = -1;
-      }
-      else {
-	/* If we had ENOENT, we're okay, otherwise error */
-	if ( errno != ENOENT ) status = -1;
+	if ( !( S_ISREG(st.st_mode) || S_ISLNK(st.st_mode) ) ) status = -1;
       }
+      else if ( errno != ENOENT ) status = -1;
 
       if ( status == 0 ) {
-	/* We've cleared the backup file */
-	result = copy_file( bk_file, tfd->filename );
+	result = link_or_copy( bk_file, tfd->filename );
 	if ( result != LINK_OR_COPY_SUCCESS ) {
 	  unlink( bk_file );
 	  status = -1;
@@ -316,13 +721,7 @@ pkg_db * open_pkg_db_text_file( char *filename, dbmode_t mode ) {
   if ( filename ) {
     temp = malloc( sizeof( *temp ) );
     if ( temp ) {
-      temp->query = query_text_file;
-      temp->insert = insert_into_text_file;
-      temp->delete = delete_from_text_file;
-      temp->close = close_text_file;
-      temp->entry_count = entry_count_text_file;
-      temp->enumerate = enumerate_text_file;
-      temp->format = DBFMT_TEXT;
+      setup_text_file_db( temp );
       temp->filename = copy_string( filename );
       temp->mode = mode;
 
@@ -345,32 +744,89 @@ pkg_db * open_pkg_db_text_file( char *filename, dbmode_t mode ) {
   else return NULL;
 }
 
-static int parse_line( char *line, rbtree *t, int lnum ) {
+static int parse_journal_line( char *line, text_map *t, int lnum ) {
   int status, result, n;
   char **fields;
-  char *path, *pkg;
 
   status = 0;
   if ( line && t ) {
     result = parse_strings_from_line( line, &fields );
     if ( result == 0 ) {
       n = strlistlen( fields );
-      if ( n == 2 ) {
-	path = fields[0];
-	pkg = fields[1];
-	result = rbtree_insert_no_overwrite( t, path, pkg );
-	if ( result != RBTREE_SUCCESS ) {
-	  if ( result == RBTREE_NO_OVERWRITE ) {
-	    fprintf( stderr, "pkgdb_text_file line %d: ", lnum );
-	    fprintf( stderr, "duplicate entry for %s\n", path );
-	  }
-	  else {
-	    fprintf( stderr, "pkgdb_text_file line %d: ", lnum );
-	    fprintf( stderr, "error inserting into rbtree (%d)\n", result );
-	  }
+      if ( n == 3 && strcmp( fields[0], "+" ) == 0 ) {
+	result = text_map_insert( t, fields[1], fields[2] );
+	if ( result != TEXT_MAP_SUCCESS ) {
+	  fprintf( stderr, "pkgdb_text_file journal line %d: ", lnum );
+	  fprintf( stderr, "error inserting (%d)\n", result );
+	  status = -1;
+	}
+      }
+      else if ( n == 2 && strcmp( fields[0], "-" ) == 0 ) {
+	result = text_map_delete( t, fields[1], NULL );
+	if ( result != TEXT_MAP_SUCCESS && result != TEXT_MAP_NOT_FOUND ) {
+	  fprintf( stderr, "pkgdb_text_file journal line %d: ", lnum );
+	  fprintf( stderr, "error deleting (%d)\n", result );
 	  status = -1;
 	}
       }
+      else {
+	fprintf( stderr, "pkgdb_text_file journal line %d: ", lnum );
+	fprintf( stderr, "malformed record.\n" );
+	status = -1;
+      }
+      free( fields );
+    }
+    else status = result;
+  }
+  else status = -1;
+  return status;
+}
+
+static int parse_line( char *line, text_file_lines *tl, int lnum ) {
+  int status, result, n;
+  char **fields;
+  void *temp;
+  unsigned long new_alloced;
+
+  status = 0;
+  if ( line && tl ) {
+    if ( tl->count == tl->alloced ) {
+      new_alloced = ( tl->alloced > 0 ) ? 2 * tl->alloced : 1024;
+      temp = realloc( tl->lines, sizeof( *(tl->lines) ) * new_alloced );
+      if ( temp ) {
+	tl->lines = temp;
+	temp = realloc( tl->keys, sizeof( *(tl->keys) ) * new_alloced );
+      }
+      if ( temp ) {
+	tl->keys = temp;
+	temp = realloc( tl->vals, sizeof( *(tl->vals) ) * new_alloced );
+      }
+      if ( temp ) {
+	tl->vals = temp;
+	temp = realloc( tl->lnums, sizeof( *(tl->lnums) ) * new_alloced );
+      }
+      if ( temp ) {
+	tl->lnums = temp;
+	tl->alloced = new_alloced;
+      }
+      else {
+	fprintf( stderr, "pkgdb_text_file line %d: ", lnum );
+	fprintf( stderr, "couldn't allocate memory\n" );
+	return -1;
+      }
+    }
+
+    result = parse_strings_from_line( line, &fields );
+    if ( result == 0 ) {
+      n = strlistlen( fields );
+      if ( n == 2 ) {
+	/* The fields point into line, so keep it until we build */
+	tl->lines[tl->count] = line;
+	tl->keys[tl->count] = fields[0];
+	tl->vals[tl->count] = fields[1];
+	tl->lnums[tl->count] = lnum;
+	++(tl->count);
+      }
       else {
 	fprintf( stderr, "pkgdb_text_file line %d: ", lnum );
 	fprintf( stderr, "wrong number (%d) of fields.\n", n );
@@ -384,38 +840,116 @@ static int parse_line( char *line, rbtree *t, int lnum ) {
   return status;
 }
 
-static int parse_text_file( FILE *fp, rbtree *t ) {
+/*
+ * close_text_file() writes the file sorted, so collect all of it and
+ * build t straight from the sorted run; text_map_build_from_sorted()
+ * inserts one at a time if someone edited it out of order.  Maps that
+ * don't gain from one long run take TEXT_MAP_BATCH lines at a time
+ * instead, so the whole file isn't held in memory next to them.
+ */
+
+static int parse_text_file( FILE *fp, text_map *t ) {
+  text_file_lines tl;
   int status, lnum;
   char *line;
+  unsigned long i;
 
   status = 0;
   if ( fp && t ) {
+    tl.lines = NULL;
+    tl.keys = tl.vals = NULL;
+    tl.lnums = NULL;
+    tl.count = tl.alloced = 0;
     lnum = 0;
     while ( line = read_line_from_file( fp ) ) {
       ++lnum;
-      if ( !is_whitespace( line ) ) status = parse_line( line, t, lnum );
-      free( line );
+      if ( !is_whitespace( line ) ) status = parse_line( line, &tl, lnum );
+      /* parse_line() keeps the lines it takes */
+      if ( tl.count == 0 || tl.lines[tl.count - 1] != line ) free( line );
+      if ( status == 0 && TEXT_MAP_BATCH > 0 && tl.count == TEXT_MAP_BATCH )
+	status = load_text_file_lines( &tl, t );
       if ( status != 0 ) break;
     }
+
+    if ( status == 0 ) status = load_text_file_lines( &tl, t );
+
+    for ( i = 0; i < tl.count; ++i ) free( tl.lines[i] );
+    if ( tl.lines ) free( tl.lines );
+    if ( tl.keys ) free( tl.keys );
+    if ( tl.vals ) free( tl.vals );
+    if ( tl.lnums ) free( tl.lnums );
   }
   else status = -1;
   return status;
 }
 
-static char * query_text_file( void *tfd_v, char *key ) {
+static const char * peek_text_file( void *tfd_v, char *key ) {
   text_file_data *tfd;
   void *val;
   int result;
 
   if ( tfd_v && key ) {
     tfd = (text_file_data *)tfd_v;
-    result = rbtree_query( tfd->data, key, &val );
-    if ( result == RBTREE_SUCCESS ) return copy_string( (char *)val );
+    result = text_map_query( tfd->data, key, &val );
+    if ( result == TEXT_MAP_SUCCESS ) return (const char *)val;
     else return NULL;
   }
   else return NULL;
 }
 
+static char * query_text_file( void *tfd_v, char *key ) {
+  const char *val;
+
+  val = peek_text_file( tfd_v, key );
+  if ( val ) return copy_string( val );
+  else return NULL;
+}
+
+/*
+ * Replay the committed part of the journal, if there is one, over
+ * tfd->data.
+ */
+
+static int read_journal( text_file_data *tfd ) {
+  FILE *fp;
+  char *line;
+  int status, lnum;
+  long pos, good_len;
+
+  status = 0;
+  fp = fopen( tfd->journal_filename, "r" );
+  if ( fp ) {
+    /* First find where the last complete batch ends */
+    good_len = 0;
+    while ( line = read_line_from_file( fp ) ) {
+      if ( strcmp( line, JOURNAL_COMMIT ) == 0 ) good_len = ftell( fp );
+      free( line );
+    }
+
+    rewind( fp );
+    lnum = 0;
+    pos = 0;
+    while ( status == 0 && pos < good_len &&
+	    ( line = read_line_from_file( fp ) ) ) {
+      ++lnum;
+      if ( strcmp( line, JOURNAL_COMMIT ) != 0 && !is_whitespace( line ) ) {
+	status = parse_journal_line( line, tfd->data, lnum );
+	if ( status == 0 ) ++(tfd->journal_records);
+      }
+      free( line );
+      pos = ftell( fp );
+    }
+    tfd->journal_len = good_len;
+    fclose( fp );
+  }
+  else if ( errno != ENOENT ) {
+    fprintf( stderr, "pkgdb_text_file: couldn't open journal %s\n",
+	     tfd->journal_filename );
+    status = -1;
+  }
+  return status;
+}
+
 static text_file_data * read_text_file( char *filename ) {
   text_file_data *tfd;
   FILE *fp;
@@ -424,41 +958,230 @@ static text_file_data * read_text_file( char *filename ) {
   if ( filename ) {
     fp = fopen( filename, "r" );
     if ( fp ) {
-      tfd = malloc( sizeof( *tfd ) );
+      tfd = alloc_text_file_data( filename );
       if ( tfd ) {
-	tfd->dirty = 0;
-	tfd->created = 0;
-	tfd->filename = copy_string( filename );
-	if ( tfd->filename ) {
-	  tfd->data = rbtree_alloc( rbtree_string_comparator,
-				    rbtree_string_copier,
-				    rbtree_string_free,
-				    rbtree_string_copier,
-				    rbtree_string_free );
-	  if ( tfd->data ) {
-	    result = parse_text_file( fp, tfd->data );
-	    if ( result != 0 ) {
-	      rbtree_free( tfd->data );
-	      free( tfd->filename );
-	      free( tfd );
-	      tfd = NULL;
+	result = parse_text_file( fp, tfd->data );
+	if ( result == 0 ) result = read_journal( tfd );
+	if ( result != 0 ) {
+	  free_text_file_data( tfd );
+	  tfd = NULL;
+	}
+      }
+      fclose( fp );
+      return tfd;
+    }
+    else return NULL;
+  }
+  else return NULL;
+}
+
+/*
+ * In a transaction, remember what key held before its first change.
+ */
+
+static int save_undo( text_file_data *tfd, char *key ) {
+  void *val;
+  int status, result;
+
+  status = 0;
+  if ( tfd->undo ) {
+    result = rbtree_query( tfd->undo, key, &val );
+    if ( result == RBTREE_NOT_FOUND ) {
+      result = text_map_query( tfd->data, key, &val );
+      if ( result != TEXT_MAP_SUCCESS ) val = NULL;
+      if ( rbtree_insert( tfd->undo, key, val ) != RBTREE_SUCCESS )
+	status = -1;
+    }
+  }
+  return status;
+}
+
+static void setup_text_file_db( pkg_db *db ) {
+  db->query = query_text_file;
+  db->peek = peek_text_file;
+  db->insert = insert_into_text_file;
+  db->delete = delete_from_text_file;
+  db->close = close_text_file;
+  db->compact = compact_text_file;
+  db->begin = begin_text_file;
+  db->commit = commit_text_file;
+  db->abort = abort_text_file;
+  db->entry_count = entry_count_text_file;
+  db->enumerate = enumerate_text_file;
+  db->enumerate_by_package = enumerate_by_package_text_file;
+  db->enumerate_prefix = enumerate_prefix_text_file;
+  db->foreach = foreach_text_file;
+  db->format = DBFMT_TEXT;
+}
+
+/*
+ * Keep the owner index, if there is one, in step with key going to pkg
+ * (or away, if pkg is NULL); if that fails, drop it to build again.
+ */
+
+static void update_owners( text_file_data *tfd, char *key, char *pkg ) {
+  void *old;
+  int result;
+
+  if ( tfd->owners ) {
+    result = 0;
+    if ( text_map_query( tfd->data, key, &old ) == TEXT_MAP_SUCCESS )
+      result = remove_from_owner_index( tfd->owners, key, (char *)old );
+    if ( result == 0 && pkg )
+      result = add_to_owner_index( tfd->owners, key, pkg );
+    if ( result != 0 ) drop_owners( tfd );
+  }
+}
+
+/*
+ * Append the pending records to the journal as one committed batch.
+ */
+
+static int write_journal( text_file_data *tfd ) {
+  int status, fd;
+  ssize_t result;
+  size_t written;
+  struct stat st;
+
+  status = 0;
+  if ( tfd->pending_len > 0 ) {
+    /* add_journal_record() left room for this */
+    strcpy( tfd->pending + tfd->pending_len, JOURNAL_COMMIT "\n" );
+    tfd->pending_len += strlen( JOURNAL_COMMIT "\n" );
+
+    fd = open( tfd->journal_filename, O_WRONLY | O_CREAT, 0644 );
+    if ( fd >= 0 ) {
+      /* Drop any torn batch off the end before appending */
+      if ( fstat( fd, &st ) == 0 ) {
+	if ( st.st_size != tfd->journal_len &&
+	     ftruncate( fd, tfd->journal_len ) != 0 ) status = -1;
+      }
+      else status = -1;
+
+      if ( status == 0 &&
+	   lseek( fd, tfd->journal_len, SEEK_SET ) != tfd->journal_len )
+	status = -1;
+
+      written = 0;
+      while ( status == 0 && written < tfd->pending_len ) {
+	result = write( fd, tfd->pending + written,
+			tfd->pending_len - written );
+	if ( result > 0 ) written += result;
+	else if ( !( result < 0 && errno == EINTR ) ) status = -1;
+      }
+      if ( status == 0 && fsync( fd ) != 0 ) status = -1;
+
+      if ( status != 0 ) {
+	fprintf( stderr, "pkgdb_text_file: " );
+	fprintf( stderr, "error writing journal %s\n",
+		 tfd->journal_filename );
+      }
+      close( fd );
+    }
+    else {
+      fprintf( stderr, "pkgdb_text_file: couldn't open journal %s\n",
+	       tfd->journal_filename );
+      status = -1;
+    }
+
+    if ( status == 0 ) {
+      tfd->journal_len += tfd->pending_len;
+      tfd->journal_records += tfd->pending_records;
+      tfd->pending_len = 0;
+      tfd->pending_records = 0;
+    }
+    /* Keep the records, but not the commit line, to try again later */
+    else tfd->pending_len -= strlen( JOURNAL_COMMIT "\n" );
+  }
+  return status;
+}
+
+/*
+ * Write the whole DB out to a temporary file and rename it over the
+ * base file.
+ */
+
+static int write_text_file( text_file_data *tfd ) {
+  int status, result, lnum, fd, tmpl_len;
+  FILE *fp;
+  text_map_node *n;
+  void *key_v, *val_v;
+  char *key, *val, *tmpl;
+
+  status = 0;
+  tmpl_len = strlen( tfd->filename ) + 8;
+  tmpl = malloc( sizeof( *tmpl ) * tmpl_len );
+  if ( tmpl ) {
+    snprintf( tmpl, tmpl_len, "%s.XXXXXX", tfd->filename );
+    fp = NULL;
+    fd = mkstemp( tmpl );
+    if ( fd >= 0 ) {
+      fchmod( fd, 0644 );
+      fp = fdopen( fd, "w" );
+      if ( !fp ) close( fd );
+    }
+
+    if ( fp ) {
+      n = NULL;
+      lnum = 0;
+      while ( key_v = text_map_enum( tfd->data, n, &val_v, &n ) ) {
+	++lnum;
+	if ( key_v && val_v ) {
+	  key = (char *)key_v;
+	  val = (char *)val_v;
+	  if ( strlen( key ) > 0 && strlen( val ) > 0 ) {
+	    result = fprintf( fp, "%s %s\n", key, val );
+	    if ( result < 0 ) {
+	      fprintf( stderr, "pkgdb_text_file line %d: ", lnum );
+	      fprintf( stderr, "error %d while writing\n", result );
+	      status = -1;
 	    }
 	  }
 	  else {
-	    free( tfd->filename );
-	    free( tfd );
-	    tfd = NULL;
+	    fprintf( stderr, "pkgdb_text_file line %d: ", lnum );
+	    fprintf( stderr,
+		     "empty line from the rbtree while writing.\n" );
+	    status = -1;
 	  }
 	}
 	else {
-	  free( tfd );
-	  tfd = NULL;
+	  fprintf( stderr, "pkgdb_text_file line %d: ", lnum );
+	  fprintf( stderr,
+		   "got a NULL out of the rbtree while writing.\n" );
+	  status = -1;
 	}
       }
-      fclose( fp );
-      return tfd;
+      if ( fflush( fp ) != 0 || fsync( fileno( fp ) ) != 0 ) status = -1;
+      if ( fclose( fp ) != 0 ) status = -1;
+
+      if ( status == 0 && !(tfd->created) ) {
+	result = make_backup( tfd );
+	if ( result != 0 ) {
+	  fprintf( stderr, "pkgdb_text_file: " );
+	  fprintf( stderr, "couldn't make backup of file %s.\n",
+		   tfd->filename );
+	  status = -1;
+	}
+      }
+
+      if ( status == 0 && rename( tmpl, tfd->filename ) != 0 ) {
+	fprintf( stderr, "pkgdb_text_file: " );
+	fprintf( stderr, "couldn't rename %s to %s.\n",
+		 tmpl, tfd->filename );
+	status = -1;
+      }
+      if ( status != 0 ) unlink( tmpl );
     }
-    else return NULL;
+    else {
+      fprintf( stderr, "pkgdb_text_file: " );
+      fprintf( stderr, "couldn't open output file %s to flush.\n",
+	       tfd->filename );
+      status = -1;
+    }
+
+    free( tmpl );
   }
-  else return NULL;
+  else status = -1;
+
+  return status;
 }
@@ -10,12 +10,12 @@ static void free_pkg_descr_hdr( pkg_descr_hdr *, int );
 static int grow_num_entries_expansion( int );
 static int grow_num_entries( pkg_descr * );
 static int parse_directory_entry( pkg_descr_entry *, char ** );
-static int parse_entry_from_line( pkg_descr_entry *, char * );
-static int parse_file_entry( pkg_descr_entry *, char ** );
-static int parse_hash( char *, unsigned char * );
+static int parse_entry_from_line( pkg_descr_entry *, char *, pkg_hash_t );
+static int parse_file_entry( pkg_descr_entry *, char **, pkg_hash_t );
+static int parse_hash( char *, unsigned char *, int );
 static int parse_header_from_line( pkg_descr_hdr *, char * );
 static int parse_symlink_entry( pkg_descr_entry *, char ** );
-static int write_pkg_descr_entry( FILE *, pkg_descr_entry * );
+static int write_pkg_descr_entry( FILE *, pkg_descr_entry *, pkg_hash_t );
 static int write_pkg_descr_hdr( FILE *, pkg_descr_hdr * );
 
 static void free_pkg_descr_entry( pkg_descr_entry *p,
@@ -176,7 +176,8 @@ static int parse_directory_entry( pkg_descr_entry *e, char **fields ) {
   return status;
 }
 
-static int parse_entry_from_line( pkg_descr_entry *e, char *line ) {
+static int parse_entry_from_line( pkg_descr_entry *e, char *line,
+				  pkg_hash_t alg ) {
   int status, result;
   char **fields;
 
@@ -188,7 +189,7 @@ static int parse_entry_from_line( pkg_descr_entry *e, char *line ) {
 	if ( strcmp( fields[0], "f" ) == 0 ) {
 	  /* it's a file entry */
 	  e->type = ENTRY_FILE;
-	  status = parse_file_entry( e, fields + 1 );
+	  status = parse_file_entry( e, fields + 1, alg );
 	}
 	else if ( strcmp( fields[0], "d" ) == 0 ) {
 	  /* it's a directory entry */
@@ -219,7 +220,8 @@ static int parse_entry_from_line( pkg_descr_entry *e, char *line ) {
   return status;
 }
 
-static int parse_file_entry( pkg_descr_entry *e, char **fields ) {
+static int parse_file_entry( pkg_descr_entry *e, char **fields,
+			     pkg_hash_t alg ) {
   int status, result;
   char *filename, *owner, *group;
   unsigned int mode;
@@ -237,7 +239,7 @@ static int parse_file_entry( pkg_descr_entry *e, char **fields ) {
 	owner = copy_string( fields[2] );
 	group = copy_string( fields[3] );
 	if ( filename && owner && group ) {
-	  result = parse_hash( fields[1], hash );
+	  result = parse_hash( fields[1], hash, get_hash_len( alg ) );
 	  if ( result == 0 ) {
 	    result = sscanf( fields[4], "%o", &mode );
 	    if ( result == 1 ) {
@@ -289,16 +291,22 @@ static int parse_file_entry( pkg_descr_entry *e, char **fields ) {
   return status;
 }
 
-static int parse_hash( char *s, unsigned char *hash_out ) {
+/*
+ * Parse len bytes of hex hash from s into hash_out, zero-padding it
+ * out to HASH_LEN.
+ */
+
+static int parse_hash( char *s, unsigned char *hash_out, int len ) {
   int status, result, i;
   unsigned char temp[2], hash_temp[HASH_LEN];
   unsigned int digit_h, digit_l, hash_byte;
 
   status = 0;
-  if ( s && hash_out ) {
-    if ( strlen( s ) == 2 * HASH_LEN ) {
+  if ( s && hash_out && len > 0 && len <= HASH_LEN ) {
+    if ( strlen( s ) == 2 * len ) {
+      memset( hash_temp, 0, sizeof( hash_temp ) );
       temp[1] = '\0';
-      for ( i = 0; i < HASH_LEN; ++i ) {
+      for ( i = 0; i < len; ++i ) {
 	temp[0] = s[2*i];
 	result = sscanf( temp, "%x", &digit_h );
 	if ( result != 1 ) {
@@ -332,22 +340,36 @@ static int parse_hash( char *s, unsigned char *hash_out ) {
   return status;
 }
 
+/*
+ * The header is "name time /", with the name of the hash the file
+ * entries use tacked on the end if it isn't MD5; leaving it off for
+ * MD5 keeps those readable by older versions.
+ */
+
 static int parse_header_from_line( pkg_descr_hdr *h, char *line ) {
-  int status, result, pkg_name_len;
+  int status, result, pkg_name_len, num_fields;
   char **fields;
   char *pkg_name, *pkg_time_str, *pkg_root, *temp;
   unsigned long pkg_time;
+  pkg_hash_t alg;
 
   status = 0;
   if ( h && line ) {
     result = parse_strings_from_line( line, &fields );
     if ( result == 0 ) {
-      if ( strlistlen( fields ) == 3 ) {
+      num_fields = strlistlen( fields );
+      if ( num_fields == 3 || num_fields == 4 ) {
 	pkg_name = fields[0];
 	pkg_time_str = fields[1];
 	pkg_root = fields[2];
 	pkg_name_len = strlen( pkg_name );
-	if ( pkg_name_len > 0 ) {
+	alg = HASH_MD5;
+	if ( num_fields == 4 && parse_hash_name( fields[3], &alg ) != 0 ) {
+	  fprintf( stderr, "Syntax error parsing pkg_descr header: " );
+	  fprintf( stderr, "unknown hash \"%s\"\n", fields[3] );
+	  status = -1;
+	}
+	else if ( pkg_name_len > 0 ) {
 	  if ( strcmp( pkg_root, "/" ) == 0 ) {
 	    result = sscanf( pkg_time_str, "%lu", &pkg_time );
 	    if ( result == 1 ) {
@@ -356,6 +378,7 @@ static int parse_header_from_line( pkg_descr_hdr *h, char *line ) {
 		strncpy( temp, pkg_name, pkg_name_len + 1 );
 		h->pkg_name = temp;
 		h->pkg_time = (time_t)pkg_time;
+		h->hash = alg;
 	      }
 	      else {
 		fprintf( stderr, "Couldn't allocate memory in parse_header_from_line()\n" );
@@ -454,6 +477,7 @@ pkg_descr * read_pkg_descr_from_file( char *filename ) {
     descr = malloc( sizeof( *descr ) );
     if ( descr ) {
       descr->hdr.pkg_name = NULL;
+      descr->hdr.hash = HASH_MD5;
       descr->num_entries = 0;
       descr->num_entries_alloced = 0;
       descr->entries = NULL;
@@ -481,7 +505,7 @@ pkg_descr * read_pkg_descr_from_file( char *filename ) {
 	      if ( status == 0 ) {
 		status =
 		  parse_entry_from_line( &(descr->entries[descr->num_entries]),
-					 line );
+					 line, descr->hdr.hash );
 		if ( status == 0 ) ++(descr->num_entries);
 		else {
 		  fprintf( stderr,
@@ -516,7 +540,8 @@ pkg_descr * read_pkg_descr_from_file( char *filename ) {
   else return NULL;
 }
 
-static int write_pkg_descr_entry( FILE *fp, pkg_descr_entry *entry ) {
+static int write_pkg_descr_entry( FILE *fp, pkg_descr_entry *entry,
+				  pkg_hash_t alg ) {
   int status, result;
   char *str_temp;
 
@@ -524,7 +549,7 @@ static int write_pkg_descr_entry( FILE *fp, pkg_descr_entry *entry ) {
   if ( fp && entry ) {
     switch ( entry->type ) {
     case ENTRY_FILE:
-      str_temp = hash_to_string( entry->u.f.hash, HASH_LEN );
+      str_temp = hash_to_string( entry->u.f.hash, get_hash_len( alg ) );
       if ( str_temp ) {
 	result = fprintf( fp, "f %s %s %s %s %04o\n",
 			  entry->filename, str_temp,
@@ -576,8 +601,15 @@ static int write_pkg_descr_hdr( FILE *fp, pkg_descr_hdr *hdr ) {
 
   status = 0;
   if ( fp && hdr ) {
-    result = fprintf( fp, "%s %lu /\n",
-		      hdr->pkg_name, (unsigned long)(hdr->pkg_time) );
+    if ( hdr->hash == HASH_MD5 ) {
+      result = fprintf( fp, "%s %lu /\n",
+			hdr->pkg_name, (unsigned long)(hdr->pkg_time) );
+    }
+    else {
+      result = fprintf( fp, "%s %lu / %s\n",
+			hdr->pkg_name, (unsigned long)(hdr->pkg_time),
+			get_hash_name( hdr->hash ) );
+    }
     if ( result < 0 ) {
       fprintf( stderr, "Error writing pkg_descr_hdr %p\n", hdr );
       status = result;
@@ -598,7 +630,8 @@ int write_pkg_descr_to_file( pkg_descr *descr, char *filename ) {
       result = write_pkg_descr_hdr( fp, &(descr->hdr) );
       if ( result == 0 ) {
 	for ( i = 0; i < descr->num_entries; ++i ) {
-	  result = write_pkg_descr_entry( fp, &(descr->entries[i]) );
+	  result = write_pkg_descr_entry( fp, &(descr->entries[i]),
+					  descr->hdr.hash );
 	  if ( result != 0 ) {
 	    status = result;
 	    break;
@@ -7,6 +7,10 @@
 #include <pkg.h>
 
 static int check_md5;
+static int hash_cache;
+static int threads;
+static long io_buffer_size;
+static int io_direct;
 
 static char *pkg = NULL;
 static char *root = NULL;
@@ -76,9 +80,13 @@ void init_pkg_globals( void ) {
 #else
   check_md5 = 0;
 #endif
+  hash_cache = 1;
   pkg = DEFAULT_PKG_STRING;
   root = DEFAULT_ROOT_STRING;
   temp = DEFAULT_TEMP_STRING;
+  threads = 0;
+  io_buffer_size = DEFAULT_IO_BUFFER_SIZE;
+  io_direct = 0;
 }
 
 int sanity_check_globals( void ) {
@@ -148,6 +156,58 @@ void set_check_md5( int v ) {
   else check_md5 = 0;
 }
 
+int get_hash_cache( void ) {
+  return hash_cache;
+}
+
+void set_hash_cache( int v ) {
+  if ( v ) hash_cache = 1;
+  else hash_cache = 0;
+}
+
+int get_default_threads( void ) {
+  int result;
+#ifdef USE_PTHREADS
+  long ncpus;
+
+  if ( threads > 0 ) result = threads;
+  else {
+    /* One thread per online CPU */
+    ncpus = sysconf( _SC_NPROCESSORS_ONLN );
+    if ( ncpus > 0 ) result = (int)ncpus;
+    else result = 1;
+  }
+#else
+  /* No threads to be had */
+  result = 1;
+#endif /* USE_PTHREADS */
+
+  return result;
+}
+
+void set_default_threads( int v ) {
+  if ( v > 0 ) threads = v;
+  else threads = 0;
+}
+
+long get_io_buffer_size( void ) {
+  return io_buffer_size;
+}
+
+void set_io_buffer_size( long v ) {
+  if ( v >= MIN_IO_BUFFER_SIZE ) io_buffer_size = v;
+  else io_buffer_size = MIN_IO_BUFFER_SIZE;
+}
+
+int get_io_direct( void ) {
+  return io_direct;
+}
+
+void set_io_direct( int v ) {
+  if ( v ) io_direct = 1;
+  else io_direct = 0;
+}
+
 const char * get_pkg( void ) {
   return pkg;
 }
@@ -0,0 +1,425 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/stat.h>
+
+#ifdef USE_BLAKE3
+#include <blake3.h>
+#endif /* USE_BLAKE3 */
+
+#ifdef USE_XXHASH
+#include <xxhash.h>
+#endif /* USE_XXHASH */
+
+#include <pkg.h>
+
+/*
+ * The content hashes a package-description can use.  MD5 is built in,
+ * and it's what a description without a hash in its header means; the
+ * faster ones come from their own libraries when we're built with them.
+ * Whatever the hash, it goes through a write stream like the MD5 one,
+ * so the tee streams can hash data in the same pass that moves it.
+ */
+
+static void hash_close( void * );
+static long hash_write( void *, void *, long );
+
+void close_hash( hash_state *h ) {
+  if ( h ) {
+    switch ( h->alg ) {
+    case HASH_MD5:
+      /* The md5_state owns the ws in this case */
+      close_md5( (md5_state *)(h->ctx) );
+      h->ws = NULL;
+      break;
+#ifdef USE_BLAKE3
+    case HASH_BLAKE3:
+      free( h->ctx );
+      break;
+#endif /* USE_BLAKE3 */
+#ifdef USE_XXHASH
+    case HASH_XXH3:
+      XXH3_freeState( (XXH3_state_t *)(h->ctx) );
+      break;
+#endif /* USE_XXHASH */
+    default:
+      break;
+    }
+    if ( h->ws ) free( h->ws );
+    free( h );
+  }
+}
+
+/*
+ * Return 1 if filename hashes to hash under alg, 0 if it doesn't, or
+ * what get_file_hash() returned if we couldn't hash it.
+ */
+
+int file_hash_matches( pkg_hash_t alg, const char *filename,
+		       uint8_t *hash ) {
+  int result;
+  uint8_t h[HASH_LEN];
+
+  result = get_file_hash( alg, filename, h );
+  if ( result == 0 ) {
+    if ( memcmp( h, hash, sizeof( h ) ) == 0 ) result = 1;
+    else result = 0;
+  }
+
+  return result;
+}
+
+/*
+ * Hash filename under alg, trusting the hash cache if it's open and
+ * the file hasn't changed since it was last hashed.
+ */
+
+int get_file_hash( pkg_hash_t alg, const char *filename, uint8_t *hash ) {
+  int result, cached;
+  read_stream *file_rs;
+  struct stat st;
+
+  cached = get_cached_hash( alg, filename, &st, hash );
+  if ( cached == 1 ) return 0;
+
+  file_rs = open_read_stream_mmap( filename );
+  if ( file_rs ) {
+    result = get_stream_hash( alg, file_rs, hash );
+    close_read_stream( file_rs );
+  }
+  else result = -3;
+
+  if ( result == 0 && cached == 0 )
+    cache_file_hash( alg, filename, &st, hash );
+
+  return result;
+}
+
+/*
+ * Hash n files, into hashes + i * HASH_LEN, with what get_file_hash()
+ * would have returned for each in results[i].  MD5 can run several
+ * side by side; the library hashes are SIMD already, so they go one
+ * file at a time.  Either way, only what the hash cache misses gets
+ * read.
+ */
+
+int get_file_hashes( pkg_hash_t alg, const char **filenames,
+		     uint8_t *hashes, int *results, int n ) {
+  int i, j, m, status, *cached, *miss_results;
+  const char **misses;
+  uint8_t *miss_hashes;
+  struct stat *st;
+
+  if ( filenames && hashes && results && n >= 0 ) {
+    memset( hashes, 0, sizeof( *hashes ) * HASH_LEN * n );
+    if ( alg != HASH_MD5 ) {
+      for ( i = 0; i < n; ++i )
+	results[i] = get_file_hash( alg, filenames[i],
+				    hashes + i * HASH_LEN );
+      return 0;
+    }
+
+    cached = malloc( sizeof( *cached ) * ( n + 1 ) );
+    st = malloc( sizeof( *st ) * ( n + 1 ) );
+    misses = malloc( sizeof( *misses ) * ( n + 1 ) );
+    miss_results = malloc( sizeof( *miss_results ) * ( n + 1 ) );
+    miss_hashes = malloc( sizeof( *miss_hashes ) * HASH_LEN * ( n + 1 ) );
+    if ( cached && st && misses && miss_results && miss_hashes ) {
+      m = 0;
+      for ( i = 0; i < n; ++i ) {
+	cached[i] = get_cached_hash( alg, filenames[i], &(st[i]),
+				     hashes + i * HASH_LEN );
+	if ( cached[i] == 1 ) results[i] = 0;
+	else misses[m++] = filenames[i];
+      }
+
+      status = get_file_md5s( misses, miss_hashes, miss_results, m );
+      if ( status == 0 ) {
+	for ( i = 0, j = 0; i < n; ++i ) {
+	  if ( cached[i] == 1 ) continue;
+	  results[i] = miss_results[j];
+	  if ( results[i] == 0 ) {
+	    memcpy( hashes + i * HASH_LEN, miss_hashes + j * HASH_LEN,
+		    HASH_LEN );
+	    if ( cached[i] == 0 )
+	      cache_file_hash( alg, filenames[i], &(st[i]),
+			       hashes + i * HASH_LEN );
+	  }
+	  ++j;
+	}
+      }
+    }
+    /* No memory to sort out the hits; just hash them all */
+    else status = get_file_md5s( filenames, hashes, results, n );
+
+    if ( cached ) free( cached );
+    if ( st ) free( st );
+    if ( misses ) free( misses );
+    if ( miss_results ) free( miss_results );
+    if ( miss_hashes ) free( miss_hashes );
+
+    return status;
+  }
+  else return -1;
+}
+
+/* How many bytes of the HASH_LEN alg really uses; 0 if we don't know it */
+
+int get_hash_len( pkg_hash_t alg ) {
+  switch ( alg ) {
+  case HASH_MD5:
+    return MD5_RESULT_LEN;
+  case HASH_BLAKE3:
+    return 32;
+  case HASH_XXH3:
+    return 16;
+  default:
+    return 0;
+  }
+}
+
+/* The name for alg in package-description headers and on the command line */
+
+const char * get_hash_name( pkg_hash_t alg ) {
+  switch ( alg ) {
+  case HASH_MD5:
+    return "md5";
+  case HASH_BLAKE3:
+    return "blake3";
+  case HASH_XXH3:
+    return "xxh3";
+  default:
+    return NULL;
+  }
+}
+
+int get_hash_result( hash_state *h, uint8_t *out ) {
+  int result;
+#ifdef USE_XXHASH
+  XXH128_canonical_t canon;
+#endif /* USE_XXHASH */
+
+  if ( h && out && h->done ) {
+    memset( out, 0, HASH_LEN );
+    switch ( h->alg ) {
+    case HASH_MD5:
+      result = get_md5_result( (md5_state *)(h->ctx), out );
+      break;
+#ifdef USE_BLAKE3
+    case HASH_BLAKE3:
+      blake3_hasher_finalize( (blake3_hasher *)(h->ctx), out,
+			      BLAKE3_OUT_LEN );
+      result = 0;
+      break;
+#endif /* USE_BLAKE3 */
+#ifdef USE_XXHASH
+    case HASH_XXH3:
+      XXH128_canonicalFromHash( &canon,
+				XXH3_128bits_digest( (XXH3_state_t *)
+						     (h->ctx) ) );
+      memcpy( out, canon.digest, sizeof( canon.digest ) );
+      result = 0;
+      break;
+#endif /* USE_XXHASH */
+    default:
+      result = -1;
+    }
+  }
+  else result = -1;
+
+  return result;
+}
+
+write_stream * get_hash_ws( hash_state *h ) {
+  return h->ws;
+}
+
+/*
+ * Hash everything left in rs, through a tee so it works whether or not
+ * rs can lend us its buffer.
+ */
+
+int get_stream_hash( pkg_hash_t alg, read_stream *rs, uint8_t *hash ) {
+  int result;
+  hash_state *h;
+  read_stream *hash_rs;
+  write_stream *hash_ws;
+  void *buf, *data;
+  long len, buf_len;
+
+  result = 0;
+  h = start_new_hash( alg );
+  if ( h ) {
+    hash_ws = get_hash_ws( h );
+    if ( hash_ws ) {
+      hash_rs = open_tee_read_stream( rs, hash_ws );
+      buf_len = get_io_buffer_size();
+      buf = malloc( buf_len );
+      if ( hash_rs && buf ) {
+	/* The tee does the hashing; we only need to pull it through */
+	do {
+	  len = borrow_from_stream( hash_rs, &data, buf, buf_len );
+	} while ( len > 0 );
+	if ( len < 0 ) result = -6;
+      }
+      else result = -4;
+      if ( buf ) free( buf );
+      if ( hash_rs ) close_read_stream( hash_rs );
+
+      close_write_stream( hash_ws );
+      if ( result == 0 ) {
+	if ( get_hash_result( h, hash ) != 0 ) result = -5;
+      }
+    }
+    else result = -2;
+
+    close_hash( h );
+  }
+  else result = -1;
+
+  return result;
+}
+
+static void hash_close( void *v ) {
+  hash_state *h;
+
+  h = (hash_state *)v;
+  if ( h ) {
+    h->done = 1;
+    /* close_write_stream() frees it */
+    h->ws = NULL;
+  }
+}
+
+/* Whether we were built with what we need to compute alg */
+
+int hash_supported( pkg_hash_t alg ) {
+  switch ( alg ) {
+  case HASH_MD5:
+    return 1;
+#ifdef USE_BLAKE3
+  case HASH_BLAKE3:
+    return 1;
+#endif /* USE_BLAKE3 */
+#ifdef USE_XXHASH
+  case HASH_XXH3:
+    return 1;
+#endif /* USE_XXHASH */
+  default:
+    return 0;
+  }
+}
+
+static long hash_write( void *v, void *buf, long len ) {
+  hash_state *h;
+
+  h = (hash_state *)v;
+  if ( h && buf && len >= 0 && !(h->done) ) {
+    switch ( h->alg ) {
+#ifdef USE_BLAKE3
+    case HASH_BLAKE3:
+      blake3_hasher_update( (blake3_hasher *)(h->ctx), buf, (size_t)len );
+      return len;
+#endif /* USE_BLAKE3 */
+#ifdef USE_XXHASH
+    case HASH_XXH3:
+      if ( XXH3_128bits_update( (XXH3_state_t *)(h->ctx), buf,
+				(size_t)len ) == XXH_OK )
+	return len;
+      else return STREAMS_INTERNAL_ERROR;
+#endif /* USE_XXHASH */
+    default:
+      return STREAMS_INTERNAL_ERROR;
+    }
+  }
+  else return STREAMS_BAD_ARGS;
+}
+
+/* Parse a hash name as get_hash_name() gives it; 0 if we knew it */
+
+int parse_hash_name( const char *name, pkg_hash_t *alg ) {
+  pkg_hash_t a;
+
+  if ( name && alg ) {
+    for ( a = HASH_MD5; a < DEFAULT_HASH; ++a ) {
+      if ( strcmp( name, get_hash_name( a ) ) == 0 ) {
+	*alg = a;
+	return 0;
+      }
+    }
+  }
+
+  return -1;
+}
+
+/*
+ * Start hashing with alg: write to get_hash_ws(), close that, then
+ * get_hash_result() and close_hash().  NULL if alg isn't supported.
+ */
+
+hash_state * start_new_hash( pkg_hash_t alg ) {
+  hash_state *h;
+  md5_state *md5;
+  write_stream *ws;
+
+  if ( !hash_supported( alg ) ) return NULL;
+  h = malloc( sizeof( *h ) );
+  if ( h ) {
+    h->alg = alg;
+    h->ctx = NULL;
+    h->done = 0;
+    h->ws = NULL;
+    if ( alg == HASH_MD5 ) {
+      /*
+       * Hand out the MD5 writer itself, so MD5 costs no more than it
+       * did before there was a choice; closing it finishes the hash.
+       */
+      md5 = start_new_md5();
+      if ( md5 ) {
+	h->ctx = md5;
+	h->ws = get_md5_ws( md5 );
+	h->done = 1;
+      }
+    }
+    else {
+      ws = malloc( sizeof( *ws ) );
+      if ( ws ) {
+	switch ( alg ) {
+#ifdef USE_BLAKE3
+	case HASH_BLAKE3:
+	  h->ctx = malloc( sizeof( blake3_hasher ) );
+	  if ( h->ctx ) blake3_hasher_init( (blake3_hasher *)(h->ctx) );
+	  break;
+#endif /* USE_BLAKE3 */
+#ifdef USE_XXHASH
+	case HASH_XXH3:
+	  h->ctx = XXH3_createState();
+	  if ( h->ctx &&
+	       XXH3_128bits_reset( (XXH3_state_t *)(h->ctx) ) != XXH_OK ) {
+	    XXH3_freeState( (XXH3_state_t *)(h->ctx) );
+	    h->ctx = NULL;
+	  }
+	  break;
+#endif /* USE_XXHASH */
+	default:
+	  break;
+	}
+	if ( h->ctx ) {
+	  ws->private = h;
+	  ws->close = hash_close;
+	  ws->write = hash_write;
+	  h->ws = ws;
+	}
+	else free( ws );
+      }
+    }
+
+    if ( !(h->ctx) ) {
+      free( h );
+      h = NULL;
+    }
+  }
+
+  return h;
+}
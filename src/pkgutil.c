@@ -21,16 +21,15 @@ static char hex_digit_to_char( unsigned char );
  * Copy a file.  Return LINK_OR_COPY error codes.
  */
 
-#define COPY_BUF_SIZE 1024
-
 int copy_file( const char *dest, const char *src ) {
   int result, status, srcfd, dstfd;
-  long count, written, wcount;
+  long count, written, wcount, buf_len;
   struct stat st;
   mode_t dst_mode;
-  char buf[COPY_BUF_SIZE];
+  char *buf;
 
   status = LINK_OR_COPY_SUCCESS;
+  buf = NULL;
   if ( dest && src ) {
     result = lstat( dest, &st );
     if ( result == 0 ) {
@@ -41,9 +40,21 @@ int copy_file( const char *dest, const char *src ) {
     }
     else if ( errno != ENOENT ) status = LINK_OR_COPY_ERROR;
 
+    if ( status == LINK_OR_COPY_SUCCESS ) {
+      buf_len = get_io_buffer_size();
+      buf = malloc( buf_len );
+      if ( !buf ) {
+	fprintf( stderr, "copy_file(): couldn't allocate copy buffer\n" );
+	status = LINK_OR_COPY_ERROR;
+      }
+    }
+
     if ( status == LINK_OR_COPY_SUCCESS ) {
       srcfd = open( src, O_RDONLY );
       if ( srcfd != -1 ) {
+#ifdef POSIX_FADV_SEQUENTIAL
+	posix_fadvise( srcfd, 0, 0, POSIX_FADV_SEQUENTIAL );
+#endif /* POSIX_FADV_SEQUENTIAL */
 	/* Stat it to get the source mode */
 	result = fstat( srcfd, &st );
 	if ( result == 0 ) dst_mode = st.st_mode;
@@ -52,7 +63,7 @@ int copy_file( const char *dest, const char *src ) {
 	/* The destination name should be clear now, try to copy it */
 	dstfd = open( dest, O_RDWR | O_CREAT | O_EXCL, 0600 );
 	if ( dstfd != -1 ) {
-	  while ( ( count = read( srcfd, buf, COPY_BUF_SIZE ) ) > 0 ) {
+	  while ( ( count = read( srcfd, buf, buf_len ) ) > 0 ) {
 	    written = 0;
 	    while ( written < count &&
 		    ( wcount = write( dstfd, buf + written,
@@ -113,6 +124,8 @@ int copy_file( const char *dest, const char *src ) {
 	status = LINK_OR_COPY_ERROR;
       }
     }
+
+    if ( buf ) free( buf );
   }
   else status = LINK_OR_COPY_ERROR;
 
@@ -409,13 +422,12 @@ int is_whitespace( char *str ) {
   else return -1;
 }
 
-#define LINK_OR_COPY_BUF_SIZE 1024
-
 int link_or_copy( const char *dest, const char *src ) {
   struct stat st;
   int result, status, dstfd, srcfd;
-  unsigned char buf[LINK_OR_COPY_BUF_SIZE];
+  unsigned char *buf;
   ssize_t count, wcount, written;
+  long buf_len;
 
   status = LINK_OR_COPY_SUCCESS;
   if ( src && dest ) {
@@ -449,9 +461,13 @@ int link_or_copy( const char *dest, const char *src ) {
 	  dstfd = open( dest, O_RDWR | O_CREAT | O_EXCL, 0600 );
 	  if ( dstfd != -1 ) {
 	    srcfd = open( src, O_RDONLY );
-	    if ( srcfd != -1 ) {
-	      while ( ( count = read( srcfd, buf, LINK_OR_COPY_BUF_SIZE ) )
-		      > 0 ) {
+	    buf_len = get_io_buffer_size();
+	    buf = malloc( buf_len );
+	    if ( srcfd != -1 && buf ) {
+#ifdef POSIX_FADV_SEQUENTIAL
+	      posix_fadvise( srcfd, 0, 0, POSIX_FADV_SEQUENTIAL );
+#endif /* POSIX_FADV_SEQUENTIAL */
+	      while ( ( count = read( srcfd, buf, buf_len ) ) > 0 ) {
 		written = 0;
 		while ( written < count &&
 			( wcount = write( dstfd, buf + written,
@@ -488,6 +504,12 @@ int link_or_copy( const char *dest, const char *src ) {
 
 	      close( srcfd );
 	    }
+	    else if ( srcfd != -1 ) {
+	      fprintf( stderr,
+		       "link_or_copy(): couldn't allocate copy buffer\n" );
+	      status = LINK_OR_COPY_ERROR;
+	      close( srcfd );
+	    }
 	    /* Source open failed */
 	    else {
 	      fprintf( stderr,
@@ -495,6 +517,7 @@ int link_or_copy( const char *dest, const char *src ) {
 		       src, strerror( errno ) );
 	      status = LINK_OR_COPY_ERROR;
 	    }
+	    if ( buf ) free( buf );
 
 	    close( dstfd );
 	    /* If we failed somewhere, unlink it */
@@ -647,80 +670,69 @@ int parse_strings_from_line( char *line, char ***strings_out ) {
  * int post_path_comparator( void *left, void *right );
  *
  * Path comparator for rbtrees which sorts paths ahead of their prefixes
+ *
+ * This compares component by component, the way splitting both paths
+ * up with get_path_component() would, but walks the strings in place
+ * rather than copying them; runs of slashes separate components and
+ * leading or trailing ones don't count.
  */
 
 int post_path_comparator( void *left, void *right ) {
-  char *ls, *rs, *lbuf, *rbuf;
-  char *lcmp, *rcmp, *ltmp, *rtmp;
-  int result, temp;
+  unsigned char *ls, *rs;
+  int lc, rc, result;
 
-  ls = (char *)left;
-  rs = (char *)right;
+  ls = (unsigned char *)left;
+  rs = (unsigned char *)right;
   if ( ls && rs ) {
-    lbuf = malloc( sizeof( *lbuf ) * ( strlen( ls ) + 1 ) );
-    rbuf = malloc( sizeof( *rbuf ) * ( strlen( rs ) + 1 ) );
-    if ( lbuf && rbuf ) {
-      strcpy( lbuf, ls );
-      strcpy( rbuf, rs );
-      lcmp = get_path_component( lbuf, &ltmp );
-      rcmp = get_path_component( rbuf, &rtmp );
-      while ( 1 ) {
-	if ( lcmp && rcmp ) {
-	  temp = strcmp( lcmp, rcmp );
-	  if ( temp > 0 ) {
-	    /*
-	     * rcmp is alphabetically prior to lcmp in the first
-	     * component after a common prefix, so rs sorts first.
-	     */
-	    result = 1;
-	    break;
-	  }
-	  else if ( temp < 0 ) {
-	    /* As above, but ls sorts first. */
-	    result = -1;
-	    break;
-	  }
-	  else {
-	    /* These components match; get the next ones */
-	    lcmp = get_path_component( NULL, &ltmp );
-	    rcmp = get_path_component( NULL, &rtmp );
-	  }
+    while ( 1 ) {
+      while ( *ls == '/' ) ++ls;
+      while ( *rs == '/' ) ++rs;
+
+      if ( *ls && *rs ) {
+	/* Match up this component as far as it goes */
+	while ( *ls && *ls != '/' && *ls == *rs ) {
+	  ++ls;
+	  ++rs;
 	}
-	else {
-	  /* We ran out of data on at least one */
-	  if ( lcmp ) {
-	    /*
-	     * We still have a left component, but no right component,
-	     * so ls is a prefix of rs, and rs sorts first.
-	     */
-	    result = 1;
-	  }
-	  else if ( rcmp ) {
-	    /* As above, but rs is a prefix of ls */
-	    result = -1;
-	  }
-	  else {
-	    /* We finished both simultaneously; they must be identical */
-	    result = 0;
-	  }
-	  
-	  /* We're done */
+	/* The end of a component compares like the end of a string */
+	lc = ( *ls == '/' ) ? 0 : *ls;
+	rc = ( *rs == '/' ) ? 0 : *rs;
+	if ( lc > rc ) {
+	  /*
+	   * rs is alphabetically prior to ls in the first component
+	   * after a common prefix, so rs sorts first.
+	   */
+	  result = 1;
+	  break;
+	}
+	else if ( lc < rc ) {
+	  /* As above, but ls sorts first. */
+	  result = -1;
 	  break;
 	}
+	/* else these components match; go on to the next ones */
       }
+      else {
+	/* We ran out of components on at least one */
+	if ( *ls ) {
+	  /*
+	   * We still have a left component, but no right component,
+	   * so ls is a prefix of rs, and rs sorts first.
+	   */
+	  result = 1;
+	}
+	else if ( *rs ) {
+	  /* As above, but rs is a prefix of ls */
+	  result = -1;
+	}
+	else {
+	  /* We finished both simultaneously; they must be identical */
+	  result = 0;
+	}
 
-      free( lbuf );
-      free( rbuf );
-    }
-    else {
-      /* Alloc error */
-      fprintf( stderr,
-	       "Warning: unable to allocagte memory in post_path_comparator()\n" );
-
-      if ( lbuf ) free( lbuf );
-      if ( rbuf ) free( rbuf );
-
-      result = 0;
+	/* We're done */
+	break;
+      }
     }
   }
   else {
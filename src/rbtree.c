@@ -5,6 +5,9 @@
 
 #undef RBTREE_DEBUG
 
+/* Size of the blocks rbtree_alloc_arena() trees carve nodes from */
+#define RBTREE_ARENA_BLOCK_SIZE 65536
+
 #define rberr(...) dbg_printf( __FILE__, __LINE__, __VA_ARGS__ )
 
 #ifdef RBTREE_DEBUG
@@ -13,13 +16,38 @@
 #define rbdbg(...)
 #endif
 
+typedef struct rbtree_arena_block_struct {
+  struct rbtree_arena_block_struct *next;
+  size_t used, size;
+} rbtree_arena_block;
+
+struct rbtree_arena_struct {
+  rbtree_arena_block *blocks;
+  /* Deleted nodes, chained through left, to use again */
+  rbtree_node *free_nodes;
+  /* Whether string keys or values are copied into the blocks too */
+  int keys, vals;
+};
+
+static void * rbtree_arena_alloc( struct rbtree_arena_struct *, size_t,
+				  size_t );
+static char * rbtree_arena_copy_string( struct rbtree_arena_struct *,
+					char * );
+static rbtree_node * rbtree_build_subtree( rbtree_node **, unsigned long,
+					   unsigned long, int, int,
+					   rbtree_node * );
 static void rbtree_clear_key_and_value( rbtree *, rbtree_node * );
 static int rbtree_delete_and_fixup( rbtree *, rbtree_node * );
 static int rbtree_delete_node( rbtree *, rbtree_node *, void *, void ** );
 static int rbtree_delete_rebalance( rbtree *, rbtree_node *, rbtree_node * );
+static void * rbtree_copy_key( rbtree *, void * );
+static void * rbtree_copy_val( rbtree *, void * );
+static void rbtree_drop_key( rbtree *, void * );
+static void rbtree_drop_val( rbtree *, void * );
 static void rbtree_dump_node( rbtree_node *, int,
 			      void (*)( void * ), void (*)( void * ) );
 static void rbtree_dump_print_spaces( int );
+static void rbtree_free_node( rbtree *, rbtree_node * );
 static void rbtree_free_subtree( rbtree *, rbtree_node * );
 static rbtree_node * rbtree_get_aunt( rbtree_node * );
 static rbtree_node * rbtree_get_first( rbtree_node * );
@@ -32,6 +60,7 @@ static int rbtree_insert_node( rbtree *, rbtree_node *,
 			       void *, void *,
 			       int );
 static void rbtree_insert_post( rbtree *, rbtree_node * );
+static rbtree_node * rbtree_new_node( rbtree * );
 static int rbtree_query_node( rbtree_node *,
 			      int (*)( void *, void * ),
 			      void *, void ** );
@@ -58,25 +87,220 @@ rbtree * rbtree_alloc( int (*comparator)( void *, void * ),
       t->copy_val = copy_val;
       t->free_val = free_val;
       t->count = 0;
+      t->arena = NULL;
     }
     return t;
   }
   else return NULL;
 }
 
+/*
+ * Like rbtree_alloc(), but the nodes are bump-allocated out of large
+ * blocks and rbtree_free() releases them all at once.  If the keys or
+ * values are strings copied with rbtree_string_copier() and freed with
+ * rbtree_string_free(), the copies go in the blocks as well.  Memory
+ * for deleted nodes is reused, but the strings they held aren't freed
+ * until the whole tree is, so this is for trees that are built up,
+ * used and thrown away.
+ */
+
+rbtree * rbtree_alloc_arena( int (*comparator)( void *, void * ),
+			     void * (*copy_key)( void * ),
+			     void (*free_key)( void * ),
+			     void * (*copy_val)( void * ),
+			     void (*free_val)( void * ) ) {
+  rbtree *t;
+
+  t = rbtree_alloc( comparator, copy_key, free_key, copy_val, free_val );
+  if ( t ) {
+    t->arena = malloc( sizeof( *(t->arena) ) );
+    if ( t->arena ) {
+      t->arena->blocks = NULL;
+      t->arena->free_nodes = NULL;
+      t->arena->keys = ( copy_key == rbtree_string_copier &&
+			 free_key == rbtree_string_free );
+      t->arena->vals = ( copy_val == rbtree_string_copier &&
+			 free_val == rbtree_string_free );
+    }
+    else {
+      free( t );
+      t = NULL;
+    }
+  }
+
+  return t;
+}
+
+/* Carve len bytes aligned to align (a power of two) out of a */
+
+static void * rbtree_arena_alloc( struct rbtree_arena_struct *a,
+				  size_t len, size_t align ) {
+  rbtree_arena_block *b;
+  size_t off, size;
+
+  b = a->blocks;
+  off = 0;
+  if ( b ) off = ( b->used + align - 1 ) & ~( align - 1 );
+  if ( !b || off + len > b->size ) {
+    size = RBTREE_ARENA_BLOCK_SIZE - sizeof( *b );
+    if ( len > size ) size = len;
+    b = malloc( sizeof( *b ) + size );
+    if ( !b ) return NULL;
+    b->next = a->blocks;
+    b->used = 0;
+    b->size = size;
+    a->blocks = b;
+    off = 0;
+  }
+  b->used = off + len;
+
+  return (char *)( b + 1 ) + off;
+}
+
+static char * rbtree_arena_copy_string( struct rbtree_arena_struct *a,
+					char *s ) {
+  char *c;
+  size_t len;
+
+  len = strlen( s ) + 1;
+  c = rbtree_arena_alloc( a, len, 1 );
+  if ( c ) memcpy( c, s, len );
+
+  return c;
+}
+
+/*
+ * Load n keys and values into t.  If t is empty and the keys are in
+ * strictly increasing order, this builds the balanced tree directly in
+ * O(n); otherwise it falls back to rbtree_insert_no_overwrite() one at
+ * a time.  If an insert fails, *bad (if not NULL) gets the index of the
+ * entry it failed on, and we return its result; the entries before it
+ * stay in the tree.  If building directly runs out of memory, t is
+ * left empty.
+ */
+
+int rbtree_build_from_sorted( rbtree *t, void **keys, void **vals,
+			      unsigned long n, unsigned long *bad ) {
+  rbtree_node **nodes;
+  unsigned long i, j, m;
+  int sorted, result, red_depth;
+
+  if ( !t || ( n > 0 && !( keys && vals ) ) ) return RBTREE_ERROR;
+
+  sorted = ( t->root == NULL );
+  for ( i = 0; sorted && i < n; ++i ) {
+    if ( !(keys[i]) ||
+	 ( i > 0 && t->comparator( keys[i - 1], keys[i] ) >= 0 ) )
+      sorted = 0;
+  }
+
+  nodes = NULL;
+  if ( sorted && n > 0 ) nodes = malloc( sizeof( *nodes ) * n );
+  if ( !sorted || !nodes ) {
+    for ( i = 0; i < n; ++i ) {
+      result = rbtree_insert_no_overwrite( t, keys[i], vals[i] );
+      if ( result != RBTREE_SUCCESS ) {
+	if ( bad ) *bad = i;
+	return result;
+      }
+    }
+    return RBTREE_SUCCESS;
+  }
+
+  /* Make all the nodes first, so the only thing that can fail is here */
+  for ( i = 0; i < n; ++i ) {
+    nodes[i] = rbtree_new_node( t );
+    if ( nodes[i] ) {
+      nodes[i]->key = rbtree_copy_key( t, keys[i] );
+      nodes[i]->value = rbtree_copy_val( t, vals[i] );
+    }
+    if ( !(nodes[i]) || !(nodes[i]->key) ||
+	 ( vals[i] && !(nodes[i]->value) ) ) {
+      for ( j = 0; j <= i; ++j ) {
+	if ( nodes[j] ) {
+	  if ( nodes[j]->key && nodes[j]->key != keys[j] )
+	    rbtree_drop_key( t, nodes[j]->key );
+	  if ( nodes[j]->value && nodes[j]->value != vals[j] )
+	    rbtree_drop_val( t, nodes[j]->value );
+	  rbtree_free_node( t, nodes[j] );
+	}
+      }
+      free( nodes );
+      return RBTREE_ERROR;
+    }
+  }
+
+  /*
+   * Splitting at the middle each time fills every level but the last;
+   * making the nodes on that last level red keeps the black heights
+   * equal.
+   */
+  red_depth = 0;
+  for ( m = n + 1; m > 1; m >>= 1 ) ++red_depth;
+  t->root = rbtree_build_subtree( nodes, 0, n, 0, red_depth, NULL );
+  t->count = n;
+  free( nodes );
+
+  return RBTREE_SUCCESS;
+}
+
+/* Link nodes[lo..hi-1] under up, for rbtree_build_from_sorted() */
+
+static rbtree_node * rbtree_build_subtree( rbtree_node **nodes,
+					   unsigned long lo,
+					   unsigned long hi, int depth,
+					   int red_depth, rbtree_node *up ) {
+  rbtree_node *n;
+  unsigned long mid;
+
+  if ( lo >= hi ) return NULL;
+  mid = lo + ( hi - lo ) / 2;
+  n = nodes[mid];
+  n->up = up;
+  n->color = ( depth >= red_depth ) ? RED : BLACK;
+  n->left = rbtree_build_subtree( nodes, lo, mid, depth + 1, red_depth, n );
+  n->right = rbtree_build_subtree( nodes, mid + 1, hi, depth + 1,
+				   red_depth, n );
+
+  return n;
+}
+
 static void rbtree_clear_key_and_value( rbtree *t, rbtree_node *n ) {
   if ( t && n ) {
     if ( n->key ) {
-      if ( t->copy_key && t->free_key ) t->free_key( n->key );
+      if ( t->copy_key && t->free_key ) rbtree_drop_key( t, n->key );
       n->key = NULL;
     }
     if ( n->value ) {
-      if ( t->copy_val && t->free_val ) t->free_val( n->value );
+      if ( t->copy_val && t->free_val ) rbtree_drop_val( t, n->value );
       n->value = NULL;
     }    
   }
 }
 
+/*
+ * The tree's own copy of a key or value; arena trees put string copies
+ * in their blocks.
+ */
+
+static void * rbtree_copy_key( rbtree *t, void *key ) {
+  if ( t->arena && t->arena->keys ) {
+    if ( key ) return rbtree_arena_copy_string( t->arena, key );
+    else return NULL;
+  }
+  else if ( t->copy_key && t->free_key ) return t->copy_key( key );
+  else return key;
+}
+
+static void * rbtree_copy_val( rbtree *t, void *val ) {
+  if ( t->arena && t->arena->vals ) {
+    if ( val ) return rbtree_arena_copy_string( t->arena, val );
+    else return NULL;
+  }
+  else if ( t->copy_val && t->free_val ) return t->copy_val( val );
+  else return val;
+}
+
 static int rbtree_delete_and_fixup( rbtree *t, rbtree_node *n ) {
   /*
    * This function is called by rbtree_delete_node().  The node n has
@@ -130,7 +354,7 @@ static int rbtree_delete_and_fixup( rbtree *t, rbtree_node *n ) {
 	  t->root = child;
 	}
 	else t->root = NULL;
-	free( n );
+	rbtree_free_node( t, n );
       }
       else status = RBTREE_ERROR;
     }
@@ -154,7 +378,7 @@ static int rbtree_delete_and_fixup( rbtree *t, rbtree_node *n ) {
 	    child->up = parent;
 	  }
 	  else *parent_ptr = NULL;
-	  free( n );
+	  rbtree_free_node( t, n );
 	}
 	else if ( n->color == BLACK ) {
 	  if ( child && child->color == RED ) {
@@ -166,7 +390,7 @@ static int rbtree_delete_and_fixup( rbtree *t, rbtree_node *n ) {
 	    *parent_ptr = child;
 	    child->up = parent;
 	    child->color = BLACK;
-	    free( n );
+	    rbtree_free_node( t, n );
 	  }
 	  else {
 
@@ -177,7 +401,7 @@ static int rbtree_delete_and_fixup( rbtree *t, rbtree_node *n ) {
 	      child->up = parent;
 	      child->color = BLACK;
 	    }
-	    free( n );
+	    rbtree_free_node( t, n );
 
 	    rbdbg( "rbtree_delete_and_fixup( %p ): deleted n and put its child in its place, about to call rbtree_delete_rebalance()\n",
 		   n );
@@ -585,6 +809,16 @@ int rbtree_delete( rbtree *t, void *k, void **vout ) {
   else return RBTREE_ERROR;
 }
 
+/* Free a key or value the tree is done with, unless it's in the arena */
+
+static void rbtree_drop_key( rbtree *t, void *key ) {
+  if ( t->free_key && !( t->arena && t->arena->keys ) ) t->free_key( key );
+}
+
+static void rbtree_drop_val( rbtree *t, void *val ) {
+  if ( t->free_val && !( t->arena && t->arena->vals ) ) t->free_val( val );
+}
+
 static void rbtree_dump_node( rbtree_node *n, int depth,
 			      void (*key_printer)( void * ),
 			      void (*val_printer)( void * ) ) {
@@ -659,19 +893,81 @@ void * rbtree_enum( rbtree *t, rbtree_node *in,
   }
 }
 
+void * rbtree_enum_from( rbtree *t, void *key,
+			 void **vout, rbtree_node **nout ) {
+  /*
+   * Like rbtree_enum() starting from scratch, except that we start at
+   * the first node whose key is not less than key; continue from the
+   * node we give back with rbtree_enum().
+   */
+  rbtree_node *n, *found;
+  int cmp;
+
+  found = NULL;
+  if ( t ) {
+    n = t->root;
+    while ( n ) {
+      cmp = t->comparator( key, n->key );
+      if ( cmp == 0 ) {
+	found = n;
+	break;
+      }
+      else if ( cmp < 0 ) {
+	/* This one will do if nothing on the left does */
+	found = n;
+	n = n->left;
+      }
+      else n = n->right;
+    }
+  }
+
+  if ( found ) {
+    if ( nout ) *nout = found;
+    if ( vout ) *vout = found->value;
+    return found->key;
+  }
+  else {
+    if ( nout ) *nout = NULL;
+    if ( vout ) *vout = NULL;
+    return NULL;
+  }
+}
+
+static void rbtree_free_node( rbtree *t, rbtree_node *n ) {
+  if ( t->arena ) {
+    n->left = t->arena->free_nodes;
+    t->arena->free_nodes = n;
+  }
+  else free( n );
+}
+
 void rbtree_free_subtree( rbtree *t, rbtree_node *n ) {
   if ( t && n ) {
     if ( n->left ) rbtree_free_subtree( t, n->left );
     if ( n->right ) rbtree_free_subtree( t, n->right );
-    if ( t->free_val ) t->free_val( n->value );
-    if ( t->free_key ) t->free_key( n->key );
-    free( n );
+    rbtree_drop_val( t, n->value );
+    rbtree_drop_key( t, n->key );
+    if ( !(t->arena) ) free( n );
   }
 }
 
 void rbtree_free( rbtree *t ) {
+  rbtree_arena_block *b;
+
   if ( t ) {
-    rbtree_free_subtree( t, t->root );
+    if ( t->arena ) {
+      /* Only walk the tree if something in it isn't in the blocks */
+      if ( ( t->free_key && !(t->arena->keys) ) ||
+	   ( t->free_val && !(t->arena->vals) ) )
+	rbtree_free_subtree( t, t->root );
+      while ( t->arena->blocks ) {
+	b = t->arena->blocks;
+	t->arena->blocks = b->next;
+	free( b );
+      }
+      free( t->arena );
+    }
+    else rbtree_free_subtree( t, t->root );
     free( t );
   }
 }
@@ -768,21 +1064,19 @@ int rbtree_insert_no_overwrite( rbtree *t, void *key, void *val ) {
 
   status = RBTREE_SUCCESS;
   if ( t && key ) {
-    if ( t->copy_key && t->free_key ) k = t->copy_key( key );
-    else k = key;
+    k = rbtree_copy_key( t, key );
     if ( ( key && k ) || ( !key && !k ) ) {
-      if ( t->copy_val && t->free_val ) v = t->copy_val( val );
-      else v = val;
+      v = rbtree_copy_val( t, val );
       if ( ( val && v ) || ( !val && !v ) ) {
 	result = rbtree_insert_node( t, NULL, &(t->root), k, v, 0 );
 	if ( result != RBTREE_SUCCESS ) {
-	  if ( k != key && t->free_key ) t->free_key( k );
-	  if ( v != val && t->free_val ) t->free_val( v );
+	  if ( k != key ) rbtree_drop_key( t, k );
+	  if ( v != val ) rbtree_drop_val( t, v );
 	  status = result;
 	}
       }
       else {
-	if ( k != key && t->free_key ) t->free_key( k );
+	if ( k != key ) rbtree_drop_key( t, k );
 	status = RBTREE_ERROR;
       }
     }
@@ -802,7 +1096,7 @@ static int rbtree_insert_node( rbtree *t, rbtree_node *parent,
   if ( t && n ) {
     if ( *n == NULL ) {
       /* insert it here */
-      tmp = malloc( sizeof( *tmp ) );
+      tmp = rbtree_new_node( t );
       if ( tmp ) {
 	tmp->key = k;
 	tmp->value = v;
@@ -826,9 +1120,9 @@ static int rbtree_insert_node( rbtree *t, rbtree_node *parent,
       else if ( c == 0 ) {
 	/* Replace this value and key */
 	if ( overwrite ) {
-	  if ( t->free_key ) t->free_key( (*n)->key );
+	  rbtree_drop_key( t, (*n)->key );
 	  (*n)->key = k;
-	  if ( t->free_val ) t->free_val( (*n)->value );
+	  rbtree_drop_val( t, (*n)->value );
 	  (*n)->value = v;
 	  result = RBTREE_SUCCESS;
 	  /* We don't change the count to replace an existing node */
@@ -1030,21 +1324,19 @@ int rbtree_insert( rbtree *t, void *key, void *val ) {
 
   status = RBTREE_SUCCESS;
   if ( t && key ) {
-    if ( t->copy_key && t->free_key ) k = t->copy_key( key );
-    else k = key;
+    k = rbtree_copy_key( t, key );
     if ( ( key && k ) || ( !key && !k ) ) {
-      if ( t->copy_val && t->free_val ) v = t->copy_val( val );
-      else v = val;
+      v = rbtree_copy_val( t, val );
       if ( ( val && v ) || ( !val && !v ) ) {
 	result = rbtree_insert_node( t, NULL, &(t->root), k, v, 1 );
 	if ( result != RBTREE_SUCCESS ) {
-	  if ( k != key && t->free_key ) t->free_key( k );
-	  if ( v != val && t->free_val ) t->free_val( v );
+	  if ( k != key ) rbtree_drop_key( t, k );
+	  if ( v != val ) rbtree_drop_val( t, v );
 	  status = result;
 	}
       }
       else {
-	if ( k != key && t->free_key ) t->free_key( k );
+	if ( k != key ) rbtree_drop_key( t, k );
 	status = RBTREE_ERROR;
       }
     }
@@ -1054,6 +1346,19 @@ int rbtree_insert( rbtree *t, void *key, void *val ) {
   return status;
 }
 
+static rbtree_node * rbtree_new_node( rbtree *t ) {
+  rbtree_node *n;
+
+  if ( t->arena ) {
+    n = t->arena->free_nodes;
+    if ( n ) t->arena->free_nodes = n->left;
+    else n = rbtree_arena_alloc( t->arena, sizeof( *n ), sizeof( void * ) );
+  }
+  else n = malloc( sizeof( *n ) );
+
+  return n;
+}
+
 static int rbtree_query_node( rbtree_node *t,
 			      int (*comparator)( void *, void * ),
 			      void *key, void **val_out ) {
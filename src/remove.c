@@ -12,90 +12,93 @@
 #define REMOVE_SUCCESS 0
 #define REMOVE_ERROR -1
 
-static int remove_directory( pkg_db *, pkg_descr *, pkg_descr_entry * );
-static int remove_file( pkg_db *, pkg_descr *, pkg_descr_entry * );
+static int remove_directory( pkg_db *, rbtree *, pkg_descr *,
+			     pkg_descr_entry * );
+static int remove_file( pkg_db *, rbtree *, pkg_descr *, pkg_descr_entry * );
 static int remove_pkg_by_descr( pkg_db *, pkg_descr * );
 static int remove_pkg( pkg_db *, const char * );
-static int remove_symlink( pkg_db *, pkg_descr *, pkg_descr_entry * );
+static int remove_symlink( pkg_db *, rbtree *, pkg_descr *,
+			   pkg_descr_entry * );
 
-static int remove_directory( pkg_db *db, pkg_descr *descr,
+/*
+ * The remove_*() functions only touch what's in owned, the locations
+ * descr's package still owns in db.
+ */
+
+static int remove_directory( pkg_db *db, rbtree *owned, pkg_descr *descr,
 			     pkg_descr_entry *e ) {
   int status, result;
-  char *full_path, *owner, *canonical_path;
+  char *full_path, *canonical_path;
   struct stat buf;
+  void *owned_v;
 
   status = REMOVE_SUCCESS;
-  if ( db && descr && e && e->type == ENTRY_DIRECTORY ) {
+  if ( db && owned && descr && e && e->type == ENTRY_DIRECTORY ) {
     canonical_path = canonicalize_and_copy( e->filename );
     if ( canonical_path ) {
-      owner = query_pkg_db( db, canonical_path );
-      if ( owner ) {
-	if ( strcmp( owner, descr->hdr.pkg_name ) == 0 ) {
-	  full_path = concatenate_paths( get_root(), e->filename );
-	  if ( full_path ) {
-	    result = lstat( full_path, &buf );
-	    if ( result == 0 ) {
-	      if ( S_ISDIR( buf.st_mode ) ) {
-		/* Try to rmdir() it, and check for ENOTEMPTY */
-		result = rmdir( full_path );
-		if ( result == 0 ) {
-		  /* It's gone */
-		  printf( "RD %s\n", full_path );
-		}
-		else {
-		  /* rmdir failed(), check why */
-		  /* POSIX allows ENOTEMPTY or EEXIST */
-		  if ( errno != ENOTEMPTY && errno != EEXIST ) {
-		    fprintf( stderr,
-			     "Warning: error trying to remove directory %s for %s: %s\n",
-			     full_path, descr->hdr.pkg_name,
-			     strerror( errno ) );
-		    status = REMOVE_ERROR;
-		  }
-		  /*
-		   * else it wasn't empty, so we didn't want to remove
-		   * it anyway
-		   */
-		}
+      result = rbtree_query( owned, canonical_path, &owned_v );
+      if ( result == RBTREE_SUCCESS ) {
+	full_path = concatenate_paths( get_root(), e->filename );
+	if ( full_path ) {
+	  result = lstat( full_path, &buf );
+	  if ( result == 0 ) {
+	    if ( S_ISDIR( buf.st_mode ) ) {
+	      /* Try to rmdir() it, and check for ENOTEMPTY */
+	      result = rmdir( full_path );
+	      if ( result == 0 ) {
+		/* It's gone */
+		printf( "RD %s\n", full_path );
 	      }
-	      /* else it wasn't a directory, so nothing to do */
-	    }
-	    else {
-	      /* lstat() failed */
-	      if ( errno != ENOENT ) {
-		fprintf( stderr,
-			 "Warning: lstat() failed trying to remove directory %s for %s: %s\n",
-			 e->filename, descr->hdr.pkg_name, strerror( errno ) );
-		status = REMOVE_ERROR;
+	      else {
+		/* rmdir failed(), check why */
+		/* POSIX allows ENOTEMPTY or EEXIST */
+		if ( errno != ENOTEMPTY && errno != EEXIST ) {
+		  fprintf( stderr,
+			   "Warning: error trying to remove directory %s for %s: %s\n",
+			   full_path, descr->hdr.pkg_name,
+			   strerror( errno ) );
+		  status = REMOVE_ERROR;
+		}
+		/*
+		 * else it wasn't empty, so we didn't want to remove
+		 * it anyway
+		 */
 	      }
-	      /*
-	       * If it's ENOENT, the directory was removed, so no error; just
-	       * remove its pkgdb entry
-	       */
 	    }
-	    free( full_path );
+	    /* else it wasn't a directory, so nothing to do */
 	  }
 	  else {
-	    fprintf( stderr,
-		     "Warning: out of memory trying to remove directory %s for %s\n",
-		     e->filename, descr->hdr.pkg_name );
-	    status = REMOVE_ERROR;
-	  }
-
-	  /* Get it out of the pkg db regardless */
-	  result = delete_from_pkg_db( db, canonical_path );
-	  if ( result != 0 ) {
-	    fprintf( stderr,
-		     "Warning: failed to remove pkgdb entry for directory %s in %s\n",
-		     e->filename, descr->hdr.pkg_name );
-	    status = REMOVE_ERROR;
+	    /* lstat() failed */
+	    if ( errno != ENOENT ) {
+	      fprintf( stderr,
+		       "Warning: lstat() failed trying to remove directory %s for %s: %s\n",
+		       e->filename, descr->hdr.pkg_name, strerror( errno ) );
+	      status = REMOVE_ERROR;
+	    }
+	    /*
+	     * If it's ENOENT, the directory was removed, so no error; just
+	     * remove its pkgdb entry
+	     */
 	  }
+	  free( full_path );
+	}
+	else {
+	  fprintf( stderr,
+		   "Warning: out of memory trying to remove directory %s for %s\n",
+		   e->filename, descr->hdr.pkg_name );
+	  status = REMOVE_ERROR;
 	}
-	/* else something else claims it now, so skip it */
 
-	free( owner );
+	/* Get it out of the pkg db regardless */
+	result = delete_from_pkg_db( db, canonical_path );
+	if ( result != 0 ) {
+	  fprintf( stderr,
+		   "Warning: failed to remove pkgdb entry for directory %s in %s\n",
+		   e->filename, descr->hdr.pkg_name );
+	  status = REMOVE_ERROR;
+	}
       }
-      /* else it isn't claimed any more, so skip it */
+      /* else something else claims it now, or nothing does; skip it */
 
       free( canonical_path );
     }
@@ -111,85 +114,86 @@ static int remove_directory( pkg_db *db, pkg_descr *descr,
   return status;
 }
 
-static int remove_file( pkg_db *db, pkg_descr *descr, pkg_descr_entry *e ) {
+static int remove_file( pkg_db *db, rbtree *owned, pkg_descr *descr,
+			pkg_descr_entry *e ) {
   int status, result;
-  char *full_path, *owner, *canonical_path;
+  char *full_path, *canonical_path;
   struct stat buf;
+  void *owned_v;
 
   status = REMOVE_SUCCESS;
-  if ( db && descr && e && e->type == ENTRY_FILE ) {
+  if ( db && owned && descr && e && e->type == ENTRY_FILE ) {
     canonical_path = canonicalize_and_copy( e->filename );
     if ( canonical_path ) {
-      owner = query_pkg_db( db, canonical_path );
-      if ( owner ) {
-	if ( strcmp( owner, descr->hdr.pkg_name ) == 0 ) {
-	  full_path = concatenate_paths( get_root(), e->filename );
-	  if ( full_path ) {
-	    result = lstat( full_path, &buf );
-	    if ( result == 0 ) {
-	      if ( S_ISREG( buf.st_mode ) ) {
-		if ( buf.st_mtime == descr->hdr.pkg_time ) {
-		  if ( get_check_md5() ) {
-		    result = file_hash_matches( full_path, e->u.f.hash );
-		    if ( result == 1 ) {
-		      /* Hashes match, remove it */
-		      printf( "RF %s\n", full_path );
-		      unlink( full_path );
-		    }
-		    else if ( result != 0 ) {
-		      /* Error checking hash */
-		      fprintf( stderr,
-			       "Warning: couldn't check MD5 of file %s for %s\n",
-			       full_path, descr->hdr.pkg_name );
-		      status = REMOVE_ERROR;
-		    }
-		  }
-		  else {
-		    /* No MD5 check, remove it */
+      result = rbtree_query( owned, canonical_path, &owned_v );
+      if ( result == RBTREE_SUCCESS ) {
+	full_path = concatenate_paths( get_root(), e->filename );
+	if ( full_path ) {
+	  result = lstat( full_path, &buf );
+	  if ( result == 0 ) {
+	    if ( S_ISREG( buf.st_mode ) ) {
+	      if ( buf.st_mtime == descr->hdr.pkg_time ) {
+		if ( get_check_md5() ) {
+		  result = file_hash_matches( descr->hdr.hash, full_path,
+					      e->u.f.hash );
+		  if ( result == 1 ) {
+		    /* Hashes match, remove it */
 		    printf( "RF %s\n", full_path );
+		    forget_cached_hash( &buf );
 		    unlink( full_path );
 		  }
+		  else if ( result != 0 ) {
+		    /* Error checking hash */
+		    fprintf( stderr,
+			     "Warning: couldn't check %s hash of file %s for %s\n",
+			     get_hash_name( descr->hdr.hash ), full_path,
+			     descr->hdr.pkg_name );
+		    status = REMOVE_ERROR;
+		  }
+		}
+		else {
+		  /* No MD5 check, remove it */
+		  printf( "RF %s\n", full_path );
+		  forget_cached_hash( &buf );
+		  unlink( full_path );
 		}
-		/* else mtimes don't match, so nothing to do */
-	      }
-	      /* else it wasn't a file, so nothing to do */
-	    }
-	    else {
-	      /* lstat() failed */
-	      if ( errno != ENOENT ) {
-		fprintf( stderr,
-			 "Warning: lstat() failed trying to remove file %s for %s: %s\n",
-			 e->filename, descr->hdr.pkg_name, strerror( errno ) );
-		status = REMOVE_ERROR;
 	      }
-	      /*
-	       * If it's ENOENT, the file was removed, so no error; just
-	       * remove its pkgdb entry
-	       */
+	      /* else mtimes don't match, so nothing to do */
 	    }
-	    free( full_path );
+	    /* else it wasn't a file, so nothing to do */
 	  }
 	  else {
-	    fprintf( stderr,
-		     "Warning: out of memory trying to remove file %s for %s\n",
-		     e->filename, descr->hdr.pkg_name );
-	    status = REMOVE_ERROR;
+	    /* lstat() failed */
+	    if ( errno != ENOENT ) {
+	      fprintf( stderr,
+		       "Warning: lstat() failed trying to remove file %s for %s: %s\n",
+		       e->filename, descr->hdr.pkg_name, strerror( errno ) );
+	      status = REMOVE_ERROR;
+	    }
+	    /*
+	     * If it's ENOENT, the file was removed, so no error; just
+	     * remove its pkgdb entry
+	     */
 	  }
+	  free( full_path );
+	}
+	else {
+	  fprintf( stderr,
+		   "Warning: out of memory trying to remove file %s for %s\n",
+		   e->filename, descr->hdr.pkg_name );
+	  status = REMOVE_ERROR;
+	}
 	  
-	  /* Get it out of the pkg db regardless */
-	  result = delete_from_pkg_db( db, canonical_path );
-	  if ( result != 0 ) {
-	    fprintf( stderr,
-		     "Warning: failed to remove pkgdb entry for file %s in %s\n",
-		     e->filename, descr->hdr.pkg_name );
-	    status = REMOVE_ERROR;
-	  }
+	/* Get it out of the pkg db regardless */
+	result = delete_from_pkg_db( db, canonical_path );
+	if ( result != 0 ) {
+	  fprintf( stderr,
+		   "Warning: failed to remove pkgdb entry for file %s in %s\n",
+		   e->filename, descr->hdr.pkg_name );
+	  status = REMOVE_ERROR;
 	}
-	/* else something else claims it now, so skip it */
-
-	free( owner );
       }
-      /* else it isn't claimed any more, so skip it */
+      /* else something else claims it now, or nothing does; skip it */
 
       free( canonical_path );
     }
@@ -222,6 +226,7 @@ void remove_main( int argc, char **argv ) {
     if ( status == 0 ) {
       db = open_pkg_db();
       if ( db ) {
+	open_hash_cache();
 	for ( i = 0; i < argc; ++i ) {
 	  status = remove_pkg( db, argv[i] );
 	  if ( status != REMOVE_SUCCESS ) {
@@ -229,6 +234,7 @@ void remove_main( int argc, char **argv ) {
 	    break;
 	  }
 	}
+	close_hash_cache();
 	close_pkg_db( db );
       }
       else {
@@ -246,7 +252,7 @@ void remove_main( int argc, char **argv ) {
 static int remove_pkg_by_descr( pkg_db *db, pkg_descr *descr ) {
   int status, result, i;
   pkg_descr_entry *e;
-  rbtree *dir_queue;
+  rbtree *dir_queue, *owned;
   rbtree_node *n;
   char *path;
   void *e_v;
@@ -254,9 +260,11 @@ static int remove_pkg_by_descr( pkg_db *db, pkg_descr *descr ) {
   status = REMOVE_SUCCESS;
   if ( db && descr ) {
     /* Allocate an rbtree to queue directories in */
-    dir_queue = rbtree_alloc( post_path_comparator,
-			      NULL, NULL, NULL, NULL );
-    if ( dir_queue ) {
+    dir_queue = rbtree_alloc_arena( post_path_comparator,
+				    NULL, NULL, NULL, NULL );
+    /* One pass over the db for what we own, not a query per entry */
+    owned = get_owned_paths_for_pkg_db( db, descr->hdr.pkg_name );
+    if ( dir_queue && owned ) {
       /*
        * Scan over the description; process files and symlinks as we see
        * them, and queue directories up for later.
@@ -274,7 +282,7 @@ static int remove_pkg_by_descr( pkg_db *db, pkg_descr *descr ) {
 	  }
 	  break;
 	case ENTRY_FILE:
-	  result = remove_file( db, descr, e );
+	  result = remove_file( db, owned, descr, e );
 	  if ( result != REMOVE_SUCCESS ) {
 	    fprintf( stderr, "Warning: unable to remove file %s from %s\n",
 		     e->filename, descr->hdr.pkg_name );
@@ -282,7 +290,7 @@ static int remove_pkg_by_descr( pkg_db *db, pkg_descr *descr ) {
 	  }
 	  break;
 	case ENTRY_SYMLINK:
-	  result = remove_symlink( db, descr, e );
+	  result = remove_symlink( db, owned, descr, e );
 	  if ( result != REMOVE_SUCCESS ) {
 	    fprintf( stderr, "Warning: unable to remove symlink %s from %s\n",
 		     e->filename, descr->hdr.pkg_name );
@@ -308,7 +316,7 @@ static int remove_pkg_by_descr( pkg_db *db, pkg_descr *descr ) {
 	if ( path ) {
 	  if ( e_v ) {
 	    e = (pkg_descr_entry *)e_v;
-	    result = remove_directory( db, descr, e );
+	    result = remove_directory( db, owned, descr, e );
 	    if ( result != REMOVE_SUCCESS ) {
 	      fprintf( stderr,
 		       "Warning: unable to remove directory %s from %s\n",
@@ -325,14 +333,15 @@ static int remove_pkg_by_descr( pkg_db *db, pkg_descr *descr ) {
 	}
 	/* else we're done */
       } while ( n );
-
-      rbtree_free( dir_queue );
     }
     else {
       fprintf( stderr, "Unable to allocate memory to remove %s\n",
 	       descr->hdr.pkg_name );
       status = REMOVE_ERROR;
     }
+
+    if ( dir_queue ) rbtree_free( dir_queue );
+    if ( owned ) rbtree_free( owned );
   }
   else status = REMOVE_ERROR;
 
@@ -352,9 +361,20 @@ static int remove_pkg( pkg_db *db, const char *pkg ) {
       result = stat( descr_path, &buf );
       if ( result == 0 ) {
 	descr = read_pkg_descr_from_file( descr_path );
-	if ( descr ) {
+	if ( descr && begin_pkg_db_txn( db ) == 0 ) {
 	  result = remove_pkg_by_descr( db, descr );
 	  free_pkg_descr( descr );
+	  /*
+	   * Commit whatever happened; the files are gone either way.
+	   * The description goes only once the commit is durable, so a
+	   * crash before then leaves something for repairdb to go on.
+	   */
+	  if ( commit_pkg_db_txn( db ) != 0 ) {
+	    fprintf( stderr,
+		     "Unable to commit package db changes removing %s\n",
+		     pkg );
+	    if ( result == REMOVE_SUCCESS ) result = REMOVE_ERROR;
+	  }
 	  if ( result == REMOVE_SUCCESS ) {
 	    /*
 	     * We succeeded, so no pkgdb entries remain referring to
@@ -364,6 +384,13 @@ static int remove_pkg( pkg_db *db, const char *pkg ) {
 	  }
 	  else status = result;
 	}
+	else if ( descr ) {
+	  fprintf( stderr,
+		   "Unable to begin package db transaction removing %s\n",
+		   pkg );
+	  free_pkg_descr( descr );
+	  status = REMOVE_ERROR;
+	}
 	else {
 	  fprintf( stderr,
 		   "Unable to read package description from %s\n",
@@ -391,79 +418,76 @@ static int remove_pkg( pkg_db *db, const char *pkg ) {
   return status;
 }
 
-static int remove_symlink( pkg_db *db, pkg_descr *descr, pkg_descr_entry *e ) {
+static int remove_symlink( pkg_db *db, rbtree *owned, pkg_descr *descr,
+			   pkg_descr_entry *e ) {
   int status, result;
-  char *full_path, *owner, *target, *canonical_path;
+  char *full_path, *target, *canonical_path;
   struct stat buf;
+  void *owned_v;
 
   status = REMOVE_SUCCESS;
-  if ( db && descr && e && e->type == ENTRY_SYMLINK ) {
+  if ( db && owned && descr && e && e->type == ENTRY_SYMLINK ) {
     canonical_path = canonicalize_and_copy( e->filename );
     if ( canonical_path ) {
-      owner = query_pkg_db( db, canonical_path );
-      if ( owner ) {
-	if ( strcmp( owner, descr->hdr.pkg_name ) == 0 ) {
-	  full_path = concatenate_paths( get_root(), e->filename );
-	  if ( full_path ) {
-	    result = lstat( full_path, &buf );
-	    if ( result == 0 ) {
-	      if ( S_ISLNK( buf.st_mode ) ) {
-		target = NULL;
-		result = read_symlink_target( full_path, &target );
-		if ( result == READ_SYMLINK_SUCCESS ) {
-		  if ( strcmp( target, e->u.s.target ) == 0 ) {
-		    /* They match, so delete the symlink */
-		    printf( "RS %s\n", full_path );
-		    unlink( full_path );
-		  }
-		  /* else nothing to do */
-		  free( target );
-		}
-		else {
-		  fprintf( stderr,
-			   "Warning: unable to read target of symlink %s for %s\n",
-			   full_path, descr->hdr.pkg_name );
-		  status = REMOVE_ERROR;
+      result = rbtree_query( owned, canonical_path, &owned_v );
+      if ( result == RBTREE_SUCCESS ) {
+	full_path = concatenate_paths( get_root(), e->filename );
+	if ( full_path ) {
+	  result = lstat( full_path, &buf );
+	  if ( result == 0 ) {
+	    if ( S_ISLNK( buf.st_mode ) ) {
+	      target = NULL;
+	      result = read_symlink_target( full_path, &target );
+	      if ( result == READ_SYMLINK_SUCCESS ) {
+		if ( strcmp( target, e->u.s.target ) == 0 ) {
+		  /* They match, so delete the symlink */
+		  printf( "RS %s\n", full_path );
+		  unlink( full_path );
 		}
+		/* else nothing to do */
+		free( target );
 	      }
-	      /* else it wasn't a symlink, so nothing to do */
-	    }
-	    else {
-	      /* lstat() failed */
-	      if ( errno != ENOENT ) {
+	      else {
 		fprintf( stderr,
-			 "Warning: lstat() failed trying to remove symlink %s for %s: %s\n",
-			 e->filename, descr->hdr.pkg_name, strerror( errno ) );
+			 "Warning: unable to read target of symlink %s for %s\n",
+			 full_path, descr->hdr.pkg_name );
 		status = REMOVE_ERROR;
 	      }
-	      /*
-	       * If it's ENOENT, the symlink was removed, so no error; just
-	       * remove its pkgdb entry
-	       */
 	    }
-	    free( full_path );
+	    /* else it wasn't a symlink, so nothing to do */
 	  }
 	  else {
-	    fprintf( stderr,
-		     "Warning: out of memory trying to remove symlink %s for %s\n",
-		     e->filename, descr->hdr.pkg_name );
-	    status = REMOVE_ERROR;
-	  }
-
-	  /* Get it out of the pkg db regardless */
-	  result = delete_from_pkg_db( db, e->filename );
-	  if ( result != 0 ) {
-	    fprintf( stderr,
-		     "Warning: failed to remove pkgdb entry for symlink %s in %s\n",
-		     e->filename, descr->hdr.pkg_name );
-	    status = REMOVE_ERROR;
+	    /* lstat() failed */
+	    if ( errno != ENOENT ) {
+	      fprintf( stderr,
+		       "Warning: lstat() failed trying to remove symlink %s for %s: %s\n",
+		       e->filename, descr->hdr.pkg_name, strerror( errno ) );
+	      status = REMOVE_ERROR;
+	    }
+	    /*
+	     * If it's ENOENT, the symlink was removed, so no error; just
+	     * remove its pkgdb entry
+	     */
 	  }
+	  free( full_path );
+	}
+	else {
+	  fprintf( stderr,
+		   "Warning: out of memory trying to remove symlink %s for %s\n",
+		   e->filename, descr->hdr.pkg_name );
+	  status = REMOVE_ERROR;
 	}
-	/* else something else claims it now, so skip it */
 
-	free( owner );
+	/* Get it out of the pkg db regardless */
+	result = delete_from_pkg_db( db, e->filename );
+	if ( result != 0 ) {
+	  fprintf( stderr,
+		   "Warning: failed to remove pkgdb entry for symlink %s in %s\n",
+		   e->filename, descr->hdr.pkg_name );
+	  status = REMOVE_ERROR;
+	}
       }
-      /* else it isn't claimed any more, so skip it */
+      /* else something else claims it now, or nothing does; skip it */
 
       free( canonical_path );
     }
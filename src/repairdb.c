@@ -16,29 +16,39 @@ static int make_repairdb_backup( pkg_db *db ) {
 
   status = REPAIRDB_SUCCESS;
   if ( db && db->filename ) {
-    backup_filename_len =
-      strlen( db->filename ) + strlen( backup_suffix ) + 1;
-
-    backup_filename =
-      malloc( sizeof( *backup_filename ) * backup_filename_len );
-
-    if ( backup_filename ) {
-      snprintf( backup_filename, backup_filename_len, "%s%s",
-		db->filename, backup_suffix );
+    /* Fold any journal in, so the one file is the whole DB */
+    result = compact_pkg_db( db );
+    if ( result == 0 ) {
+      backup_filename_len =
+	strlen( db->filename ) + strlen( backup_suffix ) + 1;
+
+      backup_filename =
+	malloc( sizeof( *backup_filename ) * backup_filename_len );
+
+      if ( backup_filename ) {
+	snprintf( backup_filename, backup_filename_len, "%s%s",
+		  db->filename, backup_suffix );
+
+	result = copy_file( backup_filename, db->filename );
+	if ( result != LINK_OR_COPY_SUCCESS ) {
+	  fprintf( stderr,
+		   "Unable to copy %s to %s in make_repairdb_backup()\n",
+		   db->filename, backup_filename );
+	  status = REPAIRDB_ERROR;
+	}
 
-      result = copy_file( backup_filename, db->filename );
-      if ( result != LINK_OR_COPY_SUCCESS ) {
+	free( backup_filename );
+      }
+      else {
 	fprintf( stderr,
-		 "Unable to copy %s to %s in make_repairdb_backup()\n",
-		 db->filename, backup_filename );
+		 "Unable to allocate memory in make_repairdb_backup()\n" );
 	status = REPAIRDB_ERROR;
       }
-
-      free( backup_filename );
     }
     else {
       fprintf( stderr,
-	       "Unable to allocate memory in make_repairdb_backup()\n" );
+	       "Unable to compact %s in make_repairdb_backup()\n",
+	       db->filename );
       status = REPAIRDB_ERROR;
     }
   }
@@ -50,7 +60,7 @@ static int make_repairdb_backup( pkg_db *db ) {
 static int perform_repair( pkg_db *db, char content_checking ) {
   int status, result;
   claims_list_map_t *m;
-  rbtree *t;
+  pkg_map *t;
 
   status = REPAIRDB_SUCCESS;
   if ( db ) {
@@ -139,7 +149,7 @@ static int perform_repair( pkg_db *db, char content_checking ) {
 	  fprintf( stderr, "Unable to complete pass three of repairdb\n" );
 	}
 
-	rbtree_free( t );
+	pkg_map_free( t );
       }
       else {
 	fprintf( stderr, "Unable to complete pass two of repairdb\n" );
@@ -230,11 +240,13 @@ static void repairdb( char content_checking ) {
     }
 
     if ( status == REPAIRDB_SUCCESS ) {
+      if ( content_checking ) open_hash_cache();
       result = perform_repair( db, content_checking );
       if ( result != REPAIRDB_SUCCESS ) {
 	fprintf( stderr, "Failed to repair database\n" );
 	status = result;
       }
+      close_hash_cache();
     }
 
     close_pkg_db( db );
@@ -23,7 +23,8 @@ claims_list_map_t * alloc_claims_list_map( void ) {
     m->num_locations = 0;
     m->num_packages = 0;
     m->num_claims = 0;
-    m->t = rbtree_alloc( rbtree_string_comparator, NULL, NULL, NULL, NULL );
+    m->t = pkg_map_alloc_transient( rbtree_string_comparator,
+				    NULL, NULL, NULL, NULL );
     if ( !(m->t) ) {
       free( m );
       m = NULL;
@@ -35,13 +36,13 @@ claims_list_map_t * alloc_claims_list_map( void ) {
 
 void * enumerate_claims_list_map( claims_list_map_t *m, void *n,
 				  claims_list_t **cl_out ) {
-  rbtree_node *n_in, *n_out;
+  pkg_map_node *n_in, *n_out;
   void *k, *v;
 
   n_out = NULL;
   if ( m && m->t && cl_out ) {
-    n_in = (rbtree_node *)n;
-    k = rbtree_enum( m->t, n_in, &v, &n_out );
+    n_in = (pkg_map_node *)n;
+    k = pkg_map_enum( m->t, n_in, &v, &n_out );
     if ( k ) *cl_out = v;
     else *cl_out = NULL;
   }
@@ -50,52 +51,35 @@ void * enumerate_claims_list_map( claims_list_map_t *m, void *n,
 }
 
 void free_claims_list_map( claims_list_map_t *m ) {
-  rbtree_node *n;
+  pkg_map_node *n;
   void *k, *v;
   char *location;
   claims_list_t *cl;
 
   if ( m ) {
     if ( m->t ) {
-      do {
-	/*
-	 * Grab the first node from the tree (yes, we do init n
-	 * *inside* the loop; the n in the loop condition is set to
-	 * non-NULL if the tree was not empty by rbtree_enum() - we
-	 * can't use that n to get the next node because we free that
-	 * node in the loop, so we get the first node of the tree
-	 * every time)
-	 */
-	n = NULL;
-	k = rbtree_enum( m->t, n, &v, &n );
-
-	/*
-	 * If we got one, first we delete it from the tree, and then
-	 * we free its key and value.
-	 */
-	if ( k ) {
-	  location = (char *)k;
-
-	  /* Delete this one from the tree */
-	  rbtree_delete( m->t, location, NULL );
-
-	  /* It's out of the tree, now free the value if we can */
-	  if ( v ) {
-	    cl = (claims_list_t *)v;
-	    free_claims_list( cl );
-	  }
+      /*
+       * The tree doesn't own its keys or values, so we free them as
+       * we walk it; stepping to the next node only looks at the
+       * nodes, not the keys in them.  Then the nodes all go at once.
+       */
+      n = NULL;
+      while ( ( k = pkg_map_enum( m->t, n, &v, &n ) ) ) {
+	location = (char *)k;
 
-	  /*
-	   * Now free the key (after the value because the
-	   * claims_list_t refers to it)
-	   */
-	  free( location );
+	if ( v ) {
+	  cl = (claims_list_t *)v;
+	  free_claims_list( cl );
 	}
-      } while ( n );
 
-      /* The tree should now have no nodes */
+	/*
+	 * Now free the key (after the value because the
+	 * claims_list_t refers to it)
+	 */
+	free( location );
+      }
 
-      rbtree_free( m->t );
+      pkg_map_free( m->t );
       m->t = NULL;
     }
 
@@ -180,9 +164,9 @@ claims_list_t * get_claims_list_by_location( claims_list_map_t *m,
 
   cl = NULL;
   if ( m && m->t && location ) {
-    result = rbtree_query( m->t, location, &v );
-    if ( result == RBTREE_SUCCESS ) cl = (claims_list_t *)v;
-    else if ( result == RBTREE_NOT_FOUND ) {
+    result = pkg_map_query( m->t, location, &v );
+    if ( result == PKG_MAP_SUCCESS ) cl = (claims_list_t *)v;
+    else if ( result == PKG_MAP_NOT_FOUND ) {
       /*
        * We allocate a new one and insert it into the tree, or return
        * NULL if we fail.
@@ -194,8 +178,8 @@ claims_list_t * get_claims_list_by_location( claims_list_map_t *m,
 	  cl->location = k;
 	  cl->num_claims = 0;
 	  cl->head = cl->tail = NULL;
-	  result = rbtree_insert( m->t, k, cl );
-	  if ( result != RBTREE_SUCCESS ) {
+	  result = pkg_map_insert( m->t, k, cl );
+	  if ( result != PKG_MAP_SUCCESS ) {
 	    free_claims_list( cl );
 	    free( k );
 	    cl = NULL;
@@ -240,6 +224,7 @@ static int pass_one_handle_descr_entry( claims_list_map_t *m, char *p,
 	      claim->c.claim_type = CLAIM_FILE;
 	      memcpy( claim->c.u.f.hash, e->u.f.hash,
 		      sizeof( claim->c.u.f.hash ) );
+	      claim->c.u.f.alg = descr->hdr.hash;
 	    }
 	    else if ( e->type == ENTRY_DIRECTORY ) {
 	      claim->c.claim_type = CLAIM_DIRECTORY;
@@ -418,6 +403,11 @@ claims_list_map_t * repairdb_pass_one( void ) {
 	    valid = 0;
 	  }
 
+	  /* And the hash cache, which lives alongside */
+	  if ( valid &&
+	       strcmp( dentry->d_name, HASH_CACHE_FILE_NAME ) == 0 )
+	    valid = 0;
+
 	  /*
 	   * Exclude anything with a . in it (package-descriptions
 	   * don't have them)
@@ -9,27 +9,37 @@
 #include <stdlib.h>
 #include <string.h>
 
-static char * resolve_claim_check_content( claims_list_t * );
+static void hash_claims_batch( claims_list_t **, int, uint8_t *, int *,
+			       pkg_hash_t * );
+static char * resolve_claim_check_content( claims_list_t *, uint8_t *,
+					   pkg_hash_t );
 static char * resolve_claim( claims_list_t * );
 
 #define STR_BUF_LEN 80
 
-rbtree * repairdb_pass_two( claims_list_map_t *m, char content_checking ) {
-  rbtree *t;
+/* Locations we take at a time, so get_file_hashes() can batch them */
+#define CLAIMS_BATCH_LEN 64
+
+pkg_map * repairdb_pass_two( claims_list_map_t *m, char content_checking ) {
+  pkg_map *t;
   claims_list_t *l;
+  claims_list_t *batch[CLAIMS_BATCH_LEN];
+  uint8_t hashes[CLAIMS_BATCH_LEN * HASH_LEN];
+  int hashed[CLAIMS_BATCH_LEN];
+  pkg_hash_t algs[CLAIMS_BATCH_LEN];
   void *n;
   char *pkg;
   int result;
   unsigned long count;
   char error;
   char buf[STR_BUF_LEN];
-  int i, prev_chars_displayed;
+  int i, j, k, prev_chars_displayed;
 
   t = NULL;
   if ( m ) {
-    t = rbtree_alloc( rbtree_string_comparator,
-		      rbtree_string_copier, rbtree_string_free,
-		      rbtree_string_copier, rbtree_string_free );
+    t = pkg_map_alloc_transient( rbtree_string_comparator,
+				 rbtree_string_copier, rbtree_string_free,
+				 rbtree_string_copier, rbtree_string_free );
     if ( t ) {
       prev_chars_displayed = 0;
       count = 0;
@@ -37,9 +47,19 @@ rbtree * repairdb_pass_two( claims_list_map_t *m, char content_checking ) {
       n = NULL;
       printf( "Resolving claims: " );
       do {
-	l = NULL;
-	n = enumerate_claims_list_map( m, n, &l );
-	if ( l ) {
+	/* Take a batch of locations, so we can hash their files together */
+	k = 0;
+	do {
+	  l = NULL;
+	  n = enumerate_claims_list_map( m, n, &l );
+	  if ( l ) batch[k++] = l;
+	} while ( n && k < CLAIMS_BATCH_LEN );
+
+	if ( content_checking )
+	  hash_claims_batch( batch, k, hashes, hashed, algs );
+
+	for ( j = 0; j < k && !error; ++j ) {
+	  l = batch[j];
 	  if ( prev_chars_displayed > 0 ) {
 	    for ( i = 0; i < prev_chars_displayed; ++i ) putchar( '\b' );   
 	  }
@@ -48,22 +68,24 @@ rbtree * repairdb_pass_two( claims_list_map_t *m, char content_checking ) {
 	  printf( "%s", buf );
 
 	  if ( content_checking ) {
-	    pkg = resolve_claim_check_content( l );
+	    pkg = resolve_claim_check_content( l, hashed[j] ?
+					       hashes + j * HASH_LEN : NULL,
+					       algs[j] );
 	  }
 	  else {
 	    pkg = resolve_claim( l );
 	  }
 
 	  if ( pkg ) {
-	    result = rbtree_insert( t, l->location, pkg );
-	    if ( result != RBTREE_SUCCESS ) {
+	    result = pkg_map_insert( t, l->location, pkg );
+	    if ( result != PKG_MAP_SUCCESS ) {
 	      /*
 	       * Get to the next line, since we aren't displaying the
 	       * counter any more.
 	       */
 	      printf( "\n" );
 	      fprintf( stderr, "Error in pass two: couldn't insert claim" );
-	      fprintf( stderr, " by %s for %s into rbtree\n",
+	      fprintf( stderr, " by %s for %s into the map\n",
 		       pkg, l->location );
 	    }
 	  }
@@ -74,7 +96,7 @@ rbtree * repairdb_pass_two( claims_list_map_t *m, char content_checking ) {
       } while ( n && !error );
 
       if ( error ) {
-	rbtree_free( t );
+	pkg_map_free( t );
 	t = NULL;
       }
       /* Stop displaying the counter and get to the next line */
@@ -85,7 +107,65 @@ rbtree * repairdb_pass_two( claims_list_map_t *m, char content_checking ) {
   return t;
 }
 
-static char * resolve_claim_check_content( claims_list_t *l ) {
+/*
+ * Hash, together, whichever of the k locations in batch are regular
+ * files with a file claim on them; hashed[i] says whether hashes +
+ * i * HASH_LEN got filled in, using the hash in algs[i] that the first
+ * file claim there wants.  Anything left out, the resolver will hash
+ * for itself if it needs to.
+ */
+
+static void hash_claims_batch( claims_list_t **batch, int k,
+			       uint8_t *hashes, int *hashed,
+			       pkg_hash_t *algs ) {
+  const char *names[CLAIMS_BATCH_LEN];
+  char *paths[CLAIMS_BATCH_LEN];
+  uint8_t out[CLAIMS_BATCH_LEN * HASH_LEN];
+  int results[CLAIMS_BATCH_LEN], which[CLAIMS_BATCH_LEN];
+  claims_list_node_t *n;
+  struct stat st;
+  pkg_hash_t alg;
+  int i, count, status;
+
+  for ( i = 0; i < k; ++i ) hashed[i] = 0;
+  /* Almost always just MD5 or just one other, but they can be mixed */
+  for ( alg = HASH_MD5; alg < DEFAULT_HASH; ++alg ) {
+    count = 0;
+    for ( i = 0; i < k; ++i ) {
+      for ( n = batch[i]->head; n; n = n->next ) {
+	if ( n->c.claim_type == CLAIM_FILE ) break;
+      }
+      if ( n && n->c.u.f.alg == alg ) {
+	paths[count] = concatenate_paths( get_root(), batch[i]->location );
+	if ( paths[count] ) {
+	  if ( lstat( paths[count], &st ) == 0 && S_ISREG( st.st_mode ) ) {
+	    names[count] = paths[count];
+	    which[count] = i;
+	    ++count;
+	  }
+	  else free( paths[count] );
+	}
+      }
+    }
+
+    if ( count > 0 ) {
+      status = get_file_hashes( alg, names, out, results, count );
+      for ( i = 0; i < count; ++i ) {
+	if ( status == 0 && results[i] == 0 ) {
+	  memcpy( hashes + which[i] * HASH_LEN, out + i * HASH_LEN,
+		  HASH_LEN );
+	  hashed[which[i]] = 1;
+	  algs[which[i]] = alg;
+	}
+	free( paths[i] );
+      }
+    }
+  }
+}
+
+static char * resolve_claim_check_content( claims_list_t *l,
+					   uint8_t *known_hash,
+					   pkg_hash_t known_alg ) {
   /*
    * This is the content-aware resolver.  We scan over the list
    * looking for claims which match the file on disk.  If we find more
@@ -99,13 +179,15 @@ static char * resolve_claim_check_content( claims_list_t *l ) {
   char *full_path;
   /*
    * Keep track of the stat() results and hash for the file.  Compute
-   * these on demand, so we can avoid computing the expensive MD5 if
-   * there are no file claims, but only compute them at most once.
+   * these on demand, so we can avoid computing the expensive hash if
+   * there are no file claims, but only compute them at most once
+   * unless packages used different hashes.
    */
   int have_stat, no_stat;
   struct stat st;
   int have_hash, no_hash;
   uint8_t hash[HASH_LEN];
+  pkg_hash_t hash_alg;
   char *target;
   int match, result;
 
@@ -117,6 +199,14 @@ static char * resolve_claim_check_content( claims_list_t *l ) {
      */
     full_path = NULL;
     have_hash = 0;
+    hash_alg = HASH_MD5;
+    if ( known_hash ) {
+      /* hash_claims_batch() already did the work */
+      memcpy( hash, known_hash, sizeof( hash ) );
+      hash_alg = known_alg;
+      have_hash = 1;
+      no_hash = 0;
+    }
     have_stat = 0;
     target = NULL;
     n = l->head;
@@ -165,9 +255,10 @@ static char * resolve_claim_check_content( claims_list_t *l ) {
 	  if ( !no_stat && S_ISREG( st.st_mode ) ) {
 	    if ( get_check_md5() ) {
 	      /* If we're checking MD5s */
-	      if ( !have_hash ) {
-		/* If we don't have a hash for this file, compute one */
-		result = get_file_hash( full_path, hash );
+	      if ( !have_hash || hash_alg != n->c.u.f.alg ) {
+		/* If we don't have this claim's hash for the file, compute one */
+		hash_alg = n->c.u.f.alg;
+		result = get_file_hash( hash_alg, full_path, hash );
 		have_hash = 1;
 		if ( result == 0 ) no_hash = 0;
 		else no_hash = 1;
@@ -3,12 +3,105 @@
 
 #include <pkg.h>
 
-int repairdb_pass_three( pkg_db *db, rbtree *t ) {
+/* What pass_three_visit() checks each database entry against */
+typedef struct {
+  pkg_map *t;
+  rbtree *deletions, *modifications;
+  int status;
+} pass_three_state;
+
+static int pass_three_visit( const char *, const char *, void * );
+
+/*
+ * Sort one database entry into st->deletions or st->modifications,
+ * taking it out of st->t if it stays; returns nonzero to stop.
+ */
+
+static int pass_three_visit( const char *location, const char *pkg,
+			     void *st_v ) {
+  pass_three_state *st;
+  void *tpkg_v;
+  char *tpkg;
+  int result;
+
+  st = (pass_three_state *)st_v;
+
+  /* Query the map from pass two for this location. */
+  tpkg_v = NULL;
+  result = pkg_map_query( st->t, (char *)location, &tpkg_v );
+  tpkg = (char *)tpkg_v;
+  if ( result == PKG_MAP_SUCCESS ) {
+    /*
+     * Found it; check if it needs to be modified by comparing the
+     * values.
+     */
+    if ( pkg && tpkg ) {
+      /* Compare the values */
+      if ( strcmp( pkg, tpkg ) != 0 ) {
+	/* They don't match, so we need to modify this DB record */
+	result = rbtree_insert( st->modifications, (char *)location, tpkg );
+	if ( result != RBTREE_SUCCESS ) {
+	  fprintf( stderr,
+		   "Error while adding %s (for %s from %s)",
+		   location, tpkg, pkg );
+	  fprintf( stderr, "to the modification list in pass" );
+	  fprintf( stderr, "three\n" );
+	  st->status = REPAIRDB_ERROR;
+	}
+      }
+      /* else no modification needed */
+
+      /*
+       * Either way, this one does not need to be added, so we remove
+       * it from t.
+       */
+      if ( st->status == REPAIRDB_SUCCESS ) {
+	result = pkg_map_delete( st->t, (char *)location, NULL );
+	if ( result != PKG_MAP_SUCCESS ) {
+	  fprintf( stderr, "Error removing %s from addition list",
+		   location );
+	  fprintf( stderr, "in pass three\n" );
+	  st->status = REPAIRDB_ERROR;
+	}
+      }
+    }
+    else {
+      fprintf( stderr, "Saw NULL value where one shouldn't have" );
+      fprintf( stderr, " been during pass three\n" );
+      fprintf( stderr, "location = %s, pkg = %s, tpkg = %s\n",
+	       location, ( pkg ? pkg : "null" ),
+	       (tpkg ? tpkg : "null" ) );
+      st->status = REPAIRDB_ERROR;
+    }
+  }
+  else if ( result == PKG_MAP_NOT_FOUND ) {
+    /* Not found, add this one to the delete list */
+    result = rbtree_insert( st->deletions, (char *)location, NULL );
+    if ( result != RBTREE_SUCCESS ) {
+      fprintf( stderr, "Error while adding %s to deletion list",
+	       location );
+      fprintf( stderr, "in pass three\n" );
+      st->status = REPAIRDB_ERROR;
+    }
+  }
+  else {
+    /* error querying the map from pass two */
+    fprintf( stderr, "Error querying map from pass two for " );
+    fprintf( stderr, "location %s in pass three\n", location );
+    st->status = REPAIRDB_ERROR;
+  }
+
+  return ( st->status == REPAIRDB_SUCCESS ) ? 0 : 1;
+}
+
+int repairdb_pass_three( pkg_db *db, pkg_map *t ) {
   int status, result;
-  void *n, *tpkg_v, *location_v, *pkg_v;
-  char *location, *pkg, *tpkg;
+  void *location_v, *pkg_v;
+  char *location, *pkg;
   rbtree *deletions, *modifications;
   rbtree_node *rn;
+  pkg_map_node *mn;
+  pass_three_state st;
 
   status = REPAIRDB_SUCCESS;
   if ( db && t ) {
@@ -17,126 +110,49 @@ int repairdb_pass_three( pkg_db *db, rbtree *t ) {
      * database; the keys are locations and the values are always
      * NULL.
      */
-    deletions = rbtree_alloc( rbtree_string_comparator,
-			      rbtree_string_copier, rbtree_string_free,
-			      NULL, NULL );
+    deletions = rbtree_alloc_arena( rbtree_string_comparator,
+				    rbtree_string_copier, rbtree_string_free,
+				    NULL, NULL );
     /*
      * This rbtree holds the list of records in the database to be
      * modified; the keys are locations and the values are the new
      * package names to assign to these locations.
      */
-    modifications = rbtree_alloc( rbtree_string_comparator,
-				  rbtree_string_copier, rbtree_string_free,
-				  rbtree_string_copier, rbtree_string_free );
+    modifications = rbtree_alloc_arena( rbtree_string_comparator,
+					rbtree_string_copier, rbtree_string_free,
+					rbtree_string_copier, rbtree_string_free );
 
     if ( deletions && modifications ) {
-      n = NULL;
-      do {
-	location = NULL;
-	pkg = NULL;
-	result = enumerate_pkg_db( db, n, &location, &pkg, &n );
-	if ( result == 0 ) {
-	  if ( n ) {
-	    if ( location ) {
-	      /*
-	       * Query the rbtree from pass two for this location.
-	       */
-	      tpkg_v = NULL;
-	      result = rbtree_query( t, location, &tpkg_v );
-	      tpkg = (char *)tpkg_v;
-	      if ( result == RBTREE_SUCCESS ) {
-		/*
-		 * Found it; check if it needs to be modified by comparing
-		 * the values.
-		 */
-		if ( pkg && tpkg ) {
-		  /* Compare the values */
-		  if ( strcmp( pkg, tpkg ) != 0 ) {
-		    /*
-		     * They don't match, so we need to modify this DB
-		     * record
-		     */
-		    result = rbtree_insert( modifications, location, tpkg );
-		    if ( result != RBTREE_SUCCESS ) {
-		      fprintf( stderr,
-			       "Error while adding %s (for %s from %s)",
-			       location, tpkg, pkg );
-		      fprintf( stderr, "to the modification list in pass" );
-		      fprintf( stderr, "three\n" );
-		      status = REPAIRDB_ERROR;
-		    }
-		  }
-		  /* else no modification needed */
-
-		  /*
-		   * Either way, this one does not need to be added, so
-		   * we remove it from t.
-		   */
-		  if ( status == REPAIRDB_SUCCESS ) {
-		    result = rbtree_delete( t, location, NULL );
-		    if ( result != RBTREE_SUCCESS ) {
-		      fprintf( stderr, "Error removing %s from addition list",
-			       location );
-		      fprintf( stderr, "in pass three\n" );
-		      status = REPAIRDB_ERROR;
-		    }
-		  }
-		}
-		else {
-		  fprintf( stderr, "Saw NULL value where one shouldn't have" );
-		  fprintf( stderr, " been during pass three\n" );
-		  fprintf( stderr, "location = %s, pkg = %s, tpkg = %s\n",
-			   location, ( pkg ? pkg : "null" ),
-			   (tpkg ? tpkg : "null" ) );
-		  status = REPAIRDB_ERROR;
-		}
-	      }
-	      else if ( result == RBTREE_NOT_FOUND ) {
-		/* Not found, add this one to the delete list */
-		result = rbtree_insert( deletions, location, NULL );
-		if ( result != RBTREE_SUCCESS ) {
-		  fprintf( stderr, "Error while adding %s to deletion list",
-			   location );
-		  fprintf( stderr, "in pass three\n" );
-		  status = REPAIRDB_ERROR;
-		}
-	      }
-	      else {
-		/* error querying rbtree from pass two */
-		fprintf( stderr, "Error querying rbtree from pass two for " );
-		fprintf( stderr, "location %s in pass three\n", location );
-		status = REPAIRDB_ERROR;
-	      }
-	    }
-	    else {
-	      fprintf( stderr,
-		       "Error: saw null location while enumerating database" );
-	      fprintf( stderr, " for pass three\n" );
-	      /* status = REPAIRDB_ERROR; */
-	    }
-	  }
-	  /* else end of db */
-	}
-	else {
-	  fprintf( stderr,
-		   "Error %d while enumerating database for pass three\n",
-		   result );
-	  status = REPAIRDB_ERROR;
-	}
-
-	if ( location ) free( location );
-	if ( pkg ) free( pkg );
-      
-      } while ( n && status == REPAIRDB_SUCCESS );
+      st.t = t;
+      st.deletions = deletions;
+      st.modifications = modifications;
+      st.status = REPAIRDB_SUCCESS;
+      result = foreach_pkg_db( db, pass_three_visit, &st );
+      if ( result < 0 ) {
+	fprintf( stderr,
+		 "Error %d while enumerating database for pass three\n",
+		 result );
+	status = REPAIRDB_ERROR;
+      }
+      else if ( st.status != REPAIRDB_SUCCESS ) status = st.status;
 
       if ( status == REPAIRDB_SUCCESS ) {
 	/*
 	 * Now, deletions is the list of records to be deleted from
 	 * the database, modifications are records which need their
 	 * value changed, and t holds the records which must be added.
-	 * Perform those actions.
+	 * Perform those actions, in one transaction so either the
+	 * whole repair lands or the database is left as it was.
 	 */
+	result = begin_pkg_db_txn( db );
+	if ( result != 0 ) {
+	  fprintf( stderr, "Error %d beginning a transaction in pass three\n",
+		   result );
+	  status = REPAIRDB_ERROR;
+	}
+      }
 
+      if ( status == REPAIRDB_SUCCESS ) {
 	/* Deletions */
 	printf( "Performing %lu deletions...", deletions->count );
 	rn = NULL;
@@ -200,10 +216,10 @@ int repairdb_pass_three( pkg_db *db, rbtree *t ) {
 
 	/* Additions */
 	printf( "Peforming %lu additions...", t->count );
-	rn = NULL;
+	mn = NULL;
 	do {
-	  location_v = rbtree_enum( t, rn, &pkg_v, &rn );
-	  if ( rn ) {
+	  location_v = pkg_map_enum( t, mn, &pkg_v, &mn );
+	  if ( mn ) {
 	    if ( location_v && pkg_v ) {
 	      location = (char *)location_v;
 	      pkg = (char *)pkg_v;
@@ -223,12 +239,24 @@ int repairdb_pass_three( pkg_db *db, rbtree *t ) {
 	    }
 	  }
 	  /* else end of tree */
-	} while ( rn );
+	} while ( mn );
 	printf( "done\n" );
 	/*
 	 * We don't free t here because the main repairdb routine in
 	 * repairdb.c does after this function returns.
 	 */
+
+	if ( status == REPAIRDB_SUCCESS ) {
+	  result = commit_pkg_db_txn( db );
+	  if ( result != 0 ) {
+	    fprintf( stderr, "Error %d committing pass three\n", result );
+	    status = REPAIRDB_ERROR;
+	  }
+	}
+	else {
+	  fprintf( stderr, "Rolling back the changes from pass three\n" );
+	  abort_pkg_db_txn( db );
+	}
       }
     }
 
@@ -10,8 +10,9 @@
 #include <string.h>
 
 static pkg_descr_entry * find_descr_entry( pkg_descr *, const char * );
+static void hash_pkg_files( pkg_descr *, rbtree *, uint8_t *, int * );
 static void show_status( const char *, struct stat *, const char *,
-			 pkg_descr *, pkg_descr_entry * );
+			 pkg_descr *, pkg_descr_entry *, uint8_t * );
 static void status_file( const char * );
 static void status_pkg( const char * );
 
@@ -41,14 +42,91 @@ static pkg_descr_entry * find_descr_entry( pkg_descr *d, const char *p ) {
   return e;
 }
 
+/*
+ * Hash all the regular files d has file entries for and still owns
+ * according to owned in one go, so get_file_hashes() can run them side
+ * by side; hashed[i] says whether hashes + i * HASH_LEN has entry i's
+ * hash.
+ */
+
+static void hash_pkg_files( pkg_descr *d, rbtree *owned,
+			    uint8_t *hashes, int *hashed ) {
+  const char **names;
+  char **paths;
+  uint8_t *out;
+  int *results, *which;
+  struct stat st;
+  char *canonical;
+  void *owned_v;
+  int i, count, result;
+
+  for ( i = 0; i < d->num_entries; ++i ) hashed[i] = 0;
+
+  names = malloc( sizeof( *names ) * d->num_entries );
+  paths = malloc( sizeof( *paths ) * d->num_entries );
+  out = malloc( sizeof( *out ) * HASH_LEN * d->num_entries );
+  results = malloc( sizeof( *results ) * d->num_entries );
+  which = malloc( sizeof( *which ) * d->num_entries );
+  if ( names && paths && out && results && which ) {
+    count = 0;
+    for ( i = 0; i < d->num_entries; ++i ) {
+      if ( d->entries[i].type == ENTRY_FILE ) {
+	/* Files some other package has taken over aren't ours to check */
+	canonical = canonicalize_and_copy( d->entries[i].filename );
+	if ( canonical ) {
+	  result = rbtree_query( owned, canonical, &owned_v );
+	  free( canonical );
+	}
+	else result = RBTREE_ERROR;
+	if ( result == RBTREE_SUCCESS ) {
+	  paths[count] = concatenate_paths( get_root(),
+					    d->entries[i].filename );
+	  if ( paths[count] ) {
+	    if ( lstat( paths[count], &st ) == 0 &&
+		 S_ISREG( st.st_mode ) ) {
+	      names[count] = paths[count];
+	      which[count] = i;
+	      ++count;
+	    }
+	    else free( paths[count] );
+	  }
+	}
+      }
+    }
+
+    if ( get_file_hashes( d->hdr.hash, names, out, results,
+			  count ) == 0 ) {
+      for ( i = 0; i < count; ++i ) {
+	if ( results[i] == 0 ) {
+	  memcpy( hashes + which[i] * HASH_LEN, out + i * HASH_LEN,
+		  HASH_LEN );
+	  hashed[which[i]] = 1;
+	}
+      }
+    }
+    for ( i = 0; i < count; ++i ) free( paths[i] );
+  }
+  /* else show_status() will hash them one at a time */
+
+  if ( names ) free( names );
+  if ( paths ) free( paths );
+  if ( out ) free( out );
+  if ( results ) free( results );
+  if ( which ) free( which );
+}
+
 static void show_status( const char *filename, struct stat *st,
 			 const char *pkg, pkg_descr *descr,
-			 pkg_descr_entry *entry ) {
+			 pkg_descr_entry *entry, uint8_t *known_hash ) {
   int result;
   char *link_target;
   uint8_t hash[HASH_LEN];
+  const char *by;
 
   if ( filename && pkg && descr && entry ) {
+    /* Keep saying MD5 the way we always have */
+    if ( descr->hdr.hash == HASH_MD5 ) by = "MD5";
+    else by = get_hash_name( descr->hdr.hash );
     if ( st ) {
       switch ( entry->type ) {
       case ENTRY_DIRECTORY:
@@ -63,22 +141,26 @@ static void show_status( const char *filename, struct stat *st,
       case ENTRY_FILE:
 	if ( S_ISREG( st->st_mode ) ) {
 	  if ( get_check_md5() ) {
-	    result = get_file_hash( filename, hash );
+	    if ( known_hash ) {
+	      memcpy( hash, known_hash, sizeof( hash ) );
+	      result = 0;
+	    }
+	    else result = get_file_hash( descr->hdr.hash, filename, hash );
 	    if ( result == 0 ) {
 	      if ( memcmp( hash, entry->u.f.hash, sizeof( hash ) ) == 0 ) {
-		printf( "%s is owned by %s (as a file) (by MD5)\n",
-			filename, pkg );
+		printf( "%s is owned by %s (as a file) (by %s)\n",
+			filename, pkg, by );
 	      }
 	      else {
 		printf( "%s is claimed as a file by %s, ",
 			filename, pkg );
-		printf( "but it has been modified (by MD5)\n" );
+		printf( "but it has been modified (by %s)\n", by );
 	      }
 	    }
 	    else {
 	      printf( "%s is claimed as a file by %s, ",
 		      filename, pkg );
-	      printf( "but its MD5 could not be read\n" );
+	      printf( "but its %s could not be read\n", by );
 	    }
 	  }
 	  else {
@@ -196,7 +278,7 @@ static void status_file( const char *filename ) {
 	if ( pkg ) {
 	  if ( descr ) {
 	    if ( entry ) show_status( filename, not_found ? NULL : &st,
-				      pkg, descr, entry );
+				      pkg, descr, entry, NULL );
 	    else {
 	      if ( not_found ) {
 		printf( "%s does not exist; it is claimed by %s, but the ",
@@ -266,6 +348,7 @@ void status_main( int argc, char **argv ) {
   struct stat st;
 
   if ( argc == 1 || argc == 2 ) {
+    open_hash_cache();
     if ( argc == 1 ) {
       /*
        * Try to stat argv[0] to see if there's a file we can use
@@ -297,6 +380,7 @@ void status_main( int argc, char **argv ) {
 		 argv[0] );
       }
     }
+    close_hash_cache();
   }
   else {
     fprintf( stderr, "Wrong number of arguments to mpkg status.\n" );
@@ -308,13 +392,18 @@ void status_main( int argc, char **argv ) {
 }
 
 static void status_pkg( const char *pkgname ) {
-  char *descr_file, *p, *full_p, *pkg_from_db;
+  char *descr_file, *p, *full_p;
+  const char *pkg_from_db;
   pkg_descr *descr;
   pkg_descr_entry *e;
   pkg_db *db;
   int error, i, result;
   struct stat st;
   int not_found, have_stat;
+  uint8_t *hashes;
+  int *hashed;
+  rbtree *owned;
+  void *owned_v;
 
   /* Try to load the package-description */
   descr = NULL;
@@ -333,54 +422,72 @@ static void status_pkg( const char *pkgname ) {
     if ( descr ) {
       /* We got it; now try to open the database */
       db = open_pkg_db_with_mode( DBMODE_RO );
-      if ( db ) {
+      if ( db ) owned = get_owned_paths_for_pkg_db( db, (char *)pkgname );
+      else owned = NULL;
+      if ( owned ) {
+	hashes = NULL;
+	hashed = NULL;
+	if ( get_check_md5() && descr->num_entries > 0 ) {
+	  hashes = malloc( sizeof( *hashes ) * HASH_LEN * descr->num_entries );
+	  hashed = malloc( sizeof( *hashed ) * descr->num_entries );
+	  if ( hashes && hashed ) {
+	    hash_pkg_files( descr, owned, hashes, hashed );
+	  }
+	  else {
+	    /* Never mind; show_status() can hash them itself */
+	    if ( hashes ) free( hashes );
+	    if ( hashed ) free( hashed );
+	    hashes = NULL;
+	    hashed = NULL;
+	  }
+	}
+
 	for ( i = 0; i < descr->num_entries; ++i ) {
 	  e = &(descr->entries[i]);
 	  p = canonicalize_and_copy( e->filename );
 	  full_p = concatenate_paths( get_root(), e->filename );
 
 	  if ( p && full_p ) {
-	    /* Check what package claims this in the database */
-	    pkg_from_db = query_pkg_db( db, p );
-	    if ( pkg_from_db ) {
-	      /* Check if that's ours */
-	      if ( strcmp( pkg_from_db, pkgname ) == 0 ) {
-		/*
-		 * It is; try to stat it, and we'll pass the results
-		 * on to show_status() which will do the checks
-		 * specific to this case.
-		 */
-
-		have_stat = 0;
-		not_found = 0;
-		result = lstat( full_p, &st );
-		if ( result == 0 ) have_stat = 1;
-		else {
-		  if ( errno == ENOENT ) {
-		    have_stat = 1;
-		    not_found = 1;
-		  }
-		}
+	    /* Check whether this package still claims it */
+	    result = rbtree_query( owned, p, &owned_v );
+	    if ( result == RBTREE_SUCCESS ) {
+	      /*
+	       * It does; try to stat it, and we'll pass the results
+	       * on to show_status() which will do the checks
+	       * specific to this case.
+	       */
 
-		if ( have_stat ) {
-		  show_status( full_p, not_found ? NULL : &st, pkgname,
-			       descr, e );
-		}
-		else {
-		  printf( "%s is claimed by this package, ", full_p );
-		  printf( "but lstat() failed\n" );
+	      have_stat = 0;
+	      not_found = 0;
+	      result = lstat( full_p, &st );
+	      if ( result == 0 ) have_stat = 1;
+	      else {
+		if ( errno == ENOENT ) {
+		  have_stat = 1;
+		  not_found = 1;
 		}
 	      }
+
+	      if ( have_stat ) {
+		show_status( full_p, not_found ? NULL : &st, pkgname,
+			     descr, e, ( hashed && hashed[i] ) ?
+			     hashes + i * HASH_LEN : NULL );
+	      }
 	      else {
-		/* It isn't */
-		printf( "%s has been claimed by %s\n",
-			full_p, pkg_from_db );
+		printf( "%s is claimed by this package, ", full_p );
+		printf( "but lstat() failed\n" );
 	      }
-
-	      free( pkg_from_db );
 	    }
 	    else {
-	      printf( "%s is unclaimed in the database\n", full_p );
+	      /* It doesn't; only now is it worth asking who does */
+	      pkg_from_db = peek_pkg_db( db, p );
+	      if ( pkg_from_db ) {
+		printf( "%s has been claimed by %s\n",
+			full_p, pkg_from_db );
+	      }
+	      else {
+		printf( "%s is unclaimed in the database\n", full_p );
+	      }
 	    }
 	  }
 	  else {
@@ -392,12 +499,19 @@ static void status_pkg( const char *pkgname ) {
 	  if ( full_p ) free( full_p );
 	}
 
-	/* Close the database */
-	close_pkg_db( db );
+	if ( hashes ) free( hashes );
+	if ( hashed ) free( hashed );
+	rbtree_free( owned );
+      }
+      else if ( db ) {
+	fprintf( stderr, "Unable to read package database.\n" );
       }
       else {
 	fprintf( stderr, "Unable to open package database.\n" );
       }
+
+      /* Close the database */
+      if ( db ) close_pkg_db( db );
     }
     else {
       /* No package-description */
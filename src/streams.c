@@ -2,6 +2,37 @@
 
 #include <pkg.h>
 
+/*
+ * Like read_from_stream(), but if the stream can lend out its own
+ * buffer, point *out at that instead of copying into buf.  Either way
+ * *out is only good until the next read from the stream.
+ */
+
+long borrow_from_stream( read_stream *r, void **out, void *buf, long len ) {
+  long result;
+
+  if ( r && out ) {
+    if ( r->peek && r->consume ) {
+      result = r->peek( r->private, out, len );
+      if ( result > 0 ) {
+	if ( r->consume( r->private, result ) != result )
+	  result = STREAMS_INTERNAL_ERROR;
+      }
+    }
+    else {
+      *out = buf;
+      result = r->read( r->private, buf, len );
+    }
+    return result;
+  }
+  else return STREAMS_BAD_STREAM;
+}
+
+int can_peek_stream( read_stream *r ) {
+  if ( r && r->peek && r->consume ) return 1;
+  else return 0;
+}
+
 void close_read_stream( read_stream *r ) {
   if ( r ) {
     r->close( r->private );
@@ -16,6 +47,18 @@ void close_write_stream( write_stream *w ) {
   }
 }
 
+long consume_stream( read_stream *r, long len ) {
+  if ( r && r->consume )
+    return r->consume( r->private, len );
+  else return STREAMS_BAD_STREAM;
+}
+
+long peek_stream( read_stream *r, void **out, long len ) {
+  if ( r && r->peek && out )
+    return r->peek( r->private, out, len );
+  else return STREAMS_BAD_STREAM;
+}
+
 long read_from_stream( read_stream *r, void *buf, long len ) {
   if ( r )
     return r->read( r->private, buf, len );
@@ -3,11 +3,34 @@
 #include <pkg.h>
 
 #include <stdlib.h>
+#include <string.h>
 
 #include <bzlib.h>
 
 #define CHUNK_SIZE 16384
 
+#ifdef USE_PTHREADS
+/*
+ * Input per block for the parallel writer.  The RLE pass libbz2 does
+ * first can turn 4 bytes into 5, and a level 9 block holds 899981
+ * bytes after it, so this always fits in one block.
+ */
+#define PAR_BLOCK_SIZE 700000
+/* How much compressed input the parallel reader asks for at once */
+#define PAR_READ_SIZE 131072
+/* How many blocks we let be in flight per worker thread */
+#define PAR_JOBS_PER_THREAD 2
+/* The 48-bit magic numbers starting each block and ending each stream */
+#define BZ_BLOCK_MAGIC 0x314159265359ULL
+#define BZ_EOS_MAGIC 0x177245385090ULL
+#define BZ_MAGIC_MASK 0xffffffffffffULL
+/*
+ * No real block compresses to more than this many bits; if merging
+ * suspected blocks in the reader goes past it, the input is bad.
+ */
+#define BZ_MAX_BLOCK_BITS( level ) ( (level) * 100000ULL * 3 * 8 )
+#endif /* USE_PTHREADS */
+
 static void close_bzip2_read( void * );
 static void close_bzip2_write( void * );
 static long read_bzip2( void *, void *, long );
@@ -27,6 +50,141 @@ typedef struct {
   int use_stream;
 } bzip2_private;
 
+#ifdef USE_PTHREADS
+
+/*
+ * The parallel streams lean on two properties of the bzip2 format.
+ * Each block starts with a 48-bit magic number and carries its own
+ * CRC, and the stream CRC at the end is just the block CRCs folded
+ * together with a rotate and xor.  Blocks aren't byte-aligned,
+ * though, so we have to work in bits.
+ *
+ * The writer compresses PAR_BLOCK_SIZE pieces of input into
+ * single-block streams on the worker pool, then splices the blocks
+ * out of them into a single stream of our own.  A single stream
+ * matters: older readers stop at the end of the first stream.
+ *
+ * The reader scans the input for the magic numbers, wraps each block
+ * it finds in a minimal single-block stream, and decompresses those
+ * on the worker pool.  The magic can turn up inside compressed data
+ * by chance, so a block that fails to decompress gets merged with
+ * the one after it and tried again.
+ */
+
+/* A bit-level output buffer */
+typedef struct {
+  unsigned char *buf;
+  unsigned long len;
+  unsigned int acc;
+  int nacc;
+} bzip2_bits;
+
+/* A compression job for the writer */
+typedef struct {
+  char *in;
+  unsigned int in_len;
+  char *out;
+  unsigned int out_len;
+  /* The bits of out holding the block, and its CRC */
+  unsigned long long bits_start, bits_end;
+  unsigned int crc;
+  int error;
+} bzip2_job;
+
+typedef struct {
+  write_stream *ws;
+  stream_pool *pool;
+  /* The block we're filling, if any */
+  bzip2_job *curr;
+  /* Output not yet written; bits.buf is CHUNK_SIZE bytes */
+  bzip2_bits bits;
+  /* Stream CRC so far */
+  unsigned int crc;
+  int max_pending;
+  int error;
+} bzip2_parallel_private;
+
+/* A decompression job for the reader */
+typedef struct {
+  /* A single-block stream wrapped around the block */
+  char *in;
+  unsigned int in_len;
+  /* Bits in the block itself, which start at bit 32 of in */
+  unsigned long long nbits;
+  int level;
+  /* CRC stored in the block header */
+  unsigned int crc;
+  /* If this is the last block of a stream, the stream CRC */
+  int ends_stream;
+  unsigned int stream_crc;
+  char *out;
+  unsigned long out_len, out_pos;
+  int error;
+} bunzip2_job;
+
+typedef struct {
+  read_stream *rs;
+  stream_pool *pool;
+  /* Compressed input; cbuf[0] is byte cbase of the whole input */
+  unsigned char *cbuf;
+  unsigned long clen, csize;
+  unsigned long long cbase;
+  int in_eof;
+  /* Set when the scanner has no more jobs to give */
+  int done;
+  /* Scanner state */
+  int in_block;
+  int level;
+  int streams_seen;
+  /* Absolute bit offset of the block we're scanning for the end of */
+  unsigned long long block_start;
+  /*
+   * Absolute byte offset of the next byte to scan in a block, or of
+   * the next stream header between blocks
+   */
+  unsigned long long scan_pos;
+  unsigned long long window;
+  /* Block CRCs folded as stored, for sanity checking the stream end */
+  unsigned int stored_crc;
+  /* Block CRCs folded as we hand out data, checked at each stream end */
+  unsigned int crc;
+  /* The job we're reading out of */
+  bunzip2_job *curr;
+  int max_pending;
+  int error;
+} bunzip2_parallel_private;
+
+static void bits_copy( bzip2_bits *, const unsigned char *,
+		       unsigned long long, unsigned long long );
+static unsigned long long bits_get( const unsigned char *,
+				    unsigned long long, int );
+static void bits_pad( bzip2_bits * );
+static void bits_put( bzip2_bits *, unsigned long, int );
+static bunzip2_job * bunzip2_make_job( const unsigned char *,
+				       unsigned long long,
+				       unsigned long long, int );
+static bunzip2_job * bunzip2_merge_jobs( bunzip2_job *, bunzip2_job * );
+static int bunzip2_parallel_ensure( bunzip2_parallel_private *,
+				    unsigned long long );
+static int bunzip2_parallel_next( bunzip2_parallel_private * );
+static int bunzip2_parallel_scan( bunzip2_parallel_private * );
+static int bunzip2_parallel_submit( bunzip2_parallel_private *,
+				    unsigned long long, int, unsigned int );
+static int bzip2_parallel_collect( bzip2_parallel_private * );
+static int bzip2_parallel_flush( bzip2_parallel_private * );
+static int bzip2_parallel_submit( bzip2_parallel_private * );
+static void close_bunzip2_parallel_read( void * );
+static void close_bzip2_parallel_write( void * );
+static void compress_bzip2_job( void * );
+static void decompress_bunzip2_job( void * );
+static void free_bunzip2_job( bunzip2_job * );
+static void free_bzip2_job( bzip2_job * );
+static long read_bunzip2_parallel( void *, void *, long );
+static unsigned int rotate_crc( unsigned int );
+static long write_bzip2_parallel( void *, void *, long );
+
+#endif /* USE_PTHREADS */
+
 static void close_bzip2_read( void *vp ) {
   bzip2_private *p;
 
@@ -122,6 +280,8 @@ read_stream * open_read_stream_from_stream_bzip2( read_stream *rs ) {
 	    p->u.streams.rs = rs;
 	    r->close = close_bzip2_read;
 	    r->read = read_bzip2;
+	    r->peek = NULL;
+	    r->consume = NULL;
 	  }
 	  else {
 	    free( p->buf );
@@ -146,6 +306,79 @@ read_stream * open_read_stream_from_stream_bzip2( read_stream *rs ) {
   return r;
 }
 
+/*
+ * Parallel version of open_read_stream_from_stream_bzip2(); this
+ * reads ahead of the caller, and decompresses blocks on several
+ * threads at once.  Unlike the serial version, it goes on to read
+ * any further streams concatenated to the first.
+ */
+
+read_stream * open_read_stream_from_stream_bzip2_parallel( read_stream *rs,
+							   int threads ) {
+  read_stream *r;
+#ifdef USE_PTHREADS
+  bunzip2_parallel_private *p;
+
+  if ( rs && threads > 1 ) {
+    r = malloc( sizeof( *r ) );
+    if ( r ) {
+      p = malloc( sizeof( *p ) );
+      if ( p ) {
+	r->private = (void *)p;
+	p->rs = rs;
+	p->csize = 4 * PAR_READ_SIZE;
+	p->cbuf = malloc( p->csize );
+	if ( p->cbuf ) {
+	  p->clen = 0;
+	  p->cbase = 0;
+	  p->in_eof = 0;
+	  p->done = 0;
+	  p->in_block = 0;
+	  p->level = 0;
+	  p->streams_seen = 0;
+	  p->block_start = 0;
+	  p->scan_pos = 0;
+	  p->window = 0;
+	  p->stored_crc = 0;
+	  p->crc = 0;
+	  p->curr = NULL;
+	  p->max_pending = PAR_JOBS_PER_THREAD * threads;
+	  p->error = 0;
+	  p->pool = start_stream_pool( threads, decompress_bunzip2_job );
+	  if ( p->pool ) {
+	    r->close = close_bunzip2_parallel_read;
+	    r->read = read_bunzip2_parallel;
+	    r->peek = NULL;
+	    r->consume = NULL;
+	  }
+	  else {
+	    /* No threads to be had; do it the old way */
+	    free( p->cbuf );
+	    free( p );
+	    free( r );
+	    r = open_read_stream_from_stream_bzip2( rs );
+	  }
+	}
+	else {
+	  free( p );
+	  free( r );
+	  r = NULL;
+	}
+      }
+      else {
+	free( r );
+	r = NULL;
+      }
+    }
+  }
+  else r = open_read_stream_from_stream_bzip2( rs );
+#else
+  r = open_read_stream_from_stream_bzip2( rs );
+#endif /* USE_PTHREADS */
+
+  return r;
+}
+
 read_stream * open_read_stream_bzip2( const char *filename ) {
   read_stream *r;
   bzip2_private *p;
@@ -173,6 +406,8 @@ read_stream * open_read_stream_bzip2( const char *filename ) {
 	    if ( p->u.fp ) {
 	      r->close = close_bzip2_read;
 	      r->read = read_bzip2;
+	      r->peek = NULL;
+	      r->consume = NULL;
 	    }
 	    else {
 	      BZ2_bzDecompressEnd( &(p->strm) );
@@ -256,6 +491,71 @@ write_stream * open_write_stream_from_stream_bzip2( write_stream *ws ) {
   else w = NULL;
   return w;
 }
+/*
+ * Parallel version of open_write_stream_from_stream_bzip2(); the
+ * output is still a single bzip2 stream.
+ */
+
+write_stream * open_write_stream_from_stream_bzip2_parallel( write_stream *ws,
+							     int threads ) {
+  write_stream *w;
+#ifdef USE_PTHREADS
+  bzip2_parallel_private *p;
+
+  if ( ws && threads > 1 ) {
+    w = malloc( sizeof( *w ) );
+    if ( w ) {
+      p = malloc( sizeof( *p ) );
+      if ( p ) {
+	w->private = (void *)p;
+	p->bits.buf = malloc( CHUNK_SIZE );
+	if ( p->bits.buf ) {
+	  p->bits.len = 0;
+	  p->bits.acc = 0;
+	  p->bits.nacc = 0;
+	  p->ws = ws;
+	  p->curr = NULL;
+	  p->crc = 0;
+	  p->max_pending = PAR_JOBS_PER_THREAD * threads;
+	  p->error = 0;
+	  p->pool = start_stream_pool( threads, compress_bzip2_job );
+	  if ( p->pool ) {
+	    /* Stream header; it goes out with the first block */
+	    bits_put( &(p->bits), 'B', 8 );
+	    bits_put( &(p->bits), 'Z', 8 );
+	    bits_put( &(p->bits), 'h', 8 );
+	    bits_put( &(p->bits), '9', 8 );
+	    w->close = close_bzip2_parallel_write;
+	    w->write = write_bzip2_parallel;
+	  }
+	  else {
+	    /* No threads to be had; do it the old way */
+	    free( p->bits.buf );
+	    free( p );
+	    free( w );
+	    w = open_write_stream_from_stream_bzip2( ws );
+	  }
+	}
+	else {
+	  free( p );
+	  free( w );
+	  w = NULL;
+	}
+      }
+      else {
+	free( w );
+	w = NULL;
+      }
+    }
+  }
+  else w = open_write_stream_from_stream_bzip2( ws );
+#else
+  w = open_write_stream_from_stream_bzip2( ws );
+#endif /* USE_PTHREADS */
+
+  return w;
+}
+
 write_stream * open_write_stream_bzip2( const char *filename ) {
   write_stream *w;
   bzip2_private *p;
@@ -410,4 +710,712 @@ static long write_bzip2( void *vp, void *buf, long len ) {
   else return STREAMS_BAD_ARGS;
 }
 
+#ifdef USE_PTHREADS
+
+/* Append n bits of src, starting at bit start, to b */
+
+static void bits_copy( bzip2_bits *b, const unsigned char *src,
+		       unsigned long long start, unsigned long long n ) {
+  unsigned long i;
+  unsigned int byte;
+  int s;
+
+  if ( b->nacc == 0 && ( start & 7 ) == 0 ) {
+    /* Everything lines up; no need to shift */
+    memcpy( b->buf + b->len, src + ( start >> 3 ), n >> 3 );
+    b->len += n >> 3;
+    start += n & ~7ULL;
+    n &= 7;
+  }
+  while ( n >= 8 ) {
+    i = start >> 3;
+    s = start & 7;
+    if ( s == 0 ) byte = src[i];
+    else byte = ( ( src[i] << s ) | ( src[i + 1] >> ( 8 - s ) ) ) & 0xff;
+    bits_put( b, byte, 8 );
+    start += 8;
+    n -= 8;
+  }
+  if ( n > 0 ) bits_put( b, bits_get( src, start, n ), n );
+}
+
+/* Get n <= 48 bits of src, starting at bit start */
+
+static unsigned long long bits_get( const unsigned char *src,
+				    unsigned long long start, int n ) {
+  unsigned long long v;
+  int k;
+
+  v = 0;
+  for ( k = 0; k < n; ++k, ++start ) {
+    v = ( v << 1 ) | ( ( src[start >> 3] >> ( 7 - ( start & 7 ) ) ) & 1 );
+  }
+
+  return v;
+}
+
+/* Pad b with zero bits to a byte boundary */
+
+static void bits_pad( bzip2_bits *b ) {
+  if ( b->nacc > 0 ) bits_put( b, 0, 8 - b->nacc );
+}
+
+/* Append the low n <= 24 bits of v to b */
+
+static void bits_put( bzip2_bits *b, unsigned long v, int n ) {
+  b->acc = ( b->acc << n ) | ( v & ( ( 1UL << n ) - 1 ) );
+  b->nacc += n;
+  while ( b->nacc >= 8 ) {
+    b->nacc -= 8;
+    b->buf[(b->len)++] = ( b->acc >> b->nacc ) & 0xff;
+  }
+  b->acc &= ( 1U << b->nacc ) - 1;
+}
+
+/*
+ * Wrap the nbits bits of block starting at bit start of src in a
+ * single-block stream libbz2 will decompress on its own.
+ */
+
+static bunzip2_job * bunzip2_make_job( const unsigned char *src,
+				       unsigned long long start,
+				       unsigned long long nbits,
+				       int level ) {
+  bunzip2_job *job;
+  bzip2_bits b;
+
+  job = malloc( sizeof( *job ) );
+  if ( job ) {
+    /* Header, block, end of stream marker and CRC, padding */
+    job->in = malloc( 4 + ( nbits + 7 ) / 8 + 10 + 1 );
+    if ( job->in ) {
+      b.buf = (unsigned char *)(job->in);
+      b.len = 0;
+      b.acc = 0;
+      b.nacc = 0;
+      bits_put( &b, 'B', 8 );
+      bits_put( &b, 'Z', 8 );
+      bits_put( &b, 'h', 8 );
+      bits_put( &b, '0' + level, 8 );
+      job->crc = bits_get( src, start + 48, 32 );
+      bits_copy( &b, src, start, nbits );
+      bits_put( &b, BZ_EOS_MAGIC >> 24, 24 );
+      bits_put( &b, BZ_EOS_MAGIC & 0xffffff, 24 );
+      /* The stream CRC of a single block stream is the block CRC */
+      bits_put( &b, job->crc >> 16, 16 );
+      bits_put( &b, job->crc & 0xffff, 16 );
+      bits_pad( &b );
+      job->in_len = b.len;
+      job->nbits = nbits;
+      job->level = level;
+      job->ends_stream = 0;
+      job->stream_crc = 0;
+      job->out = NULL;
+      job->out_len = 0;
+      job->out_pos = 0;
+      job->error = 0;
+    }
+    else {
+      free( job );
+      job = NULL;
+    }
+  }
+
+  return job;
+}
+
+/*
+ * Make a job for the block made of a followed by b, for when the
+ * boundary between them wasn't real.
+ */
+
+static bunzip2_job * bunzip2_merge_jobs( bunzip2_job *a, bunzip2_job *b ) {
+  bunzip2_job *job;
+  bzip2_bits bits;
+
+  job = malloc( sizeof( *job ) );
+  if ( job ) {
+    job->nbits = a->nbits + b->nbits;
+    job->in = malloc( 4 + ( job->nbits + 7 ) / 8 + 10 + 1 );
+    if ( job->in ) {
+      bits.buf = (unsigned char *)(job->in);
+      bits.len = 0;
+      bits.acc = 0;
+      bits.nacc = 0;
+      /* Reuse a's header */
+      bits_copy( &bits, (unsigned char *)(a->in), 0, 32 );
+      bits_copy( &bits, (unsigned char *)(a->in), 32, a->nbits );
+      bits_copy( &bits, (unsigned char *)(b->in), 32, b->nbits );
+      bits_put( &bits, BZ_EOS_MAGIC >> 24, 24 );
+      bits_put( &bits, BZ_EOS_MAGIC & 0xffffff, 24 );
+      bits_put( &bits, a->crc >> 16, 16 );
+      bits_put( &bits, a->crc & 0xffff, 16 );
+      bits_pad( &bits );
+      job->in_len = bits.len;
+      job->level = a->level;
+      job->crc = a->crc;
+      job->ends_stream = b->ends_stream;
+      job->stream_crc = b->stream_crc;
+      job->out = NULL;
+      job->out_len = 0;
+      job->out_pos = 0;
+      job->error = 0;
+    }
+    else {
+      free( job );
+      job = NULL;
+    }
+  }
+
+  return job;
+}
+
+/*
+ * Read until we have input up to (not including) absolute byte upto;
+ * returns 1 if we got there, 0 if the input ended first, and -1 on
+ * error.
+ */
+
+static int bunzip2_parallel_ensure( bunzip2_parallel_private *p,
+				    unsigned long long upto ) {
+  unsigned long long keep;
+  unsigned long shift;
+  unsigned char *temp;
+  long result;
+
+  while ( p->cbase + p->clen < upto && !(p->in_eof) ) {
+    if ( p->csize - p->clen < PAR_READ_SIZE ) {
+      /* Drop whatever is before the block or header we're working on */
+      keep = p->in_block ? ( p->block_start >> 3 ) : p->scan_pos;
+      if ( keep > p->cbase ) {
+	shift = keep - p->cbase;
+	if ( shift > p->clen ) shift = p->clen;
+	memmove( p->cbuf, p->cbuf + shift, p->clen - shift );
+	p->cbase += shift;
+	p->clen -= shift;
+      }
+      if ( p->csize - p->clen < PAR_READ_SIZE ) {
+	temp = realloc( p->cbuf, 2 * p->csize );
+	if ( temp ) {
+	  p->cbuf = temp;
+	  p->csize *= 2;
+	}
+	else return -1;
+      }
+    }
+    result = read_from_stream( p->rs, p->cbuf + p->clen, PAR_READ_SIZE );
+    if ( result > 0 ) p->clen += result;
+    else if ( result == 0 ) p->in_eof = 1;
+    else return -1;
+  }
+
+  return ( p->cbase + p->clen >= upto ) ? 1 : 0;
+}
+
+/*
+ * Set p->curr to the next block's worth of output, or to NULL at the
+ * end of the input; returns 0 if all is well.
+ */
+
+static int bunzip2_parallel_next( bunzip2_parallel_private *p ) {
+  bunzip2_job *job, *next, *merged;
+
+  /* Keep the pool busy */
+  while ( !(p->done) &&
+	  get_stream_pool_pending( p->pool ) < p->max_pending ) {
+    if ( bunzip2_parallel_scan( p ) != 0 ) {
+      p->error = 1;
+      return -1;
+    }
+  }
+
+  job = wait_stream_job( p->pool );
+  /* Out of jobs means we're done */
+  if ( !job ) return 0;
+
+  while ( job->error ) {
+    /*
+     * This might have been cut short by the block magic turning up
+     * inside a block; try again with the next one tacked on.  That
+     * can't happen across the end of a stream.
+     */
+    next = NULL;
+    if ( !(job->ends_stream) ) {
+      while ( !(p->done) && get_stream_pool_pending( p->pool ) == 0 ) {
+	if ( bunzip2_parallel_scan( p ) != 0 ) break;
+      }
+      next = wait_stream_job( p->pool );
+    }
+    if ( next ) {
+      merged = bunzip2_merge_jobs( job, next );
+      free_bunzip2_job( job );
+      free_bunzip2_job( next );
+      job = merged;
+      if ( job ) {
+	/* Past this size, it's just bad input */
+	if ( job->nbits <= BZ_MAX_BLOCK_BITS( job->level ) )
+	  decompress_bunzip2_job( job );
+	else break;
+      }
+      else break;
+    }
+    else break;
+  }
+
+  if ( job && job->error == 0 ) {
+    p->crc = rotate_crc( p->crc ) ^ job->crc;
+    if ( job->ends_stream ) {
+      if ( p->crc == job->stream_crc ) p->crc = 0;
+      else {
+	/* Every block checked out, but the stream as a whole doesn't */
+	free_bunzip2_job( job );
+	p->error = 1;
+	return -1;
+      }
+    }
+    p->curr = job;
+    return 0;
+  }
+  else {
+    if ( job ) free_bunzip2_job( job );
+    p->error = 1;
+    return -1;
+  }
+}
+
+/*
+ * Scan forward until we can submit one more job to the pool, or we
+ * reach the end of the input; returns 0 if all is well.
+ */
+
+static int bunzip2_parallel_scan( bunzip2_parallel_private *p ) {
+  unsigned long long magic, start, hb;
+  unsigned int block_crc, stream_crc, folded;
+  unsigned char *c;
+  int avail, s, accept;
+
+  while ( !(p->done) ) {
+    if ( !(p->in_block) ) {
+      /* Expect a stream header and the first magic number */
+      avail = bunzip2_parallel_ensure( p, p->scan_pos + 10 );
+      if ( avail < 0 ) return -1;
+      c = p->cbuf + ( p->scan_pos - p->cbase );
+      if ( avail == 0 || !( c[0] == 'B' && c[1] == 'Z' && c[2] == 'h' &&
+			    c[3] >= '1' && c[3] <= '9' ) ) {
+	/*
+	 * Clean EOF, or junk after a stream, which the serial reader
+	 * ignores too; anything else is an error.
+	 */
+	if ( p->cbase + p->clen == p->scan_pos || p->streams_seen > 0 ) {
+	  p->done = 1;
+	  return 0;
+	}
+	else return -1;
+      }
+      p->level = c[3] - '0';
+      magic = bits_get( c + 4, 0, 48 );
+      if ( magic == BZ_BLOCK_MAGIC ) {
+	p->in_block = 1;
+	p->block_start = 8 * ( p->scan_pos + 4 );
+	p->scan_pos += 4;
+	p->window = 0;
+	p->stored_crc = 0;
+      }
+      else if ( magic == BZ_EOS_MAGIC ) {
+	/* An empty stream; just step over it */
+	if ( bunzip2_parallel_ensure( p, p->scan_pos + 14 ) != 1 )
+	  return -1;
+	p->scan_pos += 14;
+	++(p->streams_seen);
+      }
+      else return -1;
+    }
+    else {
+      avail = bunzip2_parallel_ensure( p, p->scan_pos + 1 );
+      /* Running out of input in a block means it was truncated */
+      if ( avail != 1 ) return -1;
+      p->window = ( p->window << 8 ) | p->cbuf[p->scan_pos - p->cbase];
+      ++(p->scan_pos);
+      /* Try each bit alignment ending in this byte, in order */
+      for ( s = 7; s >= 0; --s ) {
+	magic = ( p->window >> s ) & BZ_MAGIC_MASK;
+	if ( magic != BZ_BLOCK_MAGIC && magic != BZ_EOS_MAGIC ) continue;
+	start = 8 * p->scan_pos - s - 48;
+	/* Too close to be real; the block header alone is 80 bits */
+	if ( start < p->block_start + 80 ) continue;
+	block_crc = bits_get( p->cbuf, p->block_start + 48 - 8 * p->cbase, 32 );
+	folded = rotate_crc( p->stored_crc ) ^ block_crc;
+	if ( magic == BZ_BLOCK_MAGIC ) {
+	  if ( bunzip2_parallel_submit( p, start, 0, 0 ) != 0 ) return -1;
+	  p->stored_crc = folded;
+	  p->block_start = start;
+	  /* Nothing else in this byte can be far enough along */
+	  return 0;
+	}
+	else {
+	  /*
+	   * Believe an end of stream marker if the stream CRC after it
+	   * checks out against the block CRCs, or if it's followed by
+	   * EOF or another stream.
+	   */
+	  hb = ( start + 80 + 7 ) / 8;
+	  avail = bunzip2_parallel_ensure( p, hb + 4 );
+	  if ( avail < 0 ) return -1;
+	  accept = 0;
+	  stream_crc = 0;
+	  if ( p->cbase + p->clen >= hb ) {
+	    stream_crc = bits_get( p->cbuf, start + 48 - 8 * p->cbase, 32 );
+	    if ( stream_crc == folded ) accept = 1;
+	    else if ( p->cbase + p->clen == hb ) accept = 1;
+	    else if ( avail == 1 ) {
+	      c = p->cbuf + ( hb - p->cbase );
+	      if ( c[0] == 'B' && c[1] == 'Z' && c[2] == 'h' &&
+		   c[3] >= '1' && c[3] <= '9' ) accept = 1;
+	    }
+	  }
+	  if ( accept ) {
+	    if ( bunzip2_parallel_submit( p, start, 1, stream_crc ) != 0 )
+	      return -1;
+	    p->in_block = 0;
+	    p->scan_pos = hb;
+	    ++(p->streams_seen);
+	    return 0;
+	  }
+	  /* Otherwise it was just an unlucky bit pattern */
+	}
+      }
+    }
+  }
+
+  return 0;
+}
+
+/* Submit the block from p->block_start up to bit end */
+
+static int bunzip2_parallel_submit( bunzip2_parallel_private *p,
+				    unsigned long long end,
+				    int ends_stream, unsigned int stream_crc ) {
+  bunzip2_job *job;
+
+  job = bunzip2_make_job( p->cbuf, p->block_start - 8 * p->cbase,
+			  end - p->block_start, p->level );
+  if ( job ) {
+    job->ends_stream = ends_stream;
+    job->stream_crc = stream_crc;
+    if ( submit_stream_job( p->pool, job ) != 0 ) {
+      free_bunzip2_job( job );
+      return -1;
+    }
+    else return 0;
+  }
+  else return -1;
+}
+
+/*
+ * Wait for the oldest block in flight and splice it into our output;
+ * returns 0 if all is well.
+ */
+
+static int bzip2_parallel_collect( bzip2_parallel_private *p ) {
+  bzip2_job *job;
+  unsigned long long start, n;
+
+  job = wait_stream_job( p->pool );
+  if ( job ) {
+    if ( p->error == 0 && job->error == 0 ) {
+      if ( job->bits_end > job->bits_start ) {
+	start = job->bits_start;
+	/* A piece at a time, so it fits in our output buffer */
+	while ( start < job->bits_end && p->error == 0 ) {
+	  n = job->bits_end - start;
+	  if ( n > 8ULL * ( CHUNK_SIZE / 2 ) ) n = 8ULL * ( CHUNK_SIZE / 2 );
+	  bits_copy( &(p->bits), (unsigned char *)(job->out), start, n );
+	  start += n;
+	  if ( bzip2_parallel_flush( p ) != 0 ) p->error = 1;
+	}
+	p->crc = rotate_crc( p->crc ) ^ job->crc;
+      }
+    }
+    else p->error = 1;
+    free_bzip2_job( job );
+  }
+
+  return ( p->error == 0 ) ? 0 : -1;
+}
+
+/* Write out all the whole bytes in p->bits */
+
+static int bzip2_parallel_flush( bzip2_parallel_private *p ) {
+  if ( p->bits.len > 0 ) {
+    if ( write_to_stream( p->ws, p->bits.buf,
+			  p->bits.len ) != p->bits.len ) return -1;
+    p->bits.len = 0;
+  }
+
+  return 0;
+}
+
+/*
+ * Hand the current block to the pool, and collect finished blocks
+ * until we're under our limit for blocks in flight; returns 0 if all
+ * is well.
+ */
+
+static int bzip2_parallel_submit( bzip2_parallel_private *p ) {
+  bzip2_job *job;
+
+  job = p->curr;
+  p->curr = NULL;
+  if ( submit_stream_job( p->pool, job ) != 0 ) {
+    free_bzip2_job( job );
+    p->error = 1;
+    return -1;
+  }
+
+  while ( get_stream_pool_pending( p->pool ) >= p->max_pending ) {
+    if ( bzip2_parallel_collect( p ) != 0 ) return -1;
+  }
+
+  return 0;
+}
+
+static void close_bunzip2_parallel_read( void *vp ) {
+  bunzip2_parallel_private *p;
+  bunzip2_job *job;
+
+  p = (bunzip2_parallel_private *)vp;
+  if ( p ) {
+    /* Wait out anything still in flight */
+    while ( ( job = wait_stream_job( p->pool ) ) != NULL )
+      free_bunzip2_job( job );
+    stop_stream_pool( p->pool );
+    if ( p->curr ) free_bunzip2_job( p->curr );
+    if ( p->cbuf ) free( p->cbuf );
+    free( p );
+  }
+}
+
+static void close_bzip2_parallel_write( void *vp ) {
+  bzip2_parallel_private *p;
+
+  p = (bzip2_parallel_private *)vp;
+  if ( p ) {
+    if ( p->error == 0 && p->curr && p->curr->in_len > 0 )
+      bzip2_parallel_submit( p );
+    /* Collect everything still in flight, even after an error */
+    while ( get_stream_pool_pending( p->pool ) > 0 )
+      bzip2_parallel_collect( p );
+    if ( p->error == 0 ) {
+      bits_put( &(p->bits), BZ_EOS_MAGIC >> 24, 24 );
+      bits_put( &(p->bits), BZ_EOS_MAGIC & 0xffffff, 24 );
+      bits_put( &(p->bits), p->crc >> 16, 16 );
+      bits_put( &(p->bits), p->crc & 0xffff, 16 );
+      bits_pad( &(p->bits) );
+      if ( bzip2_parallel_flush( p ) != 0 ) p->error = 1;
+    }
+    stop_stream_pool( p->pool );
+    if ( p->curr ) free_bzip2_job( p->curr );
+    free( p->bits.buf );
+    free( p );
+  }
+}
+
+static void compress_bzip2_job( void *vp ) {
+  bzip2_job *job;
+  unsigned int size;
+  unsigned long long total, pos;
+  int pad;
+
+  job = (bzip2_job *)vp;
+  /* libbz2 promises output fits in 1% more than the input plus 600 */
+  size = job->in_len + job->in_len / 100 + 600;
+  job->out = malloc( size );
+  if ( job->out ) {
+    job->out_len = size;
+    job->error = 1;
+    if ( BZ2_bzBuffToBuffCompress( job->out, &(job->out_len),
+				   job->in, job->in_len,
+				   9, 0, 30 ) == BZ_OK &&
+	 job->out_len >= 14 ) {
+      /*
+       * Find the end of stream marker; all that follows it is the
+       * stream CRC and up to seven bits of zero padding.
+       */
+      total = 8ULL * job->out_len;
+      for ( pad = 0; pad < 8; ++pad ) {
+	pos = total - 80 - pad;
+	if ( bits_get( (unsigned char *)(job->out), pos, 48 ) ==
+	     BZ_EOS_MAGIC &&
+	     ( pad == 0 ||
+	       bits_get( (unsigned char *)(job->out),
+			 total - pad, pad ) == 0 ) ) {
+	  /* Skip the stream header */
+	  job->bits_start = 32;
+	  job->bits_end = pos;
+	  job->crc = bits_get( (unsigned char *)(job->out), pos + 48, 32 );
+	  job->error = 0;
+	  break;
+	}
+      }
+    }
+  }
+  else job->error = 1;
+}
+
+static void decompress_bunzip2_job( void *vp ) {
+  bunzip2_job *job;
+  bz_stream strm;
+  unsigned long size;
+  char *temp;
+  int status;
+
+  job = (bunzip2_job *)vp;
+  strm.bzalloc = NULL;
+  strm.bzfree = NULL;
+  strm.opaque = NULL;
+  if ( BZ2_bzDecompressInit( &strm, 0, 0 ) == BZ_OK ) {
+    /* About right, unless the block was mostly long runs */
+    size = job->level * 100000UL;
+    job->out = malloc( size );
+    if ( job->out ) {
+      strm.next_in = job->in;
+      strm.avail_in = job->in_len;
+      strm.next_out = job->out;
+      strm.avail_out = size;
+      while ( 1 ) {
+	status = BZ2_bzDecompress( &strm );
+	if ( status == BZ_STREAM_END ) break;
+	else if ( status == BZ_OK ) {
+	  if ( strm.avail_out == 0 ) {
+	    temp = realloc( job->out, 2 * size );
+	    if ( temp ) {
+	      job->out = temp;
+	      strm.next_out = job->out + size;
+	      strm.avail_out = size;
+	      size *= 2;
+	    }
+	    else {
+	      job->error = 1;
+	      break;
+	    }
+	  }
+	  else if ( strm.avail_in == 0 ) {
+	    /* Out of input without reaching the end */
+	    job->error = 1;
+	    break;
+	  }
+	}
+	else {
+	  job->error = 1;
+	  break;
+	}
+      }
+      job->out_len = size - strm.avail_out;
+    }
+    else job->error = 1;
+    BZ2_bzDecompressEnd( &strm );
+  }
+  else job->error = 1;
+}
+
+static void free_bunzip2_job( bunzip2_job *job ) {
+  if ( job ) {
+    if ( job->in ) free( job->in );
+    if ( job->out ) free( job->out );
+    free( job );
+  }
+}
+
+static void free_bzip2_job( bzip2_job *job ) {
+  if ( job ) {
+    if ( job->in ) free( job->in );
+    if ( job->out ) free( job->out );
+    free( job );
+  }
+}
+
+static long read_bunzip2_parallel( void *vp, void *buf, long len ) {
+  bunzip2_parallel_private *p;
+  long done, n;
+
+  p = (bunzip2_parallel_private *)vp;
+  if ( p && buf && len > 0 ) {
+    if ( p->error == 0 ) {
+      done = 0;
+      while ( done < len ) {
+	if ( p->curr ) {
+	  if ( p->curr->out_pos < p->curr->out_len ) {
+	    n = p->curr->out_len - p->curr->out_pos;
+	    if ( n > len - done ) n = len - done;
+	    memcpy( (char *)buf + done, p->curr->out + p->curr->out_pos, n );
+	    p->curr->out_pos += n;
+	    done += n;
+	    continue;
+	  }
+	  free_bunzip2_job( p->curr );
+	  p->curr = NULL;
+	}
+	if ( bunzip2_parallel_next( p ) != 0 ) break;
+	/* No next block means EOF */
+	if ( !(p->curr) ) break;
+      }
+      if ( p->error == 0 ) return done;
+      else return STREAMS_INTERNAL_ERROR;
+    }
+    else return STREAMS_INTERNAL_ERROR;
+  }
+  else return STREAMS_BAD_ARGS;
+}
+
+/* One step of folding block CRCs into a stream CRC */
+
+static unsigned int rotate_crc( unsigned int crc ) {
+  return ( ( crc << 1 ) | ( ( crc >> 31 ) & 1 ) ) & 0xffffffffU;
+}
+
+static long write_bzip2_parallel( void *vp, void *buf, long len ) {
+  bzip2_parallel_private *p;
+  bzip2_job *job;
+  long done, n;
+
+  p = (bzip2_parallel_private *)vp;
+  if ( p && buf && len > 0 ) {
+    if ( p->error == 0 ) {
+      done = 0;
+      while ( done < len ) {
+	if ( !(p->curr) ) {
+	  job = malloc( sizeof( *job ) );
+	  if ( job ) {
+	    job->in = malloc( PAR_BLOCK_SIZE );
+	    job->in_len = 0;
+	    job->out = NULL;
+	    job->out_len = 0;
+	    job->error = 0;
+	    if ( job->in ) p->curr = job;
+	    else free( job );
+	  }
+	  if ( !(p->curr) ) {
+	    p->error = 1;
+	    break;
+	  }
+	}
+	n = PAR_BLOCK_SIZE - p->curr->in_len;
+	if ( n > len - done ) n = len - done;
+	memcpy( p->curr->in + p->curr->in_len, (char *)buf + done, n );
+	p->curr->in_len += n;
+	done += n;
+	if ( p->curr->in_len == PAR_BLOCK_SIZE ) {
+	  if ( bzip2_parallel_submit( p ) != 0 ) break;
+	}
+      }
+      if ( p->error == 0 ) return done;
+      else return STREAMS_INTERNAL_ERROR;
+    }
+    else return STREAMS_INTERNAL_ERROR;
+  }
+  else return STREAMS_BAD_ARGS;
+}
+
+#endif /* USE_PTHREADS */
+
 #endif /* COMPRESSION_BZIP2 */
@@ -3,11 +3,21 @@
 #include <pkg.h>
 
 #include <stdlib.h>
+#include <string.h>
 
 #include <zlib.h>
 
 #define CHUNK_SIZE 16384
 
+#ifdef USE_PTHREADS
+/* Input block size for the parallel writer */
+#define PAR_BLOCK_SIZE 131072
+/* Each block's deflate stream is primed with this much preceding input */
+#define PAR_DICT_SIZE 32768
+/* How many blocks we let be in flight per worker thread */
+#define PAR_JOBS_PER_THREAD 2
+#endif /* USE_PTHREADS */
+
 static void close_gzip_read( void * );
 static void close_gzip_write( void * );
 static long read_gzip( void *, void *, long );
@@ -27,6 +37,79 @@ typedef struct {
   int use_stream;
 } gzip_private;
 
+#ifdef USE_PTHREADS
+
+/*
+ * The parallel writer works like pigz: the input is cut into
+ * PAR_BLOCK_SIZE blocks, and each one is deflated independently as
+ * raw deflate data on the worker pool, with the last PAR_DICT_SIZE
+ * bytes of the block before it as a preset dictionary.  All but the
+ * last block end with a sync flush, so the pieces concatenate into a
+ * single deflate stream, and we wrap that in our own gzip header and
+ * trailer, combining the per-block CRCs as the blocks come back.
+ */
+
+typedef struct {
+  unsigned char *in;
+  long in_len;
+  unsigned char dict[PAR_DICT_SIZE];
+  long dict_len;
+  unsigned char *out;
+  long out_len;
+  uLong crc;
+  int last;
+  int error;
+} gzip_job;
+
+typedef struct {
+  write_stream *ws;
+  stream_pool *pool;
+  /* The block we're filling, if any */
+  gzip_job *curr;
+  /* The tail of the input so far, to prime the next block with */
+  unsigned char dict[PAR_DICT_SIZE];
+  long dict_len;
+  /* CRC and length of all the input so far, for the trailer */
+  uLong crc;
+  unsigned long total_len;
+  int max_pending;
+  int error;
+} gzip_parallel_private;
+
+static gzip_job * alloc_gzip_job( void );
+static void close_gzip_parallel_write( void * );
+static void deflate_gzip_job( void * );
+static void free_gzip_job( gzip_job * );
+static int gzip_parallel_collect( gzip_parallel_private * );
+static int gzip_parallel_submit( gzip_parallel_private *, int );
+static long write_gzip_parallel( void *, void *, long );
+
+static gzip_job * alloc_gzip_job( void ) {
+  gzip_job *job;
+
+  job = malloc( sizeof( *job ) );
+  if ( job ) {
+    job->in = malloc( PAR_BLOCK_SIZE );
+    if ( job->in ) {
+      job->in_len = 0;
+      job->dict_len = 0;
+      job->out = NULL;
+      job->out_len = 0;
+      job->crc = 0;
+      job->last = 0;
+      job->error = 0;
+    }
+    else {
+      free( job );
+      job = NULL;
+    }
+  }
+
+  return job;
+}
+
+#endif /* USE_PTHREADS */
+
 static void close_gzip_read( void *vp ) {
   gzip_private *p;
 
@@ -96,6 +179,192 @@ static void close_gzip_write( void *vp ) {
   }
 }
 
+#ifdef USE_PTHREADS
+
+static void close_gzip_parallel_write( void *vp ) {
+  gzip_parallel_private *p;
+  unsigned char trailer[8];
+  int i;
+
+  p = (gzip_parallel_private *)vp;
+  if ( p ) {
+    /*
+     * Always submit a last block, even an empty one, since it's the
+     * one that ends the deflate stream.
+     */
+    if ( p->error == 0 ) {
+      if ( gzip_parallel_submit( p, 1 ) != 0 ) p->error = 1;
+    }
+    /* Collect everything still in flight, even after an error */
+    while ( get_stream_pool_pending( p->pool ) > 0 )
+      gzip_parallel_collect( p );
+    if ( p->error == 0 ) {
+      /* CRC-32 and input length mod 2^32, both little-endian */
+      for ( i = 0; i < 4; ++i ) {
+	trailer[i] = ( p->crc >> ( 8 * i ) ) & 0xff;
+	trailer[i + 4] = ( p->total_len >> ( 8 * i ) ) & 0xff;
+      }
+      if ( write_to_stream( p->ws, trailer, 8 ) != 8 ) p->error = 1;
+    }
+    stop_stream_pool( p->pool );
+    if ( p->curr ) free_gzip_job( p->curr );
+    free( p );
+  }
+}
+
+static void deflate_gzip_job( void *vp ) {
+  gzip_job *job;
+  z_stream strm;
+  unsigned char *temp;
+  uLong size;
+  int flush, def_status;
+
+  job = (gzip_job *)vp;
+  strm.zalloc = Z_NULL;
+  strm.zfree = Z_NULL;
+  strm.opaque = Z_NULL;
+  /* Raw deflate; the header and trailer are ours to write */
+  if ( deflateInit2( &strm, 9, Z_DEFLATED, -15, 9,
+		     Z_DEFAULT_STRATEGY ) == Z_OK ) {
+    if ( job->dict_len > 0 ) {
+      if ( deflateSetDictionary( &strm, job->dict,
+				 job->dict_len ) != Z_OK )
+	job->error = 1;
+    }
+    if ( job->error == 0 ) {
+      /* Leave some slack for the sync flush marker */
+      size = deflateBound( &strm, job->in_len ) + 16;
+      job->out = malloc( size );
+      if ( job->out ) {
+	strm.next_in = job->in;
+	strm.avail_in = job->in_len;
+	strm.next_out = job->out;
+	strm.avail_out = size;
+	flush = job->last ? Z_FINISH : Z_SYNC_FLUSH;
+	while ( 1 ) {
+	  def_status = deflate( &strm, flush );
+	  if ( def_status == Z_STREAM_END ) break;
+	  else if ( def_status == Z_OK ||
+		    ( def_status == Z_BUF_ERROR && strm.avail_out == 0 ) ) {
+	    if ( strm.avail_out > 0 ) {
+	      /* A sync flush is done once it leaves room to spare */
+	      if ( flush == Z_SYNC_FLUSH && strm.avail_in == 0 ) break;
+	    }
+	    else {
+	      /* deflateBound() was wrong; grow the buffer */
+	      temp = realloc( job->out, 2 * size );
+	      if ( temp ) {
+		job->out = temp;
+		strm.next_out = job->out + strm.total_out;
+		strm.avail_out = 2 * size - strm.total_out;
+		size *= 2;
+	      }
+	      else {
+		job->error = 1;
+		break;
+	      }
+	    }
+	  }
+	  else {
+	    job->error = 1;
+	    break;
+	  }
+	}
+	job->out_len = strm.total_out;
+      }
+      else job->error = 1;
+    }
+    deflateEnd( &strm );
+  }
+  else job->error = 1;
+
+  job->crc = crc32( crc32( 0L, Z_NULL, 0 ), job->in, job->in_len );
+}
+
+static void free_gzip_job( gzip_job *job ) {
+  if ( job ) {
+    if ( job->in ) free( job->in );
+    if ( job->out ) free( job->out );
+    free( job );
+  }
+}
+
+/*
+ * Wait for the oldest block in flight and write it out; returns 0 if
+ * all is well.
+ */
+
+static int gzip_parallel_collect( gzip_parallel_private *p ) {
+  gzip_job *job;
+
+  job = wait_stream_job( p->pool );
+  if ( job ) {
+    if ( p->error == 0 && job->error == 0 ) {
+      p->crc = crc32_combine( p->crc, job->crc, job->in_len );
+      p->total_len += job->in_len;
+      if ( job->out_len > 0 ) {
+	if ( write_to_stream( p->ws, job->out,
+			      job->out_len ) != job->out_len )
+	  p->error = 1;
+      }
+    }
+    else p->error = 1;
+    free_gzip_job( job );
+  }
+
+  return ( p->error == 0 ) ? 0 : -1;
+}
+
+/*
+ * Hand the current block to the pool, and collect finished blocks
+ * until we're under our limit for blocks in flight; returns 0 if all
+ * is well.
+ */
+
+static int gzip_parallel_submit( gzip_parallel_private *p, int last ) {
+  gzip_job *job;
+  long keep;
+
+  if ( !(p->curr) ) {
+    p->curr = alloc_gzip_job();
+    if ( !(p->curr) ) {
+      p->error = 1;
+      return -1;
+    }
+  }
+  job = p->curr;
+  p->curr = NULL;
+  job->last = last;
+  memcpy( job->dict, p->dict, p->dict_len );
+  job->dict_len = p->dict_len;
+  /* Slide the input into our dictionary for the next block */
+  if ( job->in_len >= PAR_DICT_SIZE ) {
+    memcpy( p->dict, job->in + job->in_len - PAR_DICT_SIZE, PAR_DICT_SIZE );
+    p->dict_len = PAR_DICT_SIZE;
+  }
+  else if ( job->in_len > 0 ) {
+    keep = PAR_DICT_SIZE - job->in_len;
+    if ( keep > p->dict_len ) keep = p->dict_len;
+    memmove( p->dict, p->dict + p->dict_len - keep, keep );
+    memcpy( p->dict + keep, job->in, job->in_len );
+    p->dict_len = keep + job->in_len;
+  }
+
+  if ( submit_stream_job( p->pool, job ) != 0 ) {
+    free_gzip_job( job );
+    p->error = 1;
+    return -1;
+  }
+
+  while ( get_stream_pool_pending( p->pool ) >= p->max_pending ) {
+    if ( gzip_parallel_collect( p ) != 0 ) return -1;
+  }
+
+  return 0;
+}
+
+#endif /* USE_PTHREADS */
+
 read_stream * open_read_stream_from_stream_gzip( read_stream *rs ) {
   read_stream *r;
   gzip_private *p;
@@ -122,6 +391,8 @@ read_stream * open_read_stream_from_stream_gzip( read_stream *rs ) {
 	    p->u.streams.rs = rs;
 	    r->close = close_gzip_read;
 	    r->read = read_gzip;
+	    r->peek = NULL;
+	    r->consume = NULL;
 	  }
 	  else {
 	    free( p->buf );
@@ -173,6 +444,8 @@ read_stream * open_read_stream_gzip( const char *filename ) {
 	    if ( p->u.fp ) {
 	      r->close = close_gzip_read;
 	      r->read = read_gzip;
+	      r->peek = NULL;
+	      r->consume = NULL;
 	    }
 	    else {
 	      inflateEnd( &(p->strm) );
@@ -260,6 +533,67 @@ write_stream * open_write_stream_from_stream_gzip( write_stream *ws ) {
   return w;
 }
 
+/*
+ * Parallel version of open_write_stream_from_stream_gzip(); the
+ * output is still a single gzip member any gzip reader can handle.
+ */
+
+write_stream * open_write_stream_from_stream_gzip_parallel( write_stream *ws,
+							    int threads ) {
+  write_stream *w;
+#ifdef USE_PTHREADS
+  gzip_parallel_private *p;
+  /* Deflate, no flags, no mtime, max compression, Unix */
+  unsigned char header[10] =
+    { 0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x03 };
+
+  if ( ws && threads > 1 ) {
+    w = malloc( sizeof( *w ) );
+    if ( w ) {
+      p = malloc( sizeof( *p ) );
+      if ( p ) {
+	w->private = (void *)p;
+	p->ws = ws;
+	p->curr = NULL;
+	p->dict_len = 0;
+	p->crc = crc32( 0L, Z_NULL, 0 );
+	p->total_len = 0;
+	p->max_pending = PAR_JOBS_PER_THREAD * threads;
+	p->error = 0;
+	p->pool = start_stream_pool( threads, deflate_gzip_job );
+	if ( p->pool ) {
+	  if ( write_to_stream( ws, header, 10 ) == 10 ) {
+	    w->close = close_gzip_parallel_write;
+	    w->write = write_gzip_parallel;
+	  }
+	  else {
+	    stop_stream_pool( p->pool );
+	    free( p );
+	    free( w );
+	    w = NULL;
+	  }
+	}
+	else {
+	  /* No threads to be had; do it the old way */
+	  free( p );
+	  free( w );
+	  w = open_write_stream_from_stream_gzip( ws );
+	}
+      }
+      else {
+	free( w );
+	w = NULL;
+      }
+    }
+  }
+  else w = open_write_stream_from_stream_gzip( ws );
+#else
+  w = open_write_stream_from_stream_gzip( ws );
+#endif /* USE_PTHREADS */
+
+  return w;
+}
+
 write_stream * open_write_stream_gzip( const char *filename ) {
   write_stream *w;
   gzip_private *p;
@@ -420,4 +754,42 @@ static long write_gzip( void *vp, void *buf, long len ) {
   else return STREAMS_BAD_ARGS;
 }
 
+#ifdef USE_PTHREADS
+
+static long write_gzip_parallel( void *vp, void *buf, long len ) {
+  gzip_parallel_private *p;
+  long done, n;
+
+  p = (gzip_parallel_private *)vp;
+  if ( p && buf && len > 0 ) {
+    if ( p->error == 0 ) {
+      done = 0;
+      while ( done < len ) {
+	if ( !(p->curr) ) {
+	  p->curr = alloc_gzip_job();
+	  if ( !(p->curr) ) {
+	    p->error = 1;
+	    break;
+	  }
+	}
+	n = PAR_BLOCK_SIZE - p->curr->in_len;
+	if ( n > len - done ) n = len - done;
+	memcpy( p->curr->in + p->curr->in_len, (unsigned char *)buf + done, n );
+	p->curr->in_len += n;
+	done += n;
+	/* Full blocks go off now; the last one waits for close */
+	if ( p->curr->in_len == PAR_BLOCK_SIZE ) {
+	  if ( gzip_parallel_submit( p, 0 ) != 0 ) break;
+	}
+      }
+      if ( p->error == 0 ) return done;
+      else return STREAMS_INTERNAL_ERROR;
+    }
+    else return STREAMS_INTERNAL_ERROR;
+  }
+  else return STREAMS_BAD_ARGS;
+}
+
+#endif /* USE_PTHREADS */
+
 #endif /* COMPRESS_GZIP */
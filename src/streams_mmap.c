@@ -0,0 +1,144 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <pkg.h>
+
+/*
+ * A read stream over a whole file mapped into memory.  It lends out
+ * pointers straight into the mapping through peek()/consume(), so
+ * uncompressed packages and source files can go from the page cache
+ * to wherever they're going without a bounce buffer.
+ */
+
+typedef struct {
+  unsigned char *map;
+  size_t size;
+  size_t pos;
+} mmap_private;
+
+static void close_mmap( void * );
+static long consume_mmap( void *, long );
+static long peek_mmap( void *, void **, long );
+static long read_mmap( void *, void *, long );
+
+static void close_mmap( void *vp ) {
+  mmap_private *p;
+
+  p = (mmap_private *)vp;
+  if ( p ) {
+    munmap( p->map, p->size );
+    free( p );
+  }
+}
+
+static long consume_mmap( void *vp, long len ) {
+  mmap_private *p;
+
+  p = (mmap_private *)vp;
+  if ( p && len >= 0 ) {
+    if ( (size_t)len <= p->size - p->pos ) {
+      p->pos += len;
+      return len;
+    }
+    else return STREAMS_BAD_ARGS;
+  }
+  else return STREAMS_BAD_ARGS;
+}
+
+read_stream * open_read_stream_mmap( const char *filename ) {
+  read_stream *r;
+  mmap_private *p;
+  struct stat st;
+  void *map;
+  int fd;
+
+  r = NULL;
+  if ( filename ) {
+    /*
+     * O_DIRECT means we were asked to stay out of the page cache, and
+     * we can't map anything that isn't a non-empty regular file that
+     * fits in our address space; use a plain stream for those.
+     */
+    map = MAP_FAILED;
+    if ( !get_io_direct() ) {
+      fd = open( filename, O_RDONLY );
+      if ( fd != -1 ) {
+	if ( fstat( fd, &st ) == 0 && S_ISREG( st.st_mode ) &&
+	     st.st_size > 0 && (uintmax_t)st.st_size <= SIZE_MAX ) {
+	  map = mmap( NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE,
+		      fd, 0 );
+	}
+	/* The mapping keeps its own reference to the file */
+	close( fd );
+      }
+    }
+
+    if ( map != MAP_FAILED ) {
+#ifdef MADV_SEQUENTIAL
+      madvise( map, (size_t)st.st_size, MADV_SEQUENTIAL );
+#endif /* MADV_SEQUENTIAL */
+      r = malloc( sizeof( *r ) );
+      p = malloc( sizeof( *p ) );
+      if ( r && p ) {
+	p->map = map;
+	p->size = (size_t)st.st_size;
+	p->pos = 0;
+	r->private = (void *)p;
+	r->close = close_mmap;
+	r->read = read_mmap;
+	r->peek = peek_mmap;
+	r->consume = consume_mmap;
+      }
+      else {
+	if ( r ) free( r );
+	if ( p ) free( p );
+	munmap( map, (size_t)st.st_size );
+	r = NULL;
+      }
+    }
+    else r = open_read_stream_none( filename );
+  }
+
+  return r;
+}
+
+static long peek_mmap( void *vp, void **out, long len ) {
+  mmap_private *p;
+  size_t avail;
+
+  p = (mmap_private *)vp;
+  if ( p && out && len > 0 ) {
+    avail = p->size - p->pos;
+    if ( avail > 0 ) {
+      if ( (size_t)len > avail ) len = (long)avail;
+      *out = p->map + p->pos;
+      return len;
+    }
+    else return STREAMS_EOF;
+  }
+  else return STREAMS_BAD_ARGS;
+}
+
+static long read_mmap( void *vp, void *buf, long len ) {
+  void *src;
+  long result;
+
+  if ( buf ) {
+    result = peek_mmap( vp, &src, len );
+    if ( result > 0 ) {
+      memcpy( buf, src, result );
+      consume_mmap( vp, result );
+    }
+  }
+  else result = STREAMS_BAD_ARGS;
+
+  return result;
+}
@@ -1,92 +1,337 @@
+#ifdef __linux__
+/* For O_DIRECT */
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include <pkg.h>
 
-static void close_none( void * );
+/* O_DIRECT wants buffers, file offsets and lengths aligned to this */
+#define DIRECT_ALIGN 4096
+
+/*
+ * These go straight to the file descriptor, with a buffer of
+ * get_io_buffer_size() bytes rather than stdio's.  Reads and writes
+ * at least that large skip the buffer entirely, except under
+ * O_DIRECT, which needs the aligned buffer.
+ */
+
+typedef struct {
+  int fd;
+  /* O_DIRECT is set on fd */
+  int direct;
+  /* Allocated on first use, since big reads and writes never need it */
+  char *buf;
+  long size;
+  /* When reading, buf[pos..len) is unread; when writing, buf[0..len) */
+  long pos, len;
+  int eof;
+  int error;
+} none_private;
+
+static none_private * alloc_none_private( int, int );
+static void close_none_read( void * );
+static void close_none_write( void * );
+static int flush_none( none_private * );
+static int get_none_buf( none_private * );
+static int open_none_fd( const char *, int, mode_t, int * );
+static long read_fd( int, void *, long );
 static long read_none( void *, void *, long );
+static int write_fd( int, void *, long );
 static long write_none( void *, void *, long );
 
-static void close_none( void *p ) {
-  FILE *fp;
+static none_private * alloc_none_private( int fd, int direct ) {
+  none_private *p;
+  long size;
+
+  p = malloc( sizeof( *p ) );
+  if ( p ) {
+    size = get_io_buffer_size();
+    if ( direct && size % DIRECT_ALIGN != 0 )
+      size += DIRECT_ALIGN - size % DIRECT_ALIGN;
+    p->fd = fd;
+    p->direct = direct;
+    p->buf = NULL;
+    p->size = size;
+    p->pos = 0;
+    p->len = 0;
+    p->eof = 0;
+    p->error = 0;
+  }
+
+  return p;
+}
+
+static void close_none_read( void *vp ) {
+  none_private *p;
+
+  p = (none_private *)vp;
+  if ( p ) {
+    close( p->fd );
+    if ( p->buf ) free( p->buf );
+    free( p );
+  }
+}
+
+static void close_none_write( void *vp ) {
+  none_private *p;
+  int flags;
 
-  fp = (FILE *)p;
-  if ( fp ) fclose( fp );
+  p = (none_private *)vp;
+  if ( p ) {
+    if ( p->error == 0 && p->len > 0 ) {
+#ifdef O_DIRECT
+      /*
+       * Everything so far went out in whole buffers, but the tail
+       * probably isn't aligned; drop O_DIRECT for it.
+       */
+      if ( p->direct && p->len % DIRECT_ALIGN != 0 ) {
+	flags = fcntl( p->fd, F_GETFL );
+	if ( flags != -1 ) fcntl( p->fd, F_SETFL, flags & ~O_DIRECT );
+	p->direct = 0;
+      }
+#endif /* O_DIRECT */
+      flush_none( p );
+    }
+    close( p->fd );
+    if ( p->buf ) free( p->buf );
+    free( p );
+  }
+}
+
+static int flush_none( none_private *p ) {
+  if ( p->len > 0 ) {
+    if ( write_fd( p->fd, p->buf, p->len ) != 0 ) {
+      p->error = 1;
+      return -1;
+    }
+    p->len = 0;
+  }
+
+  return 0;
+}
+
+static int get_none_buf( none_private *p ) {
+  void *temp;
+
+  if ( !(p->buf) ) {
+    if ( p->direct ) {
+      if ( posix_memalign( &temp, DIRECT_ALIGN, p->size ) == 0 )
+	p->buf = temp;
+    }
+    else p->buf = malloc( p->size );
+  }
+
+  return ( p->buf ) ? 0 : -1;
+}
+
+/*
+ * Open filename with flags, trying O_DIRECT first if we've been asked
+ * to; not every filesystem supports it.
+ */
+
+static int open_none_fd( const char *filename, int flags, mode_t mode,
+			 int *direct ) {
+  int fd;
+
+  fd = -1;
+  *direct = 0;
+#ifdef O_DIRECT
+  if ( get_io_direct() ) {
+    fd = open( filename, flags | O_DIRECT, mode );
+    if ( fd != -1 ) *direct = 1;
+  }
+#endif /* O_DIRECT */
+  if ( fd == -1 ) fd = open( filename, flags, mode );
+
+  return fd;
 }
 
 read_stream * open_read_stream_none( const char *filename ) {
   read_stream *r;
-  FILE *fp;
-
-  r = malloc( sizeof( *r ) );
-  if ( r ) {
-    fp = fopen( filename, "r" );
-    if ( fp ) {
-      r->private = (void *)fp;
-      r->close = close_none;
-      r->read = read_none;
-    }
-    else {
-      free( r );
-      r = NULL;
+  none_private *p;
+  int fd, direct;
+
+  if ( filename ) {
+    r = malloc( sizeof( *r ) );
+    if ( r ) {
+      fd = open_none_fd( filename, O_RDONLY, 0, &direct );
+      if ( fd != -1 ) {
+	p = alloc_none_private( fd, direct );
+	if ( p ) {
+#ifdef POSIX_FADV_SEQUENTIAL
+	  /* We always read front to back; tell the kernel to read ahead */
+	  posix_fadvise( fd, 0, 0, POSIX_FADV_SEQUENTIAL );
+#endif /* POSIX_FADV_SEQUENTIAL */
+	  r->private = (void *)p;
+	  r->close = close_none_read;
+	  r->read = read_none;
+	  r->peek = NULL;
+	  r->consume = NULL;
+	}
+	else {
+	  close( fd );
+	  free( r );
+	  r = NULL;
+	}
+      }
+      else {
+	free( r );
+	r = NULL;
+      }
     }
   }
+  else r = NULL;
   return r;
 }
 
 write_stream * open_write_stream_none( const char *filename ) {
   write_stream *w;
-  FILE *fp;
-
-  w = malloc( sizeof( *w ) );
-  if ( w ) {
-    fp = fopen( filename, "w" );
-    if ( fp ) {
-      w->private = (void *)fp;
-      w->close = close_none;
-      w->write = write_none;
-    }
-    else {
-      free( w );
-      w = NULL;
+  none_private *p;
+  int fd, direct;
+
+  if ( filename ) {
+    w = malloc( sizeof( *w ) );
+    if ( w ) {
+      fd = open_none_fd( filename, O_WRONLY | O_CREAT | O_TRUNC, 0666,
+			 &direct );
+      if ( fd != -1 ) {
+	p = alloc_none_private( fd, direct );
+	if ( p ) {
+	  w->private = (void *)p;
+	  w->close = close_none_write;
+	  w->write = write_none;
+	}
+	else {
+	  close( fd );
+	  free( w );
+	  w = NULL;
+	}
+      }
+      else {
+	free( w );
+	w = NULL;
+      }
     }
   }
+  else w = NULL;
   return w;
+}
+
+/* read(), but retry on EINTR */
 
+static long read_fd( int fd, void *buf, long len ) {
+  long result;
+
+  do {
+    result = read( fd, buf, len );
+  } while ( result < 0 && errno == EINTR );
+
+  return result;
 }
 
-static long read_none( void *p, void *buf, long len ) {
-  FILE *fp;
-  size_t result;
-
-  fp = (FILE *)p;
-  if ( fp && buf && len > 0 ) {
-    result = fread( buf, 1, len, fp );
-    if ( result < 0 ) return STREAMS_INTERNAL_ERROR;
-    else if ( result < len ) {
-      if ( result > 0 ) return result;
-      else if ( feof( fp ) ) return STREAMS_EOF;
-      else return STREAMS_INTERNAL_ERROR;
+static long read_none( void *vp, void *buf, long len ) {
+  none_private *p;
+  long done, n, result;
+
+  p = (none_private *)vp;
+  if ( p && buf && len > 0 ) {
+    done = 0;
+    /* Fill the whole request unless we hit EOF, like fread() did */
+    while ( done < len && p->error == 0 ) {
+      if ( p->pos < p->len ) {
+	n = p->len - p->pos;
+	if ( n > len - done ) n = len - done;
+	memcpy( (char *)buf + done, p->buf + p->pos, n );
+	p->pos += n;
+	done += n;
+      }
+      else if ( p->eof ) break;
+      else if ( !(p->direct) && len - done >= p->size ) {
+	/* Big enough to skip the buffer */
+	result = read_fd( p->fd, (char *)buf + done, len - done );
+	if ( result > 0 ) done += result;
+	else if ( result == 0 ) p->eof = 1;
+	else p->error = 1;
+      }
+      else {
+	if ( get_none_buf( p ) == 0 ) {
+	  result = read_fd( p->fd, p->buf, p->size );
+	  if ( result > 0 ) {
+	    p->pos = 0;
+	    p->len = result;
+	  }
+	  else if ( result == 0 ) p->eof = 1;
+	  else p->error = 1;
+	}
+	else p->error = 1;
+      }
     }
-    else return result;
+
+    /* Hand back what we got before any error; the next call reports it */
+    if ( done > 0 ) return done;
+    else if ( p->error ) return STREAMS_INTERNAL_ERROR;
+    else return STREAMS_EOF;
   }
   else return STREAMS_BAD_ARGS;
 }
 
-static long write_none( void *p, void *buf, long len ) {
-  FILE *fp;
-  size_t result;
-
-  fp = (FILE *)p;
-  if ( fp && buf && len > 0 ) {
-    result = fwrite( buf, 1, len, fp );
-    if ( result < 0 ) return STREAMS_INTERNAL_ERROR;
-    else if ( result < len ) {
-      if ( result > 0 ) return result;
-      else if ( feof( fp ) ) return STREAMS_EOF;
+/* write() all of buf, retrying on EINTR; 0 on success */
+
+static int write_fd( int fd, void *buf, long len ) {
+  long written, result;
+
+  written = 0;
+  while ( written < len ) {
+    result = write( fd, (char *)buf + written, len - written );
+    if ( result > 0 ) written += result;
+    else if ( !( result < 0 && errno == EINTR ) ) return -1;
+  }
+
+  return 0;
+}
+
+static long write_none( void *vp, void *buf, long len ) {
+  none_private *p;
+  long done, n;
+
+  p = (none_private *)vp;
+  if ( p && buf && len > 0 ) {
+    if ( p->error == 0 ) {
+      done = 0;
+      while ( done < len ) {
+	if ( p->len == 0 && !(p->direct) && len - done >= p->size ) {
+	  /* Big enough to skip the buffer */
+	  if ( write_fd( p->fd, (char *)buf + done, len - done ) == 0 )
+	    done = len;
+	  else p->error = 1;
+	  break;
+	}
+	if ( get_none_buf( p ) != 0 ) {
+	  p->error = 1;
+	  break;
+	}
+	n = p->size - p->len;
+	if ( n > len - done ) n = len - done;
+	memcpy( p->buf + p->len, (char *)buf + done, n );
+	p->len += n;
+	done += n;
+	/* Only whole buffers go out before close, which keeps O_DIRECT happy */
+	if ( p->len == p->size ) {
+	  if ( flush_none( p ) != 0 ) break;
+	}
+      }
+      if ( p->error == 0 ) return done;
       else return STREAMS_INTERNAL_ERROR;
     }
-    else return result;
+    else return STREAMS_INTERNAL_ERROR;
   }
   else return STREAMS_BAD_ARGS;
 }
@@ -0,0 +1,204 @@
+#ifdef USE_PTHREADS
+
+#include <pkg.h>
+
+#include <stdlib.h>
+
+#include <pthread.h>
+
+/*
+ * A small worker pool for the compressing and decompressing streams.
+ * Jobs are opaque pointers; the workers run the pool's work function
+ * on them in whatever order they get to them, but wait_stream_job()
+ * always hands them back in the order they were submitted, so the
+ * caller can write out or read from them sequentially.
+ */
+
+typedef struct stream_pool_job_s {
+  void *job;
+  int done;
+  struct stream_pool_job_s *next;
+} stream_pool_job;
+
+struct stream_pool_s {
+  pthread_mutex_t lock;
+  /* Signalled when a job is submitted or we shut down */
+  pthread_cond_t work_cond;
+  /* Signalled when a job completes */
+  pthread_cond_t done_cond;
+  void (*work)( void * );
+  /* All jobs not yet returned by wait_stream_job(), oldest first */
+  stream_pool_job *head, *tail;
+  /* The oldest job no worker has picked up yet */
+  stream_pool_job *next_unclaimed;
+  int pending;
+  int shutdown;
+  int threads;
+  pthread_t *workers;
+};
+
+static void * stream_pool_worker( void * );
+
+int get_stream_pool_pending( stream_pool *pool ) {
+  int result;
+
+  if ( pool ) {
+    pthread_mutex_lock( &(pool->lock) );
+    result = pool->pending;
+    pthread_mutex_unlock( &(pool->lock) );
+  }
+  else result = 0;
+
+  return result;
+}
+
+stream_pool * start_stream_pool( int threads, void (*work)( void * ) ) {
+  stream_pool *pool;
+  int i;
+
+  if ( threads > 0 && work ) {
+    pool = malloc( sizeof( *pool ) );
+    if ( pool ) {
+      pool->workers = malloc( sizeof( *(pool->workers) ) * threads );
+      if ( pool->workers ) {
+	pool->work = work;
+	pool->head = NULL;
+	pool->tail = NULL;
+	pool->next_unclaimed = NULL;
+	pool->pending = 0;
+	pool->shutdown = 0;
+	pool->threads = 0;
+	pthread_mutex_init( &(pool->lock), NULL );
+	pthread_cond_init( &(pool->work_cond), NULL );
+	pthread_cond_init( &(pool->done_cond), NULL );
+	for ( i = 0; i < threads; ++i ) {
+	  if ( pthread_create( &(pool->workers[i]), NULL,
+			       stream_pool_worker, pool ) == 0 )
+	    ++(pool->threads);
+	  else break;
+	}
+	if ( pool->threads == 0 ) {
+	  /* Couldn't get any threads at all */
+	  pthread_cond_destroy( &(pool->done_cond) );
+	  pthread_cond_destroy( &(pool->work_cond) );
+	  pthread_mutex_destroy( &(pool->lock) );
+	  free( pool->workers );
+	  free( pool );
+	  pool = NULL;
+	}
+      }
+      else {
+	free( pool );
+	pool = NULL;
+      }
+    }
+  }
+  else pool = NULL;
+
+  return pool;
+}
+
+void stop_stream_pool( stream_pool *pool ) {
+  stream_pool_job *j, *next;
+  int i;
+
+  if ( pool ) {
+    pthread_mutex_lock( &(pool->lock) );
+    pool->shutdown = 1;
+    pthread_cond_broadcast( &(pool->work_cond) );
+    pthread_mutex_unlock( &(pool->lock) );
+    for ( i = 0; i < pool->threads; ++i )
+      pthread_join( pool->workers[i], NULL );
+    /*
+     * Anything the caller never collected is its problem; we only
+     * free our own list nodes.
+     */
+    for ( j = pool->head; j; j = next ) {
+      next = j->next;
+      free( j );
+    }
+    pthread_cond_destroy( &(pool->done_cond) );
+    pthread_cond_destroy( &(pool->work_cond) );
+    pthread_mutex_destroy( &(pool->lock) );
+    free( pool->workers );
+    free( pool );
+  }
+}
+
+static void * stream_pool_worker( void *vp ) {
+  stream_pool *pool;
+  stream_pool_job *j;
+
+  pool = (stream_pool *)vp;
+  pthread_mutex_lock( &(pool->lock) );
+  while ( 1 ) {
+    while ( !(pool->next_unclaimed) && !(pool->shutdown) )
+      pthread_cond_wait( &(pool->work_cond), &(pool->lock) );
+    /* Finish any queued work before we honor a shutdown */
+    j = pool->next_unclaimed;
+    if ( !j ) break;
+    pool->next_unclaimed = j->next;
+    pthread_mutex_unlock( &(pool->lock) );
+
+    pool->work( j->job );
+
+    pthread_mutex_lock( &(pool->lock) );
+    j->done = 1;
+    pthread_cond_broadcast( &(pool->done_cond) );
+  }
+  pthread_mutex_unlock( &(pool->lock) );
+
+  return NULL;
+}
+
+int submit_stream_job( stream_pool *pool, void *job ) {
+  stream_pool_job *j;
+  int status;
+
+  status = 0;
+  if ( pool && job ) {
+    j = malloc( sizeof( *j ) );
+    if ( j ) {
+      j->job = job;
+      j->done = 0;
+      j->next = NULL;
+      pthread_mutex_lock( &(pool->lock) );
+      if ( pool->tail ) pool->tail->next = j;
+      else pool->head = j;
+      pool->tail = j;
+      if ( !(pool->next_unclaimed) ) pool->next_unclaimed = j;
+      ++(pool->pending);
+      pthread_cond_signal( &(pool->work_cond) );
+      pthread_mutex_unlock( &(pool->lock) );
+    }
+    else status = -1;
+  }
+  else status = -1;
+
+  return status;
+}
+
+void * wait_stream_job( stream_pool *pool ) {
+  stream_pool_job *j;
+  void *job;
+
+  job = NULL;
+  if ( pool ) {
+    pthread_mutex_lock( &(pool->lock) );
+    j = pool->head;
+    if ( j ) {
+      while ( !(j->done) )
+	pthread_cond_wait( &(pool->done_cond), &(pool->lock) );
+      pool->head = j->next;
+      if ( !(pool->head) ) pool->tail = NULL;
+      --(pool->pending);
+      job = j->job;
+      free( j );
+    }
+    pthread_mutex_unlock( &(pool->lock) );
+  }
+
+  return job;
+}
+
+#endif /* USE_PTHREADS */
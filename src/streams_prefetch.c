@@ -0,0 +1,268 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <pkg.h>
+
+#ifdef USE_PTHREADS
+
+#include <pthread.h>
+
+/*
+ * Read-ahead around another read stream: a worker thread keeps reading
+ * from it into a ring of buffers while we hand out what it's already
+ * read, so whatever is behind the inner stream (inflating, disk reads)
+ * overlaps with whatever our caller does with the data.  Like the
+ * from_stream wrappers, this doesn't close the inner stream; since the
+ * worker may have read past what we handed out, don't read from the
+ * inner stream yourself afterwards.
+ */
+
+#define PREFETCH_SLOTS 4
+
+typedef struct {
+  char *buf;
+  long len;
+  /* Filled by the worker and not yet given back by the reader */
+  int full;
+} prefetch_slot;
+
+typedef struct {
+  read_stream *rs;
+  long size;
+  prefetch_slot slots[PREFETCH_SLOTS];
+  pthread_mutex_t lock;
+  /* Signalled whenever a slot changes hands or we shut down */
+  pthread_cond_t cond;
+  pthread_t worker;
+  /* The slot the worker fills next */
+  int fill;
+  /* The slot the reader is on, and how far into it */
+  int drain;
+  long pos;
+  /*
+   * The reader holds slots[drain] until it needs the next one, so a
+   * pointer from peek() stays good until the next peek() or read().
+   */
+  int holding;
+  /* The worker has stopped; final is STREAMS_EOF or its error */
+  int done;
+  long final;
+  int shutdown;
+} prefetch_private;
+
+static void close_prefetch( void * );
+static long consume_prefetch( void *, long );
+static long peek_prefetch( void *, void **, long );
+static void * prefetch_worker( void * );
+static long read_prefetch( void *, void *, long );
+static long wait_prefetch_slot( prefetch_private * );
+
+static void close_prefetch( void *vp ) {
+  prefetch_private *p;
+  int i;
+
+  p = (prefetch_private *)vp;
+  if ( p ) {
+    pthread_mutex_lock( &(p->lock) );
+    p->shutdown = 1;
+    pthread_cond_broadcast( &(p->cond) );
+    pthread_mutex_unlock( &(p->lock) );
+    pthread_join( p->worker, NULL );
+    pthread_cond_destroy( &(p->cond) );
+    pthread_mutex_destroy( &(p->lock) );
+    for ( i = 0; i < PREFETCH_SLOTS; ++i ) free( p->slots[i].buf );
+    free( p );
+  }
+}
+
+static long consume_prefetch( void *vp, long len ) {
+  prefetch_private *p;
+
+  p = (prefetch_private *)vp;
+  if ( p && len >= 0 ) {
+    if ( len == 0 ) return 0;
+    else if ( p->holding && len <= p->slots[p->drain].len - p->pos ) {
+      p->pos += len;
+      return len;
+    }
+    else return STREAMS_BAD_ARGS;
+  }
+  else return STREAMS_BAD_ARGS;
+}
+
+read_stream * open_read_stream_prefetch( read_stream *rs ) {
+  read_stream *r;
+  prefetch_private *p;
+  int i, status;
+
+  r = NULL;
+  /* --threads 1 asks us not to start any */
+  if ( rs && get_default_threads() > 1 ) {
+    r = malloc( sizeof( *r ) );
+    p = malloc( sizeof( *p ) );
+    if ( r && p ) {
+      p->rs = rs;
+      p->size = get_io_buffer_size();
+      status = 0;
+      for ( i = 0; i < PREFETCH_SLOTS; ++i ) {
+	p->slots[i].buf = malloc( p->size );
+	if ( !(p->slots[i].buf) ) status = -1;
+	p->slots[i].len = 0;
+	p->slots[i].full = 0;
+      }
+      p->fill = 0;
+      p->drain = 0;
+      p->pos = 0;
+      p->holding = 0;
+      p->done = 0;
+      p->final = STREAMS_EOF;
+      p->shutdown = 0;
+      if ( status == 0 ) {
+	pthread_mutex_init( &(p->lock), NULL );
+	pthread_cond_init( &(p->cond), NULL );
+	if ( pthread_create( &(p->worker), NULL, prefetch_worker, p ) == 0 ) {
+	  r->private = (void *)p;
+	  r->close = close_prefetch;
+	  r->read = read_prefetch;
+	  r->peek = peek_prefetch;
+	  r->consume = consume_prefetch;
+	}
+	else {
+	  pthread_cond_destroy( &(p->cond) );
+	  pthread_mutex_destroy( &(p->lock) );
+	  status = -1;
+	}
+      }
+      if ( status != 0 ) {
+	for ( i = 0; i < PREFETCH_SLOTS; ++i ) free( p->slots[i].buf );
+	free( p );
+	free( r );
+	r = NULL;
+      }
+    }
+    else {
+      if ( r ) free( r );
+      if ( p ) free( p );
+      r = NULL;
+    }
+  }
+
+  return r;
+}
+
+static long peek_prefetch( void *vp, void **out, long len ) {
+  prefetch_private *p;
+  long result;
+
+  p = (prefetch_private *)vp;
+  if ( p && out && len > 0 ) {
+    result = wait_prefetch_slot( p );
+    if ( result > 0 ) {
+      if ( len > result ) len = result;
+      *out = p->slots[p->drain].buf + p->pos;
+      return len;
+    }
+    else return result;
+  }
+  else return STREAMS_BAD_ARGS;
+}
+
+static void * prefetch_worker( void *vp ) {
+  prefetch_private *p;
+  prefetch_slot *s;
+  long len;
+
+  p = (prefetch_private *)vp;
+  pthread_mutex_lock( &(p->lock) );
+  while ( !(p->shutdown) ) {
+    s = &(p->slots[p->fill]);
+    if ( s->full ) {
+      pthread_cond_wait( &(p->cond), &(p->lock) );
+      continue;
+    }
+    /* Nobody else touches a slot that isn't full */
+    pthread_mutex_unlock( &(p->lock) );
+    len = read_from_stream( p->rs, s->buf, p->size );
+    pthread_mutex_lock( &(p->lock) );
+    if ( len > 0 ) {
+      s->len = len;
+      s->full = 1;
+      p->fill = ( p->fill + 1 ) % PREFETCH_SLOTS;
+    }
+    else {
+      p->final = len;
+      p->done = 1;
+    }
+    pthread_cond_broadcast( &(p->cond) );
+    if ( p->done ) break;
+  }
+  pthread_mutex_unlock( &(p->lock) );
+
+  return NULL;
+}
+
+static long read_prefetch( void *vp, void *buf, long len ) {
+  prefetch_private *p;
+  long done, n;
+
+  p = (prefetch_private *)vp;
+  if ( p && buf && len > 0 ) {
+    done = 0;
+    n = 0;
+    while ( done < len ) {
+      n = wait_prefetch_slot( p );
+      if ( n <= 0 ) break;
+      if ( n > len - done ) n = len - done;
+      memcpy( (char *)buf + done, p->slots[p->drain].buf + p->pos, n );
+      p->pos += n;
+      done += n;
+    }
+
+    /* Like the other streams, report errors only once we run dry */
+    if ( done > 0 ) return done;
+    else return n;
+  }
+  else return STREAMS_BAD_ARGS;
+}
+
+/*
+ * Make sure we're holding a slot with something left in it, giving
+ * back the one we're done with; return how much is left, or
+ * STREAMS_EOF or the worker's error once everything's handed out.
+ */
+
+static long wait_prefetch_slot( prefetch_private *p ) {
+  long result;
+
+  if ( p->holding && p->pos < p->slots[p->drain].len )
+    return p->slots[p->drain].len - p->pos;
+
+  pthread_mutex_lock( &(p->lock) );
+  if ( p->holding ) {
+    p->slots[p->drain].full = 0;
+    p->drain = ( p->drain + 1 ) % PREFETCH_SLOTS;
+    p->pos = 0;
+    p->holding = 0;
+    pthread_cond_broadcast( &(p->cond) );
+  }
+  /* The worker fills slots in order, so check full before done */
+  while ( !(p->slots[p->drain].full) && !(p->done) )
+    pthread_cond_wait( &(p->cond), &(p->lock) );
+  if ( p->slots[p->drain].full ) {
+    p->holding = 1;
+    result = p->slots[p->drain].len;
+  }
+  else result = p->final;
+  pthread_mutex_unlock( &(p->lock) );
+
+  return result;
+}
+
+#else /* USE_PTHREADS */
+
+read_stream * open_read_stream_prefetch( read_stream *rs ) {
+  /* No threads, no read-ahead; callers use rs directly */
+  return NULL;
+}
+
+#endif /* USE_PTHREADS */
@@ -0,0 +1,176 @@
+#include <stdlib.h>
+
+#include <pkg.h>
+
+/*
+ * Tee streams: a write stream that writes everything to two others,
+ * and a read stream that copies everything read through it into a
+ * write stream, such as an MD5 writer, so data gets hashed in the same
+ * pass that moves it.  Neither closes the streams it was given.
+ */
+
+typedef struct {
+  write_stream *a, *b;
+} tee_write_private;
+
+typedef struct {
+  read_stream *rs;
+  write_stream *ws;
+  /* From the last peek, so consume() knows what to copy out */
+  void *peeked;
+  long peeked_len;
+  int error;
+} tee_read_private;
+
+static void close_tee_read( void * );
+static void close_tee_write( void * );
+static long consume_tee( void *, long );
+static long peek_tee( void *, void **, long );
+static long read_tee( void *, void *, long );
+static long write_tee( void *, void *, long );
+
+static void close_tee_read( void *vp ) {
+  if ( vp ) free( vp );
+}
+
+static void close_tee_write( void *vp ) {
+  if ( vp ) free( vp );
+}
+
+static long consume_tee( void *vp, long len ) {
+  tee_read_private *p;
+  long result;
+
+  p = (tee_read_private *)vp;
+  if ( p && len >= 0 && len <= p->peeked_len ) {
+    if ( p->error ) return STREAMS_INTERNAL_ERROR;
+    result = consume_stream( p->rs, len );
+    if ( result == len && len > 0 ) {
+      if ( write_to_stream( p->ws, p->peeked, len ) != len ) {
+	p->error = 1;
+	result = STREAMS_INTERNAL_ERROR;
+      }
+      else {
+	p->peeked = (char *)(p->peeked) + len;
+	p->peeked_len -= len;
+      }
+    }
+    return result;
+  }
+  else return STREAMS_BAD_ARGS;
+}
+
+read_stream * open_tee_read_stream( read_stream *rs, write_stream *ws ) {
+  read_stream *r;
+  tee_read_private *p;
+
+  r = NULL;
+  if ( rs && ws ) {
+    r = malloc( sizeof( *r ) );
+    if ( r ) {
+      p = malloc( sizeof( *p ) );
+      if ( p ) {
+	p->rs = rs;
+	p->ws = ws;
+	p->peeked = NULL;
+	p->peeked_len = 0;
+	p->error = 0;
+	r->private = (void *)p;
+	r->close = close_tee_read;
+	r->read = read_tee;
+	if ( can_peek_stream( rs ) ) {
+	  r->peek = peek_tee;
+	  r->consume = consume_tee;
+	}
+	else {
+	  r->peek = NULL;
+	  r->consume = NULL;
+	}
+      }
+      else {
+	free( r );
+	r = NULL;
+      }
+    }
+  }
+
+  return r;
+}
+
+write_stream * open_tee_write_stream( write_stream *a, write_stream *b ) {
+  write_stream *w;
+  tee_write_private *p;
+
+  w = NULL;
+  if ( a && b ) {
+    w = malloc( sizeof( *w ) );
+    if ( w ) {
+      p = malloc( sizeof( *p ) );
+      if ( p ) {
+	p->a = a;
+	p->b = b;
+	w->private = (void *)p;
+	w->close = close_tee_write;
+	w->write = write_tee;
+      }
+      else {
+	free( w );
+	w = NULL;
+      }
+    }
+  }
+
+  return w;
+}
+
+static long peek_tee( void *vp, void **out, long len ) {
+  tee_read_private *p;
+  long result;
+
+  p = (tee_read_private *)vp;
+  if ( p && out ) {
+    if ( p->error ) return STREAMS_INTERNAL_ERROR;
+    result = peek_stream( p->rs, out, len );
+    if ( result > 0 ) {
+      p->peeked = *out;
+      p->peeked_len = result;
+    }
+    else p->peeked_len = 0;
+    return result;
+  }
+  else return STREAMS_BAD_ARGS;
+}
+
+static long read_tee( void *vp, void *buf, long len ) {
+  tee_read_private *p;
+  long result;
+
+  p = (tee_read_private *)vp;
+  if ( p ) {
+    if ( p->error ) return STREAMS_INTERNAL_ERROR;
+    p->peeked_len = 0;
+    result = read_from_stream( p->rs, buf, len );
+    if ( result > 0 ) {
+      if ( write_to_stream( p->ws, buf, result ) != result ) {
+	p->error = 1;
+	result = STREAMS_INTERNAL_ERROR;
+      }
+    }
+    return result;
+  }
+  else return STREAMS_BAD_ARGS;
+}
+
+static long write_tee( void *vp, void *buf, long len ) {
+  tee_write_private *p;
+  long result;
+
+  p = (tee_write_private *)vp;
+  if ( p ) {
+    result = write_to_stream( p->a, buf, len );
+    if ( result == len ) result = write_to_stream( p->b, buf, len );
+    else if ( result >= 0 ) result = STREAMS_INTERNAL_ERROR;
+    return result;
+  }
+  else return STREAMS_BAD_ARGS;
+}
@@ -0,0 +1,455 @@
+#ifdef COMPRESSION_ZSTD
+
+#include <pkg.h>
+
+#include <stdlib.h>
+
+#include <zstd.h>
+
+/* zstd works in bigger pieces than zlib or libbz2 */
+#define CHUNK_SIZE 131072
+#define ZSTD_LEVEL 19
+
+static void close_zstd_read( void * );
+static void close_zstd_write( void * );
+static long read_zstd( void *, void *, long );
+static long write_zstd( void *, void *, long );
+
+typedef struct {
+  union {
+    FILE *fp;
+    union {
+      read_stream *rs;
+      write_stream *ws;
+    } streams;
+  } u;
+  union {
+    ZSTD_DStream *d;
+    ZSTD_CStream *c;
+  } strm;
+  /* Input buffer when reading, output buffer when writing */
+  ZSTD_inBuffer in;
+  ZSTD_outBuffer out;
+  void *buf;
+  /* Last return from ZSTD_decompressStream(); 0 at end of frame */
+  size_t last;
+  int eof;
+  int error;
+  int use_stream;
+} zstd_private;
+
+static void close_zstd_read( void *vp ) {
+  zstd_private *p;
+
+  p = (zstd_private *)vp;
+  if ( p ) {
+    ZSTD_freeDStream( p->strm.d );
+    if ( p->buf ) free( p->buf );
+    if ( !(p->use_stream) ) {
+      if ( p->u.fp ) fclose( p->u.fp );
+    }
+    free( p );
+  }
+}
+
+static void close_zstd_write( void *vp ) {
+  zstd_private *p;
+  size_t result, remaining;
+
+  p = (zstd_private *)vp;
+  if ( p ) {
+    if ( p->error == 0 && p->buf &&
+	 ( ( p->use_stream && p->u.streams.ws ) ||
+	   ( !(p->use_stream) && p->u.fp ) ) ) {
+      do {
+	remaining = ZSTD_endStream( p->strm.c, &(p->out) );
+	if ( ZSTD_isError( remaining ) ) {
+	  p->error = 1;
+	  break;
+	}
+	if ( p->out.pos > 0 ) {
+	  if ( p->use_stream )
+	    result = write_to_stream( p->u.streams.ws, p->buf, p->out.pos );
+	  else
+	    result = fwrite( p->buf, 1, p->out.pos, p->u.fp );
+	  if ( result == p->out.pos ) p->out.pos = 0;
+	  else {
+	    /* We couldn't write all the output we had */
+	    p->error = 1;
+	    break;
+	  }
+	}
+      } while ( remaining > 0 );
+    }
+    ZSTD_freeCStream( p->strm.c );
+    if ( p->buf ) free( p->buf );
+    if ( !(p->use_stream) ) {
+      if ( p->u.fp ) fclose( p->u.fp );
+    }
+    free( p );
+  }
+}
+
+read_stream * open_read_stream_from_stream_zstd( read_stream *rs ) {
+  read_stream *r;
+  zstd_private *p;
+  size_t status;
+
+  if ( rs ) {
+    r = malloc( sizeof( *r ) );
+    if ( r ) {
+      p = malloc( sizeof( *p ) );
+      if ( p ) {
+	r->private = (void *)p;
+	p->error = 0;
+	p->eof = 0;
+	p->last = 0;
+	p->buf = malloc( CHUNK_SIZE );
+	if ( p->buf ) {
+	  p->in.src = p->buf;
+	  p->in.size = 0;
+	  p->in.pos = 0;
+	  p->strm.d = ZSTD_createDStream();
+	  if ( p->strm.d ) {
+	    status = ZSTD_initDStream( p->strm.d );
+	    if ( !ZSTD_isError( status ) ) {
+	      p->use_stream = 1;
+	      p->u.streams.rs = rs;
+	      r->close = close_zstd_read;
+	      r->read = read_zstd;
+	      r->peek = NULL;
+	      r->consume = NULL;
+	    }
+	    else {
+	      ZSTD_freeDStream( p->strm.d );
+	      free( p->buf );
+	      free( p );
+	      free( r );
+	      r = NULL;
+	    }
+	  }
+	  else {
+	    free( p->buf );
+	    free( p );
+	    free( r );
+	    r = NULL;
+	  }
+	}
+	else {
+	  free( p );
+	  free( r );
+	  r = NULL;
+	}
+      }
+      else {
+	free( r );
+	r = NULL;
+      }
+    }
+  }
+  else r = NULL;
+  return r;
+}
+
+read_stream * open_read_stream_zstd( const char *filename ) {
+  read_stream *r;
+  zstd_private *p;
+  size_t status;
+
+  if ( filename ) {
+    r = malloc( sizeof( *r ) );
+    if ( r ) {
+      p = malloc( sizeof( *p ) );
+      if ( p ) {
+	r->private = (void *)p;
+	p->error = 0;
+	p->eof = 0;
+	p->last = 0;
+	p->buf = malloc( CHUNK_SIZE );
+	if ( p->buf ) {
+	  p->in.src = p->buf;
+	  p->in.size = 0;
+	  p->in.pos = 0;
+	  p->strm.d = ZSTD_createDStream();
+	  if ( p->strm.d ) {
+	    status = ZSTD_initDStream( p->strm.d );
+	    if ( !ZSTD_isError( status ) ) {
+	      p->use_stream = 0;
+	      p->u.fp = fopen( filename, "r" );
+	      if ( p->u.fp ) {
+		r->close = close_zstd_read;
+		r->read = read_zstd;
+		r->peek = NULL;
+		r->consume = NULL;
+	      }
+	      else {
+		ZSTD_freeDStream( p->strm.d );
+		free( p->buf );
+		free( p );
+		free( r );
+		r = NULL;
+	      }
+	    }
+	    else {
+	      ZSTD_freeDStream( p->strm.d );
+	      free( p->buf );
+	      free( p );
+	      free( r );
+	      r = NULL;
+	    }
+	  }
+	  else {
+	    free( p->buf );
+	    free( p );
+	    free( r );
+	    r = NULL;
+	  }
+	}
+	else {
+	  free( p );
+	  free( r );
+	  r = NULL;
+	}
+      }
+      else {
+	free( r );
+	r = NULL;
+      }
+    }
+  }
+  else r = NULL;
+  return r;
+}
+
+write_stream * open_write_stream_from_stream_zstd( write_stream *ws ) {
+  write_stream *w;
+  zstd_private *p;
+  size_t status;
+
+  if ( ws ) {
+    w = malloc( sizeof( *w ) );
+    if ( w ) {
+      p = malloc( sizeof( *p ) );
+      if ( p ) {
+	w->private = (void *)p;
+	p->error = 0;
+	p->buf = malloc( CHUNK_SIZE );
+	if ( p->buf ) {
+	  p->out.dst = p->buf;
+	  p->out.size = CHUNK_SIZE;
+	  p->out.pos = 0;
+	  p->strm.c = ZSTD_createCStream();
+	  if ( p->strm.c ) {
+	    status = ZSTD_initCStream( p->strm.c, ZSTD_LEVEL );
+	    if ( !ZSTD_isError( status ) ) {
+	      p->use_stream = 1;
+	      p->u.streams.ws = ws;
+	      w->close = close_zstd_write;
+	      w->write = write_zstd;
+	    }
+	    else {
+	      ZSTD_freeCStream( p->strm.c );
+	      free( p->buf );
+	      free( p );
+	      free( w );
+	      w = NULL;
+	    }
+	  }
+	  else {
+	    free( p->buf );
+	    free( p );
+	    free( w );
+	    w = NULL;
+	  }
+	}
+	else {
+	  free( p );
+	  free( w );
+	  w = NULL;
+	}
+      }
+      else {
+	free( w );
+	w = NULL;
+      }
+    }
+  }
+  else w = NULL;
+  return w;
+}
+
+write_stream * open_write_stream_zstd( const char *filename ) {
+  write_stream *w;
+  zstd_private *p;
+  size_t status;
+
+  if ( filename ) {
+    w = malloc( sizeof( *w ) );
+    if ( w ) {
+      p = malloc( sizeof( *p ) );
+      if ( p ) {
+	w->private = (void *)p;
+	p->error = 0;
+	p->buf = malloc( CHUNK_SIZE );
+	if ( p->buf ) {
+	  p->out.dst = p->buf;
+	  p->out.size = CHUNK_SIZE;
+	  p->out.pos = 0;
+	  p->strm.c = ZSTD_createCStream();
+	  if ( p->strm.c ) {
+	    status = ZSTD_initCStream( p->strm.c, ZSTD_LEVEL );
+	    if ( !ZSTD_isError( status ) ) {
+	      p->use_stream = 0;
+	      p->u.fp = fopen( filename, "w" );
+	      if ( p->u.fp ) {
+		w->close = close_zstd_write;
+		w->write = write_zstd;
+	      }
+	      else {
+		ZSTD_freeCStream( p->strm.c );
+		free( p->buf );
+		free( p );
+		free( w );
+		w = NULL;
+	      }
+	    }
+	    else {
+	      ZSTD_freeCStream( p->strm.c );
+	      free( p->buf );
+	      free( p );
+	      free( w );
+	      w = NULL;
+	    }
+	  }
+	  else {
+	    free( p->buf );
+	    free( p );
+	    free( w );
+	    w = NULL;
+	  }
+	}
+	else {
+	  free( p );
+	  free( w );
+	  w = NULL;
+	}
+      }
+      else {
+	free( w );
+	w = NULL;
+      }
+    }
+  }
+  else w = NULL;
+  return w;
+}
+
+static long read_zstd( void *vp, void *buf, long len ) {
+  zstd_private *p;
+  ZSTD_outBuffer out;
+  size_t result, before;
+  long status;
+
+  p = (zstd_private *)vp;
+  if ( p && buf && len > 0 ) {
+    if ( p->error == 0 ) {
+      status = 0;
+      out.dst = buf;
+      out.size = len;
+      out.pos = 0;
+      while ( out.pos < out.size ) {
+	if ( p->in.pos == p->in.size && !(p->eof) ) {
+	  if ( p->use_stream ) {
+	    result = read_from_stream( p->u.streams.rs, p->buf, CHUNK_SIZE );
+	    if ( (long)result < 0 ) {
+	      status = STREAMS_INTERNAL_ERROR;
+	      break;
+	    }
+	  }
+	  else {
+	    result = fread( p->buf, 1, CHUNK_SIZE, p->u.fp );
+	    if ( result == 0 && ferror( p->u.fp ) ) {
+	      status = STREAMS_INTERNAL_ERROR;
+	      break;
+	    }
+	  }
+	  if ( result > 0 ) {
+	    p->in.size = result;
+	    p->in.pos = 0;
+	  }
+	  else p->eof = 1;
+	}
+
+	/*
+	 * Call this even at EOF, since the decoder may be holding
+	 * output back for lack of room last time around.
+	 */
+	before = out.pos;
+	p->last = ZSTD_decompressStream( p->strm.d, &out, &(p->in) );
+	if ( ZSTD_isError( p->last ) ) {
+	  p->error = 1;
+	  status = STREAMS_INTERNAL_ERROR;
+	  break;
+	}
+
+	if ( p->eof && p->in.pos == p->in.size && out.pos == before ) {
+	  /* No more input and nothing left to flush; was it truncated? */
+	  if ( p->last != 0 ) {
+	    p->error = 1;
+	    status = STREAMS_INTERNAL_ERROR;
+	  }
+	  break;
+	}
+      }
+      if ( status >= 0 ) status = out.pos;
+      return status;
+    }
+    else return STREAMS_INTERNAL_ERROR;
+  }
+  else return STREAMS_BAD_ARGS;
+}
+
+static long write_zstd( void *vp, void *buf, long len ) {
+  zstd_private *p;
+  ZSTD_inBuffer in;
+  size_t result, z_status;
+  long status;
+
+  p = (zstd_private *)vp;
+  if ( p && buf && len > 0 ) {
+    if ( p->error == 0 ) {
+      status = 0;
+      in.src = buf;
+      in.size = len;
+      in.pos = 0;
+      while ( in.pos < in.size ) {
+	if ( p->out.pos == p->out.size ) {
+	  if ( p->use_stream )
+	    result = write_to_stream( p->u.streams.ws, p->buf, CHUNK_SIZE );
+	  else
+	    result = fwrite( p->buf, 1, CHUNK_SIZE, p->u.fp );
+	  if ( result == CHUNK_SIZE ) p->out.pos = 0;
+	  else {
+	    /* We couldn't write all the output we had */
+	    status = STREAMS_INTERNAL_ERROR;
+	    p->error = 1;
+	    break;
+	  }
+	}
+	/* We only flush the frame in close */
+	z_status = ZSTD_compressStream( p->strm.c, &(p->out), &in );
+	if ( ZSTD_isError( z_status ) ) {
+	  p->error = 1;
+	  status = STREAMS_INTERNAL_ERROR;
+	  break;
+	}
+      }
+      if ( status >= 0 ) status = in.pos;
+      return status;
+    }
+    else return STREAMS_INTERNAL_ERROR;
+  }
+  else return STREAMS_BAD_ARGS;
+}
+
+#endif /* COMPRESSION_ZSTD */
@@ -7,6 +7,9 @@
 
 #include <pkg.h>
 
+/* The most we ask to peek at once while skipping a member */
+#define SKIP_CHUNK ( 1L << 30 )
+
 static int emit_tar_header( write_stream *, tar_file_info *,
 			    unsigned long long );
 
@@ -26,9 +29,13 @@ static void prepare_for_file_read( tar_reader *, void * );
  */
 
 static int read_tar_block( tar_reader *, void * );
+static int read_tar_bytes( tar_reader *, void *, long );
+static int skip_tar_blocks( tar_reader *, unsigned long long );
 
 static void tar_close_read_stream( void * );
 static void tar_close_write_stream( void * );
+static long tar_consume_from_stream( void *, long );
+static long tar_peek_from_stream( void *, void **, long );
 static long tar_read_from_stream( void *, void *, long );
 static long tar_write_to_stream( void *, void *, long );
 
@@ -213,14 +220,20 @@ int get_next_file( tar_reader *tr ) {
     if ( tr->state == TAR_READY || tr->state == TAR_IN_FILE ) {
       if ( tr->state == TAR_IN_FILE ) {
         status = TAR_SUCCESS;
+	if ( tr->u.in_file.partial ) {
+	  status = read_tar_bytes( tr, buf, tr->u.in_file.blocks_seen *
+				   TAR_BLOCK_SIZE - tr->u.in_file.bytes_seen );
+	  tr->u.in_file.partial = 0;
+	}
 	blocks_total = tr->u.in_file.bytes_total / TAR_BLOCK_SIZE;
 	if ( tr->u.in_file.bytes_total % TAR_BLOCK_SIZE > 0 )
 	  ++blocks_total;
-	while ( tr->u.in_file.blocks_seen < blocks_total ) {
-	  status = read_tar_block( tr, buf );
+	if ( status == TAR_SUCCESS &&
+	     tr->u.in_file.blocks_seen < blocks_total ) {
+	  status = skip_tar_blocks( tr, blocks_total -
+				    tr->u.in_file.blocks_seen );
 	  if ( status == TAR_SUCCESS )
-	    ++(tr->u.in_file.blocks_seen);
-	  else break;
+	    tr->u.in_file.blocks_seen = blocks_total;
 	}
 	if ( tr->u.in_file.f ) {
 	  free( tr->u.in_file.f );
@@ -290,6 +303,15 @@ read_stream * get_reader_for_file( tar_reader *tr ) {
 	  rs->private = trs;
 	  rs->read = tar_read_from_stream;
 	  rs->close = tar_close_read_stream;
+	  /* We can only lend out what the stream under us lends us */
+	  if ( can_peek_stream( tr->rs ) ) {
+	    rs->peek = tar_peek_from_stream;
+	    rs->consume = tar_consume_from_stream;
+	  }
+	  else {
+	    rs->peek = NULL;
+	    rs->consume = NULL;
+	  }
 	}
 	else {
 	  free( rs );
@@ -520,6 +542,7 @@ static void prepare_for_file_read( tar_reader *tr, void *buf ) {
 
       tr->u.in_file.blocks_seen = 0;
       tr->u.in_file.bytes_seen = 0;
+      tr->u.in_file.partial = 0;
     }
   }
 }
@@ -568,20 +591,70 @@ write_stream * put_next_file( tar_writer *tw, tar_file_info *info ) {
   else return NULL;
 }
 
+/*
+ * Like put_next_file(), but the caller promises exactly size bytes of
+ * content.  The header goes out right away and the content passes
+ * straight through to the underlying stream, so there's no spool.
+ * Writing more than size bytes is an error; if fewer are written, the
+ * member is zero-filled to size on close.
+ */
+
+write_stream * put_next_file_sized( tar_writer *tw, tar_file_info *info,
+				    unsigned long long size ) {
+  write_stream *ws;
+  int status;
+
+  if ( tw && info ) {
+    if ( tw->state == TAR_READY ) {
+      ws = malloc( sizeof( *ws ) );
+      if ( ws ) {
+	status = emit_tar_header( tw->ws, info, size );
+	if ( status == TAR_SUCCESS ) {
+	  ++(tw->blocks_out);
+	  ws->private = tw;
+	  ws->close = tar_close_write_stream;
+	  ws->write = tar_write_to_stream;
+	  tw->u.in_file.f = info;
+	  tw->u.in_file.bytes_seen = 0;
+	  tw->u.in_file.bytes_total = size;
+	  tw->u.in_file.tmp = -1;
+	  tw->u.in_file.tmp_name = NULL;
+	  tw->state = TAR_IN_FILE;
+	  ++(tw->files_out);
+	  return ws;
+	}
+	else {
+	  free( ws );
+	  return NULL;
+	}
+      }
+      else return NULL;
+    }
+    else return NULL;
+  }
+  else return NULL;
+}
+
 static int read_tar_block( tar_reader *tr, void *buf ) {
-  int status, result;
+  return read_tar_bytes( tr, buf, TAR_BLOCK_SIZE );
+}
+
+/* Read exactly size bytes, or return TAR_NO_MORE_FILES */
+
+static int read_tar_bytes( tar_reader *tr, void *buf, long size ) {
+  int result;
   long len, read;
 
   result = TAR_SUCCESS;
   if ( tr && buf ) {
     if ( tr->rs ) {
       read = 0;
-      while ( read < TAR_BLOCK_SIZE ) {
-	len = read_from_stream( tr->rs, buf + read, TAR_BLOCK_SIZE - read );
+      while ( read < size ) {
+	len = read_from_stream( tr->rs, buf + read, size - read );
 	if ( len > 0 ) read += len;
 	else break;
       }
-      if ( read < TAR_BLOCK_SIZE ) result = TAR_NO_MORE_FILES;
+      if ( read < size ) result = TAR_NO_MORE_FILES;
     }
     else result = TAR_INTERNAL_ERROR;
   }
@@ -589,6 +662,42 @@ static int read_tar_block( tar_reader *tr, void *buf ) {
   return result;
 }
 
+/*
+ * Step over blocks we don't want; if the stream can lend them to us,
+ * there's no need to copy them anywhere first.
+ */
+
+static int skip_tar_blocks( tar_reader *tr, unsigned long long blocks ) {
+  char buf[TAR_BLOCK_SIZE];
+  unsigned long long bytes;
+  void *p;
+  long len;
+  int result;
+
+  result = TAR_SUCCESS;
+  if ( can_peek_stream( tr->rs ) ) {
+    bytes = blocks * TAR_BLOCK_SIZE;
+    while ( bytes > 0 ) {
+      len = ( bytes > SKIP_CHUNK ) ? SKIP_CHUNK : (long)bytes;
+      len = peek_stream( tr->rs, &p, len );
+      if ( len > 0 && consume_stream( tr->rs, len ) == len ) bytes -= len;
+      else {
+	result = TAR_NO_MORE_FILES;
+	break;
+      }
+    }
+  }
+  else {
+    while ( blocks > 0 ) {
+      result = read_tar_block( tr, buf );
+      if ( result == TAR_SUCCESS ) --blocks;
+      else break;
+    }
+  }
+
+  return result;
+}
+
 tar_reader * start_tar_reader( read_stream *rs ) {
   tar_reader *tr;
 
@@ -619,6 +728,7 @@ tar_writer * start_tar_writer( write_stream *ws ) {
       tw->u.in_file.tmp_name = NULL;
       tw->u.in_file.tmp = -1;
       tw->u.in_file.bytes_seen = 0;
+      tw->u.in_file.bytes_total = 0;
       tw->ws = ws;
       return tw;
     }
@@ -631,6 +741,51 @@ static void tar_close_read_stream( void *v ) {
   if ( v ) free( v );
 }
 
+/*
+ * If we're on a block boundary, the last peek came straight from the
+ * stream under us, so consume it there; if that leaves us partway into
+ * a block, the rest of it gets pulled into curr_block on the next
+ * peek, not now, so the peeked pointer stays good.  Otherwise the last
+ * peek came from curr_block.
+ */
+
+static long tar_consume_from_stream( void *v, long size ) {
+  tar_read_stream *trs;
+  tar_reader *tr;
+  unsigned long long left_in_block;
+
+  if ( v && size >= 0 ) {
+    trs = (tar_read_stream *)v;
+    tr = trs->tr;
+    if ( tr && tr->files_seen == trs->filenum &&
+	 tr->state == TAR_IN_FILE ) {
+      if ( size > tr->u.in_file.bytes_total - tr->u.in_file.bytes_seen )
+	return STREAMS_BAD_ARGS;
+      left_in_block = tr->u.in_file.blocks_seen * TAR_BLOCK_SIZE -
+	tr->u.in_file.bytes_seen;
+      if ( left_in_block == 0 ) {
+	if ( size > 0 && consume_stream( tr->rs, size ) != size )
+	  return STREAMS_INTERNAL_ERROR;
+	tr->u.in_file.bytes_seen += size;
+	tr->u.in_file.blocks_seen += size / TAR_BLOCK_SIZE;
+	tr->blocks_seen += size / TAR_BLOCK_SIZE;
+	if ( size % TAR_BLOCK_SIZE > 0 ) {
+	  ++(tr->u.in_file.blocks_seen);
+	  ++(tr->blocks_seen);
+	  tr->u.in_file.partial = 1;
+	}
+      }
+      else {
+	if ( size > left_in_block ) return STREAMS_BAD_ARGS;
+	tr->u.in_file.bytes_seen += size;
+      }
+      return size;
+    }
+    else return STREAMS_BAD_STREAM;
+  }
+  else return STREAMS_BAD_ARGS;
+}
+
 static void tar_close_write_stream( void *v ) {
   tar_writer *tw;
   int status;
@@ -685,18 +840,122 @@ static void tar_close_write_stream( void *v ) {
 	tw->state = TAR_READY;
       }
     }
+    else if ( tw->state == TAR_IN_FILE ) {
+      /*
+       * This came from put_next_file_sized(), so the header and data
+       * are already out; zero-fill any shortfall and the rest of the
+       * last block.
+       */
+      memset( buf, 0, TAR_BLOCK_SIZE );
+      so_far = tw->u.in_file.bytes_seen;
+      while ( so_far < tw->u.in_file.bytes_total ) {
+	this_time = tw->u.in_file.bytes_total - so_far;
+	if ( this_time > TAR_BLOCK_SIZE ) this_time = TAR_BLOCK_SIZE;
+	r = write_to_stream( tw->ws, buf, (long)this_time );
+	if ( r != this_time ) break;
+	so_far += this_time;
+      }
+      block_so_far = so_far % TAR_BLOCK_SIZE;
+      if ( block_so_far > 0 )
+	write_to_stream( tw->ws, buf, TAR_BLOCK_SIZE - block_so_far );
+      tw->blocks_out += ( so_far + TAR_BLOCK_SIZE - 1 ) / TAR_BLOCK_SIZE;
+      tw->state = TAR_READY;
+    }
   }
 }
 
+/*
+ * Lend out the file contents straight from the stream under us when
+ * we're on a block boundary, and from curr_block otherwise.  Only
+ * called if the stream under us can peek.
+ */
+
+static long tar_peek_from_stream( void *v, void **out, long size ) {
+  tar_read_stream *trs;
+  tar_reader *tr;
+  unsigned long long left_in_file, left_in_block;
+  long len;
+  void *p;
+  int status;
+
+  if ( v && out && size > 0 ) {
+    trs = (tar_read_stream *)v;
+    tr = trs->tr;
+    if ( tr && tr->files_seen == trs->filenum ) {
+      if ( tr->state == TAR_IN_FILE ) {
+	left_in_file = tr->u.in_file.bytes_total - tr->u.in_file.bytes_seen;
+	if ( left_in_file == 0 ) return STREAMS_EOF;
+	if ( size > left_in_file ) size = (long)left_in_file;
+
+	left_in_block = tr->u.in_file.blocks_seen * TAR_BLOCK_SIZE -
+	  tr->u.in_file.bytes_seen;
+	if ( left_in_block == 0 ) {
+	  len = peek_stream( tr->rs, &p, size );
+	  /*
+	   * Lend whole blocks, or everything that's left of the file;
+	   * if the stream under us can't give us that much, fall back
+	   * to reading a block into curr_block.
+	   */
+	  if ( len > 0 && len < size ) len -= len % TAR_BLOCK_SIZE;
+	  if ( len > 0 ) {
+	    *out = p;
+	    return len;
+	  }
+
+	  status = read_tar_block( tr, tr->u.in_file.curr_block );
+	  if ( status == TAR_SUCCESS ) {
+	    ++(tr->blocks_seen);
+	    ++(tr->u.in_file.blocks_seen);
+	    left_in_block = TAR_BLOCK_SIZE;
+	  }
+	  else return STREAMS_EOF;
+	}
+	else if ( tr->u.in_file.partial ) {
+	  /* Pull in the rest of the block the last consume() left us in */
+	  status = read_tar_bytes( tr, tr->u.in_file.curr_block +
+				   ( TAR_BLOCK_SIZE - left_in_block ),
+				   (long)left_in_block );
+	  if ( status == TAR_SUCCESS ) tr->u.in_file.partial = 0;
+	  else return STREAMS_EOF;
+	}
+
+	if ( size > left_in_block ) size = (long)left_in_block;
+	*out = tr->u.in_file.curr_block + ( TAR_BLOCK_SIZE - left_in_block );
+	return size;
+      }
+      else return STREAMS_EOF;
+    }
+    else return STREAMS_BAD_STREAM;
+  }
+  else return STREAMS_BAD_ARGS;
+}
+
 static long tar_read_from_stream( void *v, void *buf, long size ) {
   tar_read_stream *trs;
   long max_read, read, this_read;
   unsigned long long left_in_block, ofs;
   int status;
+  void *src;
 
   if ( v && buf && size > 0 ) {
     trs = (tar_read_stream *)v;
-    if ( trs->tr ) {
+    if ( trs->tr && can_peek_stream( trs->tr->rs ) ) {
+      /* Copy straight from underneath, skipping curr_block */
+      read = 0;
+      while ( read < size ) {
+	this_read = tar_peek_from_stream( v, &src, size - read );
+	if ( this_read <= 0 ) break;
+	memcpy( buf + read, src, this_read );
+	if ( tar_consume_from_stream( v, this_read ) != this_read ) {
+	  this_read = STREAMS_INTERNAL_ERROR;
+	  break;
+	}
+	read += this_read;
+      }
+      if ( read > 0 ) return read;
+      else return this_read;
+    }
+    else if ( trs->tr ) {
       if ( trs->tr->files_seen == trs->filenum ) {
 	if ( trs->tr->state == TAR_IN_FILE ) {
 	  max_read = trs->tr->u.in_file.bytes_total -
@@ -763,7 +1022,18 @@ static long tar_write_to_stream( void *v, void *buf, long size ) {
 	if ( total > 0 ) return total;
 	else return STREAMS_INTERNAL_ERROR;
       }
-      else return STREAMS_BAD_STREAM;
+      else {
+	/* Sized member, pass it through unless it's too long */
+	if ( (unsigned long long)size >
+	     tw->u.in_file.bytes_total - tw->u.in_file.bytes_seen )
+	  return STREAMS_INTERNAL_ERROR;
+	written = write_to_stream( tw->ws, buf, size );
+	if ( written > 0 ) {
+	  tw->u.in_file.bytes_seen += written;
+	  return written;
+	}
+	else return STREAMS_INTERNAL_ERROR;
+      }
     }
     else return STREAMS_BAD_STREAM;
   }
@@ -15,11 +15,12 @@ typedef struct {
 } pkg_handle_builder;
 
 static pkg_handle_builder * alloc_pkg_handle_builder( void );
+static pkg_stream * alloc_pkg_stream( void );
 static int check_cksums( pkg_handle_builder * );
 static void * cksum_copier( void * );
 static void cksum_free( void * );
 static void cleanup_pkg_handle_builder( pkg_handle_builder * );
-static int handle_descr( pkg_handle_builder *, read_stream * );
+static int handle_descr( pkg_handle *, read_stream * );
 static int handle_file( pkg_handle_builder *, tar_file_info *,
 			read_stream * );
 static int setup_dirs_for_unpack( char *, char * );
@@ -32,14 +33,22 @@ static pkg_handle * open_pkg_file_v1_bzip2( const char * );
 # ifdef COMPRESSION_GZIP
 static pkg_handle * open_pkg_file_v1_gzip( const char * );
 # endif
+# ifdef COMPRESSION_ZSTD
+static pkg_handle * open_pkg_file_v1_zstd( const char * );
+# endif
 static pkg_handle * open_pkg_file_v1_none( const char * );
 static pkg_handle * open_pkg_file_v1_stream( read_stream *, pkg_compression_t );
+static pkg_stream * open_pkg_stream_v1( const char *, pkg_compression_t );
 #endif
 
 #ifdef PKGFMT_V2
 static int handle_content_v2( pkg_handle_builder *, read_stream * );
 static pkg_handle * open_pkg_file_v2( const char * );
 static pkg_handle * open_pkg_file_v2_stream( read_stream * );
+static pkg_stream * open_pkg_stream_v2( const char * );
+static int open_pkg_stream_content_v2( pkg_stream *, pkg_compression_t );
+static int finish_pkg_stream_content_v2( pkg_stream * );
+static int is_content_name_v2( const char *, pkg_compression_t * );
 #endif
 
 static pkg_handle_builder * alloc_pkg_handle_builder( void ) {
@@ -99,9 +108,57 @@ error:
   return NULL;
 }
 
+static pkg_stream * alloc_pkg_stream( void ) {
+  pkg_stream *ps;
+
+  ps = malloc( sizeof( *ps ) );
+  if ( ps ) {
+    ps->file_rs = NULL;
+    ps->comp_rs = NULL;
+    ps->prefetch_rs = NULL;
+    ps->outer_tr = NULL;
+#ifdef PKGFMT_V2
+    ps->content_rs = NULL;
+    ps->content_tr = NULL;
+    ps->descr_trails = 0;
+#endif
+    ps->tr = NULL;
+    ps->curr_rs = NULL;
+    ps->h = malloc( sizeof( *(ps->h) ) );
+    if ( ps->h ) {
+      ps->h->compression = DEFAULT_COMPRESSION;
+      ps->h->version = DEFAULT_VERSION;
+      ps->h->descr = NULL;
+      ps->h->descr_file = NULL;
+      /* Only the package-description goes here */
+      ps->h->unpacked_dir = get_temp_dir();
+      if ( !(ps->h->unpacked_dir) ) {
+	free( ps->h );
+	free( ps );
+	ps = NULL;
+      }
+    }
+    else {
+      free( ps );
+      ps = NULL;
+    }
+  }
+
+  return ps;
+}
+
+/*
+ * Check the checksums handle_file() took against the
+ * package-description.  Files that went by before we had the
+ * description to tell us which hash to use get hashed from where they
+ * were unpacked now instead.
+ */
+
 static int check_cksums( pkg_handle_builder *b ) {
   int result, i, status;
   uint8_t *descr_cksum, *actual_cksum;
+  uint8_t cksum[HASH_LEN];
+  char *tmp, *path;
 
   result = 0;
   if ( b ) {
@@ -113,8 +170,24 @@ static int check_cksums( pkg_handle_builder *b ) {
 	    status = rbtree_query( b->cksums,
 				   b->p->descr->entries[i].filename,
 				   (void **)(&actual_cksum) );
+	    if ( status == RBTREE_NOT_FOUND ) {
+	      path = NULL;
+	      tmp = concatenate_paths( b->p->unpacked_dir, "package-content" );
+	      if ( tmp ) {
+		path = concatenate_paths( tmp,
+					  b->p->descr->entries[i].filename );
+		free( tmp );
+	      }
+	      if ( path &&
+		   get_file_hash( b->p->descr->hdr.hash, path, cksum ) == 0 ) {
+		actual_cksum = cksum;
+		status = RBTREE_SUCCESS;
+	      }
+	      if ( path ) free( path );
+	    }
+
 	    if ( status == RBTREE_SUCCESS ) {
-	      if ( memcmp( descr_cksum, actual_cksum, MD5_RESULT_LEN ) != 0 ) {
+	      if ( memcmp( descr_cksum, actual_cksum, HASH_LEN ) != 0 ) {
 		fprintf( stderr, "Checksums do not match for %s\n",
 			 b->p->descr->entries[i].filename );
 		result = -4;
@@ -153,8 +226,8 @@ static void * cksum_copier( void *v ) {
   copy = NULL;
   if ( v ) {
     cksum = (uint8_t *)v;
-    copy = malloc( sizeof( *copy ) * MD5_RESULT_LEN );
-    if ( copy ) memcpy( copy, cksum, sizeof( *cksum ) * MD5_RESULT_LEN );
+    copy = malloc( sizeof( *copy ) * HASH_LEN );
+    if ( copy ) memcpy( copy, cksum, sizeof( *cksum ) * HASH_LEN );
   }
 
   return copy;
@@ -192,17 +265,153 @@ void close_pkg( pkg_handle *h ) {
   }
 }
 
+void close_pkg_stream( pkg_stream *ps ) {
+  if ( ps ) {
+    if ( ps->curr_rs ) close_read_stream( ps->curr_rs );
+#ifdef PKGFMT_V2
+    if ( ps->content_tr ) close_tar_reader( ps->content_tr );
+#endif
+    /* Each of these is wrapped around the next, so close in order */
+    if ( ps->prefetch_rs ) close_read_stream( ps->prefetch_rs );
+    if ( ps->comp_rs ) close_read_stream( ps->comp_rs );
+#ifdef PKGFMT_V2
+    if ( ps->content_rs ) close_read_stream( ps->content_rs );
+#endif
+    if ( ps->outer_tr ) close_tar_reader( ps->outer_tr );
+    if ( ps->file_rs ) close_read_stream( ps->file_rs );
+    if ( ps->h ) close_pkg( ps->h );
+    free( ps );
+  }
+}
+
+#ifdef PKGFMT_V2
+
+static int finish_pkg_stream_content_v2( pkg_stream *ps ) {
+  int result, status;
+  tar_file_info *tinf;
+  pkg_compression_t comp;
+
+  result = 0;
+  if ( ps ) {
+    if ( ps->content_tr ) {
+      close_tar_reader( ps->content_tr );
+      ps->content_tr = NULL;
+    }
+    if ( ps->prefetch_rs ) {
+      close_read_stream( ps->prefetch_rs );
+      ps->prefetch_rs = NULL;
+    }
+    if ( ps->comp_rs ) {
+      close_read_stream( ps->comp_rs );
+      ps->comp_rs = NULL;
+    }
+    if ( ps->content_rs ) {
+      close_read_stream( ps->content_rs );
+      ps->content_rs = NULL;
+    }
+
+    /*
+     * Check the rest of the outer tarball the same way
+     * open_pkg_file_v2_stream() would
+     */
+
+    if ( ps->outer_tr ) {
+      while ( ( status = get_next_file( ps->outer_tr ) ) == TAR_SUCCESS ) {
+	tinf = get_file_info( ps->outer_tr );
+	if ( tinf->type == TAR_FILE ) {
+	  if ( strcmp( tinf->filename, "package-description" ) == 0 &&
+	       ps->descr_trails ) {
+	    /* We already read this one in open_pkg_stream_v2() */
+	    ps->descr_trails = 0;
+	  }
+	  else if ( strcmp( tinf->filename, "package-description" ) == 0 ||
+		    is_content_name_v2( tinf->filename, &comp ) ) {
+	    /* Duplicate package-description or package-content */
+	    result = -3;
+	    break;
+	  }
+	}
+      }
+      if ( result == 0 && status != TAR_NO_MORE_FILES ) result = -4;
+    }
+    else result = -2;
+  }
+  else result = -1;
+
+  return result;
+}
+
+#endif
+
+int get_next_pkg_stream_file( pkg_stream *ps, tar_file_info **tinf_out,
+			      read_stream **rs_out ) {
+  int result, status;
+  tar_file_info *tinf;
+
+  result = PKG_STREAM_ERROR;
+  if ( ps && tinf_out && rs_out ) {
+    if ( ps->curr_rs ) {
+      close_read_stream( ps->curr_rs );
+      ps->curr_rs = NULL;
+    }
+
+    if ( ps->tr ) {
+      while ( ( status = get_next_file( ps->tr ) ) == TAR_SUCCESS ) {
+	tinf = get_file_info( ps->tr );
+	if ( tinf->type == TAR_FILE ) {
+#ifdef PKGFMT_V1
+	  /* Duplicate package-description */
+	  if ( ps->h->version == V1 &&
+	       strcmp( tinf->filename, "package-description" ) == 0 ) break;
+#endif
+	  ps->curr_rs = get_reader_for_file( ps->tr );
+	  if ( ps->curr_rs ) {
+	    *tinf_out = tinf;
+	    *rs_out = ps->curr_rs;
+	    result = PKG_STREAM_SUCCESS;
+	  }
+	  break;
+	}
+	/* Else skip non-files */
+      }
+
+      if ( status == TAR_NO_MORE_FILES ) {
+	ps->tr = NULL;
+#ifdef PKGFMT_V2
+	if ( ps->h->version == V2 ) {
+	  if ( finish_pkg_stream_content_v2( ps ) == 0 )
+	    result = PKG_STREAM_NO_MORE_FILES;
+	}
+	else result = PKG_STREAM_NO_MORE_FILES;
+#else
+	result = PKG_STREAM_NO_MORE_FILES;
+#endif
+      }
+    }
+    else result = PKG_STREAM_NO_MORE_FILES;
+  }
+
+  return result;
+}
+
 #ifdef PKGFMT_V2
 
 static int handle_content_v2( pkg_handle_builder *b, read_stream *rs ) {
   int error, status, result;
   tar_reader *tr;
   tar_file_info *tinf;
-  read_stream *trs;
+  read_stream *trs, *prs;
 
   status = 0;
   if ( b && rs ) {
-    tr = start_tar_reader( rs );
+    /*
+     * If rs can't lend out its buffer, it's a decompressor; run it
+     * ahead of us on another thread.
+     */
+    prs = NULL;
+    if ( !can_peek_stream( rs ) ) prs = open_read_stream_prefetch( rs );
+    if ( prs ) tr = start_tar_reader( prs );
+    else tr = start_tar_reader( rs );
     if ( tr ) {
       error = 0;
       while ( ( result = get_next_file( tr ) ) == TAR_SUCCESS ) {
@@ -233,6 +442,8 @@ static int handle_content_v2( pkg_handle_builder *b, read_stream *rs ) {
       close_tar_reader( tr );
     }
     else status = -2;
+
+    if ( prs ) close_read_stream( prs );
   }
   else status = -1;
 
@@ -241,30 +452,35 @@ static int handle_content_v2( pkg_handle_builder *b, read_stream *rs ) {
 
 #endif
 
-#define UNPACK_BUF_LEN 1024
-
-static int handle_descr( pkg_handle_builder *b, read_stream *rs ) {
+static int handle_descr( pkg_handle *p, read_stream *rs ) {
   int result, error;
-  unsigned char buf[UNPACK_BUF_LEN];
+  unsigned char *buf;
   char *dst;
   write_stream *ws;
-  long len, wlen;
+  long len, wlen, buf_len;
   pkg_descr *descr;
 
   result = 0;
-  if ( b && rs ) {
-    dst = concatenate_paths( b->p->unpacked_dir, "package-description" );
+  if ( p && rs ) {
+    dst = concatenate_paths( p->unpacked_dir, "package-description" );
     if ( dst ) {
       ws = open_write_stream_none( dst );
       if ( ws ) {
 	error = 0;
-	while ( ( len = read_from_stream( rs, buf, UNPACK_BUF_LEN ) ) > 0 ) {
-	  wlen = write_to_stream( ws, buf, len );
-	  if ( wlen != len ) {
-	    error = 1;
-	    break;
+	len = 0;
+	buf_len = get_io_buffer_size();
+	buf = malloc( buf_len );
+	if ( buf ) {
+	  while ( ( len = read_from_stream( rs, buf, buf_len ) ) > 0 ) {
+	    wlen = write_to_stream( ws, buf, len );
+	    if ( wlen != len ) {
+	      error = 1;
+	      break;
+	    }
 	  }
+	  free( buf );
 	}
+	else error = 1;
 	if ( len < 0 || error ) {
 	  /* Error reading or writing it */
 	  result = -4;
@@ -276,12 +492,19 @@ static int handle_descr( pkg_handle_builder *b, read_stream *rs ) {
 
       if ( result == 0 ) {
 	descr = read_pkg_descr_from_file( dst );
-	if ( !descr ) result == -4;
+	if ( !descr ) result = -4;
+	else if ( get_check_md5() && !hash_supported( descr->hdr.hash ) ) {
+	  fprintf( stderr,
+		   "Package uses %s checksums, which this mpkg can't check\n",
+		   get_hash_name( descr->hdr.hash ) );
+	  free_pkg_descr( descr );
+	  result = -4;
+	}
       }
 
       if ( result == 0 ) {
-	b->p->descr_file = dst;
-	b->p->descr = descr;
+	p->descr_file = dst;
+	p->descr = descr;
       }
       else free( dst );
     }
@@ -296,26 +519,31 @@ static int handle_file( pkg_handle_builder *b, tar_file_info *tinf,
 			read_stream *rs ) {
   int result, error, status;
   char *dst, *tmp;
-  write_stream *ws, *md5_ws;
-  md5_state *md5;
-  unsigned char buf[UNPACK_BUF_LEN];
-  long len, wlen;
-  uint8_t cksum[MD5_RESULT_LEN];
+  write_stream *ws, *hash_ws, *tee_ws, *out_ws;
+  hash_state *h;
+  unsigned char *buf;
+  void *data;
+  long len, wlen, buf_len;
+  uint8_t cksum[HASH_LEN];
 
   result = 0;
   if ( b && tinf && rs ) {
     if ( tinf->type == TAR_FILE ) {
-      if ( get_check_md5() ) {
-	md5 = start_new_md5();
-	if ( md5 ) md5_ws = get_md5_ws( md5 );
-	else md5_ws = NULL;
+      /*
+       * Until we've seen the package-description, we don't know which
+       * hash it wants; check_cksums() will hash those files later.
+       */
+      if ( get_check_md5() && b->p->descr ) {
+	h = start_new_hash( b->p->descr->hdr.hash );
+	if ( h ) hash_ws = get_hash_ws( h );
+	else hash_ws = NULL;
       }
       else {
-	md5 = NULL;
-	md5_ws = NULL;
+	h = NULL;
+	hash_ws = NULL;
       }
 
-      if ( !get_check_md5() || md5 ) {
+      if ( !( get_check_md5() && b->p->descr ) || h ) {
 	tmp = concatenate_paths( b->p->unpacked_dir, "package-content" );
 	if ( tmp ) {
 	  dst = concatenate_paths( tmp, tinf->filename );
@@ -327,26 +555,34 @@ static int handle_file( pkg_handle_builder *b, tar_file_info *tinf,
 	      free( dst );
 	      if ( ws ) {
 		error = 0;
-		while ( ( len =
-			  read_from_stream( rs, buf, UNPACK_BUF_LEN ) ) > 0 ) {
-		  if ( md5_ws ) {
-		    wlen = write_to_stream( md5_ws, buf, len );
+		len = 0;
+		buf_len = get_io_buffer_size();
+		buf = malloc( buf_len );
+		tee_ws = NULL;
+		if ( hash_ws ) {
+		  /* One write does both the file and the checksum */
+		  tee_ws = open_tee_write_stream( hash_ws, ws );
+		  out_ws = tee_ws;
+		}
+		else out_ws = ws;
+		if ( buf && out_ws ) {
+		  while ( ( len = borrow_from_stream( rs, &data,
+						      buf, buf_len ) ) > 0 ) {
+		    wlen = write_to_stream( out_ws, data, len );
 		    if ( wlen != len ) {
 		      error = 1;
 		      break;
 		    }
 		  }
-		  wlen = write_to_stream( ws, buf, len );
-		  if ( wlen != len ) {
-		    error = 1;
-		    break;
-		  }
 		}
+		else error = 1;
+		if ( buf ) free( buf );
+		if ( tee_ws ) close_write_stream( tee_ws );
 		if ( len == 0 && !error ) {
 		  close_write_stream( ws );
-		  if ( md5_ws ) close_write_stream( md5_ws );
-		  if ( md5 ) {
-		    status = get_md5_result( md5, cksum );
+		  if ( hash_ws ) close_write_stream( hash_ws );
+		  if ( h ) {
+		    status = get_hash_result( h, cksum );
 		    if ( status == 0 ) {
 		      tmp = concatenate_paths( "/", tinf->filename );
 		      if ( tmp ) {
@@ -364,7 +600,7 @@ static int handle_file( pkg_handle_builder *b, tar_file_info *tinf,
 		  /* Error reading or writing */
 
 		  close_write_stream( ws );
-		  if ( md5_ws ) close_write_stream( md5_ws );
+		  if ( hash_ws ) close_write_stream( hash_ws );
 		  result = -8;
 		}
 	      }
@@ -376,7 +612,7 @@ static int handle_file( pkg_handle_builder *b, tar_file_info *tinf,
 	}
 	else result = -4;
 
-	if ( md5 ) close_md5( md5 );
+	if ( h ) close_hash( h );
       }
       else result = -3;
     }
@@ -451,6 +687,16 @@ pkg_handle * open_pkg_file( const char *filename ) {
     }
   }
 #endif
+#ifdef COMPRESSION_ZSTD
+  if ( len > 8 && tried_v1 == 0 ) {
+    suffix = filename + len - 8;
+    if ( strcmp( suffix, ".tar.zst" ) == 0 ) {
+      h = open_pkg_file_v1( filename );
+      if ( h ) return h;
+      else tried_v1 = 1;
+    }
+  }
+#endif
 
   /* It didn't have any of the standard suffixes */
 
@@ -489,6 +735,110 @@ pkg_handle * open_pkg_file( const char *filename ) {
 
 }
 
+pkg_stream * open_pkg_stream( const char *filename ) {
+  pkg_stream *ps;
+  int len;
+  const char *suffix;
+#ifdef PKGFMT_V1
+  int tried_none = 0;
+# ifdef COMPRESSION_GZIP
+  int tried_gzip = 0;
+# endif
+# ifdef COMPRESSION_BZIP2
+  int tried_bzip2 = 0;
+# endif
+# ifdef COMPRESSION_ZSTD
+  int tried_zstd = 0;
+# endif
+#endif
+#ifdef PKGFMT_V2
+  int tried_v2 = 0;
+#endif
+
+  /*
+   * Same order of guesses as open_pkg_file(); this returns NULL if
+   * the package-description doesn't come ahead of the content, since
+   * we can't stream that.
+   */
+
+  ps = NULL;
+  if ( filename ) {
+    len = strlen( filename );
+#ifdef PKGFMT_V2
+    if ( !ps && len > 4 ) {
+      suffix = filename + len - 4;
+      if ( strcmp( suffix, ".pkg" ) == 0 ) {
+	ps = open_pkg_stream_v2( filename );
+	tried_v2 = 1;
+      }
+    }
+    if ( !ps && !tried_v2 && len > 5 ) {
+      suffix = filename + len - 5;
+      if ( strcmp( suffix, ".mpkg" ) == 0 ) {
+	ps = open_pkg_stream_v2( filename );
+	tried_v2 = 1;
+      }
+    }
+#endif
+#ifdef PKGFMT_V1
+    if ( !ps && len > 4 ) {
+      suffix = filename + len - 4;
+      if ( strcmp( suffix, ".tar" ) == 0 ) {
+	ps = open_pkg_stream_v1( filename, NONE );
+	tried_none = 1;
+      }
+    }
+# ifdef COMPRESSION_GZIP
+    if ( !ps && len > 7 ) {
+      suffix = filename + len - 7;
+      if ( strcmp( suffix, ".tar.gz" ) == 0 ) {
+	ps = open_pkg_stream_v1( filename, GZIP );
+	tried_gzip = 1;
+      }
+    }
+# endif
+# ifdef COMPRESSION_BZIP2
+    if ( !ps && len > 8 ) {
+      suffix = filename + len - 8;
+      if ( strcmp( suffix, ".tar.bz2" ) == 0 ) {
+	ps = open_pkg_stream_v1( filename, BZIP2 );
+	tried_bzip2 = 1;
+      }
+    }
+# endif
+# ifdef COMPRESSION_ZSTD
+    if ( !ps && len > 8 ) {
+      suffix = filename + len - 8;
+      if ( strcmp( suffix, ".tar.zst" ) == 0 ) {
+	ps = open_pkg_stream_v1( filename, ZSTD );
+	tried_zstd = 1;
+      }
+    }
+# endif
+#endif
+
+    /* It didn't have any of the standard suffixes */
+
+#ifdef PKGFMT_V2
+    if ( !ps && !tried_v2 ) ps = open_pkg_stream_v2( filename );
+#endif
+#ifdef PKGFMT_V1
+    if ( !ps && !tried_none ) ps = open_pkg_stream_v1( filename, NONE );
+# ifdef COMPRESSION_GZIP
+    if ( !ps && !tried_gzip ) ps = open_pkg_stream_v1( filename, GZIP );
+# endif
+# ifdef COMPRESSION_BZIP2
+    if ( !ps && !tried_bzip2 ) ps = open_pkg_stream_v1( filename, BZIP2 );
+# endif
+# ifdef COMPRESSION_ZSTD
+    if ( !ps && !tried_zstd ) ps = open_pkg_stream_v1( filename, ZSTD );
+# endif
+#endif
+  }
+
+  return ps;
+}
+
 #ifdef PKGFMT_V1
 
 static pkg_handle * open_pkg_file_v1( const char *filename ) {
@@ -500,6 +850,9 @@ static pkg_handle * open_pkg_file_v1( const char *filename ) {
 # endif
 # ifdef COMPRESSION_BZIP2
   int tried_bzip2 = 0;
+# endif
+# ifdef COMPRESSION_ZSTD
+  int tried_zstd = 0;
 # endif
   pkg_handle *result;
 
@@ -515,6 +868,15 @@ static pkg_handle * open_pkg_file_v1( const char *filename ) {
       }
     }
 # endif
+# ifdef COMPRESSION_ZSTD
+    if ( !result && len >= 8 ) {
+      suffix = filename + len - 8;
+      if ( strcmp( suffix, ".tar.zst" ) == 0 ) {
+	result = open_pkg_file_v1_zstd( filename );
+	tried_zstd = 1;
+      }
+    }
+# endif
 # ifdef COMPRESSION_GZIP
     if ( !result && len >= 7 ) {
       suffix = filename + len - 7;
@@ -547,6 +909,12 @@ static pkg_handle * open_pkg_file_v1( const char *filename ) {
       result = open_pkg_file_v1_bzip2( filename );
       tried_bzip2 = 1;
     }
+# endif
+# ifdef COMPRESSION_ZSTD
+    if ( !result && !tried_zstd ) {
+      result = open_pkg_file_v1_zstd( filename );
+      tried_zstd = 1;
+    }
 # endif
   }
 
@@ -556,15 +924,20 @@ static pkg_handle * open_pkg_file_v1( const char *filename ) {
 #ifdef COMPRESSION_BZIP2
 
 static pkg_handle * open_pkg_file_v1_bzip2( const char *filename ) {
-  read_stream *rs;
+  read_stream *file_rs, *rs;
   pkg_handle *p;
 
   p = NULL;
   if ( filename ) {
-    rs = open_read_stream_bzip2( filename );
-    if ( rs ) {
-      p = open_pkg_file_v1_stream( rs, BZIP2 );
-      close_read_stream( rs );
+    file_rs = open_read_stream_mmap( filename );
+    if ( file_rs ) {
+      rs = open_read_stream_from_stream_bzip2_parallel( file_rs,
+							get_default_threads() );
+      if ( rs ) {
+	p = open_pkg_file_v1_stream( rs, BZIP2 );
+	close_read_stream( rs );
+      }
+      close_read_stream( file_rs );
     }
   }
 
@@ -593,13 +966,33 @@ static pkg_handle * open_pkg_file_v1_gzip( const char *filename ) {
 
 #endif
 
+#ifdef COMPRESSION_ZSTD
+
+static pkg_handle * open_pkg_file_v1_zstd( const char *filename ) {
+  read_stream *rs;
+  pkg_handle *p;
+
+  p = NULL;
+  if ( filename ) {
+    rs = open_read_stream_zstd( filename );
+    if ( rs ) {
+      p = open_pkg_file_v1_stream( rs, ZSTD );
+      close_read_stream( rs );
+    }
+  }
+
+  return p;
+}
+
+#endif
+
 static pkg_handle * open_pkg_file_v1_none( const char *filename ) {
   read_stream *rs;
   pkg_handle *p;
 
   p = NULL;
   if ( filename ) {
-    rs = open_read_stream_none( filename );
+    rs = open_read_stream_mmap( filename );
     if ( rs ) {
       p = open_pkg_file_v1_stream( rs, NONE );
       close_read_stream( rs );
@@ -612,14 +1005,18 @@ static pkg_handle * open_pkg_file_v1_none( const char *filename ) {
 static pkg_handle * open_pkg_file_v1_stream( read_stream *rs, pkg_compression_t comp ) {
   pkg_handle *p;
   tar_reader *tr;
-  read_stream *trs;
+  read_stream *trs, *prs;
   tar_file_info *tinf;
   int error, status;
   pkg_handle_builder *b;
 
   p = NULL;
   if ( rs ) {
-    tr = start_tar_reader( rs );
+    /* Run the decompressor ahead of us, as in handle_content_v2() */
+    prs = NULL;
+    if ( comp != NONE ) prs = open_read_stream_prefetch( rs );
+    if ( prs ) tr = start_tar_reader( prs );
+    else tr = start_tar_reader( rs );
     if ( tr ) {
       b = alloc_pkg_handle_builder();
       if ( b ) {
@@ -632,7 +1029,7 @@ static pkg_handle * open_pkg_file_v1_stream( read_stream *rs, pkg_compression_t
 	    trs = get_reader_for_file( tr );
 	    if ( trs ) {
 	      if ( strcmp( tinf->filename, "package-description" ) == 0 )
-		status = handle_descr( b, trs );
+		status = handle_descr( b->p, trs );
 	      else status = handle_file( b, tinf, trs );
 	      if ( status != 0 ) {
 		error = 1;
@@ -657,11 +1054,93 @@ static pkg_handle * open_pkg_file_v1_stream( read_stream *rs, pkg_compression_t
       }
       close_tar_reader( tr );
     }  
+
+    if ( prs ) close_read_stream( prs );
   }
 
   return p;
 }
 
+static pkg_stream * open_pkg_stream_v1( const char *filename,
+					pkg_compression_t comp ) {
+  pkg_stream *ps;
+  read_stream *rs, *trs;
+  tar_file_info *tinf;
+  int status, got_descr;
+
+  ps = NULL;
+  if ( filename ) {
+    ps = alloc_pkg_stream();
+    if ( ps ) {
+      ps->h->compression = comp;
+      ps->h->version = V1;
+      got_descr = 0;
+      rs = NULL;
+      ps->file_rs = open_read_stream_mmap( filename );
+      if ( ps->file_rs ) {
+	if ( comp == NONE ) rs = ps->file_rs;
+# ifdef COMPRESSION_GZIP
+	else if ( comp == GZIP ) {
+	  ps->comp_rs = open_read_stream_from_stream_gzip( ps->file_rs );
+	  rs = ps->comp_rs;
+	}
+# endif
+# ifdef COMPRESSION_BZIP2
+	else if ( comp == BZIP2 ) {
+	  ps->comp_rs =
+	    open_read_stream_from_stream_bzip2_parallel( ps->file_rs,
+							 get_default_threads() );
+	  rs = ps->comp_rs;
+	}
+# endif
+# ifdef COMPRESSION_ZSTD
+	else if ( comp == ZSTD ) {
+	  ps->comp_rs = open_read_stream_from_stream_zstd( ps->file_rs );
+	  rs = ps->comp_rs;
+	}
+# endif
+	if ( ps->comp_rs ) {
+	  ps->prefetch_rs = open_read_stream_prefetch( ps->comp_rs );
+	  if ( ps->prefetch_rs ) rs = ps->prefetch_rs;
+	}
+      }
+
+      if ( rs ) {
+	ps->outer_tr = start_tar_reader( rs );
+	if ( ps->outer_tr ) {
+	  /*
+	   * The first file must be the package-description, or we
+	   * can't stream this one.
+	   */
+	  while ( ( status = get_next_file( ps->outer_tr ) ) ==
+		  TAR_SUCCESS ) {
+	    tinf = get_file_info( ps->outer_tr );
+	    if ( tinf->type == TAR_FILE ) {
+	      if ( strcmp( tinf->filename, "package-description" ) == 0 ) {
+		trs = get_reader_for_file( ps->outer_tr );
+		if ( trs ) {
+		  status = handle_descr( ps->h, trs );
+		  if ( status == 0 ) got_descr = 1;
+		  close_read_stream( trs );
+		}
+	      }
+	      break;
+	    }
+	  }
+	}
+      }
+
+      if ( got_descr ) ps->tr = ps->outer_tr;
+      else {
+	close_pkg_stream( ps );
+	ps = NULL;
+      }
+    }
+  }
+
+  return ps;
+}
+
 #endif
 
 #ifdef PKGFMT_V2
@@ -672,7 +1151,7 @@ static pkg_handle * open_pkg_file_v2( const char *filename ) {
 
   p = NULL;
   if ( filename ) {
-    rs = open_read_stream_none( filename );
+    rs = open_read_stream_mmap( filename );
     if ( rs ) {
       p = open_pkg_file_v2_stream( rs );
       close_read_stream( rs );
@@ -708,7 +1187,7 @@ static pkg_handle * open_pkg_file_v2_stream( read_stream *rs ) {
 	    if ( trs ) {
 	      if ( strcmp( tinf->filename, "package-description" ) == 0 ) {
 		if ( !got_descr ) {
-		  status = handle_descr( b, trs );
+		  status = handle_descr( b->p, trs );
 		  if ( status == 0 ) got_descr = 1;
 		}
 		/* Duplicate package-description */
@@ -746,7 +1225,9 @@ static pkg_handle * open_pkg_file_v2_stream( read_stream *rs ) {
 #ifdef COMPRESSION_BZIP2
 	      else if ( strcmp( tinf->filename, "package-content.tar.bz2" ) == 0 ) {
 		if ( !got_content ) {
-		  decomped_trs = open_read_stream_from_stream_bzip2( trs );
+		  decomped_trs =
+		    open_read_stream_from_stream_bzip2_parallel( trs,
+								 get_default_threads() );
 		  if ( decomped_trs ) {
 		    status = handle_content_v2( b, decomped_trs );
 		    if ( status == 0 ) {
@@ -760,6 +1241,24 @@ static pkg_handle * open_pkg_file_v2_stream( read_stream *rs ) {
 		/* Duplicate package-content */
 		else status = -1;
 	      }
+#endif
+#ifdef COMPRESSION_ZSTD
+	      else if ( strcmp( tinf->filename, "package-content.tar.zst" ) == 0 ) {
+		if ( !got_content ) {
+		  decomped_trs = open_read_stream_from_stream_zstd( trs );
+		  if ( decomped_trs ) {
+		    status = handle_content_v2( b, decomped_trs );
+		    if ( status == 0 ) {
+		      got_content = 1;
+		      b->p->compression = ZSTD;
+		    }
+		    close_read_stream( decomped_trs );
+		    decomped_trs = NULL;
+		  }
+		}
+		/* Duplicate package-content */
+		else status = -1;
+	      }
 #endif
 	      /* 
 	       * else {
@@ -803,6 +1302,183 @@ static pkg_handle * open_pkg_file_v2_stream( read_stream *rs ) {
   return p;
 }
 
+static pkg_stream * open_pkg_stream_v2( const char *filename ) {
+  pkg_stream *ps;
+  read_stream *trs;
+  tar_file_info *tinf;
+  pkg_compression_t comp;
+  int status, got_descr, got_content, error;
+
+  ps = NULL;
+  if ( filename ) {
+    ps = alloc_pkg_stream();
+    if ( ps ) {
+      ps->h->version = V2;
+      got_descr = 0;
+      got_content = 0;
+      error = 0;
+      ps->file_rs = open_read_stream_mmap( filename );
+      if ( ps->file_rs ) ps->outer_tr = start_tar_reader( ps->file_rs );
+      if ( ps->outer_tr ) {
+	while ( !error && !(ps->tr) &&
+		( status = get_next_file( ps->outer_tr ) ) == TAR_SUCCESS ) {
+	  tinf = get_file_info( ps->outer_tr );
+	  if ( tinf->type == TAR_FILE ) {
+	    if ( strcmp( tinf->filename, "package-description" ) == 0 ) {
+	      if ( !got_descr ) {
+		trs = get_reader_for_file( ps->outer_tr );
+		if ( trs ) {
+		  status = handle_descr( ps->h, trs );
+		  if ( status == 0 ) got_descr = 1;
+		  else error = 1;
+		  close_read_stream( trs );
+		}
+		else error = 1;
+	      }
+	      /* Duplicate package-description */
+	      else error = 1;
+	    }
+	    else if ( is_content_name_v2( tinf->filename, &comp ) ) {
+	      /*
+	       * If we haven't seen the package-description yet, skip
+	       * this and come back for it once we have.
+	       */
+	      if ( got_content ) error = 1;
+	      else if ( got_descr ) {
+		if ( open_pkg_stream_content_v2( ps, comp ) != 0 ) error = 1;
+	      }
+	      got_content = 1;
+	    }
+	    /*
+	     * else {
+	     *     Skip any filenames we don't recognize so they can be
+	     *     used in future versions
+	     * }
+	     */
+	  }
+	}
+
+	if ( !error && !(ps->tr) && got_descr && got_content ) {
+	  /*
+	   * The package-description trailed the content, so start over
+	   * from the top of the file for the content.
+	   */
+	  close_tar_reader( ps->outer_tr );
+	  ps->outer_tr = NULL;
+	  close_read_stream( ps->file_rs );
+	  ps->file_rs = open_read_stream_mmap( filename );
+	  if ( ps->file_rs ) ps->outer_tr = start_tar_reader( ps->file_rs );
+	  if ( ps->outer_tr ) {
+	    while ( !(ps->tr) &&
+		    get_next_file( ps->outer_tr ) == TAR_SUCCESS ) {
+	      tinf = get_file_info( ps->outer_tr );
+	      if ( tinf->type == TAR_FILE &&
+		   is_content_name_v2( tinf->filename, &comp ) ) {
+		if ( open_pkg_stream_content_v2( ps, comp ) == 0 )
+		  ps->descr_trails = 1;
+		break;
+	      }
+	    }
+	  }
+	}
+      }
+
+      if ( !(ps->tr) ) {
+	close_pkg_stream( ps );
+	ps = NULL;
+      }
+    }
+  }
+
+  return ps;
+}
+
+/*
+ * Set up ps to read files from the content member outer_tr is at now,
+ * compressed with comp; 0 on success.
+ */
+
+static int open_pkg_stream_content_v2( pkg_stream *ps,
+				       pkg_compression_t comp ) {
+  read_stream *rs;
+  int result;
+
+  result = -1;
+  ps->content_rs = get_reader_for_file( ps->outer_tr );
+  if ( ps->content_rs ) {
+    if ( comp == NONE ) rs = ps->content_rs;
+# ifdef COMPRESSION_GZIP
+    else if ( comp == GZIP ) {
+      ps->comp_rs = open_read_stream_from_stream_gzip( ps->content_rs );
+      rs = ps->comp_rs;
+    }
+# endif
+# ifdef COMPRESSION_BZIP2
+    else if ( comp == BZIP2 ) {
+      ps->comp_rs =
+	open_read_stream_from_stream_bzip2_parallel( ps->content_rs,
+						     get_default_threads() );
+      rs = ps->comp_rs;
+    }
+# endif
+# ifdef COMPRESSION_ZSTD
+    else if ( comp == ZSTD ) {
+      ps->comp_rs = open_read_stream_from_stream_zstd( ps->content_rs );
+      rs = ps->comp_rs;
+    }
+# endif
+    else rs = NULL;
+
+    if ( ps->comp_rs ) {
+      ps->prefetch_rs = open_read_stream_prefetch( ps->comp_rs );
+      if ( ps->prefetch_rs ) rs = ps->prefetch_rs;
+    }
+
+    if ( rs ) {
+      ps->content_tr = start_tar_reader( rs );
+      if ( ps->content_tr ) {
+	ps->h->compression = comp;
+	ps->tr = ps->content_tr;
+	result = 0;
+      }
+    }
+  }
+
+  return result;
+}
+
+static int is_content_name_v2( const char *filename, pkg_compression_t *comp ) {
+  int result;
+
+  result = 0;
+  if ( filename && comp ) {
+    if ( strcmp( filename, "package-content.tar" ) == 0 ) {
+      *comp = NONE;
+      result = 1;
+    }
+# ifdef COMPRESSION_GZIP
+    else if ( strcmp( filename, "package-content.tar.gz" ) == 0 ) {
+      *comp = GZIP;
+      result = 1;
+    }
+# endif
+# ifdef COMPRESSION_BZIP2
+    else if ( strcmp( filename, "package-content.tar.bz2" ) == 0 ) {
+      *comp = BZIP2;
+      result = 1;
+    }
+# endif
+# ifdef COMPRESSION_ZSTD
+    else if ( strcmp( filename, "package-content.tar.zst" ) == 0 ) {
+      *comp = ZSTD;
+      result = 1;
+    }
+# endif
+  }
+
+  return result;
+}
+
 #endif
 
 static int setup_dirs_for_unpack( char *base, char *dst ) {
@@ -0,0 +1,255 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <pkg.h>
+
+/*
+ * Check the B+tree against the rbtree it stands in for under
+ * USE_BTREE: random inserts, overwrites, deletes and queries on both,
+ * with the B+tree validated and both enumerated and compared as we go.
+ * With "bench", time insert, query and enumerate on each at 10k, 100k
+ * and 1M keys instead.
+ */
+
+#define CHECK_KEYS 5000
+#define CHECK_OPS 200000
+#define CHECK_EVERY 10000
+
+static int bench( void );
+static int bench_size( unsigned long );
+static int check( void );
+static int check_run( unsigned int, int );
+static int compare_maps( btree *, rbtree * );
+static void fail( const char *, unsigned int, int );
+static char * make_key( char *, size_t, unsigned long );
+static void shuffle( char **, unsigned long );
+
+static int failures = 0;
+
+static int bench( void ) {
+  int status;
+
+  status = bench_size( 10000 );
+  if ( status == 0 ) status = bench_size( 100000 );
+  if ( status == 0 ) status = bench_size( 1000000 );
+
+  return status;
+}
+
+static int bench_size( unsigned long n ) {
+  char **keys;
+  char buf[64];
+  btree *b;
+  rbtree *r;
+  btree_entry *be;
+  rbtree_node *rn;
+  clock_t start;
+  double bt[3], rt[3];
+  unsigned long i, found;
+  void *v;
+
+  keys = malloc( sizeof( *keys ) * n );
+  b = btree_alloc( rbtree_string_comparator, NULL, NULL, NULL, NULL );
+  r = rbtree_alloc( rbtree_string_comparator, NULL, NULL, NULL, NULL );
+  if ( !( keys && b && r ) ) {
+    printf( "FAIL: allocating\n" );
+    return 1;
+  }
+  srand( 1 );
+  for ( i = 0; i < n; ++i )
+    keys[i] = copy_string( make_key( buf, sizeof( buf ), i ) );
+  shuffle( keys, n );
+
+  start = clock();
+  for ( i = 0; i < n; ++i ) btree_insert( b, keys[i], keys[i] );
+  bt[0] = (double)( clock() - start ) / CLOCKS_PER_SEC;
+  start = clock();
+  for ( i = 0; i < n; ++i ) rbtree_insert( r, keys[i], keys[i] );
+  rt[0] = (double)( clock() - start ) / CLOCKS_PER_SEC;
+
+  shuffle( keys, n );
+  found = 0;
+  start = clock();
+  for ( i = 0; i < n; ++i )
+    if ( btree_query( b, keys[i], &v ) == BTREE_SUCCESS ) ++found;
+  bt[1] = (double)( clock() - start ) / CLOCKS_PER_SEC;
+  start = clock();
+  for ( i = 0; i < n; ++i )
+    if ( rbtree_query( r, keys[i], &v ) == RBTREE_SUCCESS ) ++found;
+  rt[1] = (double)( clock() - start ) / CLOCKS_PER_SEC;
+
+  be = NULL;
+  start = clock();
+  do {
+    btree_enum( b, be, &v, &be );
+    if ( be ) ++found;
+  } while ( be );
+  bt[2] = (double)( clock() - start ) / CLOCKS_PER_SEC;
+  rn = NULL;
+  start = clock();
+  do {
+    rbtree_enum( r, rn, &v, &rn );
+    if ( rn ) ++found;
+  } while ( rn );
+  rt[2] = (double)( clock() - start ) / CLOCKS_PER_SEC;
+
+  printf( "btree: %lu keys: insert %.3f s / rbtree %.3f s, "
+	  "query %.3f s / %.3f s, enum %.3f s / %.3f s\n",
+	  n, bt[0], rt[0], bt[1], rt[1], bt[2], rt[2] );
+  if ( found != 4 * n ) printf( "FAIL: %lu keys: lost some\n", n );
+
+  btree_free( b );
+  rbtree_free( r );
+  for ( i = 0; i < n; ++i ) free( keys[i] );
+  free( keys );
+
+  return ( found == 4 * n ) ? 0 : 1;
+}
+
+static int check( void ) {
+  unsigned int seed;
+
+  /* Small key spaces keep the trees shallow and the deletes frequent */
+  for ( seed = 1; seed <= 4; ++seed ) {
+    check_run( seed, 50 );
+    check_run( seed, CHECK_KEYS );
+  }
+
+  if ( failures > 0 ) return 1;
+  printf( "btree: OK\n" );
+  return 0;
+}
+
+static int check_run( unsigned int seed, int nkeys ) {
+  btree *b;
+  rbtree *r;
+  char key[64], val[16], *bk, *rk;
+  void *bv, *rv;
+  int i, bs, rs, owned;
+
+  b = btree_alloc( rbtree_string_comparator, rbtree_string_copier,
+		   rbtree_string_free, rbtree_string_copier,
+		   rbtree_string_free );
+  r = rbtree_alloc( rbtree_string_comparator, rbtree_string_copier,
+		    rbtree_string_free, rbtree_string_copier,
+		    rbtree_string_free );
+  if ( !( b && r ) ) {
+    fail( "allocating", seed, nkeys );
+    return -1;
+  }
+
+  srand( seed );
+  for ( i = 0; i < CHECK_OPS; ++i ) {
+    make_key( key, sizeof( key ), rand() % nkeys );
+    snprintf( val, sizeof( val ), "%d", i );
+    bv = rv = NULL;
+    owned = 0;
+    switch ( rand() % 5 ) {
+    case 0:
+    case 1:
+      bs = btree_insert( b, key, val );
+      rs = rbtree_insert( r, key, val );
+      break;
+    case 2:
+      bs = btree_insert_no_overwrite( b, key, val );
+      rs = rbtree_insert_no_overwrite( r, key, val );
+      break;
+    case 3:
+      bs = btree_delete( b, key, &bv );
+      rs = rbtree_delete( r, key, &rv );
+      /* delete hands back a copy of the value; query doesn't */
+      owned = 1;
+      break;
+    default:
+      bs = btree_query( b, key, &bv );
+      rs = rbtree_query( r, key, &rv );
+      break;
+    }
+    if ( bs != rs ) fail( "status differs", seed, nkeys );
+    else if ( ( bv || rv ) &&
+	      !( bv && rv && strcmp( bv, rv ) == 0 ) )
+      fail( "value differs", seed, nkeys );
+    if ( owned && bv ) free( bv );
+    if ( owned && rv ) free( rv );
+
+    /* Start from somewhere at random, as owners does */
+    make_key( key, sizeof( key ), rand() % nkeys );
+    bk = btree_enum_from( b, key, &bv, NULL );
+    rk = rbtree_enum_from( r, key, &rv, NULL );
+    if ( ( bk || rk ) &&
+	 !( bk && rk && strcmp( bk, rk ) == 0 && strcmp( bv, rv ) == 0 ) )
+      fail( "enum_from differs", seed, nkeys );
+
+    if ( ( i + 1 ) % CHECK_EVERY == 0 ) {
+      if ( !btree_validate( b ) ) fail( "validate", seed, nkeys );
+      compare_maps( b, r );
+    }
+  }
+
+  btree_free( b );
+  rbtree_free( r );
+
+  return 0;
+}
+
+/* Enumerate both and check they hold the same things in the same order */
+
+static int compare_maps( btree *b, rbtree *r ) {
+  btree_entry *be;
+  rbtree_node *rn;
+  char *bk, *rk;
+  void *bv, *rv;
+
+  if ( btree_size( b ) != rbtree_size( r ) ) {
+    fail( "size differs", 0, 0 );
+    return -1;
+  }
+
+  be = NULL;
+  rn = NULL;
+  do {
+    bk = btree_enum( b, be, &bv, &be );
+    rk = rbtree_enum( r, rn, &rv, &rn );
+    if ( ( bk || rk ) &&
+	 !( bk && rk && strcmp( bk, rk ) == 0 && strcmp( bv, rv ) == 0 ) ) {
+      fail( "enum differs", 0, 0 );
+      return -1;
+    }
+  } while ( be && rn );
+
+  return 0;
+}
+
+static void fail( const char *msg, unsigned int seed, int nkeys ) {
+  if ( failures < 10 )
+    printf( "FAIL: %s (seed %u, %d keys)\n", msg, seed, nkeys );
+  ++failures;
+}
+
+/* Path-like keys which share prefixes, as locations in a DB do */
+
+static char * make_key( char *buf, size_t len, unsigned long i ) {
+  snprintf( buf, len, "/usr/share/dir%lu/dir%lu/file%lu",
+	    i % 17, ( i / 17 ) % 101, i );
+  return buf;
+}
+
+static void shuffle( char **a, unsigned long n ) {
+  unsigned long i, j;
+  char *t;
+
+  for ( i = n; i > 1; --i ) {
+    /* rand() may only go up to 32767 */
+    j = ( (unsigned long)rand() * ( RAND_MAX + 1UL ) + rand() ) % i;
+    t = a[i - 1];
+    a[i - 1] = a[j];
+    a[j] = t;
+  }
+}
+
+int main( int argc, char **argv ) {
+  if ( argc > 1 && strcmp( argv[1], "bench" ) == 0 ) return bench();
+  else return check();
+}
@@ -0,0 +1,53 @@
+#!/bin/sh
+#
+# Check that the hash cache forgets files changed or removed outside
+# mpkg the next time it's saved.  Run from the top of the tree after
+# building, or with MPKG set to the mpkg to test.
+
+MPKG=${MPKG:-`pwd`/src/mpkg}
+W=`mktemp -d ${TMPDIR:-/tmp}/mpkg-hashcache.XXXXXX` || exit 1
+trap 'rm -rf $W' 0
+
+fail() {
+  echo "FAIL: $*"
+  exit 1
+}
+
+R=$W/root
+G="--instroot $R --pkgdir $R/var/mpkg --tempdir $W/tmp"
+CACHE=$R/var/mpkg/pkg-hash-cache
+
+mkdir -p $W/in/usr/share/foo $R/var/mpkg $W/tmp
+echo hello > $W/in/usr/share/foo/a
+echo world > $W/in/usr/share/foo/b
+seq 1 1000 > $W/in/usr/share/foo/c
+
+$MPKG $G createdb || fail "createdb"
+(cd $W && $MPKG create in foo foo.tar) || fail "create"
+$MPKG $G install $W/foo.tar > /dev/null || fail "install"
+$MPKG $G status foo > $W/status || fail "status"
+grep -q modified $W/status && fail "status from the cache"
+# Fill fresh memory with junk (glibc), so unset hash bytes show up
+MALLOC_PERTURB_=165 $MPKG $G --disable-hash-cache status foo > $W/status || \
+  fail "status without the cache"
+grep -q modified $W/status && fail "status without the cache"
+for f in a b c; do
+  grep -q " $R/usr/share/foo/$f\$" $CACHE || fail "$f not cached"
+done
+
+# Behind mpkg's back: remove a, and give c a new inode
+rm $R/usr/share/foo/a
+mv $R/usr/share/foo/c $W/c.old
+echo changed > $R/usr/share/foo/c
+
+# Rehashing c makes the cache save again
+$MPKG $G status foo > /dev/null || fail "second status"
+grep -q " $R/usr/share/foo/a\$" $CACHE && fail "stale entry for a kept"
+test `grep -c " $R/usr/share/foo/c\$" $CACHE` -eq 1 || \
+  fail "stale entry for c kept"
+ino=`ls -i $R/usr/share/foo/c | awk '{ print $1 }'`
+grep " $R/usr/share/foo/c\$" $CACHE | grep -q "^[0-9]* $ino " || \
+  fail "no entry for the new c"
+grep -q " $R/usr/share/foo/b\$" $CACHE || fail "entry for b lost"
+
+echo "hashcache: OK"
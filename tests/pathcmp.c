@@ -0,0 +1,215 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <pkg.h>
+
+/*
+ * Check post_path_comparator() against the copying implementation it
+ * replaced, on random paths full of slash runs, empty components,
+ * prefixes and high-bit characters.  With "bench", time the two on
+ * deep paths sharing long prefixes instead.
+ */
+
+#define NUM_RANDOM_PAIRS 1000000
+#define BENCH_PATHS 20000
+#define BENCH_COMPARES 1000000
+#define MAX_PATH_LEN 64
+
+static int bench( void );
+static int check( void );
+static int check_pair( char *, char * );
+static int old_post_path_comparator( void *, void * );
+static void random_path( char * );
+static int sign( int );
+
+static int failures = 0;
+
+static int bench( void ) {
+  char **paths;
+  char buf[256];
+  int (*cmps[2])( void *, void * ) =
+    { old_post_path_comparator, post_path_comparator };
+  const char *names[2] = { "old", "new" };
+  clock_t start;
+  int i, j, k, pos, *pairs;
+  long sum;
+
+  paths = malloc( sizeof( *paths ) * BENCH_PATHS );
+  pairs = malloc( sizeof( *pairs ) * 2 * BENCH_COMPARES );
+  if ( !( paths && pairs ) ) {
+    printf( "FAIL: allocating\n" );
+    return 1;
+  }
+
+  srand( 1 );
+  for ( i = 0; i < BENCH_PATHS; ++i ) {
+    /* Ten components under a few shared directories, like a package */
+    pos = snprintf( buf, sizeof( buf ), "/usr/share/doc" );
+    for ( j = 0; j < 10; ++j )
+      pos += snprintf( buf + pos, sizeof( buf ) - pos, "/dir%d",
+		       ( j < 7 ) ? rand() % 3 : rand() % 100 );
+    paths[i] = copy_string( buf );
+  }
+  for ( i = 0; i < 2 * BENCH_COMPARES; ++i )
+    pairs[i] = rand() % BENCH_PATHS;
+
+  for ( k = 0; k < 2; ++k ) {
+    sum = 0;
+    start = clock();
+    for ( i = 0; i < BENCH_COMPARES; ++i )
+      sum += cmps[k]( paths[pairs[2 * i]], paths[pairs[2 * i + 1]] );
+    printf( "pathcmp: %s: %d compares in %.3f s (%ld)\n", names[k],
+	    BENCH_COMPARES, (double)( clock() - start ) / CLOCKS_PER_SEC,
+	    sum );
+  }
+
+  for ( i = 0; i < BENCH_PATHS; ++i ) free( paths[i] );
+  free( paths );
+  free( pairs );
+
+  return 0;
+}
+
+static int check( void ) {
+  char *fixed[] = {
+    "", "/", "//", "a", "/a", "a/", "//a//", "/a/b", "/a//b", "/a/b/",
+    "/a/bc", "/ab", "/ab/c", "/a/b/c", "/a-b", "/a.b", "/a/b-c",
+    "/\xe9", "/a/\xe9", "/a\xe9", "/A", "/a/B", NULL
+  };
+  char l[MAX_PATH_LEN + 1], r[MAX_PATH_LEN + 1];
+  int i, j, n;
+
+  for ( i = 0; fixed[i]; ++i ) {
+    for ( j = 0; fixed[j]; ++j ) check_pair( fixed[i], fixed[j] );
+    check_pair( fixed[i], NULL );
+    check_pair( NULL, fixed[i] );
+  }
+  check_pair( NULL, NULL );
+
+  srand( 1 );
+  for ( i = 0; i < NUM_RANDOM_PAIRS; ++i ) {
+    random_path( l );
+    switch ( rand() % 3 ) {
+    case 0:
+      random_path( r );
+      break;
+    case 1:
+      /* A prefix of l, cut anywhere */
+      n = strlen( l );
+      n = ( n > 0 ) ? rand() % ( n + 1 ) : 0;
+      memcpy( r, l, n );
+      r[n] = '\0';
+      break;
+    default:
+      /* l with more added */
+      n = strlen( l );
+      strcpy( r, l );
+      random_path( r + n );
+      break;
+    }
+    check_pair( l, r );
+    check_pair( r, l );
+  }
+
+  if ( failures > 0 ) return 1;
+  printf( "pathcmp: OK\n" );
+  return 0;
+}
+
+static int check_pair( char *l, char *r ) {
+  int o, n;
+
+  o = sign( old_post_path_comparator( l, r ) );
+  n = sign( post_path_comparator( l, r ) );
+  if ( o != n ) {
+    if ( failures < 10 )
+      printf( "FAIL: \"%s\" vs \"%s\": old %d, new %d\n",
+	      l ? l : "(null)", r ? r : "(null)", o, n );
+    ++failures;
+    return -1;
+  }
+
+  return 0;
+}
+
+/* post_path_comparator() as it was, splitting copies of both paths */
+
+static int old_post_path_comparator( void *left, void *right ) {
+  char *ls, *rs, *lbuf, *rbuf;
+  char *lcmp, *rcmp, *ltmp, *rtmp;
+  int result, temp;
+
+  ls = (char *)left;
+  rs = (char *)right;
+  if ( ls && rs ) {
+    lbuf = malloc( sizeof( *lbuf ) * ( strlen( ls ) + 1 ) );
+    rbuf = malloc( sizeof( *rbuf ) * ( strlen( rs ) + 1 ) );
+    if ( lbuf && rbuf ) {
+      strcpy( lbuf, ls );
+      strcpy( rbuf, rs );
+      lcmp = get_path_component( lbuf, &ltmp );
+      rcmp = get_path_component( rbuf, &rtmp );
+      while ( 1 ) {
+	if ( lcmp && rcmp ) {
+	  temp = strcmp( lcmp, rcmp );
+	  if ( temp > 0 ) {
+	    result = 1;
+	    break;
+	  }
+	  else if ( temp < 0 ) {
+	    result = -1;
+	    break;
+	  }
+	  else {
+	    lcmp = get_path_component( NULL, &ltmp );
+	    rcmp = get_path_component( NULL, &rtmp );
+	  }
+	}
+	else {
+	  if ( lcmp ) result = 1;
+	  else if ( rcmp ) result = -1;
+	  else result = 0;
+	  break;
+	}
+      }
+
+      free( lbuf );
+      free( rbuf );
+    }
+    else {
+      if ( lbuf ) free( lbuf );
+      if ( rbuf ) free( rbuf );
+      result = 0;
+    }
+  }
+  else {
+    if ( !ls && rs ) result = 1;
+    else if ( ls && !rs ) result = -1;
+    else result = 0;
+  }
+
+  return result;
+}
+
+/* Short components from a small alphabet, so prefixes and ties are common */
+
+static void random_path( char *p ) {
+  static const char alphabet[] = "//ab-.\xe9";
+  int i, n;
+
+  n = rand() % ( MAX_PATH_LEN / 4 );
+  for ( i = 0; i < n; ++i )
+    p[i] = alphabet[rand() % ( sizeof( alphabet ) - 1 )];
+  p[n] = '\0';
+}
+
+static int sign( int x ) {
+  return ( x > 0 ) - ( x < 0 );
+}
+
+int main( int argc, char **argv ) {
+  if ( argc > 1 && strcmp( argv[1], "bench" ) == 0 ) return bench();
+  else return check();
+}
@@ -0,0 +1,217 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pkg.h>
+
+/*
+ * Check foreach and peek against enumerate and query in each database
+ * format built in.  One location is longer than the buffer BDB starts
+ * its bulk reads with, so foreach_bdb() has to grow it.
+ */
+
+#define NUM_ENTRIES 5000
+#define BIG_LEN ( 300 * 1024 )
+
+typedef struct {
+  char **keys, **vals;
+  int count, alloced;
+} entry_list;
+
+static int add_entry( const char *, const char *, void * );
+static int check_db( const char *, char *,
+		     pkg_db * (*)( char *, dbmode_t ) );
+static int check_format( const char *, const char *,
+			 pkg_db * (*)( char * ),
+			 pkg_db * (*)( char *, dbmode_t ) );
+static void fail( const char *, const char * );
+static void free_entry_list( entry_list * );
+
+static char *big_key;
+static int failures = 0;
+
+static int add_entry( const char *k, const char *v, void *arg ) {
+  entry_list *l;
+  void *temp;
+
+  l = (entry_list *)arg;
+  if ( l->count == l->alloced ) {
+    l->alloced = ( l->alloced > 0 ) ? 2 * l->alloced : 1024;
+    temp = realloc( l->keys, sizeof( *(l->keys) ) * l->alloced );
+    if ( !temp ) return -1;
+    l->keys = temp;
+    temp = realloc( l->vals, sizeof( *(l->vals) ) * l->alloced );
+    if ( !temp ) return -1;
+    l->vals = temp;
+  }
+  l->keys[l->count] = copy_string( k );
+  l->vals[l->count] = copy_string( v );
+  if ( !( l->keys[l->count] && l->vals[l->count] ) ) return -1;
+  ++(l->count);
+
+  return 0;
+}
+
+/* Compare what foreach, enumerate, peek and query say about db */
+
+static int check_db( const char *what, char *filename,
+		     pkg_db * (*open)( char *, dbmode_t ) ) {
+  pkg_db *db;
+  entry_list l;
+  char *k, *v, *q;
+  const char *p;
+  void *n;
+  int i, result;
+
+  db = open( filename, DBMODE_RO );
+  if ( !db ) {
+    fail( what, "reopening" );
+    return -1;
+  }
+
+  memset( &l, 0, sizeof( l ) );
+  result = foreach_pkg_db( db, add_entry, &l );
+  if ( result != 0 ) fail( what, "foreach" );
+  else if ( l.count != NUM_ENTRIES + 1 ) fail( what, "foreach count" );
+
+  /* enumerate must see the same entries, in the same order */
+  n = NULL;
+  i = 0;
+  do {
+    k = v = NULL;
+    result = enumerate_pkg_db( db, n, &k, &v, &n );
+    if ( result != 0 ) {
+      fail( what, "enumerate" );
+      break;
+    }
+    if ( n ) {
+      if ( i >= l.count || strcmp( k, l.keys[i] ) != 0 ||
+	   strcmp( v, l.vals[i] ) != 0 ) {
+	fail( what, "foreach and enumerate differ" );
+	free( k );
+	free( v );
+	break;
+      }
+      ++i;
+      free( k );
+      free( v );
+    }
+  } while ( n );
+  if ( result == 0 && i != l.count ) fail( what, "enumerate count" );
+
+  for ( i = 0; i < l.count; ++i ) {
+    p = peek_pkg_db( db, l.keys[i] );
+    q = query_pkg_db( db, l.keys[i] );
+    if ( !p || !q || strcmp( p, l.vals[i] ) != 0 || strcmp( q, p ) != 0 )
+      fail( what, "peek and query differ" );
+    if ( q ) free( q );
+  }
+  if ( peek_pkg_db( db, "/not/there" ) ) fail( what, "peek missing key" );
+  p = peek_pkg_db( db, big_key );
+  if ( !p || strcmp( p, "big" ) != 0 ) fail( what, "peek big key" );
+
+  free_entry_list( &l );
+  close_pkg_db( db );
+
+  return 0;
+}
+
+static int check_format( const char *what, const char *name,
+			 pkg_db * (*create)( char * ),
+			 pkg_db * (*open)( char *, dbmode_t ) ) {
+  pkg_db *db;
+  char *filename;
+  char key[64], val[16];
+  int i;
+
+  filename = concatenate_paths( get_pkg(), name );
+  if ( !filename ) {
+    fail( what, "allocating" );
+    return -1;
+  }
+
+  db = create( filename );
+  if ( db ) close_pkg_db( db );
+  db = open( filename, DBMODE_RW );
+  if ( !db ) {
+    fail( what, "creating" );
+    free( filename );
+    return -1;
+  }
+  begin_pkg_db_txn( db );
+  for ( i = 0; i < NUM_ENTRIES; ++i ) {
+    snprintf( key, sizeof( key ), "/usr/share/pkgdb/%05d", i );
+    snprintf( val, sizeof( val ), "pkg%d", i % 7 );
+    if ( insert_into_pkg_db( db, key, val ) != 0 ) {
+      fail( what, "inserting" );
+      break;
+    }
+  }
+  if ( insert_into_pkg_db( db, big_key, "big" ) != 0 )
+    fail( what, "inserting big key" );
+  commit_pkg_db_txn( db );
+  close_pkg_db( db );
+
+  check_db( what, filename, open );
+  free( filename );
+
+  return 0;
+}
+
+static void fail( const char *what, const char *msg ) {
+  printf( "FAIL: %s: %s\n", what, msg );
+  ++failures;
+}
+
+static void free_entry_list( entry_list *l ) {
+  int i;
+
+  for ( i = 0; i < l->count; ++i ) {
+    free( l->keys[i] );
+    free( l->vals[i] );
+  }
+  if ( l->keys ) free( l->keys );
+  if ( l->vals ) free( l->vals );
+}
+
+int main( int argc, char **argv ) {
+  char tmpl[] = "/tmp/mpkg-pkgdb.XXXXXX";
+  char *dir, *cmd;
+  int len;
+
+  init_pkg_globals();
+  dir = mkdtemp( tmpl );
+  big_key = malloc( BIG_LEN + 1 );
+  if ( !dir || !big_key ) {
+    printf( "FAIL: setup\n" );
+    return 1;
+  }
+  set_pkg( dir );
+  set_temp( dir );
+  big_key[0] = '/';
+  memset( big_key + 1, 'x', BIG_LEN - 1 );
+  big_key[BIG_LEN] = '\0';
+
+  check_format( "text", PKGDB_TEXT_FILE_NAME, create_pkg_db_text_file,
+		open_pkg_db_text_file );
+  check_format( "mmap", PKGDB_MMAP_FILE_NAME, create_pkg_db_mmap,
+		open_pkg_db_mmap );
+#ifdef DB_BDB
+  check_format( "bdb", PKGDB_BDB_FILE_NAME, create_pkg_db_bdb,
+		open_pkg_db_bdb );
+#endif /* DB_BDB */
+
+  len = strlen( dir ) + 16;
+  cmd = malloc( len );
+  if ( cmd ) {
+    snprintf( cmd, len, "rm -rf %s", dir );
+    system( cmd );
+    free( cmd );
+  }
+  free( big_key );
+  free_pkg_globals();
+
+  if ( failures > 0 ) return 1;
+  printf( "pkgdb: OK\n" );
+  return 0;
+}